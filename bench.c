@@ -0,0 +1,551 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "regressions.h"
+
+/**
+ * Kernel benchmark harness.
+ *
+ * Every kernel is run BENCH_WARMUP times untimed, then timed until it has run
+ * at least BENCH_MIN_REPEATS times and for at least BENCH_MIN_SECONDS, up to
+ * BENCH_MAX_REPEATS times. Twenty runs is the fewest for which the 95th
+ * percentile is not simply the slowest run. The median and 95th percentile
+ * times are reported, with GFLOP/s and bytes/s worked out from the median and
+ * a flop and byte count for the kernel and shape. Shapes are square,
+ * tall-skinny (many rows, few columns) and wide (few rows, many columns).
+ *
+ * Usage: ./run_bench [scale] [--json FILE] [--compare BASELINE] [--threshold T]
+ *
+ * scale shrinks or grows every problem size, e.g. 0.25 for a quick run.
+ * --json writes the results to FILE, and --compare reads a file written that
+ * way and flags every kernel whose median time grew by more than T (default
+ * BENCH_DEFAULT_THRESHOLD, a fraction) and by more than BENCH_MIN_DELTA
+ * seconds, so timer noise on the fastest kernels is not taken for a
+ * regression. The exit status is 1 when any kernel regressed, so the
+ * comparison can gate a build.
+ */
+
+#define BENCH_WARMUP 1
+#define BENCH_MIN_REPEATS 20
+#define BENCH_MAX_REPEATS 200
+#define BENCH_MIN_SECONDS 0.5
+#define BENCH_MAX_RESULTS 128
+#define BENCH_DEFAULT_THRESHOLD 0.10
+#define BENCH_MIN_DELTA 1e-4
+
+// A scratch CSV written and removed by the loader benchmark
+#define BENCH_CSV_FILE "bench_matrix.csv"
+
+/**
+ * @struct One kernel and shape, and how fast it ran
+ */
+typedef struct BenchResult {
+    char kernel[32];
+    char shape[16];
+    size_t m;
+    size_t n;
+    size_t k;
+    int repeats;
+    double median;
+    double p95;
+    double gflops;
+    double bytes_per_second;
+} BenchResult;
+
+static BenchResult results[BENCH_MAX_RESULTS];
+static size_t n_results = 0;
+
+/**
+ * @brief Read a monotonic clock in seconds
+ *
+ * @return double
+ */
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Fill a matrix with uniform random values in [0, 1)
+ *
+ * @param A The matrix to fill
+ * @return void
+ */
+static void fill_random(Matrix* A) {
+    for (size_t i = 0; i < A->rows; i++) {
+        double* row = matrix_row(A, i);
+        for (size_t j = 0; j < A->cols; j++) {
+            row[j] = (double)rand() / RAND_MAX;
+        }
+    }
+}
+
+/**
+ * @brief Make a square matrix comfortably nonsingular by weighting its diagonal
+ *
+ * @param A The square matrix
+ * @return void
+ */
+static void make_dominant(Matrix* A) {
+    for (size_t i = 0; i < A->rows; i++) MAT_AT(A, i, i) += (double)A->cols;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+typedef void (*bench_fn)(void* ctx);
+
+/**
+ * @brief Time a kernel and record its median and 95th percentile
+ *
+ * @param kernel The name of the kernel
+ * @param shape square, tall or wide, or another label for the run
+ * @param m, n, k The problem dimensions, 1 where one does not apply
+ * @param flops The floating point operations one call does
+ * @param bytes The bytes one call reads and writes at least once
+ * @param fn The kernel call
+ * @param ctx Passed to fn
+ * @return double The median time in seconds
+ */
+static double bench_run(const char* kernel, const char* shape, size_t m, size_t n, size_t k,
+                        double flops, double bytes, bench_fn fn, void* ctx) {
+    double times[BENCH_MAX_REPEATS];
+    for (int r = 0; r < BENCH_WARMUP; r++) fn(ctx);
+    int repeats = 0;
+    double total = 0.0;
+    while (repeats < BENCH_MAX_REPEATS && (repeats < BENCH_MIN_REPEATS || total < BENCH_MIN_SECONDS)) {
+        double start = now_seconds();
+        fn(ctx);
+        times[repeats] = now_seconds() - start;
+        total += times[repeats++];
+    }
+    qsort(times, repeats, sizeof(double), compare_doubles);
+
+    // Nearest rank percentiles
+    double median = times[(repeats - 1) / 2];
+    double p95 = times[(95 * repeats + 99) / 100 - 1];
+
+    if (n_results < BENCH_MAX_RESULTS) {
+        BenchResult* result = &results[n_results++];
+        snprintf(result->kernel, sizeof(result->kernel), "%s", kernel);
+        snprintf(result->shape, sizeof(result->shape), "%s", shape);
+        result->m = m;
+        result->n = n;
+        result->k = k;
+        result->repeats = repeats;
+        result->median = median;
+        result->p95 = p95;
+        result->gflops = flops / median * 1e-9;
+        result->bytes_per_second = bytes / median;
+    }
+    return median;
+}
+
+/**
+ * @struct Operands of the benchmarked calls
+ */
+typedef struct BenchCtx {
+    Matrix* A;
+    Matrix* B;
+    Matrix* C;
+    Vector* x;
+    Vector* y;
+    int trans_a;
+} BenchCtx;
+
+static void run_gemm(void* ctx) {
+    BenchCtx* c = (BenchCtx*)ctx;
+    size_t m = c->C->rows, n = c->C->cols;
+    size_t k = c->trans_a ? c->A->rows : c->A->cols;
+    gemm(c->trans_a, 0, m, n, k, 1.0, c->A->data, c->A->stride, c->B->data, c->B->stride,
+         0.0, c->C->data, c->C->stride);
+}
+
+static void run_matrix_product(void* ctx) {
+    BenchCtx* c = (BenchCtx*)ctx;
+    matrix_product_into(c->A, c->B, c->C);
+}
+
+static void run_gemv(void* ctx) {
+    BenchCtx* c = (BenchCtx*)ctx;
+    matrix_vector_product_into(c->A, c->x, c->y);
+}
+
+static void run_invert(void* ctx) {
+    BenchCtx* c = (BenchCtx*)ctx;
+    free_matrix(invert(c->A));
+}
+
+static void run_gauss_jordan(void* ctx) {
+    BenchCtx* c = (BenchCtx*)ctx;
+    free_matrix(gauss_jordan_elimination(c->A));
+}
+
+static void run_ols(void* ctx) {
+    BenchCtx* c = (BenchCtx*)ctx;
+    free_vector(ols(c->A, c->y));
+}
+
+static void run_csv_load(void* ctx) {
+    (void)ctx;
+    free_matrix(create_matrix_from_file(BENCH_CSV_FILE));
+}
+
+/**
+ * @brief Time C = op(A) * B through the gemm engine directly
+ *
+ * @param label A name for the run
+ * @param shape The shape class
+ * @param m Rows of op(A)
+ * @param n Columns of B
+ * @param k Columns of op(A)
+ * @param trans_a Nonzero to multiply by the transpose of a k x m matrix
+ * @return double The median time in seconds
+ */
+static double bench_gemm(const char* label, const char* shape, size_t m, size_t n, size_t k, int trans_a) {
+    BenchCtx ctx = { trans_a ? create_empty_matrix(k, m) : create_empty_matrix(m, k),
+                     create_empty_matrix(k, n), create_empty_matrix(m, n), NULL, NULL, trans_a };
+    fill_random(ctx.A);
+    fill_random(ctx.B);
+
+    double bytes = 8.0 * ((double)m * k + (double)k * n + (double)m * n);
+    double median = bench_run(label, shape, m, n, k, 2.0 * m * n * k, bytes, run_gemm, &ctx);
+
+    free_matrix(ctx.A);
+    free_matrix(ctx.B);
+    free_matrix(ctx.C);
+    return median;
+}
+
+/**
+ * @brief Time matrix_product_into() for an m x k times k x n product
+ */
+static void bench_matrix_product(const char* shape, size_t m, size_t n, size_t k) {
+    BenchCtx ctx = { create_empty_matrix(m, k), create_empty_matrix(k, n), create_empty_matrix(m, n), NULL, NULL, 0 };
+    fill_random(ctx.A);
+    fill_random(ctx.B);
+
+    double bytes = 8.0 * ((double)m * k + (double)k * n + (double)m * n);
+    bench_run("matrix_product", shape, m, n, k, 2.0 * m * n * k, bytes, run_matrix_product, &ctx);
+
+    free_matrix(ctx.A);
+    free_matrix(ctx.B);
+    free_matrix(ctx.C);
+}
+
+/**
+ * @brief Time y = A * x, one SIMD dot product per row
+ *
+ * @param label A name for the run
+ * @param shape The shape class
+ * @param m Rows of A
+ * @param n Columns of A
+ * @return double The median time in seconds
+ */
+static double bench_gemv(const char* label, const char* shape, size_t m, size_t n) {
+    BenchCtx ctx = { create_empty_matrix(m, n), NULL, NULL, create_empty_vector(n), create_empty_vector(m), 0 };
+    fill_random(ctx.A);
+    for (size_t j = 0; j < n; j++) ctx.x->data[j] = (double)rand() / RAND_MAX;
+
+    double bytes = 8.0 * ((double)m * n + n + m);
+    double median = bench_run(label, shape, m, n, 1, 2.0 * m * n, bytes, run_gemv, &ctx);
+
+    free_matrix(ctx.A);
+    free_vector(ctx.x);
+    free_vector(ctx.y);
+    return median;
+}
+
+/**
+ * @brief Time invert() of an n x n matrix, 2 n^3 flops through LU
+ */
+static void bench_invert(size_t n) {
+    BenchCtx ctx = { create_empty_matrix(n, n), NULL, NULL, NULL, NULL, 0 };
+    fill_random(ctx.A);
+    make_dominant(ctx.A);
+    bench_run("invert", "square", n, n, n, 2.0 * n * n * n, 16.0 * n * n, run_invert, &ctx);
+    free_matrix(ctx.A);
+}
+
+/**
+ * @brief Time gauss_jordan_elimination() of an m x n matrix, about m^2 n flops
+ */
+static void bench_gauss_jordan(const char* shape, size_t m, size_t n) {
+    BenchCtx ctx = { create_empty_matrix(m, n), NULL, NULL, NULL, NULL, 0 };
+    fill_random(ctx.A);
+    for (size_t i = 0; i < m && i < n; i++) MAT_AT(ctx.A, i, i) += (double)n;
+    bench_run("gauss_jordan", shape, m, n, 1, 2.0 * m * m * n, 16.0 * m * n, run_gauss_jordan, &ctx);
+    free_matrix(ctx.A);
+}
+
+/**
+ * @brief Time ols() on an m x n problem
+ *
+ * A tall problem is m n^2 flops for AtA and n^3 / 3 for the solve. A wide
+ * one goes through the SVD, counted as the same order for comparison.
+ */
+static void bench_ols(const char* shape, size_t m, size_t n) {
+    BenchCtx ctx = { create_empty_matrix(m, n), NULL, NULL, NULL, create_empty_vector(m), 0 };
+    fill_random(ctx.A);
+    for (size_t i = 0; i < m; i++) ctx.y->data[i] = (double)rand() / RAND_MAX;
+
+    double flops = (double)m * n * n + (double)n * n * n / 3.0;
+    bench_run("ols", shape, m, n, 1, flops, 8.0 * ((double)m * n + m), run_ols, &ctx);
+
+    free_matrix(ctx.A);
+    free_vector(ctx.y);
+}
+
+/**
+ * @brief Time create_matrix_from_file() on an m x n CSV file
+ *
+ * The byte rate is the size of the file over the time to parse it.
+ */
+static void bench_csv_load(const char* shape, size_t m, size_t n) {
+    FILE* fp = fopen(BENCH_CSV_FILE, "w");
+    if (fp == NULL) {
+        perror("Unable to write benchmark CSV");
+        return;
+    }
+    for (size_t i = 0; i < m; i++) {
+        for (size_t j = 0; j < n; j++) {
+            fprintf(fp, j + 1 < n ? "%.17g," : "%.17g\n", (double)rand() / RAND_MAX);
+        }
+    }
+    double file_bytes = (double)ftell(fp);
+    fclose(fp);
+
+    bench_run("csv_load", shape, m, n, 1, 0.0, file_bytes, run_csv_load, NULL);
+    remove(BENCH_CSV_FILE);
+}
+
+/**
+ * @brief Rerun the threaded kernels at 1, 2, 4, ... up to max_threads threads
+ * and report the speedup over one thread
+ *
+ * @param max_threads The largest thread count to measure
+ * @param scale The problem size scale
+ * @return void
+ */
+static void bench_scaling(size_t max_threads, double scale) {
+    size_t n = (size_t)(1024 * scale) + 1;
+    size_t rows = (size_t)(200000 * scale) + 1;
+    size_t cols = (size_t)(256 * scale) + 1;
+    double gemm_base = 0.0, gemv_base = 0.0;
+
+    printf("\nThread scaling\n");
+    for (size_t threads = 1; ; threads *= 2) {
+        if (threads > max_threads) threads = max_threads;
+        ml_set_num_threads(threads);
+
+        char shape[32];
+        snprintf(shape, sizeof(shape), "threads_%zu", threads);
+        double gemm_time = bench_gemm("gemm", shape, n, n, n, 0);
+        double gemv_time = bench_gemv("gemv", shape, rows, cols);
+        if (threads == 1) {
+            gemm_base = gemm_time;
+            gemv_base = gemv_time;
+        }
+        printf("threads: %zu speedup: gemm %.2fx, gemv %.2fx\n",
+               threads, gemm_base / gemm_time, gemv_base / gemv_time);
+
+        if (threads == max_threads) break;
+    }
+
+    ml_set_num_threads(max_threads);
+}
+
+/**
+ * @brief Print the results as a table
+ */
+static void print_table() {
+    printf("\n%-16s %-10s %7s %7s %7s %5s %12s %12s %10s %12s\n",
+           "kernel", "shape", "m", "n", "k", "runs", "median", "p95", "GFLOP/s", "MB/s");
+    for (size_t i = 0; i < n_results; i++) {
+        BenchResult* r = &results[i];
+        printf("%-16s %-10s %7zu %7zu %7zu %5d %10.4f s %10.4f s %10.2f %12.1f\n",
+               r->kernel, r->shape, r->m, r->n, r->k, r->repeats, r->median, r->p95,
+               r->gflops, r->bytes_per_second * 1e-6);
+    }
+}
+
+/**
+ * @brief Write the results as JSON, one result object per line
+ *
+ * @param file_name The file to write
+ * @param scale The problem size scale of the run
+ * @return int The resulting status code
+ */
+static int write_json(const char* file_name, double scale) {
+    FILE* fp = fopen(file_name, "w");
+    if (fp == NULL) {
+        perror("Unable to write benchmark JSON");
+        return EXIT_FAILURE;
+    }
+
+    fprintf(fp, "{\n  \"simd\": \"%s\",\n  \"threads\": %zu,\n  \"scale\": %g,\n  \"results\": [\n",
+            simd_level_name(simd_active_level()), ml_get_num_threads(), scale);
+    for (size_t i = 0; i < n_results; i++) {
+        BenchResult* r = &results[i];
+        fprintf(fp, "    {\"kernel\": \"%s\", \"shape\": \"%s\", \"m\": %zu, \"n\": %zu, \"k\": %zu, "
+                    "\"median_s\": %.9g, \"p95_s\": %.9g, \"repeats\": %d, \"gflops\": %.6g, \"bytes_per_s\": %.6g}%s\n",
+                r->kernel, r->shape, r->m, r->n, r->k, r->median, r->p95, r->repeats, r->gflops,
+                r->bytes_per_second, i + 1 < n_results ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+
+    return fclose(fp) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * @brief Compare the results with a baseline written by --json
+ *
+ * Results are matched on kernel, shape and size. Kernels missing from
+ * either side are listed but not counted as regressions.
+ *
+ * @param file_name The baseline JSON file
+ * @param threshold The fraction a median may grow by before it is flagged. It
+ *                  must also grow by BENCH_MIN_DELTA seconds
+ * @param regressions Set to the number of regressed kernels
+ * @return int The resulting status code
+ */
+static int compare_baseline(const char* file_name, double threshold, size_t* regressions) {
+    FILE* fp = fopen(file_name, "r");
+    if (fp == NULL) {
+        perror("Unable to read benchmark baseline");
+        return EXIT_FAILURE;
+    }
+
+    *regressions = 0;
+    int matched[BENCH_MAX_RESULTS] = {0};
+    char line[1024];
+    printf("\nCompared with %s (threshold %.0f%% and %.1f ms)\n", file_name, threshold * 100.0, BENCH_MIN_DELTA * 1e3);
+    printf("%-16s %-10s %7s %7s %7s %12s %12s %8s\n", "kernel", "shape", "m", "n", "k", "baseline", "now", "change");
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        BenchResult base;
+        const char* start = strstr(line, "{\"kernel\"");
+        if (start == NULL
+            || sscanf(start, "{\"kernel\": \"%31[^\"]\", \"shape\": \"%15[^\"]\", \"m\": %zu, \"n\": %zu, \"k\": %zu, "
+                             "\"median_s\": %lf", base.kernel, base.shape, &base.m, &base.n, &base.k, &base.median) != 6) {
+            continue;
+        }
+
+        size_t i = 0;
+        while (i < n_results && !(strcmp(results[i].kernel, base.kernel) == 0
+                                  && strcmp(results[i].shape, base.shape) == 0 && results[i].m == base.m
+                                  && results[i].n == base.n && results[i].k == base.k)) {
+            i++;
+        }
+        if (i == n_results) {
+            printf("%-16s %-10s %7zu %7zu %7zu %10.4f s %12s\n",
+                   base.kernel, base.shape, base.m, base.n, base.k, base.median, "not run");
+            continue;
+        }
+
+        matched[i] = 1;
+        double change = results[i].median / base.median - 1.0;
+        double delta = results[i].median - base.median;
+        const char* flag = "";
+        if (change > threshold && delta > BENCH_MIN_DELTA) {
+            flag = "  REGRESSION";
+            (*regressions)++;
+        } else if (change < -threshold && delta < -BENCH_MIN_DELTA) {
+            flag = "  faster";
+        }
+        printf("%-16s %-10s %7zu %7zu %7zu %10.4f s %10.4f s %+7.1f%%%s\n", base.kernel, base.shape,
+               base.m, base.n, base.k, base.median, results[i].median, change * 100.0, flag);
+    }
+    fclose(fp);
+
+    for (size_t i = 0; i < n_results; i++) {
+        if (!matched[i]) {
+            printf("%-16s %-10s %7zu %7zu %7zu %12s\n", results[i].kernel, results[i].shape,
+                   results[i].m, results[i].n, results[i].k, "new");
+        }
+    }
+    printf("%zu regression%s\n", *regressions, *regressions == 1 ? "" : "s");
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char* argv[]) {
+    double scale = 1.0;
+    const char* json_file = NULL;
+    const char* baseline_file = NULL;
+    double threshold = BENCH_DEFAULT_THRESHOLD;
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "--json") == 0 && a + 1 < argc) {
+            json_file = argv[++a];
+        } else if (strcmp(argv[a], "--compare") == 0 && a + 1 < argc) {
+            baseline_file = argv[++a];
+        } else if (strcmp(argv[a], "--threshold") == 0 && a + 1 < argc) {
+            threshold = atof(argv[++a]);
+        } else if (argv[a][0] != '-') {
+            scale = atof(argv[a]);
+        } else {
+            fprintf(stderr, "Usage: %s [scale] [--json FILE] [--compare BASELINE] [--threshold T]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (scale <= 0.0) scale = 1.0;
+
+    srand(42);
+
+    printf("SIMD level: %s, threads: %zu\n", simd_level_name(simd_active_level()), ml_get_num_threads());
+
+    // The gemm engine on its own
+    size_t square[] = {128, 256, 512, 1024};
+    for (size_t s = 0; s < sizeof(square) / sizeof(square[0]); s++) {
+        size_t n = (size_t)(square[s] * scale) + 1;
+        bench_gemm("gemm", "square", n, n, n, 0);
+    }
+
+    // The Gram matrix AtA of a tall-skinny design matrix
+    size_t rows = (size_t)(50000 * scale) + 1;
+    size_t cols = (size_t)(256 * scale) + 1;
+    size_t narrow = (size_t)(64 * scale) + 1;
+    bench_gemm("gemm_AtA", "tall", cols, cols, rows, 1);
+
+    // matrix_product() in each shape
+    size_t mid = (size_t)(512 * scale) + 1;
+    bench_matrix_product("square", mid, mid, mid);
+    bench_matrix_product("tall", rows, narrow, cols);
+    bench_matrix_product("wide", cols, cols, rows);
+
+    // Scoring a fitted model, one matrix-vector product per batch
+    bench_gemv("gemv", "tall", rows, cols);
+    bench_gemv("gemv", "wide", cols, rows);
+
+    size_t small = (size_t)(256 * scale) + 1;
+    bench_invert(small);
+    bench_invert(mid);
+    bench_gauss_jordan("square", small, small);
+    bench_gauss_jordan("wide", small, 2 * small);
+
+    bench_ols("tall", rows, narrow);
+    bench_ols("tall", rows, cols);
+    bench_ols("wide", narrow, 2 * narrow);
+
+    bench_csv_load("tall", rows / 5 + 1, narrow);
+
+    bench_scaling(ml_get_num_threads(), scale);
+
+    print_table();
+
+    if (json_file != NULL && write_json(json_file, scale) != EXIT_SUCCESS) {
+        return 1;
+    }
+
+    size_t regressions = 0;
+    if (baseline_file != NULL) {
+        if (compare_baseline(baseline_file, threshold, &regressions) != EXIT_SUCCESS) {
+            return 1;
+        }
+    }
+    return regressions > 0 ? 1 : 0;
+}
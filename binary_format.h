@@ -0,0 +1,406 @@
+#ifndef BINARY_FORMAT_H
+#define BINARY_FORMAT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "thread_pool.h"
+
+/**
+ * A versioned binary file format for matrices and vectors.
+ *
+ * Layout:
+ * - A 64 byte MlbHeader at offset 0
+ * - Zero padding up to data_offset, which is a multiple of MLB_PAGE_SIZE
+ * - rows * stride doubles in row-major order. Each row holds cols values
+ *   followed by stride - cols zeros
+ *
+ * Matrices are written with the same cache-line padded stride the Matrix type
+ * uses, and the data starts on a page boundary. That lets a loader map the
+ * file and hand the mapped pages to a Matrix as its buffer, with no copy.
+ *
+ * Values are stored in the byte order of the machine that wrote them, which
+ * is recorded in the header. The checksum is mlb_checksum() over the data
+ * section, padding included.
+ */
+
+#define MLB_MAGIC "MLBIN\r\n"
+#define MLB_VERSION 1
+#define MLB_DTYPE_F64 1
+#define MLB_ENDIAN_MARK 0x01020304u
+#define MLB_PAGE_SIZE 4096
+
+#define MLB_KIND_MATRIX 1
+#define MLB_KIND_VECTOR 2
+
+// Passed as the row count to mlb_writer_open() when it is not known up front
+#define MLB_ROWS_UNKNOWN UINT64_MAX
+
+// The checksum hashes the data in blocks of this many doubles
+#define MLB_BLOCK_WORDS (1 << 17)
+
+/**
+ * @struct The file header, 64 bytes with no implicit padding
+ */
+typedef struct MlbHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t dtype;
+    uint32_t endian;
+    uint32_t kind;
+    uint64_t rows;
+    uint64_t cols;
+    uint64_t stride;
+    uint64_t data_offset;
+    uint64_t checksum;
+} MlbHeader;
+
+/**
+ * @brief Hash one block of at most MLB_BLOCK_WORDS 64-bit words
+ *
+ * Four independent multiply-xor lanes keep the hash running at memory speed.
+ */
+static uint64_t _mlb_block_hash(const uint64_t* words, size_t n) {
+    const uint64_t prime = 0x100000001b3ull;
+    uint64_t lanes[4] = {
+        0xcbf29ce484222325ull, 0x84222325cbf29ce4ull,
+        0x9e3779b97f4a7c15ull, 0xc2b2ae3d27d4eb4full
+    };
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        for (size_t l = 0; l < 4; l++) {
+            lanes[l] = (lanes[l] ^ words[i + l]) * prime;
+            lanes[l] ^= lanes[l] >> 29;
+        }
+    }
+    for (; i < n; i++) {
+        lanes[0] = (lanes[0] ^ words[i]) * prime;
+        lanes[0] ^= lanes[0] >> 29;
+    }
+
+    uint64_t h = (uint64_t)n;
+    for (size_t l = 0; l < 4; l++) {
+        h = (h ^ lanes[l]) * prime;
+        h ^= h >> 31;
+    }
+    return h;
+}
+
+/**
+ * @brief Fold the hash of the next block into the running checksum
+ */
+static inline uint64_t _mlb_fold(uint64_t checksum, uint64_t block_hash) {
+    checksum = (checksum ^ block_hash) * 0x9e3779b97f4a7c15ull;
+    return checksum ^ (checksum >> 32);
+}
+
+/**
+ * @struct Arguments shared by the threads of mlb_checksum()
+ */
+typedef struct MlbChecksumTask {
+    const uint64_t* words;
+    size_t n_words;
+    uint64_t* block_hashes;
+} MlbChecksumTask;
+
+static void _mlb_checksum_task(size_t begin, size_t end, void* ctx) {
+    MlbChecksumTask* task = (MlbChecksumTask*)ctx;
+    for (size_t b = begin; b < end; b++) {
+        size_t start = b * MLB_BLOCK_WORDS;
+        size_t n = task->n_words - start < MLB_BLOCK_WORDS ? task->n_words - start : MLB_BLOCK_WORDS;
+        task->block_hashes[b] = _mlb_block_hash(task->words + start, n);
+    }
+}
+
+/**
+ * @brief Compute the checksum of a data section
+ *
+ * The blocks are hashed in parallel and then folded in order, so the result
+ * matches the one MlbWriter builds up while streaming.
+ *
+ * @param data The data section
+ * @param n_values The number of doubles in it
+ * @return uint64_t
+ */
+uint64_t mlb_checksum(const double* data, size_t n_values) {
+    size_t n_blocks = (n_values + MLB_BLOCK_WORDS - 1) / MLB_BLOCK_WORDS;
+    uint64_t* block_hashes = (uint64_t*)malloc((n_blocks + 1) * sizeof(uint64_t));
+    if (block_hashes == NULL) {
+        fprintf(stderr, "Binary: Unable to allocate checksum table\n");
+        return 0;
+    }
+
+    MlbChecksumTask task = { (const uint64_t*)data, n_values, block_hashes };
+    parallel_for(0, n_blocks, 1, _mlb_checksum_task, &task);
+
+    uint64_t checksum = 0;
+    for (size_t b = 0; b < n_blocks; b++) {
+        checksum = _mlb_fold(checksum, block_hashes[b]);
+    }
+
+    free(block_hashes);
+    return checksum;
+}
+
+/**
+ * @brief Get the stride a matrix with cols columns is stored with
+ *
+ * @param cols The number of columns
+ * @return uint64_t cols rounded up to a whole 64 byte cache line
+ */
+static inline uint64_t mlb_matrix_stride(uint64_t cols) {
+    return (cols + 7) / 8 * 8;
+}
+
+/**
+ * @brief Check whether a file starts with the binary format's magic bytes
+ *
+ * @param file_name The name of the file
+ * @return int 1 if it does, 0 otherwise
+ */
+int is_binary_file(const char* file_name) {
+    char magic[8] = {0};
+    FILE* fp = fopen(file_name, "rb");
+    if (fp == NULL) return 0;
+
+    size_t read = fread(magic, 1, sizeof(magic), fp);
+    fclose(fp);
+    return read == sizeof(magic) && memcmp(magic, MLB_MAGIC, sizeof(magic)) == 0;
+}
+
+/**
+ * @struct A binary file being written one row at a time
+ *
+ * Rows are staged in a block buffer so the checksum can be computed on the
+ * way out, and the header is rewritten with it on close. A writer opened
+ * with MLB_ROWS_UNKNOWN rows takes any number of rows and records the count
+ * on close.
+ */
+typedef struct MlbWriter {
+    FILE* fp;
+    MlbHeader header;
+    double* block;
+    size_t fill;
+    uint64_t checksum;
+    uint64_t rows_written;
+} MlbWriter;
+
+/**
+ * @brief Create a binary file and write its header
+ *
+ * @param writer The writer to set up
+ * @param file_name The name of the file to create
+ * @param kind MLB_KIND_MATRIX or MLB_KIND_VECTOR
+ * @param rows The number of rows, or MLB_ROWS_UNKNOWN
+ * @param cols The number of columns, 1 for a vector
+ * @return int The resulting status code
+ */
+int mlb_writer_open(MlbWriter* writer, const char* file_name, uint32_t kind,
+                    uint64_t rows, uint64_t cols) {
+    memset(writer, 0, sizeof(MlbWriter));
+
+    memcpy(writer->header.magic, MLB_MAGIC, sizeof(writer->header.magic));
+    writer->header.version = MLB_VERSION;
+    writer->header.dtype = MLB_DTYPE_F64;
+    writer->header.endian = MLB_ENDIAN_MARK;
+    writer->header.kind = kind;
+    writer->header.rows = rows;
+    writer->header.cols = cols;
+    writer->header.stride = (kind == MLB_KIND_MATRIX) ? mlb_matrix_stride(cols) : cols;
+    writer->header.data_offset = MLB_PAGE_SIZE;
+
+    writer->block = (double*)malloc(MLB_BLOCK_WORDS * sizeof(double));
+    writer->fp = fopen(file_name, "wb");
+    if (writer->block == NULL || writer->fp == NULL) {
+        perror("Unable to create binary file");
+        free(writer->block);
+        if (writer->fp) fclose(writer->fp);
+        return EXIT_FAILURE;
+    }
+
+    // Header followed by zeros up to the page-aligned data
+    char page[MLB_PAGE_SIZE] = {0};
+    memcpy(page, &writer->header, sizeof(MlbHeader));
+    if (fwrite(page, 1, sizeof(page), writer->fp) != sizeof(page)) {
+        perror("Unable to write binary header");
+        fclose(writer->fp);
+        free(writer->block);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Hash and write out the staged block
+ */
+static int _mlb_writer_flush(MlbWriter* writer) {
+    if (writer->fill == 0) return EXIT_SUCCESS;
+
+    writer->checksum = _mlb_fold(writer->checksum,
+                                 _mlb_block_hash((const uint64_t*)writer->block, writer->fill));
+    size_t written = fwrite(writer->block, sizeof(double), writer->fill, writer->fp);
+    int status = (written == writer->fill) ? EXIT_SUCCESS : EXIT_FAILURE;
+    writer->fill = 0;
+    return status;
+}
+
+/**
+ * @brief Append one row of cols values, padded with zeros to the stride
+ *
+ * @param writer An open writer
+ * @param row The values of the row
+ * @return int The resulting status code
+ */
+int mlb_writer_write_row(MlbWriter* writer, const double* row) {
+    if (writer->header.rows != MLB_ROWS_UNKNOWN && writer->rows_written >= writer->header.rows) {
+        fprintf(stderr, "Binary: More rows written than the header declares\n");
+        return EXIT_FAILURE;
+    }
+
+    for (uint64_t j = 0; j < writer->header.stride; j++) {
+        writer->block[writer->fill++] = (j < writer->header.cols) ? row[j] : 0.0;
+        if (writer->fill == MLB_BLOCK_WORDS && _mlb_writer_flush(writer) != EXIT_SUCCESS) {
+            perror("Unable to write binary data");
+            return EXIT_FAILURE;
+        }
+    }
+
+    writer->rows_written++;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Finish a binary file: flush the data and store the checksum
+ *
+ * @param writer An open writer, closed on return
+ * @return int The resulting status code
+ */
+int mlb_writer_close(MlbWriter* writer) {
+    int status = _mlb_writer_flush(writer);
+
+    if (writer->header.rows == MLB_ROWS_UNKNOWN) {
+        writer->header.rows = writer->rows_written;
+    } else if (writer->rows_written != writer->header.rows) {
+        fprintf(stderr, "Binary: %llu rows written, the header declares %llu\n",
+                (unsigned long long)writer->rows_written, (unsigned long long)writer->header.rows);
+        status = EXIT_FAILURE;
+    }
+
+    writer->header.checksum = writer->checksum;
+    if (fseek(writer->fp, 0, SEEK_SET) != 0
+        || fwrite(&writer->header, sizeof(MlbHeader), 1, writer->fp) != 1) {
+        perror("Unable to write binary header");
+        status = EXIT_FAILURE;
+    }
+
+    if (fclose(writer->fp) != 0) status = EXIT_FAILURE;
+    free(writer->block);
+    writer->fp = NULL;
+    writer->block = NULL;
+    return status;
+}
+
+/**
+ * @brief Check that a header describes a readable file of the expected kind
+ *
+ * @param h The header read from the start of the file
+ * @param file_size The size of the file in bytes
+ * @param kind The expected MLB_KIND_*
+ * @param file_name The name of the file, for the error message
+ * @return int The resulting status code
+ */
+int mlb_check_header(const MlbHeader* h, uint64_t file_size, uint32_t kind, const char* file_name) {
+    const char* problem = NULL;
+    if (memcmp(h->magic, MLB_MAGIC, sizeof(h->magic)) != 0) problem = "not a binary matrix file";
+    else if (h->version != MLB_VERSION) problem = "unsupported format version";
+    else if (h->endian != MLB_ENDIAN_MARK) problem = "written with a different byte order";
+    else if (h->dtype != MLB_DTYPE_F64) problem = "unsupported element type";
+    else if (h->kind != kind) problem = kind == MLB_KIND_MATRIX ? "holds a vector, not a matrix"
+                                                                : "holds a matrix, not a vector";
+    else if (h->rows == MLB_ROWS_UNKNOWN) problem = "the writer never recorded the row count";
+    else if (h->stride < h->cols || h->data_offset % MLB_PAGE_SIZE != 0) problem = "corrupt header";
+    else if (h->data_offset > SIZE_MAX ||
+             (h->stride > 0 && h->rows > (SIZE_MAX - h->data_offset) / h->stride / sizeof(double))) {
+        problem = "corrupt header";
+    }
+    else if (file_size < h->data_offset + h->rows * h->stride * sizeof(double)) problem = "file is truncated";
+
+    if (problem != NULL) {
+        fprintf(stderr, "Binary: %s: %s\n", file_name, problem);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @struct A binary file mapped into memory
+ */
+typedef struct MlbMapping {
+    MlbHeader header;
+    void* base;
+    size_t size;
+    double* data;
+} MlbMapping;
+
+/**
+ * @brief Map a binary file, validate its header and verify its checksum
+ *
+ * The mapping is private and writable: pages a caller modifies are copied on
+ * write and never reach the file.
+ *
+ * @param file_name The name of the file
+ * @param kind The expected MLB_KIND_* of the file
+ * @param mapping Filled in on success. Release it with munmap(base, size)
+ * @return int The resulting status code
+ */
+int mlb_map(const char* file_name, uint32_t kind, MlbMapping* mapping) {
+    memset(mapping, 0, sizeof(MlbMapping));
+
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0) {
+        perror("Unable to open file");
+        return EXIT_FAILURE;
+    }
+
+    struct stat st;
+    MlbHeader* h = &mapping->header;
+    if (fstat(fd, &st) != 0 || pread(fd, h, sizeof(MlbHeader), 0) != (ssize_t)sizeof(MlbHeader)) {
+        fprintf(stderr, "Binary: %s: file too short for a header\n", file_name);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    if (mlb_check_header(h, (uint64_t)st.st_size, kind, file_name) != EXIT_SUCCESS) {
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    mapping->size = (size_t)(h->data_offset + h->rows * h->stride * sizeof(double));
+    mapping->base = mmap(NULL, mapping->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping->base == MAP_FAILED) {
+        perror("Unable to map file");
+        mapping->base = NULL;
+        return EXIT_FAILURE;
+    }
+
+    mapping->data = (double*)((char*)mapping->base + h->data_offset);
+    if (mlb_checksum(mapping->data, (size_t)(h->rows * h->stride)) != h->checksum) {
+        fprintf(stderr, "Binary: %s: checksum mismatch\n", file_name);
+        munmap(mapping->base, mapping->size);
+        mapping->base = NULL;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,361 @@
+#ifndef CHOLESKY_H
+#define CHOLESKY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <float.h>
+#include <math.h>
+
+#include "matrix.h"
+
+/**
+ * Cholesky factorization A = L * Lt of symmetric positive definite matrices.
+ *
+ * The factorization works down the diagonal CHOLESKY_BLOCK columns at a time:
+ * - The diagonal block is factored with one dot product per entry
+ * - The rows below it are solved against that block, in parallel by rows
+ * - The rest of the lower triangle is updated with gemm(), so almost all of
+ *   the n^3 / 3 flops run in the blocked kernels
+ *
+ * Only the lower triangle of A is read. cholesky_pivoted() also handles
+ * semidefinite matrices and reports their numerical rank.
+ */
+
+// Columns factored per step, and the width of the trailing update blocks
+#define CHOLESKY_BLOCK 64
+
+// The blocked kernels, for double and for float (see cholesky_template.h)
+#define CHOLESKY_REAL double
+#define CHOLESKY_NAME(name) name
+#define CHOLESKY_EPSILON DBL_EPSILON
+#include "cholesky_template.h"
+#undef CHOLESKY_REAL
+#undef CHOLESKY_NAME
+#undef CHOLESKY_EPSILON
+
+#define CHOLESKY_REAL float
+#define CHOLESKY_NAME(name) name##_f
+#define CHOLESKY_EPSILON FLT_EPSILON
+#include "cholesky_template.h"
+#undef CHOLESKY_REAL
+#undef CHOLESKY_NAME
+#undef CHOLESKY_EPSILON
+
+/**
+ * @brief Compute the Cholesky factor of a symmetric positive definite matrix
+ *
+ * @param A The n x n matrix to factor. Only its lower triangle is read
+ *
+ * @return Matrix* L, lower triangular with A = L * Lt, or NULL if A is not
+ * square or not numerically positive definite
+ * @note The caller is responsible for freeing this memory using free_matrix()
+ */
+Matrix* cholesky(Matrix* A) {
+    if (A->rows != A->cols) {
+        fprintf(stderr, "Cholesky: A is not square\n");
+        return NULL;
+    }
+
+    Matrix* L = copy_matrix(A);
+    if (L == NULL) return NULL;
+
+    if (_cholesky_factor(L->data, L->stride, A->rows) != EXIT_SUCCESS) {
+        free_matrix(L);
+        return NULL;
+    }
+
+    return L;
+}
+
+/**
+ * @brief Solve A * x = b given the Cholesky factor of A
+ *
+ * Solves L * y = b by forward substitution, then Lt * x = y by back
+ * substitution, in O(n^2).
+ *
+ * @param L The factor returned by cholesky()
+ * @param b The right hand side
+ *
+ * @return Vector* x, or NULL if the sizes do not match
+ * @note The caller is responsible for freeing this memory using free_vector()
+ */
+Vector* cholesky_solve(Matrix* L, Vector* b) {
+    if (L->rows != b->rows) {
+        fprintf(stderr, "Cholesky Solve: The factor and vector have incompatible sizes\n");
+        return NULL;
+    }
+
+    size_t n = L->rows;
+    Vector* x = create_empty_vector(n);
+    if (x == NULL) return NULL;
+
+    memcpy(x->data, b->data, n * sizeof(double));
+    _cholesky_substitute(L->data, L->stride, n, x->data);
+
+    return x;
+}
+
+/**
+ * @struct A Cholesky factorization with diagonal pivoting, P * A * Pt = L * Lt
+ *
+ * Row i of L belongs to row and column pivots[i] of A. Only the first rank
+ * columns of L are nonzero.
+ */
+typedef struct PivotedCholesky {
+    Matrix* L;
+    size_t* pivots;
+    size_t rank;        // Number of pivots above the tolerance
+    double rcond;       // (L[rank-1][rank-1] / L[0][0])^2, or 0 if rank < n
+} PivotedCholesky;
+
+/**
+ * @brief Free the memory a pivoted Cholesky factorization is occupying
+ *
+ * @param chol A pointer to the factorization
+ * @return void
+ */
+void free_pivoted_cholesky(PivotedCholesky* chol) {
+    if (chol == NULL) return;
+    if (chol->L) free_matrix(chol->L);
+    free(chol->pivots);
+    free(chol);
+}
+
+/**
+ * @brief Swap row and column i with row and column p of a symmetric matrix
+ * held in its lower triangle, for i < p
+ */
+static void _cholesky_swap(double* a, size_t lda, size_t n, size_t i, size_t p) {
+    double temp;
+    double* row_i = a + i * lda;
+    double* row_p = a + p * lda;
+
+    // Already factored columns of L, then the diagonal
+    for (size_t c = 0; c < i; c++) {
+        temp = row_i[c]; row_i[c] = row_p[c]; row_p[c] = temp;
+    }
+    temp = row_i[i]; row_i[i] = row_p[p]; row_p[p] = temp;
+
+    // Column i between the two rows is row p, and below p the columns swap
+    for (size_t c = i + 1; c < p; c++) {
+        double* row_c = a + c * lda;
+        temp = row_c[i]; row_c[i] = row_p[c]; row_p[c] = temp;
+    }
+    for (size_t r = p + 1; r < n; r++) {
+        double* row_r = a + r * lda;
+        temp = row_r[i]; row_r[i] = row_r[p]; row_r[p] = temp;
+    }
+}
+
+/**
+ * @struct Arguments shared by the threads computing one column of L
+ */
+typedef struct CholeskyColumnTask {
+    double* a;
+    size_t lda;
+    size_t k;           // First column of the panel
+    size_t j;           // The column being computed
+    double* partial;    // Running sum of L[i][k..j]^2 for each row i
+} CholeskyColumnTask;
+
+/**
+ * @brief parallel_for() body computing L[i][j] for rows j + 1 + [begin, end)
+ */
+static void _cholesky_column_task(size_t begin, size_t end, void* ctx) {
+    CholeskyColumnTask* task = (CholeskyColumnTask*)ctx;
+    size_t k = task->k;
+    size_t j = task->j;
+    const double* row_j = task->a + j * task->lda;
+
+    for (size_t i = j + 1 + begin; i < j + 1 + end; i++) {
+        double* row_i = task->a + i * task->lda;
+        double l = (row_i[j] - simd_dot(row_i + k, row_j + k, j - k)) / row_j[j];
+        row_i[j] = l;
+        task->partial[i] += l * l;
+    }
+}
+
+/**
+ * @brief Factor the n x n matrix at a in place with diagonal pivoting
+ *
+ * @param a The matrix, leading dimension lda. Only its lower triangle is read
+ * @param lda The leading dimension
+ * @param n The order of the matrix
+ * @param pivots Set to the pivot order, n entries
+ * @param partial Scratch space for n values
+ * @return size_t The numerical rank
+ */
+static size_t _cholesky_pivoted_factor(double* a, size_t lda, size_t n, size_t* pivots, double* partial) {
+    for (size_t i = 0; i < n; i++) pivots[i] = i;
+
+    double max_diag = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        if (a[i * lda + i] > max_diag) max_diag = a[i * lda + i];
+    }
+    double tol = (double)n * DBL_EPSILON * max_diag;
+
+    size_t rank = n;
+    for (size_t k = 0; k < n && rank == n; k += CHOLESKY_BLOCK) {
+        size_t nb = MIN((size_t)CHOLESKY_BLOCK, n - k);
+        for (size_t i = k; i < n; i++) partial[i] = 0.0;
+
+        for (size_t j = k; j < k + nb; j++) {
+            size_t p = j;
+            for (size_t i = j + 1; i < n; i++) {
+                if (a[i * lda + i] - partial[i] > a[p * lda + p] - partial[p]) p = i;
+            }
+            double d = a[p * lda + p] - partial[p];
+            if (!(d > tol)) {
+                rank = j;
+                break;
+            }
+
+            if (p != j) {
+                _cholesky_swap(a, lda, n, j, p);
+                double temp = partial[j]; partial[j] = partial[p]; partial[p] = temp;
+                size_t index = pivots[j]; pivots[j] = pivots[p]; pivots[p] = index;
+            }
+
+            a[j * lda + j] = sqrt(d);
+            size_t below = n - j - 1;
+            CholeskyColumnTask task = { a, lda, k, j, partial };
+            parallel_for(0, below, PARALLEL_MIN_WORK / (j - k + 1) + 1, _cholesky_column_task, &task);
+        }
+        if (rank != n) break;
+
+        // A22 -= L21 * L21t, lower triangle only, as in cholesky()
+        size_t below = n - k - nb;
+        const double* L21 = a + (k + nb) * lda + k;
+        for (size_t jb = 0; jb < below; jb += CHOLESKY_BLOCK) {
+            size_t bw = MIN((size_t)CHOLESKY_BLOCK, below - jb);
+            gemm(0, 1, below - jb, bw, nb, -1.0, L21 + jb * lda, lda,
+                 L21 + jb * lda, lda, 1.0, a + (k + nb + jb) * lda + k + nb + jb, lda);
+        }
+    }
+
+    // Clear the upper triangle, and the unfactored remainder past the rank
+    for (size_t i = 0; i < n; i++) {
+        size_t first = (i < rank) ? i + 1 : rank;
+        for (size_t j = first; j < n; j++) {
+            a[i * lda + j] = 0.0;
+        }
+    }
+    return rank;
+}
+
+/**
+ * @brief Solve with the leading rank x rank block of a pivoted factor
+ *
+ * @param L The factor, leading dimension lda
+ * @param lda The leading dimension
+ * @param n The order of the factor
+ * @param rank The numerical rank
+ * @param pivots The pivot order
+ * @param b The right hand side
+ * @param x Set to the solution, zero past the rank. It may not be b
+ * @param y Scratch space for n values
+ * @return void
+ */
+static void _cholesky_pivoted_substitute(const double* L, size_t lda, size_t n, size_t rank,
+                                         const size_t* pivots, const double* b, double* x, double* y) {
+    for (size_t i = 0; i < rank; i++) {
+        const double* l_i = L + i * lda;
+        y[i] = (b[pivots[i]] - simd_dot(l_i, y, i)) / l_i[i];
+    }
+    for (size_t i = rank; i-- > 0; ) {
+        const double* l_i = L + i * lda;
+        y[i] /= l_i[i];
+        for (size_t j = 0; j < i; j++) {
+            y[j] -= l_i[j] * y[i];
+        }
+    }
+
+    memset(x, 0, n * sizeof(double));
+    for (size_t i = 0; i < rank; i++) {
+        x[pivots[i]] = y[i];
+    }
+}
+
+/**
+ * @brief Compute the Cholesky factorization of a symmetric positive
+ * semidefinite matrix with diagonal pivoting
+ *
+ * Each step takes the largest diagonal entry left, so the factorization
+ * stops as soon as what remains is rounding error. The step it stops at is
+ * the numerical rank of A, and the decay of the diagonal of L gives a
+ * condition estimate for free. Like cholesky(), the columns are taken
+ * CHOLESKY_BLOCK at a time with the trailing update done by gemm(); the
+ * pivots only need the updated diagonal, which is tracked on the side.
+ *
+ * @param A The n x n matrix to factor. Only its lower triangle is read
+ *
+ * @return PivotedCholesky* The factorization, or NULL if A is not square
+ * @note The caller is responsible for freeing this memory using
+ * free_pivoted_cholesky()
+ */
+PivotedCholesky* cholesky_pivoted(Matrix* A) {
+    if (A->rows != A->cols) {
+        fprintf(stderr, "Cholesky: A is not square\n");
+        return NULL;
+    }
+
+    size_t n = A->rows;
+    PivotedCholesky* chol = (PivotedCholesky*)calloc(1, sizeof(PivotedCholesky));
+    if (chol == NULL) return NULL;
+    chol->L = copy_matrix(A);
+    chol->pivots = (size_t*)malloc((n + 1) * sizeof(size_t));
+    double* partial = (double*)malloc((n + 1) * sizeof(double));
+    if (chol->L == NULL || chol->pivots == NULL || partial == NULL) {
+        fprintf(stderr, "Cholesky: Unable to allocate the factors\n");
+        free(partial);
+        free_pivoted_cholesky(chol);
+        return NULL;
+    }
+
+    double* a = chol->L->data;
+    size_t lda = chol->L->stride;
+    chol->rank = _cholesky_pivoted_factor(a, lda, n, chol->pivots, partial);
+    free(partial);
+
+    if (chol->rank == n && n > 0) {
+        double ratio = a[(n - 1) * lda + n - 1] / a[0];
+        chol->rcond = ratio * ratio;
+    }
+    return chol;
+}
+
+/**
+ * @brief Solve A * x = b given the pivoted Cholesky factorization of A
+ *
+ * If A is rank deficient only the leading rank x rank block of L is used and
+ * the remaining entries of x are zero, which gives a basic solution rather
+ * than the minimum norm one.
+ *
+ * @param chol The factorization returned by cholesky_pivoted()
+ * @param b The right hand side
+ *
+ * @return Vector* x, or NULL if the sizes do not match
+ * @note The caller is responsible for freeing this memory using free_vector()
+ */
+Vector* cholesky_pivoted_solve(PivotedCholesky* chol, Vector* b) {
+    const Matrix* L = chol->L;
+    if (L->rows != b->rows) {
+        fprintf(stderr, "Cholesky Solve: The factor and vector have incompatible sizes\n");
+        return NULL;
+    }
+
+    size_t n = L->rows;
+    Vector* x = create_empty_vector(n);
+    double* y = (double*)malloc((n + 1) * sizeof(double));
+    if (x == NULL || y == NULL) {
+        if (x) free_vector(x);
+        free(y);
+        return NULL;
+    }
+
+    _cholesky_pivoted_substitute(L->data, L->stride, n, chol->rank, chol->pivots, b->data, x->data, y);
+    free(y);
+    return x;
+}
+
+#endif
@@ -0,0 +1,138 @@
+/**
+ * The blocked Cholesky kernels of cholesky.h, written once for both element
+ * types.
+ *
+ * This file has no include guard on purpose: cholesky.h includes it once per
+ * type after defining
+ * - CHOLESKY_REAL, the element type
+ * - CHOLESKY_NAME(name), which gives each function and type its per-type
+ *   name, and also picks simd_dot() or simd_dot_f() and gemm() or gemm_f()
+ * - CHOLESKY_EPSILON, the machine epsilon of the type
+ */
+
+/**
+ * @brief Factor the n x n block at A in place, one column at a time
+ *
+ * @param A The block, leading dimension lda
+ * @param lda The leading dimension
+ * @param n The order of the block
+ * @param tol Pivots no larger than this mean A is not positive definite
+ * @return int The resulting status code
+ */
+static int CHOLESKY_NAME(_cholesky_unblocked)(CHOLESKY_REAL* A, size_t lda, size_t n, CHOLESKY_REAL tol) {
+    for (size_t j = 0; j < n; j++) {
+        CHOLESKY_REAL* row_j = A + j * lda;
+        CHOLESKY_REAL d = row_j[j] - CHOLESKY_NAME(simd_dot)(row_j, row_j, j);
+        if (!(d > tol)) {
+            return EXIT_FAILURE;
+        }
+        d = (CHOLESKY_REAL)sqrt(d);
+        row_j[j] = d;
+
+        for (size_t i = j + 1; i < n; i++) {
+            CHOLESKY_REAL* row_i = A + i * lda;
+            row_i[j] = (row_i[j] - CHOLESKY_NAME(simd_dot)(row_i, row_j, j)) / d;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @struct Arguments shared by the threads solving a panel against L11
+ */
+typedef struct CHOLESKY_NAME(CholeskyPanelTask) {
+    CHOLESKY_REAL* panel;       // First row below the diagonal block, at its first column
+    const CHOLESKY_REAL* L11;   // The factored diagonal block
+    size_t lda;
+    size_t nb;
+} CHOLESKY_NAME(CholeskyPanelTask);
+
+/**
+ * @brief parallel_for() body computing rows [begin, end) of L21 = A21 * L11^-T
+ */
+static void CHOLESKY_NAME(_cholesky_panel_task)(size_t begin, size_t end, void* ctx) {
+    CHOLESKY_NAME(CholeskyPanelTask)* task = (CHOLESKY_NAME(CholeskyPanelTask)*)ctx;
+
+    for (size_t r = begin; r < end; r++) {
+        CHOLESKY_REAL* x = task->panel + r * task->lda;
+        for (size_t j = 0; j < task->nb; j++) {
+            const CHOLESKY_REAL* l_j = task->L11 + j * task->lda;
+            x[j] = (x[j] - CHOLESKY_NAME(simd_dot)(x, l_j, j)) / l_j[j];
+        }
+    }
+}
+
+/**
+ * @brief Factor the n x n matrix at a in place, blocked
+ *
+ * @param a The matrix, leading dimension lda. Only its lower triangle is
+ * read, and its upper triangle is cleared
+ * @param lda The leading dimension
+ * @param n The order of the matrix
+ * @return int EXIT_FAILURE if a is not numerically positive definite
+ */
+static int CHOLESKY_NAME(_cholesky_factor)(CHOLESKY_REAL* a, size_t lda, size_t n) {
+    // A pivot this small relative to the diagonal is rounding error, not data
+    CHOLESKY_REAL max_diag = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (a[i * lda + i] > max_diag) max_diag = a[i * lda + i];
+    }
+    CHOLESKY_REAL tol = (CHOLESKY_REAL)n * CHOLESKY_EPSILON * max_diag;
+
+    for (size_t k = 0; k < n; k += CHOLESKY_BLOCK) {
+        size_t nb = MIN((size_t)CHOLESKY_BLOCK, n - k);
+        CHOLESKY_REAL* A11 = a + k * lda + k;
+
+        if (CHOLESKY_NAME(_cholesky_unblocked)(A11, lda, nb, tol) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+
+        size_t below = n - k - nb;
+        if (below == 0) break;
+
+        CHOLESKY_NAME(CholeskyPanelTask) task = { A11 + nb * lda, A11, lda, nb };
+        parallel_for(0, below, PARALLEL_MIN_WORK / (nb * nb + 1) + 1,
+                     CHOLESKY_NAME(_cholesky_panel_task), &task);
+
+        // A22 -= L21 * L21t, one block column at a time so only the lower triangle is touched
+        const CHOLESKY_REAL* L21 = A11 + nb * lda;
+        for (size_t jb = 0; jb < below; jb += CHOLESKY_BLOCK) {
+            size_t bw = MIN((size_t)CHOLESKY_BLOCK, below - jb);
+            CHOLESKY_NAME(gemm)(0, 1, below - jb, bw, nb, -1.0, L21 + jb * lda, lda,
+                                L21 + jb * lda, lda, 1.0, a + (k + nb + jb) * lda + k + nb + jb, lda);
+        }
+    }
+
+    // Clear what is left of A above the diagonal
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = i + 1; j < n; j++) {
+            a[i * lda + j] = 0;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Solve L * Lt * x = b in place, in O(n^2)
+ *
+ * @param L The factor, leading dimension lda
+ * @param lda The leading dimension
+ * @param n The order of the factor
+ * @param x The right hand side, overwritten with the solution
+ * @return void
+ */
+static void CHOLESKY_NAME(_cholesky_substitute)(const CHOLESKY_REAL* L, size_t lda, size_t n, CHOLESKY_REAL* x) {
+    for (size_t i = 0; i < n; i++) {
+        const CHOLESKY_REAL* l_i = L + i * lda;
+        x[i] = (x[i] - CHOLESKY_NAME(simd_dot)(l_i, x, i)) / l_i[i];
+    }
+
+    // Row i of L is column i of Lt, so each solved x_i is pushed up the rows above it
+    for (size_t i = n; i-- > 0; ) {
+        const CHOLESKY_REAL* l_i = L + i * lda;
+        x[i] /= l_i[i];
+        for (size_t j = 0; j < i; j++) {
+            x[j] -= l_i[j] * x[i];
+        }
+    }
+}
@@ -0,0 +1,490 @@
+#ifndef CSV_H
+#define CSV_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <locale.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "thread_pool.h"
+
+/**
+ * Memory-mapped, parallel loading of numeric CSV files.
+ *
+ * csv_open() maps the file and cuts it into chunks that start and end on a
+ * line break, then the threads count the rows in every chunk. That gives each
+ * chunk the index of its first row, so csv_read() can parse all the chunks in
+ * parallel straight into the caller's buffer. The text itself is only ever
+ * parsed once, and there is no limit on the length of a line.
+ *
+ * Numbers are parsed by a small locale-independent parser: the decimal point
+ * is always '.', whatever LC_NUMERIC says. The numbers it hands to strtod()
+ * are read in the "C" locale too. Blank lines are skipped. Every
+ * line must have as many fields as the first one; the first malformed field
+ * or ragged line is reported with its 1-based row and column.
+ */
+
+// Chunks are at least this many bytes, so small files are read by one thread
+#ifndef CSV_MIN_CHUNK_BYTES
+#define CSV_MIN_CHUNK_BYTES (1 << 20)
+#endif
+
+/**
+ * @struct A newline-aligned slice of the mapped file
+ */
+typedef struct CsvChunk {
+    size_t begin;
+    size_t end;
+    size_t first_row;
+    size_t rows;
+
+    // First problem found in this chunk, error_row is 0 when there is none
+    size_t error_row;
+    size_t error_col;
+    const char* error;
+} CsvChunk;
+
+/**
+ * @struct A mapped CSV file and its dimensions
+ */
+typedef struct CsvFile {
+    const char* file_name;
+    const char* text;
+    size_t size;
+    size_t rows;
+    size_t cols;
+
+    CsvChunk* chunks;
+    size_t n_chunks;
+
+    // Where csv_read() failed, 1-based. Both are 0 after a successful read
+    size_t error_row;
+    size_t error_col;
+
+    // Set by csv_read() for its chunk tasks
+    double* out;
+    size_t out_stride;
+} CsvFile;
+
+// Exact powers of ten, every one of them is representable as a double
+static const double _csv_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline int _csv_is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Longest number handed to strtod() from a stack buffer. Longer ones are copied to the heap
+#define CSV_TOKEN_BYTES 128
+
+// The "C" numeric locale strtod() runs in, made once for all threads
+static locale_t _csv_c_locale = (locale_t)0;
+static pthread_once_t _csv_c_locale_once = PTHREAD_ONCE_INIT;
+
+static void _csv_make_c_locale() {
+    _csv_c_locale = newlocale(LC_NUMERIC_MASK, "C", (locale_t)0);
+}
+
+/**
+ * @brief Parse a number with strtod() from a bounded copy of the token at p
+ *
+ * The text is not NUL terminated, so the token, which ends at a comma,
+ * whitespace or end, is copied first. The calling thread switches to the
+ * "C" locale for the call, so a host program's LC_NUMERIC cannot change
+ * the decimal point.
+ */
+static const char* _csv_parse_slow(const char* p, const char* end, double* value) {
+    const char* token_end = p;
+    while (token_end < end && *token_end != ',' && *token_end != '\n' && !_csv_is_space(*token_end)) {
+        token_end++;
+    }
+
+    size_t len = (size_t)(token_end - p);
+    char stack[CSV_TOKEN_BYTES];
+    char* copy = len < sizeof(stack) ? stack : (char*)malloc(len + 1);
+    if (copy == NULL) return NULL;
+    memcpy(copy, p, len);
+    copy[len] = '\0';
+
+    pthread_once(&_csv_c_locale_once, _csv_make_c_locale);
+    locale_t previous = _csv_c_locale ? uselocale(_csv_c_locale) : (locale_t)0;
+    char* used = NULL;
+    double result = strtod(copy, &used);
+    if (previous) uselocale(previous);
+    size_t n_used = (size_t)(used - copy);
+    if (copy != stack) free(copy);
+
+    if (n_used == 0) return NULL;
+    *value = result;
+    return p + n_used;
+}
+
+/**
+ * @brief Parse a decimal floating point number, correctly rounded
+ *
+ * Accepts an optional sign, digits with an optional '.', and an optional
+ * exponent. When the digits fit in 53 bits and the power of ten is at most
+ * 1e22, both are exact doubles and one multiply or divide rounds correctly.
+ * Every other number, and nan and inf, goes to strtod(), so the result is
+ * always the double nearest the text.
+ *
+ * @param p The first character
+ * @param end One past the last character that may be read
+ * @param value Where to store the number
+ * @return const char* One past the last character used, or NULL if p does
+ * not start with a number
+ */
+static const char* csv_parse_double(const char* p, const char* end, double* value) {
+    const char* start = p;
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = (*p == '-');
+        p++;
+    }
+
+    unsigned long long mantissa = 0;
+    int digits = 0;       // Significant digits kept in mantissa
+    int truncated = 0;    // Nonzero digits past the 19 that fit were dropped
+    int exponent = 0;
+    int seen_digit = 0;
+
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (unsigned long long)(*p - '0');
+            if (mantissa != 0) digits++;
+        } else {
+            truncated |= (*p != '0');
+            exponent++;
+        }
+        seen_digit = 1;
+        p++;
+    }
+
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && *p >= '0' && *p <= '9') {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (unsigned long long)(*p - '0');
+                if (mantissa != 0) digits++;
+                exponent--;
+            } else {
+                truncated |= (*p != '0');
+            }
+            seen_digit = 1;
+            p++;
+        }
+    }
+
+    if (!seen_digit) {
+        // Perhaps nan or inf, which atof() always accepted
+        return _csv_parse_slow(start, end, value);
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char* q = p + 1;
+        int exp_negative = 0;
+        if (q < end && (*q == '-' || *q == '+')) {
+            exp_negative = (*q == '-');
+            q++;
+        }
+        if (q < end && *q >= '0' && *q <= '9') {
+            int exp_value = 0;
+            while (q < end && *q >= '0' && *q <= '9') {
+                if (exp_value < 100000) exp_value = exp_value * 10 + (*q - '0');
+                q++;
+            }
+            exponent += exp_negative ? -exp_value : exp_value;
+            p = q;
+        }
+    }
+
+    double result;
+    if (mantissa == 0) {
+        result = 0.0;
+    } else if (truncated || mantissa > (1ULL << 53) || exponent < -22 || exponent > 22) {
+        return _csv_parse_slow(start, end, value);
+    } else if (exponent >= 0) {
+        result = (double)mantissa * _csv_pow10[exponent];
+    } else {
+        result = (double)mantissa / _csv_pow10[-exponent];
+    }
+
+    *value = negative ? -result : result;
+    return p;
+}
+
+/**
+ * @brief Find the end of the line starting at p
+ *
+ * @return const char* The '\n' ending the line, or end
+ */
+static inline const char* _csv_line_end(const char* p, const char* end) {
+    const char* newline = (const char*)memchr(p, '\n', (size_t)(end - p));
+    return newline ? newline : end;
+}
+
+/**
+ * @brief Check whether a line holds nothing but whitespace
+ */
+static inline int _csv_is_blank(const char* p, const char* line_end) {
+    while (p < line_end && _csv_is_space(*p)) p++;
+    return p == line_end;
+}
+
+/**
+ * @brief parallel_for() body counting the non-blank lines of chunks [begin, end)
+ */
+static void _csv_count_task(size_t begin, size_t end, void* ctx) {
+    CsvFile* csv = (CsvFile*)ctx;
+
+    for (size_t c = begin; c < end; c++) {
+        CsvChunk* chunk = &csv->chunks[c];
+        const char* p = csv->text + chunk->begin;
+        const char* chunk_end = csv->text + chunk->end;
+        size_t rows = 0;
+
+        while (p < chunk_end) {
+            const char* line_end = _csv_line_end(p, chunk_end);
+            if (!_csv_is_blank(p, line_end)) rows++;
+            p = line_end + 1;
+        }
+        chunk->rows = rows;
+    }
+}
+
+/**
+ * @brief Parse one non-blank line of exactly cols comma separated values
+ *
+ * @param p The start of the line
+ * @param line_end The end of the line, excluding the newline
+ * @param cols The number of values the line must hold
+ * @param out Where to store the values
+ * @param bad_col Set to the 0-based column of a problem
+ * @return const char* NULL on success, otherwise a description of the problem
+ */
+static const char* csv_parse_line(const char* p, const char* line_end, size_t cols,
+                                  double* out, size_t* bad_col) {
+    size_t col = 0;
+
+    for (;;) {
+        while (p < line_end && _csv_is_space(*p)) p++;
+
+        if (col == cols) {
+            *bad_col = col;
+            return "row has more fields than the first row";
+        }
+
+        const char* next = csv_parse_double(p, line_end, &out[col]);
+        if (next == NULL) {
+            *bad_col = col;
+            return (p == line_end || *p == ',') ? "empty field" : "not a number";
+        }
+        col++;
+        p = next;
+
+        while (p < line_end && _csv_is_space(*p)) p++;
+        if (p == line_end) {
+            if (col < cols) {
+                *bad_col = col;
+                return "row has fewer fields than the first row";
+            }
+            return NULL;
+        }
+        if (*p != ',') {
+            *bad_col = col - 1;
+            return "not a number";
+        }
+        p++;
+    }
+}
+
+/**
+ * @brief parallel_for() body parsing chunks [begin, end) into csv->out
+ */
+static void _csv_parse_task(size_t begin, size_t end, void* ctx) {
+    CsvFile* csv = (CsvFile*)ctx;
+
+    for (size_t c = begin; c < end; c++) {
+        CsvChunk* chunk = &csv->chunks[c];
+        const char* p = csv->text + chunk->begin;
+        const char* chunk_end = csv->text + chunk->end;
+        size_t row = chunk->first_row;
+
+        while (p < chunk_end) {
+            const char* line_end = _csv_line_end(p, chunk_end);
+            if (_csv_is_blank(p, line_end)) {
+                p = line_end + 1;
+                continue;
+            }
+
+            size_t bad_col = 0;
+            const char* error = csv_parse_line(p, line_end, csv->cols,
+                                               csv->out + row * csv->out_stride, &bad_col);
+            if (error != NULL) {
+                // Only the first problem of a chunk is kept
+                chunk->error_row = row + 1;
+                chunk->error_col = bad_col + 1;
+                chunk->error = error;
+                break;
+            }
+
+            p = line_end + 1;
+            row++;
+        }
+    }
+}
+
+/**
+ * @brief Close a CSV file opened with csv_open()
+ *
+ * @param csv The file
+ * @return void
+ */
+void csv_close(CsvFile* csv) {
+    if (csv->text != NULL && csv->size > 0) {
+        munmap((void*)csv->text, csv->size);
+    }
+    free(csv->chunks);
+    csv->text = NULL;
+    csv->chunks = NULL;
+    csv->n_chunks = 0;
+}
+
+/**
+ * @brief Map a CSV file and find its dimensions
+ *
+ * The number of columns is the number of fields on the first non-blank line.
+ *
+ * @param file_name The name of the CSV file
+ * @param csv The file to fill in. Release it with csv_close()
+ * @return int The resulting status code
+ */
+int csv_open(const char* file_name, CsvFile* csv) {
+    memset(csv, 0, sizeof(CsvFile));
+    csv->file_name = file_name;
+
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0) {
+        perror("Unable to open file");
+        return EXIT_FAILURE;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Unable to read file size");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    csv->size = (size_t)st.st_size;
+    if (csv->size == 0) {
+        close(fd);
+        return EXIT_SUCCESS;
+    }
+
+    void* mapped = mmap(NULL, csv->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        perror("Unable to map file");
+        csv->size = 0;
+        return EXIT_FAILURE;
+    }
+    csv->text = (const char*)mapped;
+    madvise(mapped, csv->size, MADV_SEQUENTIAL);
+
+    // Split into newline-aligned chunks, a few per thread
+    size_t wanted = 4 * ml_get_num_threads();
+    size_t max_chunks = csv->size / CSV_MIN_CHUNK_BYTES + 1;
+    if (wanted > max_chunks) wanted = max_chunks;
+
+    csv->chunks = (CsvChunk*)calloc(wanted, sizeof(CsvChunk));
+    if (csv->chunks == NULL) {
+        fprintf(stderr, "CSV: Unable to allocate chunk table\n");
+        csv_close(csv);
+        return EXIT_FAILURE;
+    }
+
+    size_t start = 0;
+    for (size_t c = 0; c < wanted && start < csv->size; c++) {
+        size_t stop = csv->size * (c + 1) / wanted;
+        if (stop < start) stop = start;
+        if (stop < csv->size) {
+            const char* newline = _csv_line_end(csv->text + stop, csv->text + csv->size);
+            stop = (size_t)(newline - csv->text);
+            if (stop < csv->size) stop++;
+        }
+
+        csv->chunks[csv->n_chunks].begin = start;
+        csv->chunks[csv->n_chunks].end = stop;
+        csv->n_chunks++;
+        start = stop;
+    }
+
+    parallel_for(0, csv->n_chunks, 1, _csv_count_task, csv);
+
+    for (size_t c = 0; c < csv->n_chunks; c++) {
+        csv->chunks[c].first_row = csv->rows;
+        csv->rows += csv->chunks[c].rows;
+    }
+
+    // Count the fields of the first non-blank line
+    const char* p = csv->text;
+    const char* end = csv->text + csv->size;
+    while (p < end) {
+        const char* line_end = _csv_line_end(p, end);
+        if (!_csv_is_blank(p, line_end)) {
+            csv->cols = 1;
+            for (const char* q = p; q < line_end; q++) {
+                if (*q == ',') csv->cols++;
+            }
+            break;
+        }
+        p = line_end + 1;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Parse every value of an opened CSV file into a buffer
+ *
+ * Row i is written to out + i * stride. On failure the first bad row and
+ * column are printed and kept in csv->error_row and csv->error_col.
+ *
+ * @param csv A file opened with csv_open()
+ * @param out A buffer of at least csv->rows rows
+ * @param stride The distance in doubles between the starts of two rows
+ * @return int The resulting status code
+ */
+int csv_read(CsvFile* csv, double* out, size_t stride) {
+    csv->out = out;
+    csv->out_stride = stride;
+    csv->error_row = 0;
+    csv->error_col = 0;
+
+    parallel_for(0, csv->n_chunks, 1, _csv_parse_task, csv);
+
+    // Chunks are in file order, so the first chunk with an error holds the
+    // earliest one
+    for (size_t c = 0; c < csv->n_chunks; c++) {
+        CsvChunk* chunk = &csv->chunks[c];
+        if (chunk->error_row != 0) {
+            csv->error_row = chunk->error_row;
+            csv->error_col = chunk->error_col;
+            fprintf(stderr, "CSV: %s: row %zu, column %zu: %s\n",
+                    csv->file_name, chunk->error_row, chunk->error_col, chunk->error);
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <string.h>
+#include "matrix.h"
+
+/** @brief Convert a CSV matrix or vector into the binary format of
+ * binary_format.h, which ml_app can then load without parsing.
+ *
+ * Usage: ./csv2bin [-v] input.csv output.bin
+ *
+ * @note With -v the input is read as a vector (one row or one column) and
+ * written as a binary vector. Otherwise it is written as a binary matrix.
+ *
+ * @return int
+ */
+int main(int argc, char* argv[]) {
+    int as_vector = (argc == 4 && strcmp(argv[1], "-v") == 0);
+    if (argc != 3 && !as_vector) {
+        fprintf(stderr, "Usage: %s [-v] input.csv output.bin\n", argv[0]);
+        return 1;
+    }
+
+    char* input = argv[argc - 2];
+    char* output = argv[argc - 1];
+    int status;
+
+    if (as_vector) {
+        Vector* vec = create_vector_from_file(input);
+        if (vec == NULL) return 1;
+
+        printf("Converting a %zu vector...\n", vec->rows);
+        status = write_vector_to_binary(vec, output);
+        free_vector(vec);
+    } else {
+        Matrix* mat = create_matrix_from_file(input);
+        if (mat == NULL) return 1;
+
+        printf("Converting a %zu by %zu matrix...\n", mat->rows, mat->cols);
+        status = write_matrix_to_binary(mat, output);
+        free_matrix(mat);
+    }
+
+    if (status != EXIT_SUCCESS) return 1;
+
+    printf("Done\n");
+    return 0;
+}
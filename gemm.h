@@ -0,0 +1,332 @@
+#ifndef GEMM_H
+#define GEMM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "simd.h"
+#include "thread_pool.h"
+
+#ifndef MIN
+#define MIN(a,b) (a < b ? (a) : (b))
+#endif
+
+/**
+ * Cache-blocked general matrix multiply over row-major storage.
+ *
+ * The loop structure follows the usual five-loop GEMM design:
+ * - B is cut into GEMM_KC x GEMM_NC panels that are packed once and stay in L3
+ * - A is cut into GEMM_MC x GEMM_KC blocks that are packed once and stay in L2
+ * - The micro-kernel multiplies a GEMM_MR row sliver of packed A by a GEMM_NR
+ *   column sliver of packed B, keeping the GEMM_MR x GEMM_NR tile of C in
+ *   registers for the whole GEMM_KC long inner product
+ *
+ * Packing lays both operands out in the exact order the micro-kernel reads
+ * them, so the inner loop only ever streams through contiguous memory.
+ *
+ * The engine is written once in gemm_template.h and included twice, giving
+ * gemm() for double and gemm_f() for float. Only the micro-kernels, which are
+ * tied to a register width, are written per type.
+ */
+
+// Register tile computed by the micro-kernel
+#define GEMM_MR 4
+#define GEMM_NR 8
+
+// The float tile has as many rows and twice the columns, in the same registers
+#define GEMM_NR_F 16
+
+// Cache blocking: MC x KC block of A for L2, KC x NC panel of B for L3
+#define GEMM_MC 128
+#define GEMM_KC 256
+#define GEMM_NC 2048
+
+#define GEMM_ALIGNMENT 64
+
+/**
+ * @brief Allocate an uninitialised buffer aligned to GEMM_ALIGNMENT
+ *
+ * @param bytes The size of the buffer
+ * @return void* The buffer, or NULL on failure. Release it with free()
+ */
+static void* _gemm_alloc(size_t bytes) {
+    bytes = (bytes + GEMM_ALIGNMENT - 1) / GEMM_ALIGNMENT * GEMM_ALIGNMENT;
+    return aligned_alloc(GEMM_ALIGNMENT, bytes);
+}
+
+// Packing buffers each thread keeps between calls, so that a stream of small
+// products does not go through malloc every time. Both precisions share them
+#define GEMM_BUFFER_A 0
+#define GEMM_BUFFER_B 1
+typedef struct GemmBuffers {
+    void* buffers[2];
+    size_t bytes[2];
+} GemmBuffers;
+
+static __thread GemmBuffers* _gemm_thread_buffers = NULL;
+static pthread_key_t _gemm_buffers_key;
+static pthread_once_t _gemm_buffers_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Free a thread's packing buffers when it exits
+ */
+static void _gemm_free_buffers(void* ptr) {
+    GemmBuffers* held = (GemmBuffers*)ptr;
+    free(held->buffers[GEMM_BUFFER_A]);
+    free(held->buffers[GEMM_BUFFER_B]);
+    free(held);
+}
+
+static void _gemm_make_buffers_key() {
+    pthread_key_create(&_gemm_buffers_key, _gemm_free_buffers);
+}
+
+/**
+ * @brief Get this thread's packing buffer, growing it if it is too small
+ *
+ * The buffers are registered with a thread-specific key, so they are freed
+ * when a pool worker exits.
+ *
+ * @param slot GEMM_BUFFER_A or GEMM_BUFFER_B
+ * @param bytes The size needed
+ * @return void* The buffer, or NULL on failure. It is owned by the thread
+ */
+static void* _gemm_buffer(int slot, size_t bytes) {
+    GemmBuffers* held = _gemm_thread_buffers;
+    if (held == NULL) {
+        pthread_once(&_gemm_buffers_once, _gemm_make_buffers_key);
+        held = (GemmBuffers*)calloc(1, sizeof(GemmBuffers));
+        if (held == NULL) return NULL;
+        pthread_setspecific(_gemm_buffers_key, held);
+        _gemm_thread_buffers = held;
+    }
+
+    if (held->bytes[slot] < bytes) {
+        void* buffer = _gemm_alloc(bytes);
+        if (buffer == NULL) return NULL;
+        free(held->buffers[slot]);
+        held->buffers[slot] = buffer;
+        held->bytes[slot] = bytes;
+    }
+    return held->buffers[slot];
+}
+
+// Two doubles handled as one value, which GCC and Clang map onto a single SSE2
+// register (or the equivalent on other targets)
+typedef double gemm_v2 __attribute__((vector_size(16)));
+
+/**
+ * @brief Multiply an MR sliver of packed A by an NR sliver of packed B
+ *
+ * The product is written to the GEMM_MR x GEMM_NR scratch tile ab. The tile
+ * is held in sixteen named vector accumulators, written out by hand so they
+ * stay in registers for the whole loop over p at any optimisation level.
+ * Every step broadcasts one value of A per row against the same four vectors
+ * of B.
+ */
+static void _gemm_micro_kernel(size_t kc, const double* restrict a,
+                               const double* restrict b, double* restrict ab) {
+    gemm_v2 c00 = {0.0, 0.0}, c01 = {0.0, 0.0}, c02 = {0.0, 0.0}, c03 = {0.0, 0.0};
+    gemm_v2 c10 = {0.0, 0.0}, c11 = {0.0, 0.0}, c12 = {0.0, 0.0}, c13 = {0.0, 0.0};
+    gemm_v2 c20 = {0.0, 0.0}, c21 = {0.0, 0.0}, c22 = {0.0, 0.0}, c23 = {0.0, 0.0};
+    gemm_v2 c30 = {0.0, 0.0}, c31 = {0.0, 0.0}, c32 = {0.0, 0.0}, c33 = {0.0, 0.0};
+
+    for (size_t p = 0; p < kc; p++) {
+        gemm_v2 b_0, b_1, b_2, b_3, a_i;
+        memcpy(&b_0, b + 0, sizeof(gemm_v2));
+        memcpy(&b_1, b + 2, sizeof(gemm_v2));
+        memcpy(&b_2, b + 4, sizeof(gemm_v2));
+        memcpy(&b_3, b + 6, sizeof(gemm_v2));
+
+        a_i = (gemm_v2){a[0], a[0]};
+        c00 += a_i * b_0; c01 += a_i * b_1; c02 += a_i * b_2; c03 += a_i * b_3;
+        a_i = (gemm_v2){a[1], a[1]};
+        c10 += a_i * b_0; c11 += a_i * b_1; c12 += a_i * b_2; c13 += a_i * b_3;
+        a_i = (gemm_v2){a[2], a[2]};
+        c20 += a_i * b_0; c21 += a_i * b_1; c22 += a_i * b_2; c23 += a_i * b_3;
+        a_i = (gemm_v2){a[3], a[3]};
+        c30 += a_i * b_0; c31 += a_i * b_1; c32 += a_i * b_2; c33 += a_i * b_3;
+
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+
+    gemm_v2 tile[GEMM_MR * GEMM_NR / 2] = {
+        c00, c01, c02, c03, c10, c11, c12, c13,
+        c20, c21, c22, c23, c30, c31, c32, c33
+    };
+    memcpy(ab, tile, sizeof(tile));
+}
+
+#ifdef SIMD_X86
+/**
+ * @brief AVX2 + FMA version of _gemm_micro_kernel
+ *
+ * Each row of the tile is two 256-bit accumulators, eight in total, which is
+ * enough independent FMAs to cover their latency on both FMA ports.
+ */
+__attribute__((target("avx2,fma")))
+static void _gemm_micro_kernel_avx2(size_t kc, const double* restrict a,
+                                    const double* restrict b, double* restrict ab) {
+    __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+    __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+    __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+    __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+
+    for (size_t p = 0; p < kc; p++) {
+        __m256d b_lo = _mm256_loadu_pd(b);
+        __m256d b_hi = _mm256_loadu_pd(b + 4);
+        __m256d a_i;
+
+        a_i = _mm256_broadcast_sd(a + 0);
+        c00 = _mm256_fmadd_pd(a_i, b_lo, c00); c01 = _mm256_fmadd_pd(a_i, b_hi, c01);
+        a_i = _mm256_broadcast_sd(a + 1);
+        c10 = _mm256_fmadd_pd(a_i, b_lo, c10); c11 = _mm256_fmadd_pd(a_i, b_hi, c11);
+        a_i = _mm256_broadcast_sd(a + 2);
+        c20 = _mm256_fmadd_pd(a_i, b_lo, c20); c21 = _mm256_fmadd_pd(a_i, b_hi, c21);
+        a_i = _mm256_broadcast_sd(a + 3);
+        c30 = _mm256_fmadd_pd(a_i, b_lo, c30); c31 = _mm256_fmadd_pd(a_i, b_hi, c31);
+
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+
+    _mm256_storeu_pd(ab + 0, c00); _mm256_storeu_pd(ab + 4, c01);
+    _mm256_storeu_pd(ab + 8, c10); _mm256_storeu_pd(ab + 12, c11);
+    _mm256_storeu_pd(ab + 16, c20); _mm256_storeu_pd(ab + 20, c21);
+    _mm256_storeu_pd(ab + 24, c30); _mm256_storeu_pd(ab + 28, c31);
+}
+#endif
+
+typedef void (*gemm_micro_kernel_fn)(size_t kc, const double* a, const double* b, double* ab);
+
+/**
+ * @brief Pick the micro-kernel for the active instruction set level
+ *
+ * AVX-512 uses the AVX2 kernel: a 4 x 8 tile is only four 512-bit registers,
+ * too few independent FMAs to beat eight 256-bit ones.
+ *
+ * @return gemm_micro_kernel_fn
+ */
+static gemm_micro_kernel_fn _gemm_select_micro_kernel() {
+#ifdef SIMD_X86
+    if (simd_active_level() >= SIMD_AVX2) {
+        return _gemm_micro_kernel_avx2;
+    }
+#endif
+    return _gemm_micro_kernel;
+}
+
+// Four floats handled as one value, the float counterpart of gemm_v2
+typedef float gemm_v4f __attribute__((vector_size(16)));
+
+/**
+ * @brief Float version of _gemm_micro_kernel, for a GEMM_MR x GEMM_NR_F tile
+ */
+static void _gemm_micro_kernel_f(size_t kc, const float* restrict a,
+                                 const float* restrict b, float* restrict ab) {
+    gemm_v4f c00 = {0}, c01 = {0}, c02 = {0}, c03 = {0};
+    gemm_v4f c10 = {0}, c11 = {0}, c12 = {0}, c13 = {0};
+    gemm_v4f c20 = {0}, c21 = {0}, c22 = {0}, c23 = {0};
+    gemm_v4f c30 = {0}, c31 = {0}, c32 = {0}, c33 = {0};
+
+    for (size_t p = 0; p < kc; p++) {
+        gemm_v4f b_0, b_1, b_2, b_3, a_i;
+        memcpy(&b_0, b + 0, sizeof(gemm_v4f));
+        memcpy(&b_1, b + 4, sizeof(gemm_v4f));
+        memcpy(&b_2, b + 8, sizeof(gemm_v4f));
+        memcpy(&b_3, b + 12, sizeof(gemm_v4f));
+
+        a_i = (gemm_v4f){a[0], a[0], a[0], a[0]};
+        c00 += a_i * b_0; c01 += a_i * b_1; c02 += a_i * b_2; c03 += a_i * b_3;
+        a_i = (gemm_v4f){a[1], a[1], a[1], a[1]};
+        c10 += a_i * b_0; c11 += a_i * b_1; c12 += a_i * b_2; c13 += a_i * b_3;
+        a_i = (gemm_v4f){a[2], a[2], a[2], a[2]};
+        c20 += a_i * b_0; c21 += a_i * b_1; c22 += a_i * b_2; c23 += a_i * b_3;
+        a_i = (gemm_v4f){a[3], a[3], a[3], a[3]};
+        c30 += a_i * b_0; c31 += a_i * b_1; c32 += a_i * b_2; c33 += a_i * b_3;
+
+        a += GEMM_MR;
+        b += GEMM_NR_F;
+    }
+
+    gemm_v4f tile[GEMM_MR * GEMM_NR_F / 4] = {
+        c00, c01, c02, c03, c10, c11, c12, c13,
+        c20, c21, c22, c23, c30, c31, c32, c33
+    };
+    memcpy(ab, tile, sizeof(tile));
+}
+
+#ifdef SIMD_X86
+/**
+ * @brief AVX2 + FMA version of _gemm_micro_kernel_f
+ */
+__attribute__((target("avx2,fma")))
+static void _gemm_micro_kernel_f_avx2(size_t kc, const float* restrict a,
+                                      const float* restrict b, float* restrict ab) {
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+    __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+    __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+
+    for (size_t p = 0; p < kc; p++) {
+        __m256 b_lo = _mm256_loadu_ps(b);
+        __m256 b_hi = _mm256_loadu_ps(b + 8);
+        __m256 a_i;
+
+        a_i = _mm256_broadcast_ss(a + 0);
+        c00 = _mm256_fmadd_ps(a_i, b_lo, c00); c01 = _mm256_fmadd_ps(a_i, b_hi, c01);
+        a_i = _mm256_broadcast_ss(a + 1);
+        c10 = _mm256_fmadd_ps(a_i, b_lo, c10); c11 = _mm256_fmadd_ps(a_i, b_hi, c11);
+        a_i = _mm256_broadcast_ss(a + 2);
+        c20 = _mm256_fmadd_ps(a_i, b_lo, c20); c21 = _mm256_fmadd_ps(a_i, b_hi, c21);
+        a_i = _mm256_broadcast_ss(a + 3);
+        c30 = _mm256_fmadd_ps(a_i, b_lo, c30); c31 = _mm256_fmadd_ps(a_i, b_hi, c31);
+
+        a += GEMM_MR;
+        b += GEMM_NR_F;
+    }
+
+    _mm256_storeu_ps(ab + 0, c00); _mm256_storeu_ps(ab + 8, c01);
+    _mm256_storeu_ps(ab + 16, c10); _mm256_storeu_ps(ab + 24, c11);
+    _mm256_storeu_ps(ab + 32, c20); _mm256_storeu_ps(ab + 40, c21);
+    _mm256_storeu_ps(ab + 48, c30); _mm256_storeu_ps(ab + 56, c31);
+}
+#endif
+
+typedef void (*gemm_micro_kernel_fn_f)(size_t kc, const float* a, const float* b, float* ab);
+
+/**
+ * @brief Pick the float micro-kernel for the active instruction set level
+ *
+ * @return gemm_micro_kernel_fn_f
+ */
+static gemm_micro_kernel_fn_f _gemm_select_micro_kernel_f() {
+#ifdef SIMD_X86
+    if (simd_active_level() >= SIMD_AVX2) {
+        return _gemm_micro_kernel_f_avx2;
+    }
+#endif
+    return _gemm_micro_kernel_f;
+}
+
+// double: gemm()
+#define GEMM_REAL double
+#define GEMM_NAME(name) name
+#define GEMM_TILE_NR GEMM_NR
+#include "gemm_template.h"
+#undef GEMM_REAL
+#undef GEMM_NAME
+#undef GEMM_TILE_NR
+
+// float: gemm_f()
+#define GEMM_REAL float
+#define GEMM_NAME(name) name##_f
+#define GEMM_TILE_NR GEMM_NR_F
+#include "gemm_template.h"
+#undef GEMM_REAL
+#undef GEMM_NAME
+#undef GEMM_TILE_NR
+
+#endif
@@ -0,0 +1,259 @@
+/**
+ * The GEMM engine of gemm.h, written once for both element types.
+ *
+ * This file has no include guard on purpose: gemm.h includes it once per
+ * type after defining
+ * - GEMM_REAL, the element type
+ * - GEMM_NAME(name), which gives each function and type its per-type name
+ * - GEMM_TILE_NR, the width of the micro-kernel tile for that type
+ * It also relies on GEMM_NAME(gemm_micro_kernel_fn) and
+ * GEMM_NAME(_gemm_select_micro_kernel) being defined there.
+ */
+
+/**
+ * @brief Pack an mc x kc block of op(A) into GEMM_MR row slivers
+ *
+ * Each sliver stores, for every p, the GEMM_MR values op(A)[i..i+MR][p] next
+ * to each other. Rows past mc are zero filled so the micro-kernel never has
+ * to special case the edge.
+ */
+static void GEMM_NAME(_gemm_pack_a)(int trans_a, size_t mc, size_t kc,
+                         const GEMM_REAL* A, size_t lda, GEMM_REAL* packed) {
+    for (size_t i = 0; i < mc; i += GEMM_MR) {
+        size_t mr = MIN(GEMM_MR, mc - i);
+
+        for (size_t p = 0; p < kc; p++) {
+            for (size_t ii = 0; ii < mr; ii++) {
+                packed[ii] = trans_a ? A[p * lda + i + ii] : A[(i + ii) * lda + p];
+            }
+            for (size_t ii = mr; ii < GEMM_MR; ii++) {
+                packed[ii] = 0.0;
+            }
+            packed += GEMM_MR;
+        }
+    }
+}
+
+/**
+ * @brief Pack a kc x nc panel of op(B) into GEMM_TILE_NR column slivers
+ *
+ * Each sliver stores, for every p, the GEMM_TILE_NR values op(B)[p][j..j+NR] next
+ * to each other, zero filled past nc.
+ */
+static void GEMM_NAME(_gemm_pack_b)(int trans_b, size_t kc, size_t nc,
+                         const GEMM_REAL* B, size_t ldb, GEMM_REAL* packed) {
+    for (size_t j = 0; j < nc; j += GEMM_TILE_NR) {
+        size_t nr = MIN(GEMM_TILE_NR, nc - j);
+
+        for (size_t p = 0; p < kc; p++) {
+            if (!trans_b && nr == GEMM_TILE_NR) {
+                memcpy(packed, B + p * ldb + j, GEMM_TILE_NR * sizeof(GEMM_REAL));
+            } else {
+                for (size_t jj = 0; jj < nr; jj++) {
+                    packed[jj] = trans_b ? B[(j + jj) * ldb + p] : B[p * ldb + j + jj];
+                }
+                for (size_t jj = nr; jj < GEMM_TILE_NR; jj++) {
+                    packed[jj] = 0.0;
+                }
+            }
+            packed += GEMM_TILE_NR;
+        }
+    }
+}
+
+/**
+ * @brief Multiply a packed mc x kc block of A by a packed kc x nc panel of B
+ * into C, scaling the existing contents of C by beta
+ */
+static void GEMM_NAME(_gemm_macro_kernel)(size_t mc, size_t nc, size_t kc, GEMM_REAL alpha,
+                               const GEMM_REAL* packed_a, const GEMM_REAL* packed_b,
+                               GEMM_REAL beta, GEMM_REAL* C, size_t ldc,
+                               GEMM_NAME(gemm_micro_kernel_fn) micro_kernel) {
+    GEMM_REAL ab[GEMM_MR * GEMM_TILE_NR];
+
+    for (size_t j = 0; j < nc; j += GEMM_TILE_NR) {
+        size_t nr = MIN(GEMM_TILE_NR, nc - j);
+
+        for (size_t i = 0; i < mc; i += GEMM_MR) {
+            size_t mr = MIN(GEMM_MR, mc - i);
+
+            micro_kernel(kc, packed_a + i * kc, packed_b + j * kc, ab);
+
+            // Write back the valid part of the tile. beta == 0 must not read C
+            for (size_t ii = 0; ii < mr; ii++) {
+                GEMM_REAL* c_row = C + (i + ii) * ldc + j;
+                const GEMM_REAL* ab_row = ab + ii * GEMM_TILE_NR;
+                if (beta == 0.0) {
+                    for (size_t jj = 0; jj < nr; jj++) c_row[jj] = alpha * ab_row[jj];
+                } else if (beta == 1.0) {
+                    for (size_t jj = 0; jj < nr; jj++) c_row[jj] += alpha * ab_row[jj];
+                } else {
+                    for (size_t jj = 0; jj < nr; jj++) {
+                        c_row[jj] = beta * c_row[jj] + alpha * ab_row[jj];
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @struct The state of one kc x nc panel shared by the threads working on it
+ */
+typedef struct GEMM_NAME(GemmPanel) {
+    int trans_a;
+    int trans_b;
+    size_t m, nc, kc;
+    GEMM_REAL alpha, beta;
+    const GEMM_REAL* A;            // Top-left of the m x kc slice of op(A)
+    size_t lda;
+    const GEMM_REAL* B;            // Top-left of the kc x nc panel of op(B)
+    size_t ldb;
+    GEMM_REAL* packed_b;
+    GEMM_REAL* C;                  // Top-left of the m x nc slice of C
+    size_t ldc;
+    size_t n_jr;                // Column chunks per MC block of rows
+    size_t jr_cols;             // Columns per chunk, a multiple of GEMM_TILE_NR
+    GEMM_NAME(gemm_micro_kernel_fn) micro_kernel;
+    atomic_int failed;          // Set by a thread that could not get its packing buffer
+} GEMM_NAME(GemmPanel);
+
+/**
+ * @brief parallel_for() body packing GEMM_TILE_NR slivers [begin, end) of B
+ */
+static void GEMM_NAME(_gemm_pack_b_task)(size_t begin, size_t end, void* ctx) {
+    GEMM_NAME(GemmPanel)* panel = (GEMM_NAME(GemmPanel)*)ctx;
+    size_t j = begin * GEMM_TILE_NR;
+    size_t nc = MIN(end * GEMM_TILE_NR, panel->nc) - j;
+    const GEMM_REAL* B = panel->trans_b ? panel->B + j * panel->ldb : panel->B + j;
+
+    GEMM_NAME(_gemm_pack_b)(panel->trans_b, panel->kc, nc, B, panel->ldb, panel->packed_b + j * panel->kc);
+}
+
+/**
+ * @brief parallel_for() body computing work units [begin, end) of a panel
+ *
+ * A unit is one GEMM_MC block of rows times one chunk of jr_cols columns.
+ * Consecutive units share their block of A, so it is only packed again when
+ * the block changes.
+ */
+static void GEMM_NAME(_gemm_panel_task)(size_t begin, size_t end, void* ctx) {
+    GEMM_NAME(GemmPanel)* panel = (GEMM_NAME(GemmPanel)*)ctx;
+    GEMM_REAL* packed_a = _gemm_buffer(GEMM_BUFFER_A, GEMM_MC * GEMM_KC * sizeof(GEMM_REAL));
+    if (packed_a == NULL) {
+        // Its blocks of C are left uncomputed, so gemm() must fail
+        fprintf(stderr, "GEMM: Unable to allocate packing buffers\n");
+        atomic_store(&panel->failed, 1);
+        return;
+    }
+
+    size_t packed_ic = (size_t)-1;
+    for (size_t unit = begin; unit < end; unit++) {
+        size_t ic = (unit / panel->n_jr) * GEMM_MC;
+        size_t jr = (unit % panel->n_jr) * panel->jr_cols;
+        if (jr >= panel->nc) continue;
+
+        size_t mc = MIN(GEMM_MC, panel->m - ic);
+        size_t nc = MIN(panel->jr_cols, panel->nc - jr);
+
+        if (ic != packed_ic) {
+            const GEMM_REAL* A_block = panel->trans_a ? panel->A + ic : panel->A + ic * panel->lda;
+            GEMM_NAME(_gemm_pack_a)(panel->trans_a, mc, panel->kc, A_block, panel->lda, packed_a);
+            packed_ic = ic;
+        }
+
+        GEMM_NAME(_gemm_macro_kernel)(mc, nc, panel->kc, panel->alpha, packed_a,
+                           panel->packed_b + jr * panel->kc, panel->beta,
+                           panel->C + ic * panel->ldc + jr, panel->ldc, panel->micro_kernel);
+    }
+}
+
+/**
+ * @brief Compute C = alpha * op(A) * op(B) + beta * C on row-major arrays
+ *
+ * op(A) is m x k and op(B) is k x n. When trans_a is set A is stored as a
+ * k x m array and op(A) is its transpose, likewise for trans_b.
+ *
+ * Each packed panel of B is shared by the thread pool. The threads split the
+ * panel's rows into GEMM_MC blocks, and its columns too when there are too
+ * few row blocks to go round, as for the small n x n result of AtA.
+ *
+ * @param trans_a Nonzero to use the transpose of A
+ * @param trans_b Nonzero to use the transpose of B
+ * @param m Rows of op(A) and C
+ * @param n Columns of op(B) and C
+ * @param k Columns of op(A) and rows of op(B)
+ * @param alpha Scale applied to the product
+ * @param A First operand, leading dimension lda
+ * @param B Second operand, leading dimension ldb
+ * @param beta Scale applied to C before accumulating. When 0, C is not read
+ * @param C The m x n output, leading dimension ldc
+ * @return int The resulting status code
+ */
+int GEMM_NAME(gemm)(int trans_a, int trans_b, size_t m, size_t n, size_t k,
+         GEMM_REAL alpha, const GEMM_REAL* A, size_t lda,
+         const GEMM_REAL* B, size_t ldb,
+         GEMM_REAL beta, GEMM_REAL* C, size_t ldc) {
+    if (m == 0 || n == 0) {
+        return EXIT_SUCCESS;
+    }
+
+    // Nothing to accumulate, only apply beta
+    if (k == 0 || alpha == 0.0) {
+        for (size_t i = 0; i < m; i++) {
+            for (size_t j = 0; j < n; j++) {
+                C[i * ldc + j] = (beta == 0.0) ? 0.0 : beta * C[i * ldc + j];
+            }
+        }
+        return EXIT_SUCCESS;
+    }
+
+    GEMM_REAL* packed_b = _gemm_buffer(GEMM_BUFFER_B, GEMM_KC * (MIN(n, (size_t)GEMM_NC) + GEMM_TILE_NR) * sizeof(GEMM_REAL));
+    if (packed_b == NULL) {
+        fprintf(stderr, "GEMM: Unable to allocate packing buffers\n");
+        return EXIT_FAILURE;
+    }
+
+    GEMM_NAME(GemmPanel) panel = {
+        .trans_a = trans_a, .trans_b = trans_b, .m = m, .alpha = alpha,
+        .lda = lda, .ldb = ldb, .packed_b = packed_b, .ldc = ldc,
+        .micro_kernel = GEMM_NAME(_gemm_select_micro_kernel)(),
+    };
+
+    size_t n_threads = ml_get_num_threads();
+    size_t n_ic = (m + GEMM_MC - 1) / GEMM_MC;
+
+    for (size_t jc = 0; jc < n; jc += GEMM_NC) {
+        size_t nc = MIN(GEMM_NC, n - jc);
+        size_t n_slivers = (nc + GEMM_TILE_NR - 1) / GEMM_TILE_NR;
+
+        // Aim for at least two units per thread
+        panel.n_jr = 1;
+        if (n_ic < 2 * n_threads) {
+            panel.n_jr = MIN((2 * n_threads + n_ic - 1) / n_ic, n_slivers);
+        }
+        panel.jr_cols = (n_slivers + panel.n_jr - 1) / panel.n_jr * GEMM_TILE_NR;
+        panel.nc = nc;
+
+        for (size_t pc = 0; pc < k; pc += GEMM_KC) {
+            panel.kc = MIN(GEMM_KC, k - pc);
+            // Only the first pass over k applies the caller's beta
+            panel.beta = (pc == 0) ? beta : 1.0;
+            panel.A = trans_a ? A + pc * lda : A + pc;
+            panel.B = trans_b ? B + jc * ldb + pc : B + pc * ldb + jc;
+            panel.C = C + jc;
+
+            // Small products stay on one thread
+            size_t unit_work = 2 * MIN(m, (size_t)GEMM_MC) * panel.jr_cols * panel.kc;
+            size_t grain = PARALLEL_MIN_WORK / (unit_work + 1) + 1;
+
+            parallel_for(0, n_slivers, PARALLEL_MIN_WORK / (panel.kc * GEMM_TILE_NR) + 1,
+                         GEMM_NAME(_gemm_pack_b_task), &panel);
+            parallel_for(0, n_ic * panel.n_jr, grain, GEMM_NAME(_gemm_panel_task), &panel);
+            if (atomic_load(&panel.failed)) return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
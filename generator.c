@@ -1,97 +1,451 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "binary_format.h"
+#include "thread_pool.h"
 
 #define MATRIX_FILE_NAME "full_rank_matrix.csv"
 #define VECTOR_FILE_NAME "target_vector.csv"
+#define MATRIX_BINARY_FILE_NAME "full_rank_matrix.bin"
+#define VECTOR_BINARY_FILE_NAME "target_vector.bin"
+
+#define GENERATOR_DEFAULT_SEED 42
+#define GENERATOR_DEFAULT_NOISE 0.01
+
+// Values generated per block of rows, which bounds the memory used
+#define GENERATOR_BLOCK_VALUES (1 << 20)
+
+// Significant digits of a CSV value, and the room one value takes with its separator
+#define GENERATOR_CSV_DIGITS 12
+#define GENERATOR_CSV_SLOT 32
+
+// Philox4x32-10 round and key constants
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+// Every kind of draw has its own counter stream, so the values of A do not
+// depend on whether sparsity or noise are asked for
+enum {
+    STREAM_VALUE = 0,
+    STREAM_SPARSITY = 1,
+    STREAM_NOISE = 2,
+};
+
+/**
+ * @struct What to generate and where to write it
+ */
+typedef struct GeneratorOptions {
+    size_t rows;
+    size_t cols;
+    uint64_t seed;
+    int binary;
+    int gaussian;          // Standard normal entries instead of the diagonally dominant matrix
+    double sparsity;       // Chance an entry off the diagonal is zero
+    double condition;      // Ratio of the largest to the smallest column scale
+    double noise;          // Standard deviation of the noise added to the target
+    const char* matrix_file;
+    const char* vector_file;
+} GeneratorOptions;
+
+/**
+ * @brief The Philox4x32-10 counter-based generator
+ *
+ * Maps a 128 bit counter and a 64 bit key to 128 random bits. Any value can
+ * be drawn directly from its counter, so rows are generated in any order, on
+ * any thread, and always come out the same for the same seed.
+ *
+ * @param counter The four counter words
+ * @param key The two key words, taken from the seed
+ * @param out Set to four random words
+ * @return void
+ */
+static void philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4]) {
+    uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+    uint32_t k0 = key[0], k1 = key[1];
+
+    for (int round = 0; round < 10; round++) {
+        uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+        uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+        c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        c1 = (uint32_t)p1;
+        c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c3 = (uint32_t)p0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+/**
+ * @brief Draw two uniform doubles in (0, 1) for one row, index and stream
+ *
+ * @param key The Philox key
+ * @param row The row the values belong to
+ * @param index Which pair of values in the row
+ * @param stream One of the STREAM_ constants
+ * @param u Set to the two values
+ * @return void
+ */
+static void _uniform_pair(const uint32_t key[2], uint64_t row, uint32_t index, uint32_t stream, double u[2]) {
+    uint32_t counter[4] = { index, (uint32_t)row, (uint32_t)(row >> 32), stream };
+    uint32_t bits[4];
+    philox4x32(counter, key, bits);
+
+    // 53 random bits each, offset by half a step to stay off 0 and 1
+    uint64_t a = ((uint64_t)bits[0] << 21) ^ (bits[1] >> 11);
+    uint64_t b = ((uint64_t)bits[2] << 21) ^ (bits[3] >> 11);
+    u[0] = ((double)a + 0.5) * 0x1.0p-53;
+    u[1] = ((double)b + 0.5) * 0x1.0p-53;
+}
+
+/**
+ * @brief Draw two independent standard normal values by the Box-Muller transform
+ */
+static void _normal_pair(const uint32_t key[2], uint64_t row, uint32_t index, uint32_t stream, double z[2]) {
+    double u[2];
+    _uniform_pair(key, row, index, stream, u);
+    double radius = sqrt(-2.0 * log(u[0]));
+    z[0] = radius * cos(2.0 * M_PI * u[1]);
+    z[1] = radius * sin(2.0 * M_PI * u[1]);
+}
+
+/**
+ * @brief Write a double as CSV text with GENERATOR_CSV_DIGITS significant digits
+ *
+ * A fast path for the plain decimal values the generator makes. Very large
+ * or very small values fall back to snprintf().
+ *
+ * @param out Room for at least GENERATOR_CSV_SLOT characters
+ * @param x The value
+ * @return size_t The number of characters written, without a terminator
+ */
+static size_t _format_double(char* out, double x) {
+    static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+                                     1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18 };
+    double ax = fabs(x);
+    if (x == 0.0) {
+        out[0] = '0';
+        return 1;
+    }
+    if (!(ax >= 1e-6 && ax < 1e15)) {
+        return (size_t)snprintf(out, GENERATOR_CSV_SLOT, "%.*g", GENERATOR_CSV_DIGITS, x);
+    }
+
+    // The decimal exponent of x sets how many digits follow the point
+    int exponent = 0;
+    if (ax >= 1.0) {
+        while (exponent < 15 && ax >= powers[exponent + 1]) exponent++;
+    } else {
+        while (ax * powers[-exponent] < 1.0) exponent--;
+    }
+    int decimals = GENERATOR_CSV_DIGITS - 1 - exponent;
+    if (decimals < 0) decimals = 0;
+
+    uint64_t scaled = (uint64_t)llround(ax * powers[decimals]);
+    uint64_t unit = (uint64_t)powers[decimals];
+    uint64_t whole = scaled / unit, fraction = scaled % unit;
+
+    size_t len = 0;
+    if (x < 0.0) out[len++] = '-';
+    char digits[24];
+    size_t n_digits = 0;
+    do {
+        digits[n_digits++] = (char)('0' + whole % 10);
+        whole /= 10;
+    } while (whole > 0);
+    while (n_digits > 0) out[len++] = digits[--n_digits];
+
+    // Trailing zeros of the fraction are dropped, as %g does
+    while (decimals > 0 && fraction % 10 == 0) {
+        fraction /= 10;
+        decimals--;
+    }
+    if (decimals > 0) {
+        out[len++] = '.';
+        for (int d = decimals - 1; d >= 0; d--) {
+            out[len + d] = (char)('0' + fraction % 10);
+            fraction /= 10;
+        }
+        len += decimals;
+    }
+    return len;
+}
+
+/**
+ * @struct Arguments shared by the threads generating one block of rows
+ */
+typedef struct GenerateTask {
+    const GeneratorOptions* options;
+    const double* col_scale;
+    uint32_t key[2];
+    size_t first_row;
+    double* values;        // The block's rows, cols values each
+    double* targets;
+    char* text;            // CSV text per row, cols * GENERATOR_CSV_SLOT each, or NULL for binary
+    size_t* text_len;
+    char* target_text;     // CSV text per target, GENERATOR_CSV_SLOT each
+    size_t* target_len;
+} GenerateTask;
+
+/**
+ * @brief Generate the rows [begin, end) of a block and their targets
+ *
+ * y is the sum of a row plus noise, so the true coefficients are all 1s.
+ */
+static void _generate_task(size_t begin, size_t end, void* ctx) {
+    GenerateTask* task = (GenerateTask*)ctx;
+    const GeneratorOptions* opt = task->options;
+    size_t cols = opt->cols;
+
+    for (size_t r = begin; r < end; r++) {
+        uint64_t i = task->first_row + r;
+        double* row = task->values + r * cols;
+
+        for (size_t j = 0; j < cols; j += 2) {
+            double pair[2], keep[2] = { 1.0, 1.0 };
+            if (opt->gaussian) {
+                _normal_pair(task->key, i, (uint32_t)(j / 2), STREAM_VALUE, pair);
+            } else {
+                _uniform_pair(task->key, i, (uint32_t)(j / 2), STREAM_VALUE, pair);
+            }
+            if (opt->sparsity > 0.0) {
+                _uniform_pair(task->key, i, (uint32_t)(j / 2), STREAM_SPARSITY, keep);
+            }
+
+            for (size_t t = 0; t < 2 && j + t < cols; t++) {
+                double value = pair[t];
+                // The diagonal stays nonzero so the matrix stays full rank
+                if (keep[t] < opt->sparsity && (opt->gaussian || i != j + t)) value = 0.0;
+
+                // Diagonal Dominance implementation
+                if (!opt->gaussian && i == j + t) value += (double)opt->rows;
+
+                row[j + t] = value * task->col_scale[j + t];
+            }
+        }
 
-/** @brief Generate a random 1000 by 1000 matrix CSV file and a 1000 
- * by 1 vector of the sum of each row in the maxtrix as a csv file as well.
- *  
+        double y = 0.0;
+        for (size_t j = 0; j < cols; j++) y += row[j];
+        if (opt->noise > 0.0) {
+            double z[2];
+            _normal_pair(task->key, i, 0, STREAM_NOISE, z);
+            y += opt->noise * z[0];
+        }
+        task->targets[r] = y;
+
+        if (task->text != NULL) {
+            char* out = task->text + r * cols * GENERATOR_CSV_SLOT;
+            size_t len = 0;
+            for (size_t j = 0; j < cols; j++) {
+                len += _format_double(out + len, row[j]);
+                out[len++] = (j + 1 < cols) ? ',' : '\n';
+            }
+            task->text_len[r] = len;
+
+            char* target_out = task->target_text + r * GENERATOR_CSV_SLOT;
+            task->target_len[r] = _format_double(target_out, y);
+            target_out[task->target_len[r]++] = '\n';
+        }
+    }
+}
+
+/**
+ * @brief Write the matrix and target vector a block of rows at a time
+ *
+ * @param opt What to generate and where to write it
+ * @return int The resulting status code
+ */
+static int generate(const GeneratorOptions* opt) {
+    size_t rows = opt->rows, cols = opt->cols;
+    size_t block_rows = GENERATOR_BLOCK_VALUES / cols + 1;
+    if (block_rows > rows) block_rows = rows;
+
+    FILE *matrix_fp = NULL, *vector_fp = NULL;
+    MlbWriter matrix_writer, vector_writer;
+    if (opt->binary) {
+        if (mlb_writer_open(&matrix_writer, opt->matrix_file, MLB_KIND_MATRIX, rows, cols) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        if (mlb_writer_open(&vector_writer, opt->vector_file, MLB_KIND_VECTOR, rows, 1) != EXIT_SUCCESS) {
+            mlb_writer_close(&matrix_writer);
+            return EXIT_FAILURE;
+        }
+    } else {
+        matrix_fp = fopen(opt->matrix_file, "w");
+        vector_fp = matrix_fp ? fopen(opt->vector_file, "w") : NULL;
+        if (vector_fp == NULL) {
+            perror("Cannot open file");
+            if (matrix_fp) fclose(matrix_fp);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Columns scaled geometrically from 1 down to 1 / condition
+    double* col_scale = (double*)malloc(cols * sizeof(double));
+    double* values = (double*)malloc(block_rows * cols * sizeof(double));
+    double* targets = (double*)malloc(block_rows * sizeof(double));
+    char* text = opt->binary ? NULL : (char*)malloc(block_rows * cols * GENERATOR_CSV_SLOT);
+    size_t* text_len = opt->binary ? NULL : (size_t*)malloc(block_rows * sizeof(size_t));
+    char* target_text = opt->binary ? NULL : (char*)malloc(block_rows * GENERATOR_CSV_SLOT);
+    size_t* target_len = opt->binary ? NULL : (size_t*)malloc(block_rows * sizeof(size_t));
+    int status = (col_scale && values && targets
+                  && (opt->binary || (text && text_len && target_text && target_len))) ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (status != EXIT_SUCCESS) fprintf(stderr, "Cannot allocate a block of %zu rows\n", block_rows);
+
+    for (size_t j = 0; j < cols && status == EXIT_SUCCESS; j++) {
+        col_scale[j] = cols > 1 ? pow(opt->condition, -(double)j / (double)(cols - 1)) : 1.0;
+    }
+
+    GenerateTask task = { opt, col_scale, { (uint32_t)opt->seed, (uint32_t)(opt->seed >> 32) }, 0,
+                          values, targets, text, text_len, target_text, target_len };
+    for (size_t first = 0; first < rows && status == EXIT_SUCCESS; first += block_rows) {
+        size_t count = (rows - first < block_rows) ? rows - first : block_rows;
+        task.first_row = first;
+        parallel_for(0, count, PARALLEL_MIN_WORK / (16 * cols) + 1, _generate_task, &task);
+
+        for (size_t r = 0; r < count && status == EXIT_SUCCESS; r++) {
+            if (opt->binary) {
+                if (mlb_writer_write_row(&matrix_writer, values + r * cols) != EXIT_SUCCESS
+                    || mlb_writer_write_row(&vector_writer, targets + r) != EXIT_SUCCESS) {
+                    status = EXIT_FAILURE;
+                }
+            } else if (fwrite(text + r * cols * GENERATOR_CSV_SLOT, 1, text_len[r], matrix_fp) != text_len[r]
+                       || fwrite(target_text + r * GENERATOR_CSV_SLOT, 1, target_len[r], vector_fp) != target_len[r]) {
+                perror("Unable to write CSV");
+                status = EXIT_FAILURE;
+            }
+        }
+    }
+
+    free(col_scale);
+    free(values);
+    free(targets);
+    free(text);
+    free(text_len);
+    free(target_text);
+    free(target_len);
+
+    if (opt->binary) {
+        if (mlb_writer_close(&matrix_writer) != EXIT_SUCCESS) status = EXIT_FAILURE;
+        if (mlb_writer_close(&vector_writer) != EXIT_SUCCESS) status = EXIT_FAILURE;
+    } else {
+        if (fclose(matrix_fp) != 0) status = EXIT_FAILURE;
+        if (fclose(vector_fp) != 0) status = EXIT_FAILURE;
+    }
+    return status;
+}
+
+/** @brief Generate a random rows by cols matrix and a target vector of the
+ * sum of each row in the matrix plus noise.
+ *
  * @note This doubles as a testing method. An easy way to test we got the correct
  * results from our regression is to compare it to a vector of 1s. In order for
  * our regressor to correctly output 1s, that means that the target feature
  * should be the sum of the rows.
- * 
+ *
  * In other words, we are given y and X where y = Xb. We do not know b, but
  * are trying to predict it through our regressor. This prediction is called
  * b_hat.
- * 
+ *
  * If y is the sum of the values of each row of X, then b must be all 1s.
  * This makes it easy to see if our regressor is working correctly. If b_hat is
  * all 1s, then we can tell visually it is correct.
-
- * @note To establish a matrix that is full rank, that must mean it is 
+ *
+ * @note To establish a matrix that is full rank, that must mean it is
  * invertible. An easy to tell if a matrix is invertible is if the diagonal
  * entries cannot be made 0 by a combination of the off diagonal entries
  * on the same column.
- * 
+ *
  * To do this, we make the off-diagonal entries bound between 0 and 1, and the
  * diagonal entries greater than the number of columns plus 1.
- * 
- * This strategy is called diagonal dominance
- * 
+ *
+ * This strategy is called diagonal dominance, and is the default. With
+ * --gaussian the entries are standard normal instead.
+ *
+ * @note Every value is drawn from a Philox counter indexed by its row and
+ * column, so the output depends only on the seed and the options, not on the
+ * number of threads. Rows are generated in parallel a block at a time.
+ *
+ * @note Usage: ./generate rows cols [-b] [--seed N] [--matrix FILE] [--vector FILE]
+ * [--sparsity P] [--condition K] [--noise S] [--gaussian]
+ * - -b writes the binary format of binary_format.h instead of CSV
+ * - --sparsity sets the chance an entry off the diagonal is zero
+ * - --condition scales the columns geometrically from 1 down to 1 / K, which
+ *   makes the condition number about K times that of the unscaled matrix
+ * - --noise sets the standard deviation of the normal noise in the target
+ *
  * @return int
  */
 int main(int argc, char* argv[]) {
-    FILE *matrix_fp;
-    FILE *vector_fp;
-    int i, j;
-    double matrix_val;
-    double vector_val;
-    double  noise_term;
-    int rows = atoi(argv[1]);
-    int cols = atoi(argv[2]);
-
-    srand(time(NULL));
-
-    matrix_fp = fopen(MATRIX_FILE_NAME, "w");
-    if (matrix_fp == NULL) {
-        fprintf(stderr, "Cannot open file\n");
-        return 1;
+    GeneratorOptions opt = { 0, 0, GENERATOR_DEFAULT_SEED, 0, 0, 0.0, 1.0, GENERATOR_DEFAULT_NOISE, NULL, NULL };
+    int positional = 0;
+    long long rows = 0, cols = 0;
+    int ok = 1;
+
+    for (int a = 1; a < argc && ok; a++) {
+        int has_value = a + 1 < argc;
+        if (strcmp(argv[a], "-b") == 0) {
+            opt.binary = 1;
+        } else if (strcmp(argv[a], "--gaussian") == 0) {
+            opt.gaussian = 1;
+        } else if (strcmp(argv[a], "--seed") == 0 && has_value) {
+            opt.seed = strtoull(argv[++a], NULL, 10);
+        } else if (strcmp(argv[a], "--matrix") == 0 && has_value) {
+            opt.matrix_file = argv[++a];
+        } else if (strcmp(argv[a], "--vector") == 0 && has_value) {
+            opt.vector_file = argv[++a];
+        } else if (strcmp(argv[a], "--sparsity") == 0 && has_value) {
+            opt.sparsity = atof(argv[++a]);
+        } else if (strcmp(argv[a], "--condition") == 0 && has_value) {
+            opt.condition = atof(argv[++a]);
+        } else if (strcmp(argv[a], "--noise") == 0 && has_value) {
+            opt.noise = atof(argv[++a]);
+        } else if (argv[a][0] != '-' && positional < 2) {
+            if (positional++ == 0) {
+                rows = atoll(argv[a]);
+            } else {
+                cols = atoll(argv[a]);
+            }
+        } else {
+            ok = 0;
+        }
     }
 
-    vector_fp = fopen(VECTOR_FILE_NAME, "w");
-    if (vector_fp == NULL) {
-        fprintf(stderr, "Cannot open file\n");
+    if (!ok || positional < 2) {
+        fprintf(stderr, "Usage: %s rows cols [-b] [--seed N] [--matrix FILE] [--vector FILE]\n"
+                        "       [--sparsity P] [--condition K] [--noise S] [--gaussian]\n", argv[0]);
+        return 1;
+    }
+    if (rows <= 0 || cols <= 0) {
+        fprintf(stderr, "rows and cols must be positive\n");
+        return 1;
+    }
+    if (!(opt.sparsity >= 0.0 && opt.sparsity < 1.0) || !(opt.condition >= 1.0) || !(opt.noise >= 0.0)) {
+        fprintf(stderr, "Need 0 <= sparsity < 1, condition >= 1 and noise >= 0\n");
         return 1;
     }
 
-    printf("Generating a %d by %d matrix...\n", rows, cols);
-    printf("Generating a %d vector...\n", rows);
-
-    for (i = 0; i < rows; i++) {
-        vector_val = 0.0;
-
-        for (j = 0; j < cols; j++) {
-            matrix_val = (double)rand() / RAND_MAX; // Get a random double between [0.0, 1.0]
-
-            // Diagonal Dominance implementation
-            if (i == j) {
-                matrix_val += (double)rows;
-            }
+    opt.rows = (size_t)rows;
+    opt.cols = (size_t)cols;
+    if (opt.matrix_file == NULL) opt.matrix_file = opt.binary ? MATRIX_BINARY_FILE_NAME : MATRIX_FILE_NAME;
+    if (opt.vector_file == NULL) opt.vector_file = opt.binary ? VECTOR_BINARY_FILE_NAME : VECTOR_FILE_NAME;
 
-            fprintf(matrix_fp, "%f", matrix_val);
-            vector_val += matrix_val;
+    printf("Generating a %zu by %zu matrix and a %zu vector with seed %llu...\n",
+           opt.rows, opt.cols, opt.rows, (unsigned long long)opt.seed);
 
-            if (j < cols - 1) {
-                fprintf(matrix_fp, ",");
-            }
-        }
-
-        fprintf(matrix_fp, "\n");
-        
-        noise_term = (double)rand() / (100.0 * RAND_MAX); // Add noise into the matrix and vector
-        vector_val += noise_term;
-        fprintf(vector_fp, "%f", vector_val);
-        if (i < rows - 1) {
-            fprintf(vector_fp, ",");
-        }
+    if (generate(&opt) != EXIT_SUCCESS) {
+        return 1;
     }
 
     printf("Done\n");
-
-    fclose(matrix_fp);
-    fclose(vector_fp);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,11 +1,122 @@
 #include <stdio.h>
+#include <string.h>
 #include "regressions.h"
 
+/**
+ * @brief Score new rows with saved coefficients
+ *
+ * Usage: ml_app predict [-b] matrix_file coefficients_file output_file. The
+ * rows are streamed, so the matrix file may be larger than memory. -b writes
+ * the predictions as a binary vector file instead of CSV.
+ */
+static int predict_main(int argc, char* argv[], const char* program) {
+    int binary = 0;
+    if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+        binary = 1;
+        argv++;
+        argc--;
+    }
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s predict [-b] matrix_file coefficients_file output_file\n", program);
+        return 1;
+    }
+
+    Vector* beta = is_binary_file(argv[2]) ? create_vector_from_binary(argv[2])
+                                           : create_vector_from_file(argv[2]);
+    if (beta == NULL) {
+        return 1;
+    }
+
+    size_t rows = 0;
+    int status = predict_streaming(argv[1], beta, argv[3], binary, &rows);
+    free_vector(beta);
+    if (status != EXIT_SUCCESS) {
+        return 1;
+    }
+    printf("Predicted %zu rows into %s\n", rows, argv[3]);
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
-    Matrix* X = create_matrix_from_file(argv[1]);
-    Vector* y = create_vector_from_file(argv[2]);
-    printf("y size: %ld\n", y->rows);
-    Vector* b_hat = ols(X, y);
+    const char* program = argv[0];
+    if (argc > 1 && strcmp(argv[1], "predict") == 0) {
+        return predict_main(argc - 1, argv + 1, program);
+    }
+
+    // --stream fits the model a chunk of rows at a time, for files larger than memory
+    // --mixed factors in float and refines the solution in double
+    // --sparse keeps only the nonzeros of the matrix and fits it in CSR form
+    // --save FILE writes the fitted coefficients to FILE for ml_app predict
+    int streaming = 0;
+    int mixed = 0;
+    int sparse = 0;
+    char* save_file = NULL;
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--stream") == 0) {
+            streaming = 1;
+        } else if (strcmp(argv[1], "--mixed") == 0) {
+            mixed = 1;
+        } else if (strcmp(argv[1], "--sparse") == 0) {
+            sparse = 1;
+        } else if (strcmp(argv[1], "--save") == 0 && argc > 2) {
+            save_file = argv[2];
+            argv++;
+            argc--;
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[1]);
+            return 1;
+        }
+        argv++;
+        argc--;
+    }
+
+    // Each mode has its own solver, so they cannot be combined
+    if (streaming + mixed + sparse > 1) {
+        fprintf(stderr, "Only one of --stream, --mixed and --sparse may be given\n");
+        return 1;
+    }
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s [--stream | --mixed | --sparse] [--save coefficients_file] matrix_file vector_file\n"
+                        "       %s predict [-b] matrix_file coefficients_file output_file\n", program, program);
+        return 1;
+    }
+
+    Matrix* X = NULL;
+    Vector* y = NULL;
+    Vector* b_hat = NULL;
+    if (streaming) {
+        b_hat = ols_streaming(argv[1], argv[2]);
+    } else if (sparse) {
+        SparseMatrix* S = create_sparse_matrix_from_file(argv[1]);
+        y = is_binary_file(argv[2]) ? create_vector_from_binary(argv[2])
+                                    : create_vector_from_file(argv[2]);
+        if (S == NULL || y == NULL) {
+            return 1;
+        }
+
+        printf("Nonzeros: %zu of %zu\n", S->nnz, S->rows * S->cols);
+        b_hat = ols_sparse(S, y);
+        free_sparse_matrix(S);
+    } else {
+        // Either file may be a CSV or a binary file written by csv2bin or generate -b
+        X = is_binary_file(argv[1]) ? create_matrix_from_binary(argv[1])
+                                    : create_matrix_from_file(argv[1]);
+        y = is_binary_file(argv[2]) ? create_vector_from_binary(argv[2])
+                                    : create_vector_from_file(argv[2]);
+        if (X == NULL || y == NULL) {
+            return 1;
+        }
+
+        printf("y size: %ld\n", y->rows);
+        b_hat = mixed ? ols_mixed(X, y) : ols(X, y);
+    }
+    if (b_hat == NULL) {
+        return 1;
+    }
+    if (save_file != NULL && write_vector_to_csv(b_hat, save_file) != EXIT_SUCCESS) {
+        return 1;
+    }
 
     double mae_result;
     Vector* b = create_empty_vector(b_hat->rows);
@@ -17,8 +128,8 @@ int main(int argc, char* argv[]) {
     // printf("The ordinary least squares regression is: ");
     // print_vector(b_hat);
     printf("The MAE is: %f\n", mae_result);
-    free_matrix(X);
-    free_vector(y);
+    if (X) free_matrix(X);
+    if (y) free_vector(y);
     free_vector(b_hat);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,13 +1,23 @@
+#ifndef MATRIX_H
+#define MATRIX_H
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
  
 #include "vector.h"
 
-#define MAX_LINE_LENGTH 32768
 #define MIN(a,b) (a < b ? (a) : (b))
 
+#include "gemm.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+// Edge of the square tiles tranpose_matrix() works through
+#define TRANSPOSE_TILE 32
+
 /** TODO:
 *
 * DONE: Transpose
@@ -17,26 +27,79 @@
 * DONE: Inverse
 * DONE: Pseudoinverse
 * Get target feature
-* QR decomposition
+* DONE: QR decomposition
 * Eigen decomposition
-* SVD
+* DONE: SVD
 *
 */
 
+// Byte alignment of matrix buffers and of the start of every row (one cache line)
+#define MATRIX_ALIGNMENT 64
+
 /**
  * @struct A structure encapsulating a row by column mathematical matrix
+ *
+ * The elements live in a single contiguous, MATRIX_ALIGNMENT-aligned buffer.
+ * Row i starts stride elements after row i - 1, where stride is cols rounded
+ * up to a whole cache line so every row is aligned as well.
+ *
+ * Rows swapped through swap_rows() are not moved in memory. Instead perm maps
+ * a logical row to the physical row holding it. perm is NULL while the rows
+ * are stored in order, so always go through matrix_row() or MAT_AT().
  */
 typedef struct Matrix {
     size_t rows;
     size_t cols;
-    double** data;
+    size_t stride;
+    double* data;
+    size_t* perm;
+
+    // Set when data points into a mapped binary file instead of the heap
+    void* mapping;
+    size_t mapping_size;
+
+    // Set when the matrix lives in an Arena, which owns its memory
+    Arena* arena;
 } Matrix;
 
+/**
+ * @brief Get a pointer to the first element of a logical row of a matrix
+ *
+ * @param A The matrix
+ * @param i The logical row index
+ * @return double* The row, valid for A->cols elements
+ */
+static inline double* matrix_row(const Matrix* A, size_t i) {
+    return A->data + (A->perm ? A->perm[i] : i) * A->stride;
+}
+
+// Element access usable as an lvalue, e.g. MAT_AT(A, i, j) = 1.0
+#define MAT_AT(A, i, j) (matrix_row((A), (i))[(j)])
+
 // Helper to compare doubles safely
 int is_close(double a, double b) {
     return fabs(a - b) < 0.0001;
 }
 
+/**
+ * @brief Allocate a zeroed buffer of doubles aligned to MATRIX_ALIGNMENT
+ *
+ * @param count The number of doubles in the buffer
+ * @return double* The buffer, or NULL on failure. Release it with free()
+ */
+static double* _aligned_calloc(size_t count) {
+    size_t bytes = count * sizeof(double);
+    // aligned_alloc requires a size that is a multiple of the alignment
+    bytes = (bytes + MATRIX_ALIGNMENT - 1) / MATRIX_ALIGNMENT * MATRIX_ALIGNMENT;
+    if (bytes == 0) bytes = MATRIX_ALIGNMENT;
+
+    double* buffer = (double*)aligned_alloc(MATRIX_ALIGNMENT, bytes);
+    if (buffer != NULL) {
+        memset(buffer, 0, bytes);
+    }
+    return buffer;
+}
+
 /**
  * @brief Create a matrix of size rows by columns
  * 
@@ -46,19 +109,60 @@ int is_close(double a, double b) {
  */
 Matrix* create_empty_matrix(size_t rows, size_t cols) {
     Matrix* mat = (Matrix*)malloc(sizeof(Matrix));
+    if (mat == NULL) return NULL;
+
+    // Pad every row out to a whole number of cache lines
+    size_t per_line = MATRIX_ALIGNMENT / sizeof(double);
     mat->rows = rows;
     mat->cols = cols;
-    mat->data = (double**)calloc(rows, sizeof(double*));
+    mat->stride = (cols + per_line - 1) / per_line * per_line;
+    mat->perm = NULL;
+    mat->mapping = NULL;
+    mat->mapping_size = 0;
+    mat->arena = NULL;
+    mat->data = _aligned_calloc(rows * mat->stride);
 
     if (mat->data == NULL) {
         free(mat);
         return NULL;
     }
 
-    for (size_t i= 0; i < rows; i++) {
-        mat->data[i] = (double*)calloc(cols, sizeof(double));
+    return mat;
+}
+
+/**
+ * @brief Create a matrix of size rows by columns inside an arena
+ *
+ * The matrix is zeroed and padded like one from create_empty_matrix(). It is
+ * released with the arena, and free_matrix() leaves it alone apart from any
+ * row permutation swap_rows() added.
+ *
+ * @param arena The arena to allocate from
+ * @param rows The number of rows in the matrix to create.
+ * @param cols The number of cols in the matrix to create.
+ * @return Matrix*, or NULL if the arena is full
+ */
+Matrix* arena_matrix(Arena* arena, size_t rows, size_t cols) {
+    size_t per_line = MATRIX_ALIGNMENT / sizeof(double);
+    size_t stride = (cols + per_line - 1) / per_line * per_line;
+
+    size_t mark = arena->used;
+    Matrix* mat = (Matrix*)arena_alloc(arena, sizeof(Matrix));
+    double* data = (double*)arena_alloc(arena, rows * stride * sizeof(double));
+    if (mat == NULL || data == NULL) {
+        arena_release(arena, mark);
+        return NULL;
     }
 
+    memset(data, 0, rows * stride * sizeof(double));
+    mat->rows = rows;
+    mat->cols = cols;
+    mat->stride = stride;
+    mat->data = data;
+    mat->perm = NULL;
+    mat->mapping = NULL;
+    mat->mapping_size = 0;
+    mat->arena = arena;
     return mat;
 }
 
@@ -74,11 +178,12 @@ Matrix* copy_matrix(Matrix* A) {
         return NULL;
     }
 
+    // The copy stores its rows in logical order, dropping any permutation
     Matrix* B = create_empty_matrix(A->rows, A->cols);
+    if (B == NULL) return NULL;
+
     for (size_t i = 0; i < A->rows; i++) {
-        for (size_t j = 0; j < A->cols; j++) {
-            B->data[i][j] = A->data[i][j];
-        }
+        memcpy(matrix_row(B, i), matrix_row(A, i), A->cols * sizeof(double));
     }
 
     return B;
@@ -92,10 +197,16 @@ Matrix* copy_matrix(Matrix* A) {
  * @return void
  */
 void free_matrix(Matrix* mat) {
-    for (size_t i = 0; i < mat->rows; i++) {
-        free(mat->data[i]);
+    free(mat->perm);
+    if (mat->arena != NULL) {
+        mat->perm = NULL;
+        return;
+    }
+    if (mat->mapping != NULL) {
+        munmap(mat->mapping, mat->mapping_size);
+    } else {
+        free(mat->data);
     }
-    free(mat->data);
     free(mat);
 }
 
@@ -111,7 +222,7 @@ void print_matrix(Matrix* mat) {
     for (size_t i = 0; i < mat->rows; i++) {
         printf("[");
         for (size_t j = 0; j < mat->cols; j++) {
-            printf("%g, ", mat->data[i][j]);
+            printf("%g, ", MAT_AT(mat, i, j));
         }
         printf("],\n");
     }
@@ -119,112 +230,150 @@ void print_matrix(Matrix* mat) {
 }
 
 /**
- * @brief Populate a given matrix from a given CSV file
+ * @brief Create a matrix from a file
  * 
- * @param mat A pointer to the matrix
- * @param file_name A pointer to the file name
- * @return integer representing status of population creation
+ * The file is memory mapped and parsed in parallel straight into the matrix,
+ * see csv.h. Rows may be any length, but every row must have as many values
+ * as the first.
+ * 
+ * @param file_name The name of the CSV file to create the matrix from
+ * 
+ * @return Matrix*, or NULL if the file cannot be read or is malformed
+ * @note The caller is reponsible for freeing this memory using free_matrix()
  */
-static int _populate_matrix(Matrix* mat, char* file_name) {
-    FILE* file_pointer;
-    char line_buffer[MAX_LINE_LENGTH];
-    
-    size_t cols = mat->cols; // number of cols
-    *line_buffer = '\0';
-    size_t i = 0; // Current row in matrix
-    size_t j = 0; // Currsent column in matrix
-
-    file_pointer = fopen(file_name, "r");
-    if (file_pointer == NULL) {
-        perror("Unable to open file");
-        return EXIT_FAILURE;
+Matrix* create_matrix_from_file(char* file_name) {
+    CsvFile csv;
+    if (csv_open(file_name, &csv) != EXIT_SUCCESS) {
+        return NULL;
     }
 
-    while(fgets(line_buffer, MAX_LINE_LENGTH, file_pointer) != NULL) {
-        char* token; // array of matrix values (as chars)
-        token = strtok(line_buffer, ",");
+    Matrix* mat = create_empty_matrix(csv.rows, csv.cols);
+    if (mat == NULL || csv_read(&csv, mat->data, mat->stride) != EXIT_SUCCESS) {
+        if (mat) free_matrix(mat);
+        csv_close(&csv);
+        return NULL;
+    }
 
-        while (token != NULL) {
-            mat->data[i][j] = atof(token);
+    csv_close(&csv);
+    return mat;
+}
 
-            if (j == cols - 1) {
-                i += 1;
-                j = 0;
-            } else {
-                j++;
-            }
+/**
+ * @brief Create a matrix from a binary file
+ * 
+ * The file is memory mapped and the matrix uses the mapped pages as its data,
+ * so nothing is copied or parsed. The mapping is private: changes made to the
+ * matrix are never written back to the file. See binary_format.h for the
+ * layout.
+ * 
+ * @param file_name The name of the binary file to create the matrix from
+ * 
+ * @return Matrix*, or NULL if the file is not a valid binary matrix
+ * @note The caller is reponsible for freeing this memory using free_matrix()
+ */
+Matrix* create_matrix_from_binary(char* file_name) {
+    MlbMapping mapping;
+    if (mlb_map(file_name, MLB_KIND_MATRIX, &mapping) != EXIT_SUCCESS) {
+        return NULL;
+    }
 
-            token = strtok(NULL, ",");
-        }
+    Matrix* mat = (Matrix*)malloc(sizeof(Matrix));
+    if (mat == NULL) {
+        munmap(mapping.base, mapping.size);
+        return NULL;
     }
 
-    fclose(file_pointer);
-    return EXIT_SUCCESS;
+    mat->rows = (size_t)mapping.header.rows;
+    mat->cols = (size_t)mapping.header.cols;
+    mat->stride = (size_t)mapping.header.stride;
+    mat->data = mapping.data;
+    mat->perm = NULL;
+    mat->mapping = mapping.base;
+    mat->mapping_size = mapping.size;
+    mat->arena = NULL;
+    return mat;
 }
 
 /**
- * @brief Get the dimensions of a matrix from it's CSV file
+ * @brief Write a matrix to a binary file
  * 
- * @param file_name A pointer to the file name
- * @param dims Dimensions we will find of CSV file
- * @return void, dimensions of matrix is passed to dims paramters.
+ * @param mat The matrix to write. Rows are written in their logical order
+ * @param file_name The name of the file to create
+ * 
+ * @return int The resulting status code
  */
-static void _put_matrix_dimensions(char *file_name, int dims[2]) {
-    char line_buffer[MAX_LINE_LENGTH];
-    FILE *file_pointer;
-
-    *line_buffer = '\0';
-    dims[0] = 0;
-    dims[1] = 0;
+int write_matrix_to_binary(Matrix* mat, char* file_name) {
+    MlbWriter writer;
+    if (mlb_writer_open(&writer, file_name, MLB_KIND_MATRIX, mat->rows, mat->cols) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
 
-    file_pointer = fopen(file_name, "r");
-    if (file_pointer == NULL) {
-        perror("Unable to open file");
-        return;
+    int status = EXIT_SUCCESS;
+    for (size_t i = 0; i < mat->rows && status == EXIT_SUCCESS; i++) {
+        status = mlb_writer_write_row(&writer, matrix_row(mat, i));
     }
 
-    while(fgets(line_buffer, MAX_LINE_LENGTH, file_pointer) != NULL) {
-        // If we're past the first the first row, don't bother counting the number of columns
-        // This is a potential bug if our CSV is not rectangular
-        if (dims[0] > 0) {
-            dims[0]++; 
-            continue;
-        }
+    if (mlb_writer_close(&writer) != EXIT_SUCCESS) status = EXIT_FAILURE;
+    return status;
+}
 
-        line_buffer[strcspn(line_buffer, "\n")] = 0; // Set the newline character to NULL
-        char* token; // array of matrix values (as chars)
-        token = strtok(line_buffer, ",");
+/**
+ * @struct Arguments shared by the threads of tranpose_matrix()
+ */
+typedef struct TransposeTask {
+    const Matrix* src;
+    Matrix* dst;
+} TransposeTask;
 
-        while (token != NULL) {
-            dims[1]++;
-            token = strtok(NULL, ",");
+/**
+ * @brief parallel_for() body transposing bands [begin, end) of output rows
+ *
+ * Each band is copied one TRANSPOSE_TILE square at a time so both the rows
+ * read and the rows written stay in cache.
+ */
+static void _transpose_task(size_t begin, size_t end, void* ctx) {
+    TransposeTask* task = (TransposeTask*)ctx;
+    const Matrix* src = task->src;
+    Matrix* dst = task->dst;
+
+    for (size_t band = begin; band < end; band++) {
+        size_t i_start = band * TRANSPOSE_TILE;
+        size_t i_end = MIN(i_start + TRANSPOSE_TILE, dst->rows);
+
+        for (size_t j_start = 0; j_start < dst->cols; j_start += TRANSPOSE_TILE) {
+            size_t j_end = MIN(j_start + TRANSPOSE_TILE, dst->cols);
+
+            for (size_t j = j_start; j < j_end; j++) {
+                const double* src_row = matrix_row(src, j);
+                for (size_t i = i_start; i < i_end; i++) {
+                    MAT_AT(dst, i, j) = src_row[i];
+                }
+            }
         }
-
-        dims[0]++;
- 
     }
-
-    fclose(file_pointer);
 }
 
 /**
- * @brief Create a matrix from a file
- * 
- * Create a matrix from a file using a combination of methods
- * 
- * @param file_name The name of the CSV file to create the matrix from
- * 
- * @return Matrix*
- * @note The caller is reponsible for freeing this memory using free_matrix()
+ * @brief Transpose a matrix into storage the caller provides
+ *
+ * @param mat The matrix to be transposed
+ * @param dst A mat->cols x mat->rows matrix to hold the transpose. Any row
+ * permutation it has is respected
+ *
+ * @return int The resulting status code
  */
-Matrix* create_matrix_from_file(char* file_name) {
-    int dims[2] = {0, 0};
-    _put_matrix_dimensions(file_name, dims);
-
-    Matrix* mat = create_empty_matrix(dims[0], dims[1]);
-    _populate_matrix(mat, file_name);
+int tranpose_matrix_into(Matrix* mat, Matrix* dst) {
+    if (dst->rows != mat->cols || dst->cols != mat->rows) {
+        fprintf(stderr, "Transpose: The destination has the wrong size\n");
+        return EXIT_FAILURE;
+    }
 
-    return mat;
+    // Threads take bands of TRANSPOSE_TILE output rows
+    TransposeTask task = { mat, dst };
+    size_t n_bands = (dst->rows + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE;
+    size_t band_work = TRANSPOSE_TILE * dst->cols;
+    parallel_for(0, n_bands, PARALLEL_MIN_WORK / (band_work + 1) + 1, _transpose_task, &task);
+    return EXIT_SUCCESS;
 }
 
 /**
@@ -237,22 +386,56 @@ Matrix* create_matrix_from_file(char* file_name) {
  */
 Matrix* tranpose_matrix(Matrix* mat) {
     // transposed rows and cols
-    size_t t_rows = mat->cols;
-    size_t t_cols = mat->rows;
+    Matrix* tranpose = create_empty_matrix(mat->cols, mat->rows);
+    if (tranpose == NULL) return NULL;
+
+    ML_TRACE_BEGIN(span, "tranpose_matrix");
+    tranpose_matrix_into(mat, tranpose);
+    ML_TRACE_END(span, 0, 16.0 * mat->rows * mat->cols);
 
-    Matrix* tranpose = create_empty_matrix(t_rows, t_cols);
+    return tranpose;
+}
 
-    printf("Performing matrix transponse...\n");
+/**
+ * @struct Arguments shared by the threads of matrix_vector_product()
+ */
+typedef struct MatVecTask {
+    const Matrix* A;
+    const Vector* x;
+    Vector* b;
+} MatVecTask;
 
-    for (size_t i = 0; i < mat->cols; i++) {
-        for (size_t j = 0; j < mat->rows; j++) {
-            tranpose->data[i][j] = mat->data[j][i];
-        }
+/**
+ * @brief parallel_for() body computing entries [begin, end) of A * x
+ */
+static void _matrix_vector_task(size_t begin, size_t end, void* ctx) {
+    MatVecTask* task = (MatVecTask*)ctx;
+    for (size_t i = begin; i < end; i++) {
+        task->b->data[i] = simd_dot(matrix_row(task->A, i), task->x->data, task->A->cols);
     }
+}
 
-    printf("Done\n");
+/**
+ * @brief Compute the Matrix-vector product into storage the caller provides
+ *
+ * @param A The lefthand matrix
+ * @param x The righthand vector
+ * @param b A vector of A->rows entries to hold A * x. It must not be x
+ *
+ * @return int The resulting status code
+ */
+int matrix_vector_product_into(Matrix* A, Vector* x, Vector* b) {
+    // If we get a size mismatch fail
+    if (A->cols != x->rows || A->rows != b->rows) {
+        fprintf(stderr, "Matrix Vector Product: The matrix and vectors have incompatible sizes\n");
+        return EXIT_FAILURE;
+    }
 
-    return tranpose;
+    // Each entry is a row of A dotted with x, vectorised through simd.h and
+    // split across threads by rows
+    MatVecTask task = { A, x, b };
+    parallel_for(0, A->rows, PARALLEL_MIN_WORK / (2 * A->cols + 1) + 1, _matrix_vector_task, &task);
+    return EXIT_SUCCESS;
 }
 
 /**
@@ -271,25 +454,107 @@ Vector* matrix_vector_product(Matrix* A, Vector* x) {
         return NULL;
     }
 
-    printf("Performing matrix-vector product...\n");
+    ML_TRACE_BEGIN(span, "matrix_vector_product");
 
     // Number of rows for the new vector
-    size_t v_rows = A->rows;
-    
-    Vector* b = create_empty_vector(v_rows);
+    Vector* b = create_empty_vector(A->rows);
+    if (b != NULL) matrix_vector_product_into(A, x, b);
+    ML_TRACE_END(span, 2.0 * A->rows * A->cols, 8.0 * (A->rows * A->cols + A->rows + A->cols));
 
-    for(size_t i = 0; i < A->rows; i++) {
-        for (size_t j = 0; j < A->cols; j++) {
-            b->data[i] += (A->data[i][j] * x->data[j]);
-        }
+    return b;
+}
+
+/**
+ * @struct Arguments shared by the threads of matrix_transpose_vector_product_into()
+ */
+typedef struct MatTVecTask {
+    const Matrix* A;
+    const Vector* y;
+    Vector* x;
+} MatTVecTask;
+
+/**
+ * @brief parallel_for() body computing entries [begin, end) of At * y
+ *
+ * Every row of A adds its slice of columns into x, so A is read in row
+ * order and never transposed.
+ */
+static void _matrix_transpose_vector_task(size_t begin, size_t end, void* ctx) {
+    MatTVecTask* task = (MatTVecTask*)ctx;
+    double* x = task->x->data;
+    memset(x + begin, 0, (end - begin) * sizeof(double));
+    for (size_t i = 0; i < task->A->rows; i++) {
+        const double* row = matrix_row(task->A, i);
+        double y_i = task->y->data[i];
+        for (size_t j = begin; j < end; j++) x[j] += y_i * row[j];
     }
-    printf("done\n");
+}
 
-    return b;
+/**
+ * @brief Compute the transposed Matrix-vector product At * y into storage the caller provides
+ *
+ * @param A The matrix
+ * @param y A vector of A->rows entries
+ * @param x A vector of A->cols entries to hold At * y. It must not be y
+ *
+ * @return int The resulting status code
+ */
+int matrix_transpose_vector_product_into(Matrix* A, Vector* y, Vector* x) {
+    if (A->rows != y->rows || A->cols != x->rows) {
+        fprintf(stderr, "Matrix Vector Product: The matrix and vectors have incompatible sizes\n");
+        return EXIT_FAILURE;
+    }
+
+    // At least a cache line of x per slice
+    size_t grain = PARALLEL_MIN_WORK / (2 * A->rows + 1) + 1;
+    if (grain < MATRIX_ALIGNMENT / sizeof(double)) grain = MATRIX_ALIGNMENT / sizeof(double);
+    MatTVecTask task = { A, y, x };
+    parallel_for(0, A->cols, grain, _matrix_transpose_vector_task, &task);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Compute the Matrix product into storage the caller provides
+ *
+ * The product is computed by the cache-blocked engine in gemm.h. Operands
+ * with swapped rows are first copied into row order so the engine sees a
+ * single uniform stride. C must not be A or B, and should not have swapped
+ * rows of its own.
+ *
+ * @param A The lefthand matrix
+ * @param B The righthand matrix
+ * @param C An A->rows x B->cols matrix to hold A * B
+ *
+ * @return int The resulting status code
+ */
+int matrix_product_into(Matrix* A, Matrix* B, Matrix* C) {
+    if (A->cols != B->rows || C->rows != A->rows || C->cols != B->cols || C->perm != NULL) {
+        fprintf(stderr, "Matrix Product: The matrices have incompatible sizes\n");
+        fprintf(stderr, "A rows: %zu, A cols: %zu, B rows: %zu, B cols: %zu\n",
+            A->rows, A->cols, B->rows, B->cols);
+        return EXIT_FAILURE;
+    }
+
+    Matrix* A_ordered = A->perm ? copy_matrix(A) : A;
+    Matrix* B_ordered = B->perm ? copy_matrix(B) : B;
+
+    int status = EXIT_FAILURE;
+    if (A_ordered != NULL && B_ordered != NULL) {
+        status = gemm(0, 0, A->rows, B->cols, A->cols,
+                      1.0, A_ordered->data, A_ordered->stride,
+                      B_ordered->data, B_ordered->stride,
+                      0.0, C->data, C->stride);
+    }
+
+    if (A_ordered && A_ordered != A) free_matrix(A_ordered);
+    if (B_ordered && B_ordered != B) free_matrix(B_ordered);
+    return status;
 }
 
 /**
- * @brief Compute the Matrix product (Matrix multiplication) through textbook definition O(n^3)
+ * @brief Compute the Matrix product (Matrix multiplication)
+ * 
+ * See matrix_product_into().
  * 
  * @param A The lefthand matrix
  * @param A The righthand matrix
@@ -309,40 +574,331 @@ Matrix* matrix_product(Matrix* A, Matrix* B) {
     Matrix* C = create_empty_matrix(A->rows, B->cols);
     if (C == NULL) return NULL;
     
-    printf("Performing matrix product...\n");
-    
-    for (size_t i = 0; i < A->rows; i++) {
-        for (size_t j = 0; j < B->cols; j++) {
-            double sum = 0.0;
+    ML_TRACE_BEGIN(span, "matrix_product");
+
+    int status = matrix_product_into(A, B, C);
+    ML_TRACE_END(span, 2.0 * A->rows * A->cols * B->cols,
+                 8.0 * (A->rows * A->cols + B->rows * B->cols + C->rows * C->cols));
+
+    if (status != EXIT_SUCCESS) {
+        free_matrix(C);
+        return NULL;
+    }
+    return C;
+}
+
+// Rows of A per gemm() call in gram_accumulate(), the depth of gemm()'s packed blocks
+#define GRAM_ROW_BLOCK GEMM_KC
+
+// Width of the block columns the upper triangle of AtA is built from
+#define GRAM_COL_BLOCK 32
 
-            for (size_t k = 0; k < B->rows; k++) {
-                sum += (A->data[i][k] * B->data[k][j]);
+// Most memory gram_accumulate() spends on private copies of G for its threads
+#define GRAM_SLAB_BYTES ((size_t)64 << 20)
+
+/**
+ * @brief Add the upper triangle of Ct * C, and Ct * c, for a band of rows
+ */
+static int _gram_rows(const double* A, size_t lda, size_t rows, size_t cols,
+                      const double* b, double* G, size_t ldg, double* g) {
+    for (size_t r = 0; r < rows; r += GRAM_ROW_BLOCK) {
+        size_t rb = MIN((size_t)GRAM_ROW_BLOCK, rows - r);
+        const double* C = A + r * lda;
+
+        // Block column jb only needs the rows of AtA above its diagonal block
+        for (size_t jb = 0; jb < cols; jb += GRAM_COL_BLOCK) {
+            size_t bw = MIN((size_t)GRAM_COL_BLOCK, cols - jb);
+            if (gemm(1, 0, jb + bw, bw, rb, 1.0, C, lda, C + jb, lda, 1.0, G + jb, ldg) != EXIT_SUCCESS) {
+                return EXIT_FAILURE;
+            }
+        }
+
+        // Atb while the same rows are still in cache
+        if (b != NULL) {
+            for (size_t i = 0; i < rb; i++) {
+                const double* row = C + i * lda;
+                double b_i = b[r + i];
+                for (size_t j = 0; j < cols; j++) g[j] += b_i * row[j];
             }
-        
-            C->data[i][j] = sum;
         }
     }
+    return EXIT_SUCCESS;
+}
 
-    printf("Done\n");
-    return C;
+/**
+ * @struct Arguments shared by the threads of gram_accumulate()
+ *
+ * Slab s covers rows [s * slab_rows, (s + 1) * slab_rows). Slab 0 adds
+ * straight into G and g, and slab s > 0 into its own zeroed copy at
+ * workspace + (s - 1) * slab_words, which are summed afterwards.
+ */
+typedef struct GramTask {
+    const double* A;
+    size_t lda;
+    size_t rows;
+    size_t cols;
+    const double* b;
+    size_t slab_rows;
+    double* G;
+    size_t ldg;
+    double* g;
+    double* workspace;
+    size_t slab_words;
+    atomic_int status;
+} GramTask;
+
+/**
+ * @brief parallel_for() body accumulating slabs [begin, end)
+ */
+static void _gram_task(size_t begin, size_t end, void* ctx) {
+    GramTask* task = (GramTask*)ctx;
+    for (size_t s = begin; s < end; s++) {
+        size_t r = s * task->slab_rows;
+        size_t rows = MIN(task->slab_rows, task->rows - r);
+        double* G = s ? task->workspace + (s - 1) * task->slab_words : task->G;
+        double* g = s ? G + task->cols * task->ldg : task->g;
+        if (_gram_rows(task->A + r * task->lda, task->lda, rows, task->cols,
+                       task->b ? task->b + r : NULL, G, task->ldg, g) != EXIT_SUCCESS) {
+            atomic_store(&task->status, EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * @brief The number of row slabs gram_accumulate() splits rows into
+ *
+ * One per thread while the private copies of G fit in GRAM_SLAB_BYTES,
+ * otherwise 1, and the threads split each gemm() instead.
+ */
+static size_t _gram_slabs(size_t rows, size_t cols, size_t ldg) {
+    size_t n_slabs = MIN(ml_get_num_threads(), (rows + GRAM_ROW_BLOCK - 1) / GRAM_ROW_BLOCK);
+    size_t slab_bytes = (cols * ldg + cols) * sizeof(double);
+    if (n_slabs <= 1 || rows * cols * cols < PARALLEL_MIN_WORK || (n_slabs - 1) * slab_bytes > GRAM_SLAB_BYTES) {
+        return 1;
+    }
+    return n_slabs;
+}
+
+/**
+ * @brief The most workspace gram_accumulate_workspace() uses for a cols x cols G
+ *
+ * @param cols The number of columns of A
+ * @param ldg The leading dimension of G
+ * @return size_t The number of bytes, 0 with one thread
+ */
+size_t gram_workspace_bytes(size_t cols, size_t ldg) {
+    // As _gram_slabs() for enough rows to give every thread a slab
+    size_t copies = ml_get_num_threads() - 1;
+    size_t slab_bytes = (cols * ldg + cols) * sizeof(double);
+    return (copies * slab_bytes > GRAM_SLAB_BYTES) ? 0 : copies * slab_bytes;
+}
+
+/**
+ * @brief Add At * A and At * b into G and g, reading A only once
+ *
+ * This is a symmetric rank-k update (SYRK) fused with the matrix-vector
+ * product. A is read in row major order, so no transposed copy is made, and
+ * only the upper triangle of G is updated, which is half the flops of a
+ * general product. When G is small the rows are split into one slab per
+ * thread, each summed into a private copy of G. Those copies take at most
+ * GRAM_SLAB_BYTES; past that the rows are taken in order and each gemm()
+ * is split across the threads instead, so the memory stays O(cols^2).
+ *
+ * @param A The rows x cols block of observations, leading dimension lda
+ * @param lda The leading dimension of A
+ * @param rows The number of rows of A
+ * @param cols The number of columns of A
+ * @param b The rows targets, or NULL to skip At * b
+ * @param G The cols x cols accumulator. Only its upper triangle is written
+ * @param ldg The leading dimension of G
+ * @param g The cols accumulator for At * b. Ignored if b is NULL
+ * @param workspace gram_workspace_bytes(cols, ldg) bytes for the copies of
+ * G, or NULL to allocate them
+ * @return int The resulting status code
+ */
+int gram_accumulate_workspace(const double* A, size_t lda, size_t rows, size_t cols,
+                              const double* b, double* G, size_t ldg, double* g, double* workspace) {
+    size_t n_slabs = _gram_slabs(rows, cols, ldg);
+    if (n_slabs == 1) {
+        return _gram_rows(A, lda, rows, cols, b, G, ldg, g);
+    }
+
+    size_t slab_words = cols * ldg + cols;
+    double* copies = workspace ? workspace : (double*)malloc((n_slabs - 1) * slab_words * sizeof(double));
+    if (copies == NULL) return EXIT_FAILURE;
+    memset(copies, 0, (n_slabs - 1) * slab_words * sizeof(double));
+
+    size_t slab_rows = (rows + n_slabs - 1) / n_slabs;
+    GramTask task = { A, lda, rows, cols, b, slab_rows, G, ldg, g, copies, slab_words, EXIT_SUCCESS };
+    parallel_for(0, n_slabs, 1, _gram_task, &task);
+    int status = atomic_load(&task.status);
+
+    for (size_t s = 1; s < n_slabs; s++) {
+        const double* slab_G = copies + (s - 1) * slab_words;
+        const double* slab_g = slab_G + cols * ldg;
+        for (size_t i = 0; i < cols; i++) {
+            for (size_t j = i; j < cols; j++) G[i * ldg + j] += slab_G[i * ldg + j];
+            if (b != NULL) g[i] += slab_g[i];
+        }
+    }
+
+    if (copies != workspace) free(copies);
+    return status;
+}
+
+/**
+ * @brief Add At * A and At * b into G and g, as gram_accumulate_workspace()
+ * with the private copies of G allocated as needed
+ */
+int gram_accumulate(const double* A, size_t lda, size_t rows, size_t cols,
+                    const double* b, double* G, size_t ldg, double* g) {
+    return gram_accumulate_workspace(A, lda, rows, cols, b, G, ldg, g, NULL);
+}
+
+/**
+ * @brief Copy the upper triangle of a square matrix onto its lower triangle
+ *
+ * @param A The matrix to make symmetric
+ * @return void
+ */
+void mirror_upper_triangle(Matrix* A) {
+    for (size_t i = 0; i < A->rows; i++) {
+        double* row = matrix_row(A, i);
+        for (size_t j = 0; j < i; j++) {
+            row[j] = MAT_AT(A, j, i);
+        }
+    }
+}
+
+/**
+ * @brief Compute the Gram matrix At * A, and optionally At * b
+ *
+ * One fused pass over the rows of A through gram_accumulate(), without the
+ * transposed copy of A that matrix_product(tranpose_matrix(A), A) needs.
+ *
+ * @param A The m x n matrix
+ * @param b An m x 1 vector, or NULL
+ * @param Atb Set to a new n x 1 vector At * b when b is given
+ *
+ * @return Matrix* The symmetric n x n matrix At * A, or NULL on failure
+ * @note The caller is responsible for freeing this memory using free_matrix(),
+ * and *Atb using free_vector()
+ */
+Matrix* gram_matrix(Matrix* A, Vector* b, Vector** Atb) {
+    if (b != NULL && b->rows != A->rows) {
+        fprintf(stderr, "Gram Matrix: The matrix and vector have incompatible sizes\n");
+        return NULL;
+    }
+
+    size_t cols = A->cols;
+    Matrix* AtA = create_empty_matrix(cols, cols);
+    Vector* g = b ? create_empty_vector(cols) : NULL;
+    if (AtA == NULL || (b != NULL && g == NULL)) {
+        if (AtA) free_matrix(AtA);
+        if (g) free_vector(g);
+        return NULL;
+    }
+
+    ML_TRACE_BEGIN(span, "gram_matrix");
+
+    // The row order only matters for pairing rows of A with entries of b
+    Matrix* A_ordered = (A->perm && b) ? copy_matrix(A) : A;
+    int status = A_ordered ? gram_accumulate(A_ordered->data, A_ordered->stride, A->rows, cols,
+                                             b ? b->data : NULL, AtA->data, AtA->stride, g ? g->data : NULL)
+                           : EXIT_FAILURE;
+    if (A_ordered && A_ordered != A) free_matrix(A_ordered);
+    if (status == EXIT_SUCCESS) mirror_upper_triangle(AtA);
+
+    // Only the upper triangle is computed
+    ML_TRACE_END(span, (double)A->rows * cols * (cols + 1) + (b ? 2.0 * A->rows * cols : 0.0),
+                 8.0 * (A->rows * cols + cols * cols));
+
+    if (status != EXIT_SUCCESS) {
+        free_matrix(AtA);
+        if (g) free_vector(g);
+        return NULL;
+    }
+
+    if (Atb) {
+        *Atb = g;
+    } else if (g) {
+        free_vector(g);
+    }
+    return AtA;
 }
 
 /**
  * @brief Swap two rows in a matrix
  * 
+ * Only the permutation index is updated, so a swap is O(1) no matter how many
+ * columns the matrix has. The index is created on the first swap.
+ * 
  * @param A The matrix who will have it's rows swapped
  * @param row_1 A row to swap with row_2
  * @param row_2 A row to swap with row_1
- * @return Matrix*
+ * @return void
  */
 void swap_rows(Matrix* A, size_t row_1, size_t row_2) {
     if (row_1 == row_2) {
         return;
     }
 
-    double* temp = A->data[row_1];
-    A->data[row_1] = A->data[row_2];
-    A->data[row_2] = temp;
+    if (A->perm == NULL) {
+        A->perm = (size_t*)malloc(A->rows * sizeof(size_t));
+        if (A->perm == NULL) {
+            fprintf(stderr, "Swap Rows: Unable to allocate the permutation index\n");
+            return;
+        }
+        for (size_t i = 0; i < A->rows; i++) {
+            A->perm[i] = i;
+        }
+    }
+
+    size_t temp = A->perm[row_1];
+    A->perm[row_1] = A->perm[row_2];
+    A->perm[row_2] = temp;
+}
+
+/**
+ * @struct Arguments shared by the threads eliminating one pivot column
+ *
+ * Every row except the pivot row gets the pivot row, scaled by the row's entry
+ * in the pivot column, subtracted from it. When inv is set the same operation
+ * is applied to it, as invert() needs.
+ */
+typedef struct EliminationTask {
+    Matrix* R;
+    Matrix* inv;
+    const double* pivot_row;
+    const double* pivot_inv_row;
+    size_t pivot;
+} EliminationTask;
+
+/**
+ * @brief parallel_for() body eliminating the pivot column from rows [begin, end)
+ */
+static void _eliminate_rows_task(size_t begin, size_t end, void* ctx) {
+    EliminationTask* task = (EliminationTask*)ctx;
+    size_t cols = task->R->cols;
+
+    for (size_t j = begin; j < end; j++) {
+        if (j == task->pivot) continue;
+
+        // Get the factor for zeroing out a row
+        double* row = matrix_row(task->R, j);
+        double factor = row[task->pivot];
+
+        for (size_t k = 0; k < cols; k++) {
+            row[k] -= (factor * task->pivot_row[k]);
+        }
+
+        if (task->inv != NULL) {
+            double* inv_row = matrix_row(task->inv, j);
+            for (size_t k = 0; k < cols; k++) {
+                inv_row[k] -= (factor * task->pivot_inv_row[k]);
+            }
+        }
+    }
 }
 
 /**
@@ -359,13 +915,13 @@ void swap_rows(Matrix* A, size_t row_1, size_t row_2) {
 Matrix* gauss_jordan_elimination(Matrix* A) {
     Matrix* R = copy_matrix(A);
     size_t diagonal_len = MIN(R->rows, R->cols);
-    printf("Performing gauss-jordan elimination...\n");
+    ML_TRACE_BEGIN(span, "gauss_jordan_elimination");
 
     // Work our way down the main diagonal. If the element in the current
     // main diagonal is 0, increase pivot to check the one below it
     for (size_t i = 0; i < diagonal_len; i++) {
         size_t pivot = i;
-        while (pivot < R->rows && R->data[pivot][i] == 0) {
+        while (pivot < R->rows && MAT_AT(R, pivot, i) == 0) {
             pivot++;
         }
 
@@ -379,98 +935,502 @@ Matrix* gauss_jordan_elimination(Matrix* A) {
         pivot = i;
 
         // Divide the current row by the value at the pivot cell
-        double pivot_val = R->data[i][i];
+        double* pivot_row = matrix_row(R, i);
+        double pivot_val = pivot_row[i];
         for (size_t j = 0; j < R->cols; j++) {
-            R->data[i][j] /= pivot_val;
+            pivot_row[j] /= pivot_val;
         }
         // Start at the top row, zeroing out the corresponding cell
         // If we're at the same row, skip it so we don't zero it out :)
-        for (size_t j = 0; j < R->rows; j++) {
-            if (j == i) continue;
+        // Every row is independent, so the threads share them out
+        EliminationTask task = { R, NULL, pivot_row, NULL, i };
+        parallel_for(0, R->rows, PARALLEL_MIN_WORK / (2 * R->cols + 1) + 1, _eliminate_rows_task, &task);
+    }
+
+    ML_TRACE_END(span, 2.0 * R->rows * diagonal_len * R->cols, 16.0 * R->rows * R->cols);
+    return R;
+}
+
+// Columns per LU panel, the inner dimension of the trailing gemm() update
+#define LU_BLOCK 64
+
+// Iterations of the condition number estimator
+#define LU_CONDITION_ITERATIONS 5
+
+/**
+ * @struct An LU factorization with partial pivoting, P * A = L * U
+ *
+ * L is unit lower triangular and U upper triangular, packed into one matrix
+ * with the unit diagonal of L left implicit. Row i of the factors is row
+ * pivots[i] of A.
+ */
+typedef struct LU {
+    Matrix* factors;
+    size_t* pivots;
+    double rcond;       // Estimate of 1 / (||A||_1 * ||A^-1||_1)
+} LU;
+
+/**
+ * @brief Free the memory an LU factorization is occupying
+ *
+ * @param lu A pointer to the factorization
+ * @return void
+ */
+void free_lu(LU* lu) {
+    if (lu == NULL) return;
+    if (lu->factors) free_matrix(lu->factors);
+    free(lu->pivots);
+    free(lu);
+}
 
-            // Get the factor for zeroing out a row
-            double factor = R->data[j][i];
+/**
+ * @brief Swap the contents of two physical rows
+ */
+static void _lu_swap_rows(double* a, size_t lda, size_t n, size_t r1, size_t r2) {
+    if (r1 == r2) return;
+    double* x = a + r1 * lda;
+    double* y = a + r2 * lda;
+    for (size_t j = 0; j < n; j++) {
+        double temp = x[j];
+        x[j] = y[j];
+        y[j] = temp;
+    }
+}
 
-            
-            for (size_t k = 0; k < R->cols; k++) {
-                R->data[j][k] -= (factor * R->data[i][k]);
+/**
+ * @brief Factor columns [k, k + nb) of a, unblocked, with partial pivoting
+ *
+ * Row exchanges are applied to whole rows, so the columns outside the panel
+ * stay consistent with the permutation.
+ *
+ * @return int EXIT_FAILURE if a pivot is no larger than tol
+ */
+static int _lu_panel(double* a, size_t lda, size_t n, size_t k, size_t nb,
+                     size_t* pivots, double tol) {
+    for (size_t j = k; j < k + nb; j++) {
+        size_t p = j;
+        for (size_t i = j + 1; i < n; i++) {
+            if (fabs(a[i * lda + j]) > fabs(a[p * lda + j])) p = i;
+        }
+        if (!(fabs(a[p * lda + j]) > tol)) {
+            return EXIT_FAILURE;
+        }
+
+        _lu_swap_rows(a, lda, n, j, p);
+        size_t temp = pivots[j];
+        pivots[j] = pivots[p];
+        pivots[p] = temp;
+
+        // Multipliers below the pivot, then a rank-1 update of the rest of the panel
+        const double* pivot_row = a + j * lda;
+        double inv_pivot = 1.0 / pivot_row[j];
+        for (size_t i = j + 1; i < n; i++) {
+            double* row = a + i * lda;
+            double l = (row[j] *= inv_pivot);
+            for (size_t c = j + 1; c < k + nb; c++) {
+                row[c] -= l * pivot_row[c];
             }
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @struct Arguments shared by the threads forming a block row of U
+ */
+typedef struct LuRowTask {
+    double* a;
+    size_t lda;
+    size_t k;
+    size_t nb;
+    size_t col_begin;
+} LuRowTask;
 
+/**
+ * @brief parallel_for() body computing U12 = L11^-1 * A12 for columns
+ * col_begin + [begin, end)
+ */
+static void _lu_row_task(size_t begin, size_t end, void* ctx) {
+    LuRowTask* task = (LuRowTask*)ctx;
+    size_t c0 = task->col_begin + begin;
+    size_t c1 = task->col_begin + end;
+
+    for (size_t i = task->k + 1; i < task->k + task->nb; i++) {
+        double* row = task->a + i * task->lda;
+        for (size_t p = task->k; p < i; p++) {
+            double l = row[p];
+            const double* u_p = task->a + p * task->lda;
+            for (size_t c = c0; c < c1; c++) {
+                row[c] -= l * u_p[c];
+            }
         }
     }
+}
 
-    printf("Done\n");
-    return R;
+/**
+ * @struct Arguments shared by the threads solving a diagonal block for
+ * several right hand sides
+ */
+typedef struct LuSolveTask {
+    const Matrix* factors;
+    Matrix* X;
+    size_t k;
+    size_t nb;
+    int upper;
+} LuSolveTask;
+
+/**
+ * @brief parallel_for() body solving the diagonal block of L, or of U, in
+ * place for columns [begin, end) of rows [k, k + nb) of X
+ */
+static void _lu_solve_task(size_t begin, size_t end, void* ctx) {
+    LuSolveTask* task = (LuSolveTask*)ctx;
+    const Matrix* F = task->factors;
+    Matrix* X = task->X;
+    size_t k = task->k;
+    size_t nb = task->nb;
+
+    if (!task->upper) {
+        for (size_t i = k + 1; i < k + nb; i++) {
+            const double* l_i = matrix_row(F, i);
+            double* x_i = matrix_row(X, i);
+            for (size_t p = k; p < i; p++) {
+                double l = l_i[p];
+                if (l == 0.0) continue;
+                const double* x_p = matrix_row(X, p);
+                for (size_t c = begin; c < end; c++) x_i[c] -= l * x_p[c];
+            }
+        }
+        return;
+    }
+
+    for (size_t i = k + nb; i-- > k; ) {
+        const double* u_i = matrix_row(F, i);
+        double* x_i = matrix_row(X, i);
+        for (size_t p = i + 1; p < k + nb; p++) {
+            double u = u_i[p];
+            if (u == 0.0) continue;
+            const double* x_p = matrix_row(X, p);
+            for (size_t c = begin; c < end; c++) x_i[c] -= u * x_p[c];
+        }
+        double inv_diag = 1.0 / u_i[i];
+        for (size_t c = begin; c < end; c++) x_i[c] *= inv_diag;
+    }
 }
 
 /**
- * @brief Compute the inverse of a matrix
- * 
- * @param A The matrix to invert. Must be nonsingular
- * @return Matrix*
+ * @brief Solve A * x = b, or At * x = b, for one right hand side in place
+ *
+ * @param lu The factorization of A
+ * @param x The right hand side, overwritten with the solution
+ * @param trans Nonzero to solve with At
+ * @param work Scratch space for n values
+ * @return void
  */
-Matrix* invert(Matrix* A) {
-    // We can check for non-singularity through two ways:
-    // 1. A must be square
+static void _lu_solve_vector(const LU* lu, double* x, int trans, double* work) {
+    const Matrix* F = lu->factors;
+    size_t n = F->rows;
+
+    if (!trans) {
+        for (size_t i = 0; i < n; i++) work[i] = x[lu->pivots[i]];
+        for (size_t i = 0; i < n; i++) {
+            work[i] -= simd_dot(matrix_row(F, i), work, i);
+        }
+        for (size_t i = n; i-- > 0; ) {
+            const double* u_i = matrix_row(F, i);
+            work[i] = (work[i] - simd_dot(u_i + i + 1, work + i + 1, n - i - 1)) / u_i[i];
+        }
+        memcpy(x, work, n * sizeof(double));
+        return;
+    }
+
+    // At = Ut * Lt * P. The rows of U and L are the columns of Ut and Lt, so
+    // each solved entry is pushed along its row
+    memcpy(work, x, n * sizeof(double));
+    for (size_t i = 0; i < n; i++) {
+        const double* u_i = matrix_row(F, i);
+        work[i] /= u_i[i];
+        for (size_t j = i + 1; j < n; j++) work[j] -= u_i[j] * work[i];
+    }
+    for (size_t i = n; i-- > 0; ) {
+        const double* l_i = matrix_row(F, i);
+        for (size_t j = 0; j < i; j++) work[j] -= l_i[j] * work[i];
+    }
+    for (size_t i = 0; i < n; i++) x[lu->pivots[i]] = work[i];
+}
+
+/**
+ * @brief Estimate ||A^-1||_1 from the factorization, Hager's method
+ *
+ * Each iteration costs two O(n^2) solves, far less than forming the inverse.
+ * The largest ||A^-1 x||_1 seen is kept, so the estimate never drops below
+ * that of an earlier iterate.
+ *
+ * @return double A lower bound on ||A^-1||_1, usually within a small factor
+ */
+static double _lu_inverse_norm_estimate(const LU* lu) {
+    size_t n = lu->factors->rows;
+    double* x = (double*)malloc(n * sizeof(double));
+    double* work = (double*)malloc(n * sizeof(double));
+    if (x == NULL || work == NULL) {
+        free(x);
+        free(work);
+        return 0.0;
+    }
 
+    for (size_t i = 0; i < n; i++) x[i] = 1.0 / (double)n;
+
+    // x is 1/n everywhere on the first pass and the unit vector e_j_prev
+    // after, which decides what z' * x is in the stopping test
+    double estimate = 0.0;
+    size_t j_prev = n;
+    for (int it = 0; it < LU_CONDITION_ITERATIONS; it++) {
+        _lu_solve_vector(lu, x, 0, work);
+        double norm = 0.0;
+        for (size_t i = 0; i < n; i++) {
+            norm += fabs(x[i]);
+            x[i] = (x[i] >= 0.0) ? 1.0 : -1.0;
+        }
+        if (norm > estimate) estimate = norm;
+
+        _lu_solve_vector(lu, x, 1, work);
+        size_t j = 0;
+        double zx = 0.0;
+        for (size_t i = 0; i < n; i++) {
+            if (fabs(x[i]) > fabs(x[j])) j = i;
+            zx += x[i];
+        }
+        zx = (j_prev == n) ? zx / (double)n : x[j_prev];
+        if (fabs(x[j]) <= zx || j == j_prev) break;
+
+        memset(x, 0, n * sizeof(double));
+        x[j] = 1.0;
+        j_prev = j;
+    }
+
+    free(x);
+    free(work);
+    return estimate;
+}
+
+/**
+ * @brief Compute the LU factorization of a square matrix with partial pivoting
+ *
+ * The factorization is blocked: each panel of LU_BLOCK columns is factored
+ * with row exchanges, the block row of U to its right is solved in parallel,
+ * and the trailing matrix is updated with gemm().
+ *
+ * @param A The n x n matrix to factor. It is not modified
+ *
+ * @return LU* The factorization, or NULL if A is not square or is singular
+ * @note The caller is responsible for freeing this memory using free_lu()
+ */
+LU* lu_decompose(Matrix* A) {
     if (A->rows != A->cols) {
-        fprintf(stderr, "A is not square\n");
+        fprintf(stderr, "LU: A is not square\n");
         return NULL;
     }
 
     size_t n = A->rows;
+    LU* lu = (LU*)calloc(1, sizeof(LU));
+    if (lu == NULL) return NULL;
+    lu->factors = copy_matrix(A);
+    lu->pivots = (size_t*)malloc((n + 1) * sizeof(size_t));
+    if (lu->factors == NULL || lu->pivots == NULL) {
+        fprintf(stderr, "LU: Unable to allocate the factors\n");
+        free_lu(lu);
+        return NULL;
+    }
+    for (size_t i = 0; i < n; i++) lu->pivots[i] = i;
+
+    double* a = lu->factors->data;
+    size_t lda = lu->factors->stride;
+
+    // ||A||_1 for the condition estimate, and the scale for the pivot tolerance
+    double norm_1 = 0.0;
+    double largest = 0.0;
+    for (size_t j = 0; j < n; j++) {
+        double column = 0.0;
+        for (size_t i = 0; i < n; i++) {
+            double v = fabs(a[i * lda + j]);
+            column += v;
+            if (v > largest) largest = v;
+        }
+        if (column > norm_1) norm_1 = column;
+    }
+    double tol = (double)n * DBL_EPSILON * largest;
 
-    // Create an identity matrix to turn into the inverse
-    Matrix* A_inv = create_empty_matrix(n, n);
-    for (size_t i = 0; i < n; i++) {
-        A_inv->data[i][i] = 1.0;
+    for (size_t k = 0; k < n; k += LU_BLOCK) {
+        size_t nb = MIN((size_t)LU_BLOCK, n - k);
+
+        if (_lu_panel(a, lda, n, k, nb, lu->pivots, tol) != EXIT_SUCCESS) {
+            fprintf(stderr, "LU: A is singular\n");
+            free_lu(lu);
+            return NULL;
+        }
+
+        size_t rest = n - k - nb;
+        if (rest == 0) break;
+
+        LuRowTask task = { a, lda, k, nb, k + nb };
+        parallel_for(0, rest, PARALLEL_MIN_WORK / (nb * nb + 1) + 1, _lu_row_task, &task);
+
+        // A22 -= L21 * U12
+        if (gemm(0, 0, rest, rest, nb, -1.0, a + (k + nb) * lda + k, lda,
+                 a + k * lda + k + nb, lda, 1.0, a + (k + nb) * lda + k + nb, lda) != EXIT_SUCCESS) {
+            free_lu(lu);
+            return NULL;
+        }
     }
 
-    // Every change to A must be made to B
-    // Copy A to not change it
-    Matrix* B = copy_matrix(A);
+    double inverse_norm = _lu_inverse_norm_estimate(lu);
+    lu->rcond = (norm_1 > 0.0 && inverse_norm > 0.0) ? 1.0 / (norm_1 * inverse_norm) : 0.0;
+    return lu;
+}
 
-    printf("Performing Matrix inversion...\n");
+/**
+ * @brief Solve A * X = B for any number of right hand sides
+ *
+ * Each right hand side costs O(n^2). The substitutions are blocked, so
+ * most of the work runs in gemm().
+ *
+ * @param lu The factorization of A from lu_decompose()
+ * @param B The n x k right hand sides
+ *
+ * @return Matrix* X, n x k, or NULL if the sizes do not match
+ * @note The caller is responsible for freeing this memory using free_matrix()
+ */
+Matrix* lu_solve_matrix(LU* lu, Matrix* B) {
+    size_t n = lu->factors->rows;
+    if (B->rows != n) {
+        fprintf(stderr, "LU Solve: The factors and right hand sides have incompatible sizes\n");
+        return NULL;
+    }
 
-    // We do not need a diagonal length, as we know our matrix is square
+    Matrix* X = create_empty_matrix(n, B->cols);
+    if (X == NULL) return NULL;
     for (size_t i = 0; i < n; i++) {
-        size_t pivot = i;
-        while (pivot < n && A->data[pivot][i] == 0) {
-            pivot++;
-        }
+        memcpy(matrix_row(X, i), matrix_row(B, lu->pivots[i]), B->cols * sizeof(double));
+    }
 
-        if (pivot == n) {
-            continue;
+    // Blocked substitution: the part of each block row that depends on the
+    // rows already solved is one gemm(), leaving only a small triangle
+    const Matrix* F = lu->factors;
+    size_t m = B->cols;
+    size_t grain = PARALLEL_MIN_WORK / ((size_t)LU_BLOCK * LU_BLOCK + 1) + 1;
+    for (size_t k = 0; k < n; k += LU_BLOCK) {
+        size_t nb = MIN((size_t)LU_BLOCK, n - k);
+        if (k > 0 && gemm(0, 0, nb, m, k, -1.0, matrix_row(F, k), F->stride,
+                          X->data, X->stride, 1.0, matrix_row(X, k), X->stride) != EXIT_SUCCESS) {
+            free_matrix(X);
+            return NULL;
         }
+        LuSolveTask task = { F, X, k, nb, 0 };
+        parallel_for(0, m, grain, _lu_solve_task, &task);
+    }
 
-        swap_rows(B, i, pivot);
-        swap_rows(A_inv, i, pivot);
-        pivot = i;
-        
-        // Normalize our row, every element on the main diagonal should be value 1.0
-        // Apply the same to the inverse matrix
-        double pivot_val = B->data[i][i];
-        for (size_t j = 0; j < B->cols; j++) {
-            B->data[i][j] /= pivot_val;
-            A_inv->data[i][j] /= pivot_val;
+    size_t blocks = (n + LU_BLOCK - 1) / LU_BLOCK;
+    for (size_t b = blocks; b-- > 0; ) {
+        size_t k = b * LU_BLOCK;
+        size_t nb = MIN((size_t)LU_BLOCK, n - k);
+        if (k + nb < n && gemm(0, 0, nb, m, n - k - nb, -1.0, matrix_row(F, k) + k + nb, F->stride,
+                               matrix_row(X, k + nb), X->stride, 1.0, matrix_row(X, k), X->stride) != EXIT_SUCCESS) {
+            free_matrix(X);
+            return NULL;
         }
+        LuSolveTask task = { F, X, k, nb, 1 };
+        parallel_for(0, m, grain, _lu_solve_task, &task);
+    }
+    return X;
+}
 
-        // Starting at the top row, zero out every cell in the same column as
-        // our pivot cell and apply the zeroing out operation across the row.
-        // Of course if we're on the same row as our pivot, skip it.
-        for (size_t j = 0; j < B->cols; j++) {
-            if (j == i) continue;
-
-            // Get the factor for zeroing out a cell
-            double factor = B->data[j][i];
-            for (size_t k = 0; k < B->cols; k++) {
-                B->data[j][k] -= (factor * B->data[i][k]);
-                A_inv->data[j][k] -= (factor * A_inv->data[i][k]);
-            }
+/**
+ * @brief Solve A * x = b for one right hand side, in O(n^2)
+ *
+ * @param lu The factorization of A from lu_decompose()
+ * @param b The right hand side
+ *
+ * @return Vector* x, or NULL if the sizes do not match
+ * @note The caller is responsible for freeing this memory using free_vector()
+ */
+Vector* lu_solve(LU* lu, Vector* b) {
+    size_t n = lu->factors->rows;
+    if (b->rows != n) {
+        fprintf(stderr, "LU Solve: The factors and vector have incompatible sizes\n");
+        return NULL;
+    }
+
+    Vector* x = create_empty_vector(n);
+    double* work = (double*)malloc((n + 1) * sizeof(double));
+    if (x == NULL || work == NULL) {
+        if (x) free_vector(x);
+        free(work);
+        return NULL;
+    }
+
+    memcpy(x->data, b->data, n * sizeof(double));
+    _lu_solve_vector(lu, x->data, 0, work);
+    free(work);
+    return x;
+}
+
+/**
+ * @brief Compute the inverse of a matrix
+ * 
+ * Solves A * X = I through lu_decompose().
+ * 
+ * @param A The matrix to invert. Must be nonsingular
+ * @return Matrix*, or NULL if A is not square or is singular
+ * @note The caller is responsible for freeing this memory using free_matrix()
+ */
+Matrix* invert(Matrix* A) {
+    ML_TRACE_BEGIN(span, "invert");
+
+    size_t n = A->rows;
+    Matrix* A_inv = NULL;
+    LU* lu = lu_decompose(A);
+    Matrix* I = lu ? create_empty_matrix(n, n) : NULL;
+    if (I != NULL) {
+        for (size_t i = 0; i < n; i++) {
+            MAT_AT(I, i, i) = 1.0;
         }
+        A_inv = lu_solve_matrix(lu, I);
+        free_matrix(I);
     }
+    if (lu) free_lu(lu);
 
-    printf("Done\n");
-    free_matrix(B);
+    ML_TRACE_END(span, 2.0 * n * n * n, 16.0 * n * n);
     return A_inv;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Solve the square system A * x = b
+ *
+ * Factors A with partial pivoting through lu_decompose(). Works for any
+ * nonsingular A, unlike the Cholesky solver which needs A to be symmetric
+ * positive definite. To solve several systems with the same A, factor it
+ * once and call lu_solve() for each.
+ *
+ * @param A The n x n matrix. It is not modified
+ * @param b The right hand side
+ *
+ * @return Vector* x, or NULL if the sizes do not match or A is singular
+ * @note The caller is responsible for freeing this memory using free_vector()
+ */
+Vector* solve_linear_system(Matrix* A, Vector* b) {
+    if (A->rows != A->cols || A->rows != b->rows) {
+        fprintf(stderr, "Solve: A must be square and match the size of b\n");
+        return NULL;
+    }
+
+    LU* lu = lu_decompose(A);
+    if (lu == NULL) {
+        return NULL;
+    }
+
+    Vector* x = lu_solve(lu, b);
+    free_lu(lu);
+    return x;
+}
+
+#endif
@@ -0,0 +1,370 @@
+#ifndef QR_H
+#define QR_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+#include "matrix.h"
+
+/**
+ * Blocked Householder QR factorization, A = Q * R.
+ *
+ * The columns are factored QR_BLOCK at a time. Within a panel each column
+ * gets a Householder reflector H = I - tau * v * vt that zeroes it below the
+ * diagonal. The panel's reflectors are then combined into the compact WY form
+ * H_1 * ... * H_nb = I - V * T * Vt, with T upper triangular, so the rest of
+ * the matrix is updated with two gemm() calls instead of nb rank-1 updates.
+ *
+ * The factorization is stored LAPACK style: R on and above the diagonal, and
+ * each v below the diagonal of its column with its leading 1 left implicit.
+ */
+
+// Columns per panel, the inner dimension of the trailing gemm() updates
+#define QR_BLOCK 32
+
+/**
+ * @brief Store the rows of a permuted matrix in their logical order
+ *
+ * The QR kernels work on the raw row-major buffer, so a pending permutation
+ * from swap_rows() is applied first. The rows are moved within A's own
+ * buffer one cycle of the permutation at a time, so a matrix from an arena or
+ * a mapped file keeps its storage and needs only one row of scratch space.
+ *
+ * @return int The resulting status code
+ */
+static int _qr_unpermute(Matrix* A) {
+    if (A->perm == NULL) return EXIT_SUCCESS;
+
+    double* row = (double*)malloc(A->cols * sizeof(double));
+    if (row == NULL) {
+        fprintf(stderr, "QR: Unable to allocate a row to reorder A\n");
+        return EXIT_FAILURE;
+    }
+
+    // Physical row i takes the row at perm[i]. A finished row is marked perm[i] = i
+    size_t bytes = A->cols * sizeof(double);
+    for (size_t start = 0; start < A->rows; start++) {
+        if (A->perm[start] == start) continue;
+        memcpy(row, A->data + start * A->stride, bytes);
+        size_t i = start;
+        while (A->perm[i] != start) {
+            size_t next = A->perm[i];
+            memcpy(A->data + i * A->stride, A->data + next * A->stride, bytes);
+            A->perm[i] = i;
+            i = next;
+        }
+        memcpy(A->data + i * A->stride, row, bytes);
+        A->perm[i] = i;
+    }
+
+    free(row);
+    free(A->perm);
+    A->perm = NULL;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Factor the m x nb panel at A, unblocked
+ *
+ * Each column takes two passes over the rows below the diagonal. The first
+ * finds the column's norm together with its dot products with the columns to
+ * its right, which is all the reflector and its update need. The second
+ * scales the column into v and applies the update.
+ *
+ * @param A The panel's top left entry, leading dimension lda
+ * @param lda The leading dimension
+ * @param m Rows in the panel
+ * @param nb Columns in the panel
+ * @param tau Where to store the nb reflector scales
+ * @param w Scratch space for 2 * nb values
+ * @return void
+ */
+static void _qr_panel(double* A, size_t lda, size_t m, size_t nb, double* tau, double* w) {
+    double* y = w + nb;
+
+    for (size_t j = 0; j < nb; j++) {
+        size_t rest = nb - j - 1;
+        double alpha = A[j * lda + j];
+        double xnorm2 = 0.0;
+        memset(y, 0, rest * sizeof(double));
+        for (size_t i = j + 1; i < m; i++) {
+            const double* a_i = A + i * lda + j;
+            double x_i = a_i[0];
+            xnorm2 += x_i * x_i;
+            for (size_t p = 0; p < rest; p++) y[p] += x_i * a_i[p + 1];
+        }
+
+        if (xnorm2 == 0.0) {
+            tau[j] = 0.0;
+            continue;
+        }
+
+        // H * [alpha; x] = [beta; 0] with v = [1; x / (alpha - beta)]
+        double beta = -copysign(sqrt(alpha * alpha + xnorm2), alpha);
+        double t = (beta - alpha) / beta;
+        double scale = 1.0 / (alpha - beta);
+        tau[j] = t;
+        A[j * lda + j] = beta;
+
+        // w = vt * C for the columns right of j, then C -= tau * v * wt
+        double* row_j = A + j * lda + j + 1;
+        for (size_t p = 0; p < rest; p++) {
+            w[p] = row_j[p] + scale * y[p];
+            row_j[p] -= t * w[p];
+        }
+        for (size_t i = j + 1; i < m; i++) {
+            double* a_i = A + i * lda + j;
+            a_i[0] *= scale;
+            double f = t * a_i[0];
+            for (size_t p = 0; p < rest; p++) a_i[p + 1] -= f * w[p];
+        }
+    }
+}
+
+/**
+ * @brief Build the triangular factor T of a panel's block reflector
+ *
+ * @param V The factored panel, m x nb with leading dimension nb. Its upper
+ * triangle is overwritten with the unit diagonal and zeros, so gemm() can use
+ * it as is
+ * @param m Rows in the panel
+ * @param nb Columns in the panel
+ * @param tau The panel's reflector scales
+ * @param T Where to store the nb x nb factor
+ * @param G Scratch space for nb x nb values
+ * @return int The resulting status code
+ */
+static int _qr_block_reflector(double* V, size_t m, size_t nb, const double* tau, double* T, double* G) {
+    for (size_t i = 0; i < nb; i++) {
+        for (size_t j = i; j < nb; j++) {
+            V[i * nb + j] = (i == j) ? 1.0 : 0.0;
+        }
+    }
+
+    // T, column by column: T[0:j, j] = -tau_j * T[0:j, 0:j] * V[:, 0:j]t * v_j.
+    // The dot products of the columns of V come from one gemm(), G = Vt * V
+    if (gemm(1, 0, nb, nb, m, 1.0, V, nb, V, nb, 0.0, G, nb) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    memset(T, 0, nb * nb * sizeof(double));
+    for (size_t j = 0; j < nb; j++) {
+        T[j * nb + j] = tau[j];
+        if (tau[j] == 0.0) continue;
+
+        for (size_t p = 0; p < j; p++) {
+            double sum = 0.0;
+            for (size_t q = p; q < j; q++) sum += T[p * nb + q] * G[q * nb + j];
+            T[p * nb + j] = -tau[j] * sum;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Apply a block reflector I - V * T * Vt, or its transpose, to C
+ *
+ * @param V The m x nb reflector vectors from _qr_block_reflector()
+ * @param m Rows in V and C
+ * @param nb Columns in V
+ * @param T The nb x nb triangular factor
+ * @param trans Nonzero to apply the transpose, I - V * Tt * Vt
+ * @param C The m x nc matrix to update, leading dimension ldc
+ * @param ldc The leading dimension
+ * @param nc Columns in C
+ * @param W Scratch space for nb x nc values
+ * @return int The resulting status code
+ */
+static int _qr_apply_block(const double* V, size_t m, size_t nb, const double* T, int trans,
+                           double* C, size_t ldc, size_t nc, double* W) {
+    if (gemm(1, 0, nb, nc, m, 1.0, V, nb, C, ldc, 0.0, W, nc) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    // W = op(T) * W in place. Row p of Tt * W only needs rows 0..p of W, so
+    // that works upwards; row p of T * W only needs rows p.., so that works down
+    for (size_t step = 0; step < nb; step++) {
+        size_t p = trans ? nb - 1 - step : step;
+        double* w_p = W + p * nc;
+        double t_pp = T[p * nb + p];
+        for (size_t c = 0; c < nc; c++) w_p[c] *= t_pp;
+
+        size_t q_begin = trans ? 0 : p + 1;
+        size_t q_end = trans ? p : nb;
+        for (size_t q = q_begin; q < q_end; q++) {
+            double t = trans ? T[q * nb + p] : T[p * nb + q];
+            if (t == 0.0) continue;
+            const double* w_q = W + q * nc;
+            for (size_t c = 0; c < nc; c++) w_p[c] += t * w_q[c];
+        }
+    }
+
+    return gemm(0, 0, m, nc, nb, -1.0, V, nb, W, nc, 1.0, C, ldc);
+}
+
+/**
+ * @brief Compute the QR factorization of a matrix in place
+ *
+ * @param A The m x n matrix to factor, m >= n. It is overwritten with R and
+ * the Householder vectors
+ * @param tau The n reflector scales
+ *
+ * @return int The resulting status code
+ */
+int qr_decompose(Matrix* A, Vector* tau) {
+    size_t m = A->rows;
+    size_t n = A->cols;
+    if (m < n || tau->rows != n) {
+        fprintf(stderr, "QR: A must have at least as many rows as columns, and tau one entry per column\n");
+        return EXIT_FAILURE;
+    }
+    if (_qr_unpermute(A) != EXIT_SUCCESS) return EXIT_FAILURE;
+
+    size_t nb_max = MIN((size_t)QR_BLOCK, n);
+    double* V = (double*)malloc(m * nb_max * sizeof(double));
+    double* T = (double*)malloc(nb_max * nb_max * sizeof(double));
+    double* W = (double*)malloc((nb_max * n + 2 * nb_max) * sizeof(double));
+    if (V == NULL || T == NULL || W == NULL) {
+        fprintf(stderr, "QR: Unable to allocate workspace\n");
+        free(V);
+        free(T);
+        free(W);
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_SUCCESS;
+    size_t lda = A->stride;
+    for (size_t k = 0; k < n && status == EXIT_SUCCESS; k += QR_BLOCK) {
+        size_t nb = MIN((size_t)QR_BLOCK, n - k);
+        double* panel = A->data + k * lda + k;
+
+        // The panel is factored in a dense copy, which keeps its rows contiguous
+        for (size_t i = 0; i < m - k; i++) {
+            memcpy(V + i * nb, panel + i * lda, nb * sizeof(double));
+        }
+        _qr_panel(V, nb, m - k, nb, tau->data + k, W);
+        for (size_t i = 0; i < m - k; i++) {
+            memcpy(panel + i * lda, V + i * nb, nb * sizeof(double));
+        }
+
+        if (k + nb < n) {
+            // Qt for this panel, applied to every column right of it
+            status = _qr_block_reflector(V, m - k, nb, tau->data + k, T, W);
+            if (status == EXIT_SUCCESS) {
+                status = _qr_apply_block(V, m - k, nb, T, 1, panel + nb, lda, n - k - nb, W);
+            }
+        }
+    }
+
+    free(V);
+    free(T);
+    free(W);
+    return status;
+}
+
+/**
+ * @brief Compute Qt * b for a matrix factored by qr_decompose()
+ *
+ * @param QR The factored matrix
+ * @param tau Its reflector scales
+ * @param b The vector to transform, overwritten with Qt * b
+ * @return void
+ */
+void qr_apply_qt(Matrix* QR, Vector* tau, Vector* b) {
+    size_t m = QR->rows;
+    size_t lda = QR->stride;
+    const double* a = QR->data;
+
+    for (size_t j = 0; j < QR->cols; j++) {
+        if (tau->data[j] == 0.0) continue;
+
+        double s = b->data[j];
+        for (size_t i = j + 1; i < m; i++) s += a[i * lda + j] * b->data[i];
+        s *= tau->data[j];
+
+        b->data[j] -= s;
+        for (size_t i = j + 1; i < m; i++) b->data[i] -= s * a[i * lda + j];
+    }
+}
+
+/**
+ * @brief Compute Q * C for a matrix factored by qr_decompose()
+ *
+ * The reflectors are applied a panel at a time, last panel first, through the
+ * same block reflectors the factorization used.
+ *
+ * @param QR The factored m x n matrix
+ * @param tau Its reflector scales
+ * @param C An m x k matrix, overwritten with Q * C
+ * @return int The resulting status code
+ */
+int qr_apply_q(Matrix* QR, Vector* tau, Matrix* C) {
+    size_t m = QR->rows;
+    size_t n = QR->cols;
+    if (C->rows != m || C->perm != NULL) {
+        fprintf(stderr, "QR: Q and C have incompatible sizes\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t nb_max = MIN((size_t)QR_BLOCK, n);
+    size_t w_cols = C->cols > nb_max ? C->cols : nb_max;
+    double* V = (double*)malloc(m * nb_max * sizeof(double));
+    double* T = (double*)malloc(nb_max * nb_max * sizeof(double));
+    double* W = (double*)malloc(nb_max * w_cols * sizeof(double));
+    if (V == NULL || T == NULL || W == NULL) {
+        fprintf(stderr, "QR: Unable to allocate workspace\n");
+        free(V);
+        free(T);
+        free(W);
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_SUCCESS;
+    size_t n_panels = (n + QR_BLOCK - 1) / QR_BLOCK;
+    for (size_t panel_index = n_panels; panel_index-- > 0 && status == EXIT_SUCCESS; ) {
+        size_t k = panel_index * QR_BLOCK;
+        size_t nb = MIN((size_t)QR_BLOCK, n - k);
+
+        const double* panel = QR->data + k * QR->stride + k;
+        for (size_t i = 0; i < m - k; i++) {
+            memcpy(V + i * nb, panel + i * QR->stride, nb * sizeof(double));
+        }
+        status = _qr_block_reflector(V, m - k, nb, tau->data + k, T, W);
+        if (status == EXIT_SUCCESS) {
+            status = _qr_apply_block(V, m - k, nb, T, 0, matrix_row(C, k), C->stride, C->cols, W);
+        }
+    }
+
+    free(V);
+    free(T);
+    free(W);
+    return status;
+}
+
+/**
+ * @brief Form the first k columns of Q for a matrix factored by qr_decompose()
+ *
+ * @param QR The factored m x n matrix
+ * @param tau Its reflector scales
+ * @param k The number of columns to form, at most m
+ *
+ * @return Matrix* The m x k matrix with orthonormal columns, or NULL on failure
+ * @note The caller is responsible for freeing this memory using free_matrix()
+ */
+Matrix* qr_form_q(Matrix* QR, Vector* tau, size_t k) {
+    Matrix* Q = create_empty_matrix(QR->rows, k);
+    if (Q == NULL) return NULL;
+    for (size_t i = 0; i < k && i < QR->rows; i++) {
+        MAT_AT(Q, i, i) = 1.0;
+    }
+
+    if (qr_apply_q(QR, tau, Q) != EXIT_SUCCESS) {
+        free_matrix(Q);
+        return NULL;
+    }
+    return Q;
+}
+
+#endif
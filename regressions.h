@@ -5,6 +5,86 @@
 #include <math.h>
 
 #include "matrix.h"
+#include "cholesky.h"
+#include "qr.h"
+#include "svd.h"
+#include "stream.h"
+#include "sparse.h"
+
+// Rows read and accumulated at a time by ols_streaming()
+#define OLS_STREAM_CHUNK_ROWS 4096
+
+// Refinement steps ols_mixed() takes before falling back to double
+#define OLS_MIXED_MAX_REFINEMENTS 10
+
+// Rows predict_streaming() reads, predicts and writes at a time
+#define PREDICT_CHUNK_ROWS 8192
+
+// Bytes of text one prediction may take, "%.17g" and a newline
+#define PREDICT_CSV_SLOT 32
+
+// Rows the metrics kernel sums in a plain loop before a compensated add
+#define METRICS_BLOCK_ROWS 1024
+
+// Independent partial sums the metrics kernel keeps per quantity
+#define METRICS_LANES 8
+
+/**
+ * @brief Solve the normal equations AtA * x = Atb
+ *
+ * AtA is factored with diagonal pivoting through cholesky_pivoted(), which
+ * finds the numerical rank of AtA, and so of A, as it goes. No separate rank
+ * test is needed before calling this.
+ *
+ * @param AtA The n x n Gram matrix
+ * @param Atb The n x 1 right hand side
+ * @param rank Set to the numerical rank of AtA, if not NULL
+ *
+ * @return Vector* x, or NULL if AtA is rank deficient
+ * @note The caller is reponsible for freeing this memory using free_vector()
+ */
+Vector* solve_normal_equations(Matrix* AtA, Vector* Atb, size_t* rank) {
+    PivotedCholesky* chol = cholesky_pivoted(AtA);
+    if (chol == NULL) return NULL;
+
+    if (rank) *rank = chol->rank;
+    Vector* x = NULL;
+    if (chol->rank == AtA->rows) {
+        x = cholesky_pivoted_solve(chol, Atb);
+    }
+
+    free_pivoted_cholesky(chol);
+    return x;
+}
+
+/**
+ * @brief Compute the Ordinary Least Squares Regression by pseudoinverse
+ *
+ * x_hat = pinv(A) * b through the SVD of A. Singular values below the
+ * default cutoff count as zero, so a rank deficient A still gets the
+ * minimum norm least squares solution.
+ *
+ * @param A An m x n matrix of observations
+ * @param b An m x 1 vector of target observations
+ *
+ * @return Vector* x_hat, an n x 1 vector
+ * @note The caller is reponsible for freeing this memory using free_vector()
+ */
+Vector* ols_pinv(Matrix* A, Vector* b) {
+    ML_TRACE_BEGIN(span, "ols_pinv");
+
+    size_t rank = 0;
+    Vector* x_hat = pinv_solve(A, b, 0.0, &rank);
+    if (x_hat != NULL && rank < A->cols) {
+        fprintf(stderr, "A has rank %zu of %zu columns, returning the minimum norm solution.\n",
+                rank, A->cols);
+    }
+
+    // A one-sided Jacobi SVD, counted as a thin SVD
+    ML_TRACE_END(span, 4.0 * A->rows * A->cols * A->cols + 8.0 * A->cols * A->cols * A->cols,
+                 8.0 * A->rows * (A->cols + 1));
+    return x_hat;
+}
 
 /**
  * @brief Compute the Ordinary Least Squares Regression
@@ -12,43 +92,1826 @@
  * @param A An m x n matrix of observations
  * @param b An m x 1 vector of target observations
  * 
- * @return Vector* x_hat, an m x 1 vector
+ * @return Vector* x_hat, an n x 1 vector
  * @note The caller is reponsible for freeing this memory using free_vector()
  * 
- * A must have full column rank to have a unique solution
+ * A must have full column rank to have a unique solution. Otherwise the
+ * minimum norm solution from ols_pinv() is returned
  */
 Vector* ols(Matrix* A, Vector* b) {
     size_t rows = A->rows;
     size_t cols = A->cols;
 
-    // Test to make sure A has full column rank
-    Matrix* R = gauss_jordan_elimination(A);
-    for(size_t i = 0; i < MIN(rows, cols); i++) {
-        if (fabs(R->data[i][i]) < 1e-9) {
+    // A wide A can never have full column rank
+    if (rows < cols) {
+        fprintf(stderr, "A does not have full column rank, using the pseudoinverse.\n");
+        return ols_pinv(A, b);
+    }
+
+    ML_TRACE_BEGIN(span, "ols");
+
+    // Calculate OLS from the normal equations AtA * x = Atb, both formed in
+    // one pass over A. The factorization reports the rank of A as it solves
+    size_t rank = cols;
+    Vector* Atb = NULL;
+    Matrix* AtA = gram_matrix(A, b, &Atb);
+    Vector* x_hat = AtA ? solve_normal_equations(AtA, Atb, &rank) : NULL;
+
+    if (Atb) free_vector(Atb);
+    if (AtA) free_matrix(AtA);
+    ML_TRACE_END(span, (double)rows * cols * cols + (double)cols * cols * cols / 3.0, 8.0 * rows * (cols + 1));
+
+    if (x_hat == NULL) {
+        fprintf(stderr, "A has numerical rank %zu of %zu columns, using the pseudoinverse.\n", rank, cols);
+        return ols_pinv(A, b);
+    }
+    return x_hat;
+}
+
+/**
+ * @brief Solve AtA * x = Atb by a float Cholesky factor refined in double
+ *
+ * Falls back to the double factorization when the float one fails or the
+ * refinement stalls.
+ *
+ * @param AtA The n x n Gram matrix
+ * @param Atb The n x 1 right hand side
+ * @return Vector*, or NULL if AtA is numerically singular or memory ran out
+ */
+static Vector* _ols_mixed_solve(Matrix* AtA, Vector* Atb) {
+    size_t cols = AtA->cols;
+    Vector* x_hat = create_empty_vector(cols);
+    Vector* r = create_empty_vector(cols);
+    float* L = (float*)malloc((cols * cols + 1) * sizeof(float));
+    float* d = (float*)malloc((cols + 1) * sizeof(float));
+    int converged = 0;
+
+    if (x_hat && r && L && d) {
+        // The float factor only needs the lower triangle
+        double norm_AtA = 0.0;
+        for (size_t i = 0; i < cols; i++) {
+            const double* row = matrix_row(AtA, i);
+            double row_sum = 0.0;
+            for (size_t j = 0; j < cols; j++) {
+                if (j <= i) L[i * cols + j] = (float)row[j];
+                row_sum += fabs(row[j]);
+            }
+            if (row_sum > norm_AtA) norm_AtA = row_sum;
+        }
+
+        if (_cholesky_factor_f(L, cols, cols) == EXIT_SUCCESS) {
+            // r starts as Atb, so the first pass is the plain float solve
+            memcpy(r->data, Atb->data, cols * sizeof(double));
+            for (int step = 0; step <= OLS_MIXED_MAX_REFINEMENTS; step++) {
+                if (step > 0) {
+                    matrix_vector_product_into(AtA, x_hat, r);
+                    double norm_r = 0.0, norm_x = 0.0;
+                    for (size_t i = 0; i < cols; i++) {
+                        r->data[i] = Atb->data[i] - r->data[i];
+                        norm_r = fmax(norm_r, fabs(r->data[i]));
+                        norm_x = fmax(norm_x, fabs(x_hat->data[i]));
+                    }
+                    if (norm_r <= sqrt((double)cols) * DBL_EPSILON * norm_AtA * norm_x) {
+                        converged = 1;
+                        break;
+                    }
+                }
+
+                for (size_t i = 0; i < cols; i++) d[i] = (float)r->data[i];
+                _cholesky_substitute_f(L, cols, cols, d);
+                for (size_t i = 0; i < cols; i++) x_hat->data[i] += (double)d[i];
+            }
+        }
+    }
+
+    free(L);
+    free(d);
+    if (r) free_vector(r);
+
+    if (!converged) {
+        fprintf(stderr, "Mixed precision refinement did not converge, solving in double.\n");
+        if (x_hat) free_vector(x_hat);
+        size_t rank = cols;
+        x_hat = solve_normal_equations(AtA, Atb, &rank);
+        if (x_hat == NULL) {
+            fprintf(stderr, "A has numerical rank %zu of %zu columns, using the pseudoinverse.\n", rank, cols);
+        }
+    }
+
+    return x_hat;
+}
+
+/**
+ * @brief Compute the Ordinary Least Squares Regression in mixed precision
+ *
+ * AtA and Atb are formed in double, then AtA is factored in float, which runs
+ * the n^3 / 3 flops of the factorization at twice the SIMD width. The float
+ * solution is refined in double:
+ *   r = Atb - AtA * x, solve AtA * d = r with the float factor, x += d
+ * Each step shrinks the error by about cond(AtA) * FLT_EPSILON, so while AtA
+ * is well conditioned for float the result is as accurate as the double
+ * solve. If the float factorization fails or the refinement stalls, the
+ * double path of ols() takes over.
+ *
+ * @param A An m x n matrix of observations
+ * @param b An m x 1 vector of target observations
+ *
+ * @return Vector* x_hat, an n x 1 vector
+ * @note The caller is reponsible for freeing this memory using free_vector()
+ */
+Vector* ols_mixed(Matrix* A, Vector* b) {
+    size_t cols = A->cols;
+    if (A->rows < cols) {
+        return ols(A, b);
+    }
+
+    ML_TRACE_BEGIN(span, "ols_mixed");
+
+    Vector* Atb = NULL;
+    Matrix* AtA = gram_matrix(A, b, &Atb);
+    int formed = AtA != NULL;
+    Vector* x_hat = formed ? _ols_mixed_solve(AtA, Atb) : NULL;
+
+    if (Atb) free_vector(Atb);
+    if (AtA) free_matrix(AtA);
+    ML_TRACE_END(span, (double)A->rows * cols * cols + (double)cols * cols * cols / 3.0, 8.0 * A->rows * (cols + 1));
+
+    if (x_hat == NULL && formed) {
+        return ols_pinv(A, b);
+    }
+    return x_hat;
+}
+
+/**
+ * @brief The arena space ols_into() needs for a matrix with cols columns
+ *
+ * @param cols The number of columns of A
+ * @return size_t The number of bytes
+ */
+size_t ols_workspace_bytes(size_t cols) {
+    size_t per_line = MATRIX_ALIGNMENT / sizeof(double);
+    size_t stride = (cols + per_line - 1) / per_line * per_line;
+    size_t bytes = sizeof(Matrix) + cols * stride * sizeof(double)  // AtA, factored in place
+                 + sizeof(Vector) + cols * sizeof(double)           // Atb
+                 + cols * sizeof(size_t) + 2 * cols * sizeof(double) // Pivots and scratch
+                 + gram_workspace_bytes(cols, stride);              // The threads' copies of AtA
+    return bytes + 7 * ARENA_ALIGNMENT;
+}
+
+/**
+ * @brief Compute the Ordinary Least Squares Regression into storage the
+ * caller provides
+ *
+ * Solves the same normal equations as ols(), but AtA, Atb, the threads'
+ * private copies of AtA and the scratch space of the factorization are taken
+ * from the arena and given back before returning. Refitting many models of
+ * full column rank from one arena therefore costs no malloc. Nothing is
+ * printed on success.
+ *
+ * Two cases do allocate: rows swapped through swap_rows() are copied into
+ * row order first, and if A is rank deficient the minimum norm solution from
+ * ols_pinv() is copied into x_hat.
+ *
+ * The arena size depends on the thread count, so size it after
+ * ml_set_num_threads().
+ *
+ * @param A An m x n matrix of observations
+ * @param b An m x 1 vector of target observations
+ * @param x_hat An n x 1 vector to hold the solution
+ * @param arena Holds at least ols_workspace_bytes(n) free bytes
+ *
+ * @return int The resulting status code
+ */
+int ols_into(Matrix* A, Vector* b, Vector* x_hat, Arena* arena) {
+    size_t rows = A->rows;
+    size_t cols = A->cols;
+    if (b->rows != rows || x_hat->rows != cols) {
+        fprintf(stderr, "A, b and x_hat have incompatible sizes.\n");
+        return EXIT_FAILURE;
+    }
+
+    // A wide A can never have full column rank
+    size_t rank = 0;
+    if (rows >= cols) {
+        size_t mark = arena->used;
+        Matrix* AtA = arena_matrix(arena, cols, cols);
+        Vector* Atb = arena_vector(arena, cols);
+        size_t* pivots = (size_t*)arena_alloc(arena, cols * sizeof(size_t));
+        double* scratch = (double*)arena_alloc(arena, 2 * cols * sizeof(double));
+        size_t copies_bytes = gram_workspace_bytes(cols, AtA ? AtA->stride : cols);
+        double* copies = copies_bytes ? (double*)arena_alloc(arena, copies_bytes) : NULL;
+        if (AtA == NULL || Atb == NULL || pivots == NULL || scratch == NULL || (copies_bytes && copies == NULL)) {
+            fprintf(stderr, "OLS: The arena needs %zu free bytes.\n", ols_workspace_bytes(cols));
+            arena_release(arena, mark);
+            return EXIT_FAILURE;
+        }
+
+        Matrix* A_ordered = A->perm ? copy_matrix(A) : A;
+        int status = EXIT_FAILURE;
+        if (A_ordered != NULL) {
+            status = gram_accumulate_workspace(A_ordered->data, A_ordered->stride, rows, cols,
+                                               b->data, AtA->data, AtA->stride, Atb->data, copies);
+        }
+        if (A_ordered && A_ordered != A) free_matrix(A_ordered);
+
+        // The factorization reads the lower triangle and reports the rank as it goes
+        if (status == EXIT_SUCCESS) {
+            mirror_upper_triangle(AtA);
+            rank = _cholesky_pivoted_factor(AtA->data, AtA->stride, cols, pivots, scratch);
+            if (rank == cols) {
+                _cholesky_pivoted_substitute(AtA->data, AtA->stride, cols, rank, pivots,
+                                             Atb->data, x_hat->data, scratch + cols);
+            }
+        }
+        arena_release(arena, mark);
+
+        if (status != EXIT_SUCCESS) return EXIT_FAILURE;
+        if (rank == cols) return EXIT_SUCCESS;
+    }
+
+    if (rows < cols) {
+        fprintf(stderr, "A does not have full column rank, using the pseudoinverse.\n");
+    } else {
+        fprintf(stderr, "A has numerical rank %zu of %zu columns, using the pseudoinverse.\n", rank, cols);
+    }
+    Vector* x = ols_pinv(A, b);
+    if (x == NULL) return EXIT_FAILURE;
+    memcpy(x_hat->data, x->data, cols * sizeof(double));
+    free_vector(x);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Solve for x from A's QR factors as R * x = Qt * b
+ *
+ * @param A The QR factors from qr_decompose()
+ * @param tau The reflector scales from qr_decompose()
+ * @param b The m x 1 right hand side
+ * @return Vector*, or NULL if R is numerically singular or memory ran out
+ */
+static Vector* _qr_least_squares(Matrix* A, Vector* tau, Vector* b) {
+    size_t cols = A->cols;
+    Vector* c = create_empty_vector(A->rows);
+    if (c == NULL) return NULL;
+    memcpy(c->data, b->data, b->rows * sizeof(double));
+    qr_apply_qt(A, tau, c);
+
+    // A diagonal entry of R this small relative to the largest means a dependent column
+    double r_max = 0.0;
+    for (size_t i = 0; i < cols; i++) {
+        if (fabs(MAT_AT(A, i, i)) > r_max) r_max = fabs(MAT_AT(A, i, i));
+    }
+    double tol = (double)A->rows * DBL_EPSILON * r_max;
+
+    // Back substitution through R, using the first cols entries of c = Qt * b
+    Vector* x_hat = create_empty_vector(cols);
+    if (x_hat == NULL) {
+        free_vector(c);
+        return NULL;
+    }
+    for (size_t i = cols; i-- > 0; ) {
+        const double* r_i = matrix_row(A, i);
+        if (!(fabs(r_i[i]) > tol)) {
             fprintf(stderr, "A does not have full column rank.\n");
+            free_vector(x_hat);
+            free_vector(c);
+            return NULL;
+        }
+        double sum = c->data[i] - simd_dot(r_i + i + 1, x_hat->data + i + 1, cols - i - 1);
+        x_hat->data[i] = sum / r_i[i];
+    }
+    free_vector(c);
+    return x_hat;
+}
+
+/**
+ * @brief Compute the Ordinary Least Squares Regression by QR factorization
+ *
+ * Solves min ||Ax - b|| from A = QR as R * x = Qt * b. The Gram matrix AtA is
+ * never formed, so the accuracy depends on the condition number of A rather
+ * than its square, which matters for nearly collinear features.
+ *
+ * @param A An m x n matrix of observations, m >= n. It is factored in place
+ * and holds its QR factors afterwards
+ * @param b An m x 1 vector of target observations
+ *
+ * @return Vector* x_hat, an n x 1 vector, or NULL if A does not have full
+ * column rank
+ * @note The caller is reponsible for freeing this memory using free_vector()
+ */
+Vector* ols_qr(Matrix* A, Vector* b) {
+    size_t cols = A->cols;
+    if (A->rows != b->rows) {
+        fprintf(stderr, "A and b have different numbers of rows.\n");
+        return NULL;
+    }
+
+    ML_TRACE_BEGIN(span, "ols_qr");
+
+    Vector* tau = create_empty_vector(cols);
+    Vector* x_hat = NULL;
+    if (tau != NULL && qr_decompose(A, tau) == EXIT_SUCCESS) {
+        x_hat = _qr_least_squares(A, tau, b);
+    }
+    if (tau) free_vector(tau);
+
+    ML_TRACE_END(span, 2.0 * A->rows * cols * cols - 2.0 * cols * cols * cols / 3.0, 16.0 * A->rows * (cols + 1));
+    return x_hat;
+}
+
+/**
+ * @brief Add the rows of two streams to AtA and Atb, one chunk at a time
+ *
+ * @param A_stream The rows of A
+ * @param b_stream The entries of b
+ * @param AtA The n x n sum to add to
+ * @param Atb The n x 1 sum to add to
+ * @param rows Set to the number of rows read
+ * @return int The resulting status code
+ */
+static int _ols_accumulate(RowStream* A_stream, RowStream* b_stream, Matrix* AtA, Vector* Atb, size_t* rows) {
+    size_t cols = AtA->cols;
+    Matrix* chunk = create_empty_matrix(OLS_STREAM_CHUNK_ROWS, cols);
+    Vector* b_chunk = create_empty_vector(OLS_STREAM_CHUNK_ROWS);
+    int status = EXIT_SUCCESS;
+    *rows = 0;
+
+    for (;;) {
+        size_t got = 0, b_got = 0;
+        if (row_stream_read(A_stream, chunk->data, chunk->stride, OLS_STREAM_CHUNK_ROWS, &got) != EXIT_SUCCESS
+            || row_stream_read(b_stream, b_chunk->data, 1, OLS_STREAM_CHUNK_ROWS, &b_got) != EXIT_SUCCESS) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        if (got != b_got) {
+            fprintf(stderr, "A and b have different numbers of rows.\n");
+            status = EXIT_FAILURE;
+            break;
+        }
+        if (got == 0) break;
+
+        // AtA += Ct * C and Atb += Ct * c for this chunk's rows C and targets c
+        if (gram_accumulate(chunk->data, chunk->stride, got, cols, b_chunk->data,
+                            AtA->data, AtA->stride, Atb->data) != EXIT_SUCCESS) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        *rows += got;
+    }
+    mirror_upper_triangle(AtA);
+
+    free_matrix(chunk);
+    free_vector(b_chunk);
+    return status;
+}
+
+/**
+ * @brief Compute the Ordinary Least Squares Regression without loading A
+ *
+ * A and b are read from their files OLS_STREAM_CHUNK_ROWS rows at a time.
+ * Each chunk adds its share to AtA and Atb, then the normal equations are
+ * solved once the files are used up. Only the n x n matrix AtA and one chunk
+ * of rows are ever held in memory, however many rows the files have.
+ *
+ * @param matrix_file A CSV or binary file holding the m x n matrix A
+ * @param vector_file A CSV or binary file holding the m x 1 vector b
+ *
+ * @return Vector* x_hat, an n x 1 vector, or NULL if a file cannot be read.
+ * If A does not have full column rank it is the minimum norm solution
+ * @note The caller is reponsible for freeing this memory using free_vector()
+ */
+Vector* ols_streaming(char* matrix_file, char* vector_file) {
+    RowStream A_stream, b_stream;
+    if (row_stream_open(&A_stream, matrix_file, 0) != EXIT_SUCCESS) {
+        row_stream_close(&A_stream);
+        return NULL;
+    }
+    if (row_stream_open(&b_stream, vector_file, 1) != EXIT_SUCCESS) {
+        row_stream_close(&A_stream);
+        row_stream_close(&b_stream);
+        return NULL;
+    }
+
+    ML_TRACE_BEGIN(span, "ols_streaming");
+
+    size_t cols = A_stream.cols;
+    size_t rows = 0;
+    Matrix* AtA = create_empty_matrix(cols, cols);
+    Vector* Atb = create_empty_vector(cols);
+    int status = _ols_accumulate(&A_stream, &b_stream, AtA, Atb, &rows);
+    row_stream_close(&A_stream);
+    row_stream_close(&b_stream);
+
+    // A has full column rank exactly when AtA does, which the solve reports
+    Vector* x_hat = NULL;
+    if (status == EXIT_SUCCESS && rows >= cols) {
+        x_hat = solve_normal_equations(AtA, Atb, NULL);
+    }
+
+    // pinv(AtA) * Atb is the minimum norm least squares solution, as pinv(A) * b is
+    if (status == EXIT_SUCCESS && x_hat == NULL) {
+        size_t rank = 0;
+        x_hat = pinv_solve(AtA, Atb, svd_default_rcond(rows, cols), &rank);
+        fprintf(stderr, "A has rank %zu of %zu columns, returning the minimum norm solution.\n",
+                rank, cols);
+    }
+
+    // The bytes are those of the parsed rows, not of the files
+    ML_TRACE_END(span, (double)rows * cols * cols + (double)cols * cols * cols / 3.0, 8.0 * rows * (cols + 1));
+
+    free_matrix(AtA);
+    free_vector(Atb);
+    return x_hat;
+}
+
+/**
+ * @brief Compute the Ordinary Least Squares Regression of a sparse matrix
+ *
+ * AtA and Atb are built by sparse_gram_matrix() in time proportional to the
+ * nonzeros of A, then solved as the dense normal equations are in ols().
+ *
+ * @param A The m x n sparse matrix
+ * @param b The m x 1 vector
+ *
+ * @return Vector* x_hat, an n x 1 vector, or NULL on failure. If A does not
+ * have full column rank it is the minimum norm solution
+ * @note The caller is reponsible for freeing this memory using free_vector()
+ */
+Vector* ols_sparse(SparseMatrix* A, Vector* b) {
+    Vector* Atb = NULL;
+    Matrix* AtA = sparse_gram_matrix(A, b, &Atb);
+    if (AtA == NULL) return NULL;
+
+    ML_TRACE_BEGIN(span, "ols_sparse");
+
+    Vector* x_hat = A->rows >= A->cols ? solve_normal_equations(AtA, Atb, NULL) : NULL;
+    if (x_hat == NULL) {
+        size_t rank = 0;
+        x_hat = pinv_solve(AtA, Atb, svd_default_rcond(A->rows, A->cols), &rank);
+        fprintf(stderr, "A has rank %zu of %zu columns, returning the minimum norm solution.\n",
+                rank, A->cols);
+    }
+
+    // The Gram matrix is its own span in sparse_gram_matrix()
+    ML_TRACE_END(span, (double)A->cols * A->cols * A->cols / 3.0, 8.0 * A->cols * A->cols);
+
+    free_matrix(AtA);
+    free_vector(Atb);
+    return x_hat;
+}
+
+/**
+ * @struct Controls and results of the iterative solvers lsqr() and cgls()
+ *
+ * Set the controls, or start from lsq_default_options(). The solver fills
+ * in the results.
+ */
+typedef struct LsqOptions {
+    // Stop once ||At r|| <= tol * ||A|| * ||r||, or ||r|| <= tol * ||b||
+    double tol;
+    // Most iterations to take, 0 for 4 * n
+    size_t max_iterations;
+    // Scale every column of A to unit norm while iterating (Jacobi preconditioning)
+    int precondition;
+    // Coefficients to start from, or NULL to start from zero
+    Vector* x0;
+
+    // Results
+    size_t iterations;
+    double residual_norm;
+    int converged;
+} LsqOptions;
+
+/**
+ * @brief Get the default controls for lsqr() and cgls()
+ *
+ * @return LsqOptions A tolerance of 1e-10, 4 * n iterations, column scaling
+ * on and no warm start
+ */
+LsqOptions lsq_default_options() {
+    LsqOptions options;
+    memset(&options, 0, sizeof(LsqOptions));
+    options.tol = 1e-10;
+    options.precondition = 1;
+    return options;
+}
+
+/**
+ * @struct A dense or sparse A, seen only through products with A D and (A D)t
+ *
+ * D is the diagonal column scaling, or NULL for none. St is the transpose of
+ * a sparse A, so both products run as a parallel SpMV.
+ */
+typedef struct LsqOperator {
+    Matrix* A;
+    SparseMatrix* S;
+    SparseMatrix* St;
+    Vector* D;
+    Vector* scratch;
+} LsqOperator;
+
+/**
+ * @brief y = A D x
+ */
+static int _lsq_apply(LsqOperator* op, Vector* x, Vector* y) {
+    Vector* Dx = x;
+    if (op->D) {
+        Dx = op->scratch;
+        for (size_t j = 0; j < x->rows; j++) Dx->data[j] = op->D->data[j] * x->data[j];
+    }
+    return op->A ? matrix_vector_product_into(op->A, Dx, y)
+                 : sparse_matrix_vector_product_into(op->S, Dx, y);
+}
+
+/**
+ * @brief x = D At y
+ */
+static int _lsq_apply_transpose(LsqOperator* op, Vector* y, Vector* x) {
+    int status = op->A ? matrix_transpose_vector_product_into(op->A, y, x)
+                       : sparse_matrix_vector_product_into(op->St, y, x);
+    if (op->D) {
+        for (size_t j = 0; j < x->rows; j++) x->data[j] *= op->D->data[j];
+    }
+    return status;
+}
+
+/**
+ * @brief Set D to the reciprocal norms of the columns of A, 0 for an empty column
+ */
+static void _lsq_column_scaling(LsqOperator* op) {
+    double* d = op->D->data;
+    memset(d, 0, op->D->rows * sizeof(double));
+    if (op->A) {
+        for (size_t i = 0; i < op->A->rows; i++) {
+            const double* row = matrix_row(op->A, i);
+            for (size_t j = 0; j < op->A->cols; j++) d[j] += row[j] * row[j];
+        }
+    } else {
+        for (size_t k = 0; k < op->S->nnz; k++) d[op->S->col_idx[k]] += op->S->values[k] * op->S->values[k];
+    }
+    for (size_t j = 0; j < op->D->rows; j++) d[j] = d[j] > 0.0 ? 1.0 / sqrt(d[j]) : 0.0;
+}
+
+/**
+ * @brief Euclidean norm of a vector
+ */
+static double _lsq_norm(Vector* v) {
+    return sqrt(simd_dot(v->data, v->data, v->rows));
+}
+
+/**
+ * @brief Run LSQR or CGLS on A D z = r0 and return x = x0 + D z
+ *
+ * @param op The operator, with D set up if preconditioning
+ * @param rows The rows of A
+ * @param cols The columns of A
+ * @param b The m x 1 target vector
+ * @param options The controls, results are written back
+ * @param use_lsqr 1 for LSQR, 0 for CGLS
+ */
+static Vector* _lsq_solve(LsqOperator* op, size_t rows, size_t cols, Vector* b,
+                          LsqOptions* options, int use_lsqr) {
+    if (b->rows != rows || (options->x0 && options->x0->rows != cols)) {
+        fprintf(stderr, "Least Squares: The matrix and vectors have incompatible sizes\n");
+        return NULL;
+    }
+
+    size_t max_iterations = options->max_iterations ? options->max_iterations : 4 * cols;
+    double tol = options->tol;
+    options->iterations = 0;
+    options->converged = 0;
+
+    // Vectors of length m: u, the residual r, and A D times a direction
+    // Vectors of length n: z, v, w, the product At u
+    Vector* u = create_empty_vector(rows);
+    Vector* r = create_empty_vector(rows);
+    Vector* Av = create_empty_vector(rows);
+    Vector* z = create_empty_vector(cols);
+    Vector* v = create_empty_vector(cols);
+    Vector* w = create_empty_vector(cols);
+    Vector* Atu = create_empty_vector(cols);
+    op->scratch = create_empty_vector(cols);
+    Vector* x_hat = NULL;
+    int status = (u && r && Av && z && v && w && Atu && op->scratch) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    // r0 = b - A x0, the part of b the warm start leaves to fit
+    if (status == EXIT_SUCCESS) {
+        memcpy(r->data, b->data, rows * sizeof(double));
+        if (options->x0) {
+            Vector* D = op->D;
+            op->D = NULL;
+            status = _lsq_apply(op, options->x0, Av);
+            op->D = D;
+            for (size_t i = 0; i < rows; i++) r->data[i] -= Av->data[i];
+        }
+    }
+
+    double norm_b = _lsq_norm(b);
+    double norm_r = status == EXIT_SUCCESS ? _lsq_norm(r) : 0.0;
+
+    if (status == EXIT_SUCCESS && norm_r <= tol * norm_b) {
+        options->converged = 1;
+    } else if (status == EXIT_SUCCESS && use_lsqr) {
+        // Golub-Kahan bidiagonalization: beta u = r0, alpha v = (A D)t u
+        double beta = norm_r;
+        for (size_t i = 0; i < rows; i++) u->data[i] = r->data[i] / beta;
+        status = _lsq_apply_transpose(op, u, v);
+        double alpha = _lsq_norm(v);
+        if (alpha > 0.0) {
+            for (size_t j = 0; j < cols; j++) v->data[j] /= alpha;
+        }
+        memcpy(w->data, v->data, cols * sizeof(double));
+
+        double phi_bar = beta, rho_bar = alpha;
+        double norm_A2 = 0.0;
+        norm_r = beta;
+        if (alpha == 0.0) options->converged = 1;
+
+        while (status == EXIT_SUCCESS && !options->converged && options->iterations < max_iterations) {
+            options->iterations++;
+
+            // beta u = A D v - alpha u
+            status = _lsq_apply(op, v, Av);
+            if (status != EXIT_SUCCESS) break;
+            for (size_t i = 0; i < rows; i++) u->data[i] = Av->data[i] - alpha * u->data[i];
+            beta = _lsq_norm(u);
+            norm_A2 += alpha * alpha + beta * beta;
+            if (beta > 0.0) {
+                for (size_t i = 0; i < rows; i++) u->data[i] /= beta;
+            }
+
+            // alpha v = (A D)t u - beta v
+            status = _lsq_apply_transpose(op, u, Atu);
+            if (status != EXIT_SUCCESS) break;
+            for (size_t j = 0; j < cols; j++) v->data[j] = Atu->data[j] - beta * v->data[j];
+            alpha = _lsq_norm(v);
+            if (alpha > 0.0) {
+                for (size_t j = 0; j < cols; j++) v->data[j] /= alpha;
+            }
+
+            // A plane rotation eliminates beta from the bidiagonal
+            double rho = hypot(rho_bar, beta);
+            double c = rho_bar / rho, s = beta / rho;
+            double theta = s * alpha;
+            rho_bar = -c * alpha;
+            double phi = c * phi_bar;
+            phi_bar = s * phi_bar;
+
+            for (size_t j = 0; j < cols; j++) {
+                z->data[j] += (phi / rho) * w->data[j];
+                w->data[j] = v->data[j] - (theta / rho) * w->data[j];
+            }
+
+            // phi_bar is ||r|| and phi_bar * alpha * |c| is ||(A D)t r||
+            norm_r = phi_bar;
+            double norm_Atr = phi_bar * alpha * fabs(c);
+            if (norm_r <= tol * norm_b || norm_Atr <= tol * sqrt(norm_A2) * norm_r) {
+                options->converged = 1;
+            }
+        }
+    } else if (status == EXIT_SUCCESS) {
+        // Conjugate gradients on the normal equations, with the residual kept in r
+        // v = (A D)t r is the gradient and w the search direction
+        status = _lsq_apply_transpose(op, r, v);
+        memcpy(w->data, v->data, cols * sizeof(double));
+        double gamma = simd_dot(v->data, v->data, cols);
+        double norm_A2 = 0.0;
+        if (gamma == 0.0) options->converged = 1;
+
+        while (status == EXIT_SUCCESS && !options->converged && options->iterations < max_iterations) {
+            options->iterations++;
+
+            status = _lsq_apply(op, w, Av);
+            if (status != EXIT_SUCCESS) break;
+            double delta = simd_dot(Av->data, Av->data, rows);
+            if (delta == 0.0) break;
+            double step = gamma / delta;
+            // ||A D w||^2 / ||w||^2 is a lower bound on ||A D||^2
+            norm_A2 = fmax(norm_A2, delta / simd_dot(w->data, w->data, cols));
+
+            for (size_t j = 0; j < cols; j++) z->data[j] += step * w->data[j];
+            for (size_t i = 0; i < rows; i++) r->data[i] -= step * Av->data[i];
+            status = _lsq_apply_transpose(op, r, v);
+            if (status != EXIT_SUCCESS) break;
+
+            double gamma_next = simd_dot(v->data, v->data, cols);
+            norm_r = _lsq_norm(r);
+            if (norm_r <= tol * norm_b || sqrt(gamma_next) <= tol * sqrt(norm_A2) * norm_r) {
+                options->converged = 1;
+            }
+            for (size_t j = 0; j < cols; j++) w->data[j] = v->data[j] + (gamma_next / gamma) * w->data[j];
+            gamma = gamma_next;
+        }
+    }
+
+    // x = x0 + D z
+    if (status == EXIT_SUCCESS) {
+        x_hat = create_empty_vector(cols);
+    }
+    if (x_hat) {
+        for (size_t j = 0; j < cols; j++) {
+            double step = op->D ? op->D->data[j] * z->data[j] : z->data[j];
+            x_hat->data[j] = (options->x0 ? options->x0->data[j] : 0.0) + step;
+        }
+        options->residual_norm = norm_r;
+        if (!options->converged) {
+            fprintf(stderr, "Least Squares: No convergence after %zu iterations, ||r|| = %g\n",
+                    options->iterations, norm_r);
+        }
+    }
+
+    if (u) free_vector(u);
+    if (r) free_vector(r);
+    if (Av) free_vector(Av);
+    if (z) free_vector(z);
+    if (v) free_vector(v);
+    if (w) free_vector(w);
+    if (Atu) free_vector(Atu);
+    if (op->scratch) free_vector(op->scratch);
+    return x_hat;
+}
+
+/**
+ * @brief Solve a least squares problem with a dense or sparse operator
+ */
+static Vector* _lsq_run(Matrix* A, SparseMatrix* S, Vector* b, LsqOptions* options, int use_lsqr) {
+    LsqOptions defaults = lsq_default_options();
+    if (options == NULL) options = &defaults;
+
+    size_t rows = A ? A->rows : S->rows;
+    size_t cols = A ? A->cols : S->cols;
+    LsqOperator op = { A, S, NULL, NULL, NULL };
+    if (S) {
+        op.St = sparse_transpose(S);
+        if (op.St == NULL) return NULL;
+    }
+    if (options->precondition) {
+        op.D = create_empty_vector(cols);
+        if (op.D == NULL) {
+            free_sparse_matrix(op.St);
             return NULL;
         }
+        _lsq_column_scaling(&op);
+    }
+
+    ML_TRACE_BEGIN(span, "lsq_solve");
+    Vector* x_hat = _lsq_solve(&op, rows, cols, b, options, use_lsqr);
+
+    // Each iteration is a product with A and with At, and a few vector updates
+    ML_TRACE_END(span, options->iterations * (4.0 * (S ? (double)S->nnz : (double)rows * cols) + 10.0 * (rows + cols)),
+                 options->iterations * (16.0 * (S ? (double)S->nnz : (double)rows * cols) + 40.0 * (rows + cols)));
+
+    if (op.D) free_vector(op.D);
+    free_sparse_matrix(op.St);
+    return x_hat;
+}
+
+/**
+ * @brief Compute the least squares solution of A x = b by LSQR
+ *
+ * LSQR (Paige and Saunders) only touches A through products A v and At u,
+ * so it needs O(m + n) memory beyond A and never forms AtA. That makes it
+ * the method for problems with too many features for ols(), whose n x n
+ * factorization costs n^3 / 3 flops. It is mathematically equivalent to
+ * cgls() but more stable when A is ill conditioned. Started from zero
+ * without preconditioning, a rank deficient A converges to the minimum
+ * norm solution.
+ *
+ * @param A The m x n matrix
+ * @param b The m x 1 vector
+ * @param options The controls, and where the iteration count and residual
+ * norm are reported, or NULL for lsq_default_options()
+ *
+ * @return Vector* x_hat, an n x 1 vector, or NULL on failure
+ * @note The caller is reponsible for freeing this memory using free_vector()
+ */
+Vector* lsqr(Matrix* A, Vector* b, LsqOptions* options) {
+    return _lsq_run(A, NULL, b, options, 1);
+}
+
+/**
+ * @brief Compute the least squares solution of a sparse A x = b by LSQR
+ *
+ * As lsqr(), with both products running as a sparse matrix-vector product,
+ * so an iteration costs 4 * nnz flops.
+ *
+ * @param A The m x n sparse matrix
+ * @param b The m x 1 vector
+ * @param options The controls and results, or NULL for lsq_default_options()
+ *
+ * @return Vector* x_hat, an n x 1 vector, or NULL on failure
+ * @note The caller is reponsible for freeing this memory using free_vector()
+ */
+Vector* lsqr_sparse(SparseMatrix* A, Vector* b, LsqOptions* options) {
+    return _lsq_run(NULL, A, b, options, 1);
+}
+
+/**
+ * @brief Compute the least squares solution of A x = b by CGLS
+ *
+ * Conjugate gradients applied to the normal equations AtA x = Atb, without
+ * forming AtA. Each iteration costs one product with A and one with At.
+ *
+ * @param A The m x n matrix
+ * @param b The m x 1 vector
+ * @param options The controls and results, or NULL for lsq_default_options()
+ *
+ * @return Vector* x_hat, an n x 1 vector, or NULL on failure
+ * @note The caller is reponsible for freeing this memory using free_vector()
+ */
+Vector* cgls(Matrix* A, Vector* b, LsqOptions* options) {
+    return _lsq_run(A, NULL, b, options, 0);
+}
+
+/**
+ * @brief Compute the least squares solution of a sparse A x = b by CGLS
+ *
+ * @param A The m x n sparse matrix
+ * @param b The m x 1 vector
+ * @param options The controls and results, or NULL for lsq_default_options()
+ *
+ * @return Vector* x_hat, an n x 1 vector, or NULL on failure
+ * @note The caller is reponsible for freeing this memory using free_vector()
+ */
+Vector* cgls_sparse(SparseMatrix* A, Vector* b, LsqOptions* options) {
+    return _lsq_run(NULL, A, b, options, 0);
+}
+
+/**
+ * @struct An online least squares model updated a batch of rows at a time
+ *
+ * R is the upper triangular factor of the (weighted) Gram matrix, AtA = Rt * R,
+ * and Atb its right hand side. New rows are folded into R by Givens
+ * rotations, a Cholesky rank-1 update per row, so the data itself is never
+ * kept. With forgetting below 1, every older row is weighted down by that
+ * factor each time a new row arrives.
+ */
+typedef struct RLS {
+    Matrix* R;
+    Vector* Atb;
+    Vector* coefficients;
+    double forgetting;
+    size_t observations;
+
+    // One row being folded in, and the substitution scratch
+    Vector* row;
+    Vector* work;
+} RLS;
+
+/**
+ * @brief Free an online least squares model
+ *
+ * @param rls The model to free
+ * @return void
+ */
+void free_rls(RLS* rls) {
+    if (rls == NULL) return;
+    if (rls->R) free_matrix(rls->R);
+    if (rls->Atb) free_vector(rls->Atb);
+    if (rls->coefficients) free_vector(rls->coefficients);
+    if (rls->row) free_vector(rls->row);
+    if (rls->work) free_vector(rls->work);
+    free(rls);
+}
+
+/**
+ * @brief Allocate an online model of n coefficients with R = sqrt(delta) * I
+ */
+static RLS* _rls_alloc(size_t cols, double forgetting, double delta) {
+    if (!(forgetting > 0.0 && forgetting <= 1.0)) {
+        fprintf(stderr, "RLS: The forgetting factor must be in (0, 1], got %g\n", forgetting);
+        return NULL;
+    }
+
+    RLS* rls = (RLS*)calloc(1, sizeof(RLS));
+    if (rls == NULL) return NULL;
+    rls->forgetting = forgetting;
+    rls->R = create_empty_matrix(cols, cols);
+    rls->Atb = create_empty_vector(cols);
+    rls->coefficients = create_empty_vector(cols);
+    rls->row = create_empty_vector(cols);
+    rls->work = create_empty_vector(cols);
+    if (!rls->R || !rls->Atb || !rls->coefficients || !rls->row || !rls->work) {
+        free_rls(rls);
+        return NULL;
+    }
+    for (size_t i = 0; i < cols; i++) MAT_AT(rls->R, i, i) = sqrt(delta);
+    return rls;
+}
+
+/**
+ * @brief Solve Rt * R * x = Atb for the coefficients, in O(n^2)
+ */
+static void _rls_solve(RLS* rls) {
+    size_t n = rls->R->rows;
+    double* z = rls->work->data;
+    double* x = rls->coefficients->data;
+
+    // Rt * z = Atb, a row of R at a time so every access is contiguous
+    memcpy(z, rls->Atb->data, n * sizeof(double));
+    for (size_t k = 0; k < n; k++) {
+        const double* R_k = matrix_row(rls->R, k);
+        z[k] /= R_k[k];
+        for (size_t j = k + 1; j < n; j++) z[j] -= R_k[j] * z[k];
+    }
+
+    // R * x = z
+    for (size_t i = n; i-- > 0;) {
+        const double* R_i = matrix_row(rls->R, i);
+        x[i] = (z[i] - simd_dot(R_i + i + 1, x + i + 1, n - i - 1)) / R_i[i];
+    }
+}
+
+/**
+ * @brief Fold the row a into R, so that Rt * R gains a * at
+ *
+ * Row k of R and a are rotated together so that a[k] becomes zero, for
+ * k = 0 to n - 1. a is overwritten.
+ */
+static void _rls_add_row(Matrix* R, double* a) {
+    size_t n = R->rows;
+    for (size_t k = 0; k < n; k++) {
+        if (a[k] == 0.0) continue;
+        double* R_k = matrix_row(R, k);
+        double r = hypot(R_k[k], a[k]);
+        double c = R_k[k] / r, s = a[k] / r;
+        R_k[k] = r;
+        for (size_t j = k + 1; j < n; j++) {
+            double R_kj = R_k[j];
+            R_k[j] = c * R_kj + s * a[j];
+            a[j] = c * a[j] - s * R_kj;
+        }
     }
-    free_matrix(R);
+}
 
-    printf("Performing OLS...\n");
+/**
+ * @brief Create an empty online least squares model
+ *
+ * The model starts from the prior AtA = delta * I, which keeps R invertible
+ * before n independent rows have arrived. It acts as a ridge penalty that
+ * fades as rows are added, and fades away entirely with forgetting below 1.
+ *
+ * @param cols The number of coefficients n
+ * @param forgetting The weight in (0, 1] kept by older rows per new row. 1
+ * keeps every row at full weight
+ * @param delta The prior, a small positive number such as 1e-8
+ *
+ * @return RLS*, or NULL on failure
+ * @note The caller is reponsible for freeing this memory using free_rls()
+ */
+RLS* rls_create(size_t cols, double forgetting, double delta) {
+    if (!(delta > 0.0)) {
+        fprintf(stderr, "RLS: The prior delta must be positive, got %g\n", delta);
+        return NULL;
+    }
+    return _rls_alloc(cols, forgetting, delta);
+}
+
+/**
+ * @brief Fit an online least squares model to a first batch of rows
+ *
+ * This is the fit of ols(), kept in factored form so later batches can be
+ * added with rls_update().
+ *
+ * @param A An m x n matrix of observations, with full column rank
+ * @param b An m x 1 vector of target observations
+ * @param forgetting The weight in (0, 1] kept by older rows per new row.
+ * The rows of A are all weighted as if they arrived together
+ *
+ * @return RLS*, or NULL if the sizes do not match or A is rank deficient
+ * @note The caller is reponsible for freeing this memory using free_rls()
+ */
+RLS* rls_fit(Matrix* A, Vector* b, double forgetting) {
+    Vector* Atb = NULL;
+    Matrix* AtA = gram_matrix(A, b, &Atb);
+    if (AtA == NULL) return NULL;
+
+    Matrix* L = cholesky(AtA);
+    RLS* rls = L ? _rls_alloc(A->cols, forgetting, 0.0) : NULL;
+    if (L == NULL) {
+        fprintf(stderr, "RLS: A does not have full column rank, start from rls_create() instead.\n");
+    }
 
-    // Calculate OLS via Moore-Penrose pseudo-inverse
-    Matrix* At = tranpose_matrix(A);
-    Matrix* AtA = matrix_product(At, A);
-    Matrix* AtA_inv = invert(AtA);
-    Vector* Atb = matrix_vector_product(At, b);
-    Vector* x_hat = matrix_vector_product(AtA_inv, Atb);
+    if (rls != NULL) {
+        for (size_t i = 0; i < A->cols; i++) {
+            for (size_t j = i; j < A->cols; j++) MAT_AT(rls->R, i, j) = MAT_AT(L, j, i);
+        }
+        memcpy(rls->Atb->data, Atb->data, A->cols * sizeof(double));
+        rls->observations = A->rows;
+        _rls_solve(rls);
+    }
 
+    if (L) free_matrix(L);
+    free_matrix(AtA);
     free_vector(Atb);
-    free_matrix(AtA_inv);
+    return rls;
+}
+
+/**
+ * @brief Add a batch of rows to an online least squares model
+ *
+ * Each row costs O(n^2) to fold into R, so a batch of k rows costs
+ * O(k * n^2) plus one O(n^2) solve, against O(m * n^2 + n^3) to refit from
+ * scratch. rls->coefficients holds the updated fit afterwards.
+ *
+ * With forgetting f, the i-th of the k rows is weighted by f^(k - 1 - i)
+ * and everything seen before by f^k, which is the same as adding the rows
+ * one at a time.
+ *
+ * @param rls The model
+ * @param X A k x n matrix of new observations
+ * @param y A k x 1 vector of new targets
+ *
+ * @return int The resulting status code
+ */
+int rls_update(RLS* rls, Matrix* X, Vector* y) {
+    size_t n = rls->R->rows;
+    if (X->cols != n || X->rows != y->rows) {
+        fprintf(stderr, "RLS: The batch does not match the model's %zu coefficients\n", n);
+        return EXIT_FAILURE;
+    }
+
+    size_t k = X->rows;
+    if (rls->forgetting < 1.0) {
+        double weight = pow(rls->forgetting, (double)k);
+        double root = sqrt(weight);
+        for (size_t i = 0; i < n; i++) {
+            double* R_i = matrix_row(rls->R, i);
+            for (size_t j = i; j < n; j++) R_i[j] *= root;
+            rls->Atb->data[i] *= weight;
+        }
+    }
+
+    double* a = rls->row->data;
+    for (size_t i = 0; i < k; i++) {
+        double weight = rls->forgetting < 1.0 ? pow(rls->forgetting, (double)(k - 1 - i)) : 1.0;
+        const double* x_i = matrix_row(X, i);
+        double root = sqrt(weight);
+        double wy = weight * y->data[i];
+        for (size_t j = 0; j < n; j++) {
+            rls->Atb->data[j] += wy * x_i[j];
+            a[j] = root * x_i[j];
+        }
+        _rls_add_row(rls->R, a);
+    }
+
+    rls->observations += k;
+    _rls_solve(rls);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Compute the Ridge Regression of A and b for one penalty
+ *
+ * Minimizes ||A x - b||^2 + lambda * ||x||^2 by solving the regularized
+ * normal equations (AtA + lambda * I) x = Atb with a Cholesky factorization.
+ * Every coefficient is penalized, including an intercept column if A has
+ * one. For several penalties use ridge_path(), which factors AtA only once.
+ *
+ * @param A An m x n matrix of observations
+ * @param b An m x 1 vector of target observations
+ * @param lambda The penalty, at least 0
+ *
+ * @return Vector* x_hat, an n x 1 vector, or NULL on failure
+ * @note The caller is reponsible for freeing this memory using free_vector()
+ */
+Vector* ridge(Matrix* A, Vector* b, double lambda) {
+    if (!(lambda >= 0.0)) {
+        fprintf(stderr, "Ridge: lambda must not be negative, got %g\n", lambda);
+        return NULL;
+    }
+
+    Vector* Atb = NULL;
+    Matrix* AtA = gram_matrix(A, b, &Atb);
+    if (AtA == NULL) return NULL;
+
+    ML_TRACE_BEGIN(span, "ridge");
+
+    for (size_t i = 0; i < A->cols; i++) MAT_AT(AtA, i, i) += lambda;
+    Matrix* L = cholesky(AtA);
+    Vector* x_hat = L ? cholesky_solve(L, Atb) : NULL;
+    if (L) free_matrix(L);
     free_matrix(AtA);
-    free_matrix(At);
+    free_vector(Atb);
+    ML_TRACE_END(span, (double)A->cols * A->cols * A->cols / 3.0 + 2.0 * A->cols * A->cols,
+                 8.0 * A->cols * A->cols);
 
-    printf("Done\n");
+    // Without a penalty a rank deficient A still has a minimum norm answer
+    if (x_hat == NULL && lambda == 0.0) {
+        return ols(A, b);
+    }
     return x_hat;
 }
 
+/**
+ * @brief Compute ridge coefficients for many penalties from AtA and Atb
+ *
+ * AtA = V * diag(e) * Vt is decomposed once, in O(n^3). Then with
+ * c = Vt * Atb, the coefficients for any lambda are
+ *   x(lambda) = V * (c / (e + lambda))
+ * which is O(n^2) per penalty. All penalties go through one matrix product.
+ * AtA and Atb can come from gram_matrix(), the streaming accumulation, or a
+ * sparse matrix. Directions whose e + lambda is negligible next to the
+ * largest eigenvalue are dropped, so lambda = 0 gives the minimum norm
+ * least squares solution.
+ *
+ * @param AtA The n x n Gram matrix
+ * @param Atb The n x 1 vector At * b
+ * @param lambdas The penalties, each at least 0
+ * @param n_lambdas The number of penalties
+ *
+ * @return Matrix* An n_lambdas x n matrix whose row l holds the coefficients
+ * for lambdas[l], or NULL on failure
+ * @note The caller is reponsible for freeing this memory using free_matrix()
+ */
+Matrix* ridge_path_gram(Matrix* AtA, Vector* Atb, const double* lambdas, size_t n_lambdas) {
+    size_t n = AtA->cols;
+    if (AtA->rows != n || Atb->rows != n) {
+        fprintf(stderr, "Ridge: AtA and Atb have incompatible sizes\n");
+        return NULL;
+    }
+    for (size_t l = 0; l < n_lambdas; l++) {
+        if (!(lambdas[l] >= 0.0)) {
+            fprintf(stderr, "Ridge: lambda must not be negative, got %g\n", lambdas[l]);
+            return NULL;
+        }
+    }
+
+    // AtA is symmetric positive semidefinite, so its singular value
+    // decomposition is its eigendecomposition
+    SVD* eigen = svd(AtA);
+    Matrix* W = create_empty_matrix(n_lambdas, n);
+    Matrix* X = create_empty_matrix(n_lambdas, n);
+    Vector* c = create_empty_vector(n);
+    if (eigen == NULL || W == NULL || X == NULL || c == NULL) {
+        if (eigen) free_svd(eigen);
+        if (W) free_matrix(W);
+        if (X) free_matrix(X);
+        if (c) free_vector(c);
+        return NULL;
+    }
+
+    // c = Vt * Atb
+    matrix_transpose_vector_product_into(eigen->V, Atb, c);
+
+    double cutoff = svd_default_rcond(n, n) * (n > 0 ? eigen->S->data[0] : 0.0);
+    for (size_t l = 0; l < n_lambdas; l++) {
+        double* w = matrix_row(W, l);
+        for (size_t k = 0; k < n; k++) {
+            double d = eigen->S->data[k] + lambdas[l];
+            w[k] = d > cutoff ? c->data[k] / d : 0.0;
+        }
+    }
+
+    // Row l of X is V * w_l, so X = W * Vt
+    int status = gemm(0, 1, n_lambdas, n, n, 1.0, W->data, W->stride,
+                      eigen->V->data, eigen->V->stride, 0.0, X->data, X->stride);
+
+    free_svd(eigen);
+    free_matrix(W);
+    free_vector(c);
+    if (status != EXIT_SUCCESS) {
+        free_matrix(X);
+        return NULL;
+    }
+    return X;
+}
+
+/**
+ * @brief Compute the Ridge Regression of A and b for a grid of penalties
+ *
+ * One fused pass builds AtA and Atb, then ridge_path_gram() solves for every
+ * penalty at O(n^2) each.
+ *
+ * @param A An m x n matrix of observations
+ * @param b An m x 1 vector of target observations
+ * @param lambdas The penalties, each at least 0
+ * @param n_lambdas The number of penalties
+ *
+ * @return Matrix* An n_lambdas x n matrix whose row l holds the coefficients
+ * for lambdas[l], or NULL on failure
+ * @note The caller is reponsible for freeing this memory using free_matrix()
+ */
+Matrix* ridge_path(Matrix* A, Vector* b, const double* lambdas, size_t n_lambdas) {
+    Vector* Atb = NULL;
+    Matrix* AtA = gram_matrix(A, b, &Atb);
+    if (AtA == NULL) return NULL;
+
+    // An SVD of AtA, then one n x n product for every penalty at once
+    ML_TRACE_BEGIN(span, "ridge_path");
+    Matrix* X = ridge_path_gram(AtA, Atb, lambdas, n_lambdas);
+    ML_TRACE_END(span, 12.0 * A->cols * A->cols * A->cols + 2.0 * n_lambdas * A->cols * A->cols,
+                 8.0 * (2.0 * A->cols * A->cols + n_lambdas * A->cols));
+
+    free_matrix(AtA);
+    free_vector(Atb);
+    return X;
+}
+
+/**
+ * @brief Compute predictions X * beta into a vector the caller provides
+ *
+ * @param X A k x n matrix of observations
+ * @param beta The n fitted coefficients
+ * @param y_hat A k x 1 vector to hold the predictions
+ *
+ * @return int The resulting status code
+ */
+int predict_into(Matrix* X, Vector* beta, Vector* y_hat) {
+    return matrix_vector_product_into(X, beta, y_hat);
+}
+
+/**
+ * @brief Compute predictions X * beta
+ *
+ * @param X A k x n matrix of observations
+ * @param beta The n fitted coefficients
+ *
+ * @return Vector* y_hat, a k x 1 vector, or NULL if the sizes do not match
+ * @note The caller is reponsible for freeing this memory using free_vector()
+ */
+Vector* predict(Matrix* X, Vector* beta) {
+    if (X->cols != beta->rows) {
+        fprintf(stderr, "Predict: %zu coefficients for %zu columns\n", beta->rows, X->cols);
+        return NULL;
+    }
+
+    Vector* y_hat = create_empty_vector(X->rows);
+    if (y_hat == NULL) return NULL;
+    predict_into(X, beta, y_hat);
+    return y_hat;
+}
+
+/**
+ * @struct Arguments shared by the threads formatting a block of predictions
+ *
+ * Value i is printed into its own PREDICT_CSV_SLOT bytes of text, and its
+ * length stored in lengths[i].
+ */
+typedef struct PredictFormatTask {
+    const double* values;
+    char* text;
+    size_t* lengths;
+} PredictFormatTask;
+
+/**
+ * @brief parallel_for() body formatting values [begin, end) as CSV lines
+ */
+static void _predict_format_task(size_t begin, size_t end, void* ctx) {
+    PredictFormatTask* task = (PredictFormatTask*)ctx;
+    for (size_t i = begin; i < end; i++) {
+        int len = snprintf(task->text + i * PREDICT_CSV_SLOT, PREDICT_CSV_SLOT, "%.17g\n", task->values[i]);
+        task->lengths[i] = len > 0 ? (size_t)len : 0;
+    }
+}
+
+/**
+ * @brief Predict the targets of every row of a file, without loading it
+ *
+ * The rows of X are read PREDICT_CHUNK_ROWS at a time through stream.h. Each
+ * block is multiplied by beta with the threaded matrix-vector product and
+ * its predictions are written out before the next block is read, so only
+ * one block of X is ever in memory.
+ *
+ * @param matrix_file A CSV or binary file holding the k x n matrix X
+ * @param beta The n fitted coefficients
+ * @param output_file The file to write the k predictions to
+ * @param binary Nonzero to write a binary vector file, zero for CSV with one
+ * prediction per line
+ * @param rows Set to the number of rows predicted, if not NULL
+ *
+ * @return int The resulting status code
+ */
+int predict_streaming(char* matrix_file, Vector* beta, char* output_file, int binary, size_t* rows) {
+    RowStream stream;
+    if (row_stream_open(&stream, matrix_file, 0) != EXIT_SUCCESS) {
+        row_stream_close(&stream);
+        return EXIT_FAILURE;
+    }
+    if (stream.cols != beta->rows) {
+        fprintf(stderr, "Predict: %zu coefficients for %zu columns\n", beta->rows, stream.cols);
+        row_stream_close(&stream);
+        return EXIT_FAILURE;
+    }
+
+    MlbWriter writer;
+    FILE* fp = NULL;
+    int status = binary ? mlb_writer_open(&writer, output_file, MLB_KIND_VECTOR, MLB_ROWS_UNKNOWN, 1)
+                        : ((fp = fopen(output_file, "w")) != NULL ? EXIT_SUCCESS : EXIT_FAILURE);
+    if (status != EXIT_SUCCESS) {
+        if (!binary) perror("Unable to create prediction file");
+        row_stream_close(&stream);
+        return EXIT_FAILURE;
+    }
+
+    Matrix* chunk = create_empty_matrix(PREDICT_CHUNK_ROWS, stream.cols);
+    Vector* y_hat = create_empty_vector(PREDICT_CHUNK_ROWS);
+    char* text = binary ? NULL : (char*)malloc(PREDICT_CHUNK_ROWS * PREDICT_CSV_SLOT);
+    size_t* lengths = binary ? NULL : (size_t*)malloc(PREDICT_CHUNK_ROWS * sizeof(size_t));
+    if (chunk == NULL || y_hat == NULL || (!binary && (text == NULL || lengths == NULL))) {
+        status = EXIT_FAILURE;
+    }
+
+    size_t total = 0;
+    while (status == EXIT_SUCCESS) {
+        size_t got = 0;
+        status = row_stream_read(&stream, chunk->data, chunk->stride, PREDICT_CHUNK_ROWS, &got);
+        if (status != EXIT_SUCCESS || got == 0) break;
+
+        // Views of the rows this block filled
+        Matrix block = *chunk;
+        Vector block_y = *y_hat;
+        block.rows = got;
+        block_y.rows = got;
+        predict_into(&block, beta, &block_y);
+
+        if (binary) {
+            for (size_t i = 0; i < got && status == EXIT_SUCCESS; i++) {
+                status = mlb_writer_write_row(&writer, &y_hat->data[i]);
+            }
+        } else {
+            PredictFormatTask task = { y_hat->data, text, lengths };
+            parallel_for(0, got, PARALLEL_MIN_WORK / 256 + 1, _predict_format_task, &task);
+
+            // Close up the slots into one run of text
+            size_t len = 0;
+            for (size_t i = 0; i < got; i++) {
+                memmove(text + len, text + i * PREDICT_CSV_SLOT, lengths[i]);
+                len += lengths[i];
+            }
+            if (fwrite(text, 1, len, fp) != len) {
+                perror("Unable to write predictions");
+                status = EXIT_FAILURE;
+            }
+        }
+        total += got;
+    }
+
+    row_stream_close(&stream);
+    if (binary) {
+        if (mlb_writer_close(&writer) != EXIT_SUCCESS) status = EXIT_FAILURE;
+    } else if (fclose(fp) != 0) {
+        status = EXIT_FAILURE;
+    }
+    if (chunk) free_matrix(chunk);
+    if (y_hat) free_vector(y_hat);
+    free(text);
+    free(lengths);
+
+    if (rows) *rows = total;
+    return status;
+}
+
+/**
+ * @struct Goodness of fit of predictions y_hat against targets y, r = y - y_hat
+ */
+typedef struct Metrics {
+    size_t n;
+    double sse;
+    double mse;
+    double rmse;
+    double mae;
+    // 1 - SSE / sum((y - mean(y))^2). NAN when y is constant
+    double r2;
+    double max_error;
+    double residual_mean;
+} Metrics;
+
+/**
+ * @struct Running sums over some rows, merged block by block in row order
+ *
+ * Sums carry a Neumaier compensation term. y_mean and y_m2 are the mean of
+ * y and the sum of squared deviations from it, merged by Chan's formula so
+ * R^2 needs no second pass over y.
+ */
+typedef struct MetricsPartial {
+    size_t n;
+    double sse, sse_c;
+    double sae, sae_c;
+    double sum_r, sum_r_c;
+    double y_mean;
+    double y_m2;
+    double max_error;
+} MetricsPartial;
+
+/**
+ * @struct Arguments shared by the threads of the metrics kernel
+ *
+ * y_hat gives the predictions, or is NULL to compute them from X * beta.
+ */
+typedef struct MetricsTask {
+    const double* y;
+    const double* y_hat;
+    Matrix* X;
+    const double* beta;
+    size_t rows;
+    MetricsPartial* partials;
+} MetricsTask;
+
+/**
+ * @brief Add value to the compensated sum (sum, c)
+ */
+static inline void _metrics_add(double* sum, double* c, double value) {
+    double t = *sum + value;
+    if (fabs(*sum) >= fabs(value)) {
+        *c += (*sum - t) + value;
+    } else {
+        *c += (value - t) + *sum;
+    }
+    *sum = t;
+}
+
+/**
+ * @brief Fold partial b into partial a, a covering the earlier rows
+ */
+static void _metrics_merge(MetricsPartial* a, const MetricsPartial* b) {
+    if (b->n == 0) return;
+    _metrics_add(&a->sse, &a->sse_c, b->sse + b->sse_c);
+    _metrics_add(&a->sae, &a->sae_c, b->sae + b->sae_c);
+    _metrics_add(&a->sum_r, &a->sum_r_c, b->sum_r + b->sum_r_c);
+
+    double n = (double)(a->n + b->n);
+    double delta = b->y_mean - a->y_mean;
+    a->y_m2 += b->y_m2 + delta * delta * (double)a->n * (double)b->n / n;
+    a->y_mean += delta * (double)b->n / n;
+    a->n += b->n;
+    if (b->max_error > a->max_error) a->max_error = b->max_error;
+}
+
+/**
+ * @brief parallel_for() body summing blocks [begin, end) of METRICS_BLOCK_ROWS rows
+ *
+ * Inside a block the sums run in plain, vectorizable loops over a cached
+ * copy of the residuals. Only the block totals are compensated.
+ */
+static void _metrics_task(size_t begin, size_t end, void* ctx) {
+    MetricsTask* task = (MetricsTask*)ctx;
+    double r[METRICS_BLOCK_ROWS];
+
+    for (size_t block = begin; block < end; block++) {
+        size_t lo = block * METRICS_BLOCK_ROWS;
+        size_t len = MIN(METRICS_BLOCK_ROWS, task->rows - lo);
+        const double* y = task->y + lo;
+
+        if (task->y_hat) {
+            for (size_t i = 0; i < len; i++) r[i] = y[i] - task->y_hat[lo + i];
+        } else {
+            for (size_t i = 0; i < len; i++) {
+                r[i] = y[i] - simd_dot(matrix_row(task->X, lo + i), task->beta, task->X->cols);
+            }
+        }
+
+        // METRICS_LANES independent sums per quantity keep the adds from
+        // waiting on each other, and map onto SIMD registers
+        double sse[METRICS_LANES] = {0}, sae[METRICS_LANES] = {0}, sum_r[METRICS_LANES] = {0};
+        double sum_y[METRICS_LANES] = {0}, max_error[METRICS_LANES] = {0};
+        size_t i = 0;
+        for (; i + METRICS_LANES <= len; i += METRICS_LANES) {
+            for (size_t l = 0; l < METRICS_LANES; l++) {
+                double e = r[i + l], a = fabs(e);
+                sse[l] += e * e;
+                sae[l] += a;
+                sum_r[l] += e;
+                sum_y[l] += y[i + l];
+                max_error[l] = a > max_error[l] ? a : max_error[l];
+            }
+        }
+        for (; i < len; i++) {
+            double e = r[i], a = fabs(e);
+            sse[0] += e * e;
+            sae[0] += a;
+            sum_r[0] += e;
+            sum_y[0] += y[i];
+            max_error[0] = a > max_error[0] ? a : max_error[0];
+        }
+        for (size_t l = 1; l < METRICS_LANES; l++) {
+            sse[0] += sse[l];
+            sae[0] += sae[l];
+            sum_r[0] += sum_r[l];
+            sum_y[0] += sum_y[l];
+            max_error[0] = max_error[l] > max_error[0] ? max_error[l] : max_error[0];
+        }
+
+        // The block is still in cache for the deviations from its mean
+        double y_mean = sum_y[0] / (double)len, y_m2[METRICS_LANES] = {0};
+        for (i = 0; i + METRICS_LANES <= len; i += METRICS_LANES) {
+            for (size_t l = 0; l < METRICS_LANES; l++) {
+                double d = y[i + l] - y_mean;
+                y_m2[l] += d * d;
+            }
+        }
+        for (; i < len; i++) y_m2[0] += (y[i] - y_mean) * (y[i] - y_mean);
+        for (size_t l = 1; l < METRICS_LANES; l++) y_m2[0] += y_m2[l];
+
+        MetricsPartial partial = { len, sse[0], 0.0, sae[0], 0.0, sum_r[0], 0.0, y_mean, y_m2[0], max_error[0] };
+        task->partials[block] = partial;
+    }
+}
+
+/**
+ * @brief Run the metrics kernel and fill in metrics
+ */
+static int _metrics_run(MetricsTask* task, Metrics* metrics) {
+    size_t rows = task->rows;
+    size_t blocks = (rows + METRICS_BLOCK_ROWS - 1) / METRICS_BLOCK_ROWS;
+    memset(metrics, 0, sizeof(Metrics));
+    if (rows == 0) return EXIT_SUCCESS;
+
+    task->partials = (MetricsPartial*)malloc(blocks * sizeof(MetricsPartial));
+    if (task->partials == NULL) {
+        fprintf(stderr, "Metrics: Unable to allocate workspace\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t block_work = 4 * METRICS_BLOCK_ROWS * (task->X ? task->X->cols + 1 : 1);
+    parallel_for(0, blocks, PARALLEL_MIN_WORK / block_work + 1, _metrics_task, task);
+
+    // Merged in row order, so the result does not depend on the thread count
+    MetricsPartial total = task->partials[0];
+    for (size_t b = 1; b < blocks; b++) _metrics_merge(&total, &task->partials[b]);
+    free(task->partials);
+
+    double n = (double)rows;
+    metrics->n = rows;
+    metrics->sse = total.sse + total.sse_c;
+    metrics->mse = metrics->sse / n;
+    metrics->rmse = sqrt(metrics->mse);
+    metrics->mae = (total.sae + total.sae_c) / n;
+    metrics->r2 = total.y_m2 > 0.0 ? 1.0 - metrics->sse / total.y_m2 : NAN;
+    metrics->max_error = total.max_error;
+    metrics->residual_mean = (total.sum_r + total.sum_r_c) / n;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Compute every fit metric of y_hat against y in one pass
+ *
+ * SSE, MSE, RMSE, MAE, R^2, the largest absolute error and the mean
+ * residual all come from a single read of y and y_hat, split across threads
+ * in blocks. The block totals are added with compensated summation, so the
+ * rounding error does not grow with the number of rows.
+ *
+ * @param y The targets
+ * @param y_hat The predictions
+ * @param metrics Filled in with the results
+ *
+ * @return int The resulting status code
+ */
+int compute_metrics(Vector* y, Vector* y_hat, Metrics* metrics) {
+    if (y->rows != y_hat->rows) {
+        fprintf(stderr, "Metrics: y has %zu rows, y_hat %zu\n", y->rows, y_hat->rows);
+        return EXIT_FAILURE;
+    }
+
+    MetricsTask task = { y->data, y_hat->data, NULL, NULL, y->rows, NULL };
+    return _metrics_run(&task, metrics);
+}
+
+/**
+ * @brief Compute every fit metric of the model X * beta against y in one pass
+ *
+ * As compute_metrics(), with each prediction computed from its row of X as
+ * it is needed, so y_hat is never stored.
+ *
+ * @param X The m x n observations
+ * @param beta The n coefficients
+ * @param y The m targets
+ * @param metrics Filled in with the results
+ *
+ * @return int The resulting status code
+ */
+int compute_model_metrics(Matrix* X, Vector* beta, Vector* y, Metrics* metrics) {
+    if (X->cols != beta->rows || X->rows != y->rows) {
+        fprintf(stderr, "Metrics: The matrix and vectors have incompatible sizes\n");
+        return EXIT_FAILURE;
+    }
+
+    MetricsTask task = { y->data, NULL, X, beta->data, y->rows, NULL };
+    return _metrics_run(&task, metrics);
+}
+
+/**
+ * @struct The held-out errors of a k-fold cross-validation
+ */
+typedef struct CrossValidation {
+    size_t folds;
+    Vector* fold_mse;
+    Vector* fold_mae;
+    // Over every held-out row, so larger folds count for more
+    double mse;
+    double mae;
+} CrossValidation;
+
+/**
+ * @brief Free the results of a cross-validation
+ *
+ * @param cv The results to free
+ * @return void
+ */
+void free_cross_validation(CrossValidation* cv) {
+    if (cv == NULL) return;
+    if (cv->fold_mse) free_vector(cv->fold_mse);
+    if (cv->fold_mae) free_vector(cv->fold_mae);
+    free(cv);
+}
+
+/**
+ * @struct Arguments shared by the threads of cross_validate()
+ *
+ * Fold f holds rows [bounds[f], bounds[f + 1]) of A. G and g are the upper
+ * triangle of At * A and At * b over all rows, fold_G and fold_g the same
+ * over each fold's rows alone.
+ */
+typedef struct CrossValidationTask {
+    Matrix* A;
+    Vector* b;
+    const size_t* bounds;
+    Matrix* G;
+    Vector* g;
+    Matrix** fold_G;
+    Vector** fold_g;
+    double lambda;
+    double* sse;
+    double* sae;
+    atomic_int status;
+} CrossValidationTask;
+
+/**
+ * @brief parallel_for() body training on all but fold f and scoring fold f, for folds [begin, end)
+ */
+static void _cross_validation_task(size_t begin, size_t end, void* ctx) {
+    CrossValidationTask* task = (CrossValidationTask*)ctx;
+    size_t n = task->A->cols;
+    for (size_t f = begin; f < end; f++) {
+        // The training rows' system is the whole system minus the held-out fold's
+        Matrix* T = create_empty_matrix(n, n);
+        Vector* t = create_empty_vector(n);
+        if (T == NULL || t == NULL) {
+            if (T) free_matrix(T);
+            if (t) free_vector(t);
+            atomic_store(&task->status, EXIT_FAILURE);
+            continue;
+        }
+        for (size_t i = 0; i < n; i++) {
+            double* T_i = matrix_row(T, i);
+            const double* G_i = matrix_row(task->G, i);
+            const double* F_i = matrix_row(task->fold_G[f], i);
+            for (size_t j = i; j < n; j++) T_i[j] = G_i[j] - F_i[j];
+            T_i[i] += task->lambda;
+            t->data[i] = task->g->data[i] - task->fold_g[f]->data[i];
+        }
+        mirror_upper_triangle(T);
+
+        size_t train_rows = task->A->rows - (task->bounds[f + 1] - task->bounds[f]);
+        Vector* x = solve_normal_equations(T, t, NULL);
+        if (x == NULL) {
+            size_t rank = 0;
+            x = pinv_solve(T, t, svd_default_rcond(train_rows, n), &rank);
+        }
+        free_matrix(T);
+        free_vector(t);
+        if (x == NULL) {
+            atomic_store(&task->status, EXIT_FAILURE);
+            continue;
+        }
+
+        // Score the held-out rows through views of them
+        size_t lo = task->bounds[f], rows = task->bounds[f + 1] - lo;
+        Matrix held_out = *task->A;
+        Vector held_out_b = *task->b;
+        held_out.data = matrix_row(task->A, lo);
+        held_out.rows = rows;
+        held_out_b.data = task->b->data + lo;
+        held_out_b.rows = rows;
+        Metrics metrics;
+        if (compute_model_metrics(&held_out, x, &held_out_b, &metrics) != EXIT_SUCCESS) {
+            free_vector(x);
+            atomic_store(&task->status, EXIT_FAILURE);
+            continue;
+        }
+        task->sse[f] = metrics.sse;
+        task->sae[f] = metrics.mae * (double)rows;
+        free_vector(x);
+    }
+}
+
+/**
+ * @brief Estimate the prediction error of ols() or ridge() by k-fold cross-validation
+ *
+ * The rows are split into k contiguous folds of near equal size. Shuffle
+ * the rows first if their order carries meaning. One pass over A builds
+ * At * A and At * b for every fold, and their sums give the whole system.
+ * The system for training without fold f is then the whole system minus
+ * fold f's share, so no fold refits from the data. The k solves run in
+ * parallel, and each model is scored on its held-out rows. The total cost
+ * is about one fit: m * n^2 for the Gram matrices plus k * n^3 / 3 for the
+ * solves.
+ *
+ * @param A An m x n matrix of observations
+ * @param b An m x 1 vector of target observations
+ * @param k The number of folds, from 2 to m
+ * @param lambda The ridge penalty, 0 for ordinary least squares
+ *
+ * @return CrossValidation* The per fold and overall held-out MSE and MAE, or
+ * NULL on failure
+ * @note The caller is reponsible for freeing this memory using free_cross_validation()
+ */
+CrossValidation* cross_validate(Matrix* A, Vector* b, size_t k, double lambda) {
+    size_t m = A->rows, n = A->cols;
+    if (b->rows != m) {
+        fprintf(stderr, "Cross Validation: A and b have different numbers of rows\n");
+        return NULL;
+    }
+    if (k < 2 || k > m) {
+        fprintf(stderr, "Cross Validation: Cannot split %zu rows into %zu folds\n", m, k);
+        return NULL;
+    }
+    if (!(lambda >= 0.0)) {
+        fprintf(stderr, "Cross Validation: lambda must not be negative, got %g\n", lambda);
+        return NULL;
+    }
+
+    ML_TRACE_BEGIN(span, "cross_validate");
+
+    CrossValidation* cv = (CrossValidation*)calloc(1, sizeof(CrossValidation));
+    size_t* bounds = (size_t*)malloc((k + 1) * sizeof(size_t));
+    Matrix** fold_G = (Matrix**)calloc(k, sizeof(Matrix*));
+    Vector** fold_g = (Vector**)calloc(k, sizeof(Vector*));
+    Matrix* G = create_empty_matrix(n, n);
+    Vector* g = create_empty_vector(n);
+    // The fold Gram matrices need the rows in order
+    Matrix* A_ordered = A->perm ? copy_matrix(A) : A;
+    int status = (cv && bounds && fold_G && fold_g && G && g && A_ordered) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (status == EXIT_SUCCESS) {
+        cv->folds = k;
+        cv->fold_mse = create_empty_vector(k);
+        cv->fold_mae = create_empty_vector(k);
+        if (cv->fold_mse == NULL || cv->fold_mae == NULL) status = EXIT_FAILURE;
+    }
+
+    for (size_t f = 0; f < k && status == EXIT_SUCCESS; f++) {
+        bounds[f] = f * m / k;
+        bounds[f + 1] = (f + 1) * m / k;
+        fold_G[f] = create_empty_matrix(n, n);
+        fold_g[f] = create_empty_vector(n);
+        if (fold_G[f] == NULL || fold_g[f] == NULL) {
+            status = EXIT_FAILURE;
+            break;
+        }
+
+        size_t rows = bounds[f + 1] - bounds[f];
+        status = gram_accumulate(matrix_row(A_ordered, bounds[f]), A_ordered->stride, rows, n,
+                                 b->data + bounds[f], fold_G[f]->data, fold_G[f]->stride, fold_g[f]->data);
+        for (size_t i = 0; i < n && status == EXIT_SUCCESS; i++) {
+            double* G_i = matrix_row(G, i);
+            const double* F_i = matrix_row(fold_G[f], i);
+            for (size_t j = i; j < n; j++) G_i[j] += F_i[j];
+            g->data[i] += fold_g[f]->data[i];
+        }
+    }
+
+    if (status == EXIT_SUCCESS) {
+        CrossValidationTask task = { A_ordered, b, bounds, G, g, fold_G, fold_g, lambda,
+                                     cv->fold_mse->data, cv->fold_mae->data, EXIT_SUCCESS };
+        parallel_for(0, k, 1, _cross_validation_task, &task);
+        status = atomic_load(&task.status);
+    }
+
+    if (status == EXIT_SUCCESS) {
+        double sse = 0.0, sae = 0.0;
+        for (size_t f = 0; f < k; f++) {
+            double rows = (double)(bounds[f + 1] - bounds[f]);
+            sse += cv->fold_mse->data[f];
+            sae += cv->fold_mae->data[f];
+            cv->fold_mse->data[f] /= rows;
+            cv->fold_mae->data[f] /= rows;
+        }
+        cv->mse = sse / (double)m;
+        cv->mae = sae / (double)m;
+    }
+
+    for (size_t f = 0; f < k && fold_G && fold_g; f++) {
+        if (fold_G[f]) free_matrix(fold_G[f]);
+        if (fold_g[f]) free_vector(fold_g[f]);
+    }
+    free(fold_G);
+    free(fold_g);
+    free(bounds);
+    if (G) free_matrix(G);
+    if (g) free_vector(g);
+    if (A_ordered && A_ordered != A) free_matrix(A_ordered);
+
+    // One pass of Gram matrices over A, then a solve and a scoring pass per fold
+    ML_TRACE_END(span, (double)m * n * (n + 3) + k * (double)n * n * n / 3.0 + 2.0 * m * n, 16.0 * m * (n + 1));
+
+    if (status != EXIT_SUCCESS) {
+        free_cross_validation(cv);
+        return NULL;
+    }
+    return cv;
+}
+
 /** @brief Compute the Standard Squared Error
  * 
  * Compute the SSE of two vectors. Store result in a passed double, return
@@ -62,13 +1925,9 @@ int sse(Vector* y, Vector* y_hat, double* result) {
         return EXIT_FAILURE;
     }
 
-    size_t rows = y->rows;
-    *result = 0.0;
-    
-    for (size_t i = 0; i < rows; i++) {
-        double diff = y->data[i] - y_hat->data[i];
-        *result += (diff * diff);
-    }
+    Metrics metrics;
+    if (compute_metrics(y, y_hat, &metrics) != EXIT_SUCCESS) return EXIT_FAILURE;
+    *result = metrics.sse;
 
     return EXIT_SUCCESS;
 }
@@ -86,13 +1945,11 @@ int mse(Vector* y, Vector* y_hat, double* result) {
         return EXIT_FAILURE;
     }
 
-    size_t rows = y->rows;
-    sse(y, y_hat, result);
-
-    *result = *result / (double)rows;
+    Metrics metrics;
+    if (compute_metrics(y, y_hat, &metrics) != EXIT_SUCCESS) return EXIT_FAILURE;
+    *result = metrics.mse;
 
     return EXIT_SUCCESS;
-    
 }
 
 /** @brief Compute the Mean Absolute error
@@ -108,13 +1965,9 @@ int mse(Vector* y, Vector* y_hat, double* result) {
         return EXIT_FAILURE;
     }
 
-    *result = 0.0;
-
-    for (size_t i = 0; i < y->rows; i++) {
-        *result += fabs(y->data[i] - y_hat->data[i]);
-    }
-
-    *result = *result / (double)y->rows;
+    Metrics metrics;
+    if (compute_metrics(y, y_hat, &metrics) != EXIT_SUCCESS) return EXIT_FAILURE;
+    *result = metrics.mae;
 
     return EXIT_SUCCESS;
 
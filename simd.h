@@ -0,0 +1,383 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/**
+ * Runtime selection of vectorised kernels.
+ *
+ * Every kernel here has one implementation per instruction set level. The
+ * best level the CPU and operating system support is found through CPUID the
+ * first time a kernel runs, and the matching implementations are installed
+ * behind function pointers. The whole program can be built for a baseline
+ * target and still use AVX2 or AVX-512 where they are available.
+ *
+ * Setting the environment variable ML_SIMD to scalar, sse2, avx2 or avx512
+ * forces a level, which is how each path is exercised in testing. A level the
+ * machine cannot run falls back to the best supported one.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+/**
+ * @enum Instruction set levels, ordered so a higher level implies the lower ones
+ */
+typedef enum SimdLevel {
+    SIMD_SCALAR = 0,
+    SIMD_SSE2,
+    SIMD_AVX2,
+    SIMD_AVX512
+} SimdLevel;
+
+/**
+ * @brief Get the name of an instruction set level, as accepted by ML_SIMD
+ *
+ * @param level The level
+ * @return const char*
+ */
+const char* simd_level_name(SimdLevel level) {
+    switch (level) {
+        case SIMD_SSE2: return "sse2";
+        case SIMD_AVX2: return "avx2";
+        case SIMD_AVX512: return "avx512";
+        default: return "scalar";
+    }
+}
+
+/**
+ * @brief Find the best instruction set level this machine can run
+ *
+ * AVX levels need both the CPUID feature bits and the operating system having
+ * enabled the wider register state, which is read from XCR0.
+ *
+ * @return SimdLevel
+ */
+SimdLevel simd_detect_level() {
+#ifdef SIMD_X86
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return SIMD_SCALAR;
+    }
+
+    SimdLevel level = SIMD_SCALAR;
+    if (edx & (1u << 26)) {
+        level = SIMD_SSE2;
+    }
+
+    int has_osxsave = (ecx & (1u << 27)) != 0;
+    int has_avx = (ecx & (1u << 28)) != 0;
+    int has_fma = (ecx & (1u << 12)) != 0;
+    if (!has_osxsave || !has_avx || !has_fma) {
+        return level;
+    }
+
+    unsigned int xcr0_lo, xcr0_hi;
+    __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    (void)xcr0_hi;
+
+    // XMM and YMM state
+    if ((xcr0_lo & 0x6) != 0x6) {
+        return level;
+    }
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return level;
+    }
+
+    if (ebx & (1u << 5)) {
+        level = SIMD_AVX2;
+    }
+
+    // AVX-512F plus the opmask and upper ZMM state
+    if (level == SIMD_AVX2 && (ebx & (1u << 16)) && (xcr0_lo & 0xE0) == 0xE0) {
+        level = SIMD_AVX512;
+    }
+
+    return level;
+#else
+    return SIMD_SCALAR;
+#endif
+}
+
+// --- Dot product ---
+
+static double _simd_dot_scalar(const double* a, const double* b, size_t n) {
+    // Four independent chains so the adds overlap instead of waiting on each other
+    double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        s0 += a[i] * b[i];
+        s1 += a[i + 1] * b[i + 1];
+        s2 += a[i + 2] * b[i + 2];
+        s3 += a[i + 3] * b[i + 3];
+    }
+    for (; i < n; i++) {
+        s0 += a[i] * b[i];
+    }
+
+    return (s0 + s1) + (s2 + s3);
+}
+
+#ifdef SIMD_X86
+__attribute__((target("sse2")))
+static double _simd_dot_sse2(const double* a, const double* b, size_t n) {
+    __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+    __m128d s2 = _mm_setzero_pd(), s3 = _mm_setzero_pd();
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+        s2 = _mm_add_pd(s2, _mm_mul_pd(_mm_loadu_pd(a + i + 4), _mm_loadu_pd(b + i + 4)));
+        s3 = _mm_add_pd(s3, _mm_mul_pd(_mm_loadu_pd(a + i + 6), _mm_loadu_pd(b + i + 6)));
+    }
+
+    __m128d s = _mm_add_pd(_mm_add_pd(s0, s1), _mm_add_pd(s2, s3));
+    double lanes[2];
+    _mm_storeu_pd(lanes, s);
+    double sum = lanes[0] + lanes[1];
+
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static double _simd_dot_avx2(const double* a, const double* b, size_t n) {
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    __m256d s2 = _mm256_setzero_pd(), s3 = _mm256_setzero_pd();
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        s0 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), s0);
+        s1 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4), s1);
+        s2 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 8), _mm256_loadu_pd(b + i + 8), s2);
+        s3 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 12), _mm256_loadu_pd(b + i + 12), s3);
+    }
+    for (; i + 4 <= n; i += 4) {
+        s0 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), s0);
+    }
+
+    __m256d s = _mm256_add_pd(_mm256_add_pd(s0, s1), _mm256_add_pd(s2, s3));
+    __m128d half = _mm_add_pd(_mm256_castpd256_pd128(s), _mm256_extractf128_pd(s, 1));
+    double lanes[2];
+    _mm_storeu_pd(lanes, half);
+    double sum = lanes[0] + lanes[1];
+
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avx512f")))
+static double _simd_dot_avx512(const double* a, const double* b, size_t n) {
+    __m512d s0 = _mm512_setzero_pd(), s1 = _mm512_setzero_pd();
+    __m512d s2 = _mm512_setzero_pd(), s3 = _mm512_setzero_pd();
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        s0 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i), s0);
+        s1 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i + 8), _mm512_loadu_pd(b + i + 8), s1);
+        s2 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i + 16), _mm512_loadu_pd(b + i + 16), s2);
+        s3 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i + 24), _mm512_loadu_pd(b + i + 24), s3);
+    }
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i), s0);
+    }
+
+    // The last partial vector is loaded under a mask, so no scalar tail
+    if (i < n) {
+        __mmask8 tail = (__mmask8)((1u << (n - i)) - 1);
+        s1 = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(tail, a + i), _mm512_maskz_loadu_pd(tail, b + i), s1);
+    }
+
+    __m512d s = _mm512_add_pd(_mm512_add_pd(s0, s1), _mm512_add_pd(s2, s3));
+    return _mm512_reduce_add_pd(s);
+}
+#endif
+
+// --- Single precision dot product ---
+
+static float _simd_dot_f_scalar(const float* a, const float* b, size_t n) {
+    float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        s0 += a[i] * b[i];
+        s1 += a[i + 1] * b[i + 1];
+        s2 += a[i + 2] * b[i + 2];
+        s3 += a[i + 3] * b[i + 3];
+    }
+    for (; i < n; i++) {
+        s0 += a[i] * b[i];
+    }
+
+    return (s0 + s1) + (s2 + s3);
+}
+
+#ifdef SIMD_X86
+__attribute__((target("avx2,fma")))
+static float _simd_dot_f_avx2(const float* a, const float* b, size_t n) {
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    __m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+        s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), s1);
+        s2 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16), s2);
+        s3 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24), s3);
+    }
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+    }
+
+    __m256 s = _mm256_add_ps(_mm256_add_ps(s0, s1), _mm256_add_ps(s2, s3));
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+    float lanes[4];
+    _mm_storeu_ps(lanes, half);
+    float sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+#endif
+
+// --- Dispatch ---
+
+typedef double (*simd_dot_fn)(const double* a, const double* b, size_t n);
+typedef float (*simd_dot_f_fn)(const float* a, const float* b, size_t n);
+
+static double _simd_dot_resolve(const double* a, const double* b, size_t n);
+static float _simd_dot_f_resolve(const float* a, const float* b, size_t n);
+
+// The kernels start as resolvers that run the detection once, from whichever thread calls first
+static pthread_once_t _simd_once = PTHREAD_ONCE_INIT;
+static atomic_int _simd_level = SIMD_SCALAR;
+static _Atomic(simd_dot_fn) _simd_dot = _simd_dot_resolve;
+static _Atomic(simd_dot_f_fn) _simd_dot_f = _simd_dot_f_resolve;
+
+/**
+ * @brief Install the kernels for a level, lowered to what the machine supports
+ *
+ * @return SimdLevel The level that was installed
+ */
+static SimdLevel _simd_install(SimdLevel level) {
+    SimdLevel supported = simd_detect_level();
+    if (level > supported) {
+        fprintf(stderr, "SIMD: %s is not supported here, using %s\n",
+                simd_level_name(level), simd_level_name(supported));
+        level = supported;
+    }
+
+    simd_dot_fn dot = _simd_dot_scalar;
+    simd_dot_f_fn dot_f = _simd_dot_f_scalar;
+#ifdef SIMD_X86
+    if (level == SIMD_SSE2) dot = _simd_dot_sse2;
+    if (level == SIMD_AVX2) dot = _simd_dot_avx2;
+    if (level == SIMD_AVX512) dot = _simd_dot_avx512;
+    if (level >= SIMD_AVX2) dot_f = _simd_dot_f_avx2;
+#endif
+
+    atomic_store(&_simd_dot, dot);
+    atomic_store(&_simd_dot_f, dot_f);
+    atomic_store(&_simd_level, (int)level);
+    return level;
+}
+
+/**
+ * @brief Select the kernels on first use, honouring the ML_SIMD override
+ *
+ * @return void
+ */
+static void _simd_init() {
+    SimdLevel level = simd_detect_level();
+    const char* forced = getenv("ML_SIMD");
+
+    if (forced != NULL && *forced != '\0') {
+        int matched = 0;
+        for (int l = SIMD_SCALAR; l <= SIMD_AVX512; l++) {
+            if (strcmp(forced, simd_level_name((SimdLevel)l)) == 0) {
+                level = (SimdLevel)l;
+                matched = 1;
+            }
+        }
+        if (!matched) {
+            fprintf(stderr, "SIMD: Unknown ML_SIMD value '%s', ignoring it\n", forced);
+        }
+    }
+
+    _simd_install(level);
+}
+
+/**
+ * @brief Install the kernels for a given instruction set level
+ *
+ * @param level The requested level. It is lowered to the best level the
+ * machine supports if needed.
+ * @return SimdLevel The level that was installed
+ */
+SimdLevel simd_set_level(SimdLevel level) {
+    // Detect first, so the automatic choice can never overwrite this one later
+    pthread_once(&_simd_once, _simd_init);
+    return _simd_install(level);
+}
+
+/**
+ * @brief Get the instruction set level the kernels are currently using
+ *
+ * @return SimdLevel
+ */
+SimdLevel simd_active_level() {
+    pthread_once(&_simd_once, _simd_init);
+    return (SimdLevel)atomic_load(&_simd_level);
+}
+
+static double _simd_dot_resolve(const double* a, const double* b, size_t n) {
+    pthread_once(&_simd_once, _simd_init);
+    return atomic_load(&_simd_dot)(a, b, n);
+}
+
+static float _simd_dot_f_resolve(const float* a, const float* b, size_t n) {
+    pthread_once(&_simd_once, _simd_init);
+    return atomic_load(&_simd_dot_f)(a, b, n);
+}
+
+/**
+ * @brief Compute the dot product of two arrays with the active kernel
+ *
+ * @param a The first array
+ * @param b The second array
+ * @param n The number of elements in each array
+ * @return double
+ */
+static inline double simd_dot(const double* a, const double* b, size_t n) {
+    return atomic_load_explicit(&_simd_dot, memory_order_relaxed)(a, b, n);
+}
+
+/**
+ * @brief Compute the dot product of two float arrays with the active kernel
+ *
+ * @param a The first array
+ * @param b The second array
+ * @param n The number of elements in each array
+ * @return float
+ */
+static inline float simd_dot_f(const float* a, const float* b, size_t n) {
+    return atomic_load_explicit(&_simd_dot_f, memory_order_relaxed)(a, b, n);
+}
+
+#endif
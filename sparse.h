@@ -0,0 +1,604 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "matrix.h"
+#include "stream.h"
+#include "thread_pool.h"
+
+/**
+ * Compressed sparse row (CSR) matrices.
+ *
+ * Row i holds the entries row_ptr[i] to row_ptr[i + 1] - 1 of col_idx and
+ * values, with its columns in increasing order and no column repeated.
+ * Only the nonzeros are stored, so memory and the cost of the products
+ * below grow with nnz rather than with rows x cols.
+ *
+ * A sparse matrix can be read from a dense CSV or binary file, keeping only
+ * its nonzeros, or from a CSV of row,col,value triplets (COO format). The
+ * Gram matrix At * A it produces is dense, n x n, and is solved by the same
+ * routines as the dense path.
+ */
+
+// Rows read at a time when a dense file is loaded as a sparse matrix
+#ifndef SPARSE_STREAM_CHUNK_ROWS
+#define SPARSE_STREAM_CHUNK_ROWS 4096
+#endif
+
+/**
+ * @struct A matrix in compressed sparse row format
+ */
+typedef struct SparseMatrix {
+    size_t rows;
+    size_t cols;
+    size_t nnz;
+    size_t* row_ptr;
+    size_t* col_idx;
+    double* values;
+} SparseMatrix;
+
+/**
+ * @brief Free a sparse matrix
+ *
+ * @param mat The sparse matrix to free
+ * @return void
+ */
+void free_sparse_matrix(SparseMatrix* mat) {
+    if (mat == NULL) return;
+    free(mat->row_ptr);
+    free(mat->col_idx);
+    free(mat->values);
+    free(mat);
+}
+
+/**
+ * @brief Create a sparse matrix with room for nnz entries
+ *
+ * row_ptr is zeroed, so the matrix is all zeros until the caller fills in
+ * its entries and row_ptr.
+ *
+ * @param rows The number of rows
+ * @param cols The number of columns
+ * @param nnz The number of entries to make room for
+ *
+ * @return SparseMatrix*, or NULL if the memory cannot be allocated
+ * @note The caller is responsible for freeing this memory using free_sparse_matrix()
+ */
+SparseMatrix* create_sparse_matrix(size_t rows, size_t cols, size_t nnz) {
+    SparseMatrix* mat = (SparseMatrix*)malloc(sizeof(SparseMatrix));
+    if (mat == NULL) {
+        fprintf(stderr, "Sparse: Unable to allocate matrix\n");
+        return NULL;
+    }
+
+    mat->rows = rows;
+    mat->cols = cols;
+    mat->nnz = nnz;
+    mat->row_ptr = (size_t*)calloc(rows + 1, sizeof(size_t));
+    // One spare entry so an empty matrix still gets real pointers
+    mat->col_idx = (size_t*)malloc((nnz + 1) * sizeof(size_t));
+    mat->values = (double*)malloc((nnz + 1) * sizeof(double));
+    if (mat->row_ptr == NULL || mat->col_idx == NULL || mat->values == NULL) {
+        fprintf(stderr, "Sparse: Unable to allocate %zu entries\n", nnz);
+        free_sparse_matrix(mat);
+        return NULL;
+    }
+    return mat;
+}
+
+/**
+ * @brief Create a sparse matrix from coordinate (COO) triplets
+ *
+ * Entry k is value v[k] at row r[k] and column c[k]. The triplets may come
+ * in any order, and entries given more than once are summed. Two stable
+ * counting sorts, by column and then by row, put them in CSR order in
+ * O(nnz + rows + cols) time.
+ *
+ * @param rows The number of rows
+ * @param cols The number of columns
+ * @param nnz The number of triplets
+ * @param r The row of each triplet
+ * @param c The column of each triplet
+ * @param v The value of each triplet
+ *
+ * @return SparseMatrix*, or NULL if an index is out of range
+ * @note The caller is responsible for freeing this memory using free_sparse_matrix()
+ */
+SparseMatrix* sparse_from_coo(size_t rows, size_t cols, size_t nnz,
+                              const size_t* r, const size_t* c, const double* v) {
+    for (size_t k = 0; k < nnz; k++) {
+        if (r[k] >= rows || c[k] >= cols) {
+            fprintf(stderr, "Sparse: Entry (%zu, %zu) is outside a %zu x %zu matrix\n",
+                    r[k], c[k], rows, cols);
+            return NULL;
+        }
+    }
+
+    SparseMatrix* mat = create_sparse_matrix(rows, cols, nnz);
+    size_t* col_start = (size_t*)calloc(cols + 1, sizeof(size_t));
+    size_t* by_col = (size_t*)malloc((nnz + 1) * sizeof(size_t));
+    size_t* next = (size_t*)malloc((rows + 1) * sizeof(size_t));
+    if (mat == NULL || col_start == NULL || by_col == NULL || next == NULL) {
+        free_sparse_matrix(mat);
+        free(col_start);
+        free(by_col);
+        free(next);
+        return NULL;
+    }
+
+    // Triplet indices ordered by column
+    for (size_t k = 0; k < nnz; k++) col_start[c[k] + 1]++;
+    for (size_t j = 0; j < cols; j++) col_start[j + 1] += col_start[j];
+    for (size_t k = 0; k < nnz; k++) by_col[col_start[c[k]]++] = k;
+
+    // Then stably by row, which leaves each row's columns in order
+    size_t* row_ptr = mat->row_ptr;
+    for (size_t k = 0; k < nnz; k++) row_ptr[r[k] + 1]++;
+    for (size_t i = 0; i < rows; i++) row_ptr[i + 1] += row_ptr[i];
+    memcpy(next, row_ptr, rows * sizeof(size_t));
+    for (size_t t = 0; t < nnz; t++) {
+        size_t k = by_col[t];
+        size_t dst = next[r[k]]++;
+        mat->col_idx[dst] = c[k];
+        mat->values[dst] = v[k];
+    }
+
+    // Sum repeated entries, compacting the rows towards the front
+    size_t out = 0;
+    for (size_t i = 0; i < rows; i++) {
+        size_t begin = row_ptr[i], end = row_ptr[i + 1];
+        row_ptr[i] = out;
+        for (size_t k = begin; k < end; k++) {
+            if (out > row_ptr[i] && mat->col_idx[out - 1] == mat->col_idx[k]) {
+                mat->values[out - 1] += mat->values[k];
+            } else {
+                mat->col_idx[out] = mat->col_idx[k];
+                mat->values[out] = mat->values[k];
+                out++;
+            }
+        }
+    }
+    row_ptr[rows] = out;
+    mat->nnz = out;
+
+    free(col_start);
+    free(by_col);
+    free(next);
+    return mat;
+}
+
+/**
+ * @brief Create a sparse matrix holding the nonzeros of a dense matrix
+ *
+ * @param A The dense matrix
+ *
+ * @return SparseMatrix*, or NULL if the memory cannot be allocated
+ * @note The caller is responsible for freeing this memory using free_sparse_matrix()
+ */
+SparseMatrix* sparse_from_dense(Matrix* A) {
+    size_t nnz = 0;
+    for (size_t i = 0; i < A->rows; i++) {
+        const double* row = matrix_row(A, i);
+        for (size_t j = 0; j < A->cols; j++) nnz += row[j] != 0.0;
+    }
+
+    SparseMatrix* mat = create_sparse_matrix(A->rows, A->cols, nnz);
+    if (mat == NULL) return NULL;
+
+    size_t k = 0;
+    for (size_t i = 0; i < A->rows; i++) {
+        const double* row = matrix_row(A, i);
+        for (size_t j = 0; j < A->cols; j++) {
+            if (row[j] != 0.0) {
+                mat->col_idx[k] = j;
+                mat->values[k] = row[j];
+                k++;
+            }
+        }
+        mat->row_ptr[i + 1] = k;
+    }
+    return mat;
+}
+
+/**
+ * @brief Grow the entry arrays of a sparse matrix being built to hold nnz entries
+ */
+static int _sparse_reserve(SparseMatrix* mat, size_t* capacity, size_t nnz) {
+    if (nnz <= *capacity) return EXIT_SUCCESS;
+
+    size_t new_capacity = *capacity * 2;
+    if (new_capacity < nnz) new_capacity = nnz;
+    size_t* col_idx = (size_t*)realloc(mat->col_idx, new_capacity * sizeof(size_t));
+    if (col_idx != NULL) mat->col_idx = col_idx;
+    double* values = (double*)realloc(mat->values, new_capacity * sizeof(double));
+    if (values != NULL) mat->values = values;
+    if (col_idx == NULL || values == NULL) {
+        fprintf(stderr, "Sparse: Unable to grow to %zu entries\n", new_capacity);
+        return EXIT_FAILURE;
+    }
+    *capacity = new_capacity;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Create a sparse matrix from a dense CSV or binary file
+ *
+ * The file is read SPARSE_STREAM_CHUNK_ROWS rows at a time through stream.h
+ * and only the nonzeros are kept, so the whole dense matrix is never held in
+ * memory.
+ *
+ * @param file_name The name of the CSV or binary file
+ *
+ * @return SparseMatrix*, or NULL if the file cannot be read or is malformed
+ * @note The caller is responsible for freeing this memory using free_sparse_matrix()
+ */
+SparseMatrix* create_sparse_matrix_from_file(char* file_name) {
+    RowStream stream;
+    if (row_stream_open(&stream, file_name, 0) != EXIT_SUCCESS) {
+        row_stream_close(&stream);
+        return NULL;
+    }
+
+    size_t cols = stream.cols;
+    size_t row_capacity = SPARSE_STREAM_CHUNK_ROWS;
+    size_t capacity = SPARSE_STREAM_CHUNK_ROWS;
+    SparseMatrix* mat = create_sparse_matrix(row_capacity, cols, capacity);
+    double* chunk = (double*)malloc(SPARSE_STREAM_CHUNK_ROWS * (cols + 1) * sizeof(double));
+    int status = (mat && chunk) ? EXIT_SUCCESS : EXIT_FAILURE;
+    size_t rows = 0, nnz = 0;
+
+    while (status == EXIT_SUCCESS) {
+        size_t got = 0;
+        status = row_stream_read(&stream, chunk, cols, SPARSE_STREAM_CHUNK_ROWS, &got);
+        if (status != EXIT_SUCCESS || got == 0) break;
+
+        if (rows + got > row_capacity) {
+            while (rows + got > row_capacity) row_capacity *= 2;
+            size_t* row_ptr = (size_t*)realloc(mat->row_ptr, (row_capacity + 1) * sizeof(size_t));
+            if (row_ptr == NULL) {
+                fprintf(stderr, "Sparse: Unable to grow to %zu rows\n", row_capacity);
+                status = EXIT_FAILURE;
+                break;
+            }
+            mat->row_ptr = row_ptr;
+        }
+
+        for (size_t i = 0; i < got && status == EXIT_SUCCESS; i++) {
+            const double* row = chunk + i * cols;
+            size_t row_nnz = 0;
+            for (size_t j = 0; j < cols; j++) row_nnz += row[j] != 0.0;
+            status = _sparse_reserve(mat, &capacity, nnz + row_nnz);
+            if (status != EXIT_SUCCESS) break;
+
+            for (size_t j = 0; j < cols; j++) {
+                if (row[j] != 0.0) {
+                    mat->col_idx[nnz] = j;
+                    mat->values[nnz] = row[j];
+                    nnz++;
+                }
+            }
+            mat->row_ptr[++rows] = nnz;
+        }
+    }
+
+    row_stream_close(&stream);
+    free(chunk);
+    if (status != EXIT_SUCCESS) {
+        free_sparse_matrix(mat);
+        return NULL;
+    }
+
+    mat->rows = rows;
+    mat->nnz = nnz;
+    return mat;
+}
+
+/**
+ * @brief Create a sparse matrix from a CSV of row,col,value triplets
+ *
+ * Every line holds one entry: its 0-based row, its 0-based column and its
+ * value. Lines may come in any order and repeated entries are summed, see
+ * sparse_from_coo().
+ *
+ * @param file_name The name of the CSV file
+ * @param rows The number of rows, or 0 to use one past the largest row given
+ * @param cols The number of columns, or 0 to use one past the largest column given
+ *
+ * @return SparseMatrix*, or NULL if the file cannot be read or is malformed
+ * @note The caller is responsible for freeing this memory using free_sparse_matrix()
+ */
+SparseMatrix* create_sparse_matrix_from_coo(char* file_name, size_t rows, size_t cols) {
+    CsvFile csv;
+    if (csv_open(file_name, &csv) != EXIT_SUCCESS) {
+        return NULL;
+    }
+    if (csv.cols != 3) {
+        fprintf(stderr, "Sparse: %s: expected row,col,value on each line, found %zu fields\n",
+                file_name, csv.cols);
+        csv_close(&csv);
+        return NULL;
+    }
+
+    size_t nnz = csv.rows;
+    double* triplets = (double*)malloc((nnz + 1) * 3 * sizeof(double));
+    size_t* r = (size_t*)malloc((nnz + 1) * sizeof(size_t));
+    size_t* c = (size_t*)malloc((nnz + 1) * sizeof(size_t));
+    double* v = (double*)malloc((nnz + 1) * sizeof(double));
+    int status = (triplets && r && c && v) ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (status == EXIT_SUCCESS) status = csv_read(&csv, triplets, 3);
+    csv_close(&csv);
+
+    size_t max_row = 0, max_col = 0;
+    for (size_t k = 0; k < nnz && status == EXIT_SUCCESS; k++) {
+        double row = triplets[3 * k], col = triplets[3 * k + 1];
+        if (row < 0.0 || col < 0.0 || row != floor(row) || col != floor(col)) {
+            fprintf(stderr, "Sparse: %s: line %zu: (%g, %g) is not a valid index\n",
+                    file_name, k + 1, row, col);
+            status = EXIT_FAILURE;
+            break;
+        }
+        r[k] = (size_t)row;
+        c[k] = (size_t)col;
+        v[k] = triplets[3 * k + 2];
+        if (r[k] + 1 > max_row) max_row = r[k] + 1;
+        if (c[k] + 1 > max_col) max_col = c[k] + 1;
+    }
+
+    SparseMatrix* mat = NULL;
+    if (status == EXIT_SUCCESS) {
+        mat = sparse_from_coo(rows ? rows : max_row, cols ? cols : max_col, nnz, r, c, v);
+    }
+
+    free(triplets);
+    free(r);
+    free(c);
+    free(v);
+    return mat;
+}
+
+/**
+ * @brief Index the entries of a sparse matrix by column
+ *
+ * Column j's entries are col_ptr[j] to col_ptr[j + 1] - 1 of row_of and pos,
+ * in increasing row order: row_of gives each entry's row and pos its index
+ * into col_idx and values.
+ */
+static int _sparse_columns(SparseMatrix* S, size_t** col_ptr, size_t** row_of, size_t** pos) {
+    *col_ptr = (size_t*)calloc(S->cols + 1, sizeof(size_t));
+    *row_of = (size_t*)malloc((S->nnz + 1) * sizeof(size_t));
+    *pos = (size_t*)malloc((S->nnz + 1) * sizeof(size_t));
+    size_t* next = (size_t*)malloc((S->cols + 1) * sizeof(size_t));
+    if (*col_ptr == NULL || *row_of == NULL || *pos == NULL || next == NULL) {
+        fprintf(stderr, "Sparse: Unable to allocate the column index\n");
+        free(*col_ptr);
+        free(*row_of);
+        free(*pos);
+        free(next);
+        return EXIT_FAILURE;
+    }
+
+    for (size_t k = 0; k < S->nnz; k++) (*col_ptr)[S->col_idx[k] + 1]++;
+    for (size_t j = 0; j < S->cols; j++) (*col_ptr)[j + 1] += (*col_ptr)[j];
+    memcpy(next, *col_ptr, S->cols * sizeof(size_t));
+    for (size_t i = 0; i < S->rows; i++) {
+        for (size_t k = S->row_ptr[i]; k < S->row_ptr[i + 1]; k++) {
+            size_t dst = next[S->col_idx[k]]++;
+            (*row_of)[dst] = i;
+            (*pos)[dst] = k;
+        }
+    }
+
+    free(next);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Compute the transpose of a sparse matrix
+ *
+ * The rows of the transpose are the columns of S, so this is also S in
+ * compressed sparse column format.
+ *
+ * @param S The sparse matrix
+ *
+ * @return SparseMatrix*, or NULL if the memory cannot be allocated
+ * @note The caller is responsible for freeing this memory using free_sparse_matrix()
+ */
+SparseMatrix* sparse_transpose(SparseMatrix* S) {
+    size_t *col_ptr, *row_of, *pos;
+    if (_sparse_columns(S, &col_ptr, &row_of, &pos) != EXIT_SUCCESS) {
+        return NULL;
+    }
+
+    SparseMatrix* T = create_sparse_matrix(S->cols, S->rows, S->nnz);
+    if (T != NULL) {
+        memcpy(T->row_ptr, col_ptr, (S->cols + 1) * sizeof(size_t));
+        for (size_t k = 0; k < S->nnz; k++) {
+            T->col_idx[k] = row_of[k];
+            T->values[k] = S->values[pos[k]];
+        }
+    }
+
+    free(col_ptr);
+    free(row_of);
+    free(pos);
+    return T;
+}
+
+/**
+ * @struct Arguments shared by the threads of sparse_matrix_vector_product_into()
+ */
+typedef struct SpMVTask {
+    SparseMatrix* S;
+    const double* x;
+    double* y;
+} SpMVTask;
+
+/**
+ * @brief parallel_for() body computing rows [begin, end) of S * x
+ */
+static void _spmv_task(size_t begin, size_t end, void* ctx) {
+    SpMVTask* task = (SpMVTask*)ctx;
+    const size_t* row_ptr = task->S->row_ptr;
+    const size_t* col_idx = task->S->col_idx;
+    const double* values = task->S->values;
+    for (size_t i = begin; i < end; i++) {
+        double sum = 0.0;
+        for (size_t k = row_ptr[i]; k < row_ptr[i + 1]; k++) {
+            sum += values[k] * task->x[col_idx[k]];
+        }
+        task->y[i] = sum;
+    }
+}
+
+/**
+ * @brief Compute the sparse matrix-vector product into a vector the caller provides
+ *
+ * Each entry of y is one row of S against x, and the rows are split across
+ * threads. The work is 2 * nnz flops.
+ *
+ * @param S The sparse matrix
+ * @param x A S->cols x 1 vector
+ * @param y A S->rows x 1 vector to hold S * x
+ *
+ * @return int The resulting status code
+ */
+int sparse_matrix_vector_product_into(SparseMatrix* S, Vector* x, Vector* y) {
+    if (S->cols != x->rows || S->rows != y->rows) {
+        fprintf(stderr, "Sparse Matrix Vector Product: The matrix and vectors have incompatible sizes\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t row_work = 2 * S->nnz / (S->rows ? S->rows : 1) + 1;
+    SpMVTask task = { S, x->data, y->data };
+    parallel_for(0, S->rows, PARALLEL_MIN_WORK / row_work + 1, _spmv_task, &task);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Compute the sparse matrix-vector product
+ *
+ * @param S The sparse matrix
+ * @param x The righthand vector
+ *
+ * @return Vector* S * x, or NULL if the sizes do not match
+ * @note The caller is responsible for freeing this memory using free_vector()
+ */
+Vector* sparse_matrix_vector_product(SparseMatrix* S, Vector* x) {
+    if (S->cols != x->rows) {
+        fprintf(stderr, "Sparse Matrix Vector Product: The matrix and vector have incompatible sizes\n");
+        return NULL;
+    }
+
+    Vector* y = create_empty_vector(S->rows);
+    if (y == NULL) return NULL;
+
+    sparse_matrix_vector_product_into(S, x, y);
+    return y;
+}
+
+/**
+ * @struct Arguments shared by the threads of sparse_gram_matrix()
+ *
+ * Row j of G is written only by the thread handling column j of S.
+ */
+typedef struct SparseGramTask {
+    SparseMatrix* S;
+    const size_t* col_ptr;
+    const size_t* row_of;
+    const size_t* pos;
+    const double* b;
+    Matrix* G;
+    double* g;
+} SparseGramTask;
+
+/**
+ * @brief parallel_for() body computing rows [begin, end) of the upper triangle of St * S
+ *
+ * For every entry S(i, j) of column j, the entries of row i from column j on
+ * add S(i, j) * S(i, c) to G(j, c). pos says where they start, so no search
+ * is needed and the entries left of the diagonal are never visited.
+ */
+static void _sparse_gram_task(size_t begin, size_t end, void* ctx) {
+    SparseGramTask* task = (SparseGramTask*)ctx;
+    const SparseMatrix* S = task->S;
+    for (size_t j = begin; j < end; j++) {
+        double* G_row = matrix_row(task->G, j);
+        double g_j = 0.0;
+        for (size_t t = task->col_ptr[j]; t < task->col_ptr[j + 1]; t++) {
+            size_t i = task->row_of[t];
+            size_t first = task->pos[t];
+            double s_ij = S->values[first];
+            for (size_t k = first; k < S->row_ptr[i + 1]; k++) {
+                G_row[S->col_idx[k]] += s_ij * S->values[k];
+            }
+            if (task->b) g_j += s_ij * task->b[i];
+        }
+        if (task->g) task->g[j] = g_j;
+    }
+}
+
+/**
+ * @brief Compute the Gram matrix St * S of a sparse matrix, and optionally St * b
+ *
+ * The work is the sum over rows of nnz(row)^2 / 2 rather than m * n^2 / 2,
+ * and only the nonzeros of S are read. The result is dense, so it can be
+ * passed to solve_normal_equations() or any other dense solver.
+ *
+ * @param S The m x n sparse matrix
+ * @param b An m x 1 vector, or NULL
+ * @param Atb Set to a new n x 1 vector St * b when b is given
+ *
+ * @return Matrix* The symmetric n x n matrix St * S, or NULL on failure
+ * @note The caller is responsible for freeing this memory using free_matrix(),
+ * and *Atb using free_vector()
+ */
+Matrix* sparse_gram_matrix(SparseMatrix* S, Vector* b, Vector** Atb) {
+    if (b != NULL && b->rows != S->rows) {
+        fprintf(stderr, "Sparse Gram Matrix: The matrix and vector have incompatible sizes\n");
+        return NULL;
+    }
+
+    size_t cols = S->cols;
+    Matrix* AtA = create_empty_matrix(cols, cols);
+    Vector* g = b ? create_empty_vector(cols) : NULL;
+    size_t *col_ptr = NULL, *row_of = NULL, *pos = NULL;
+    if (AtA == NULL || (b != NULL && g == NULL)
+        || _sparse_columns(S, &col_ptr, &row_of, &pos) != EXIT_SUCCESS) {
+        if (AtA) free_matrix(AtA);
+        if (g) free_vector(g);
+        return NULL;
+    }
+
+    ML_TRACE_BEGIN(span, "sparse_gram_matrix");
+
+    // Columns cost very different amounts, so aim the grain at the average
+    size_t work = 0;
+    for (size_t i = 0; i < S->rows; i++) {
+        size_t row_nnz = S->row_ptr[i + 1] - S->row_ptr[i];
+        work += row_nnz * (row_nnz + 1);
+    }
+    size_t col_work = work / (cols ? cols : 1) + 1;
+    SparseGramTask task = { S, col_ptr, row_of, pos, b ? b->data : NULL, AtA, g ? g->data : NULL };
+    parallel_for(0, cols, PARALLEL_MIN_WORK / col_work + 1, _sparse_gram_task, &task);
+    mirror_upper_triangle(AtA);
+
+    free(col_ptr);
+    free(row_of);
+    free(pos);
+
+    if (Atb) {
+        *Atb = g;
+    } else if (g) {
+        free_vector(g);
+    }
+
+    ML_TRACE_END(span, (double)work + (b ? 2.0 * S->nnz : 0.0),
+                 12.0 * S->nnz + 8.0 * (S->rows + 1) + 8.0 * cols * cols);
+    return AtA;
+}
+
+#endif
@@ -0,0 +1,387 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "csv.h"
+#include "binary_format.h"
+
+/**
+ * Sequential, bounded-memory reading of matrix and vector files.
+ *
+ * A RowStream hands out the rows of a CSV or binary file a chunk at a time,
+ * so a file can be processed in one pass whatever its size. Only a read
+ * buffer is ever held in memory: STREAM_BUFFER_BYTES of text for a CSV file,
+ * or one checksum block of MLB_BLOCK_WORDS doubles for a binary file.
+ *
+ * CSV files follow the rules of csv.h: blank lines are skipped and every line
+ * must have as many fields as the first one. A binary file's checksum is
+ * built up block by block and checked once its last row has been read.
+ *
+ * A stream opened as a vector yields one value per row. For CSV that means
+ * every value in the file, whether the values are laid out as a row or as a
+ * column, just as create_vector_from_file() reads them.
+ */
+
+// Initial size of the CSV read buffer. It grows if a single line is longer
+#ifndef STREAM_BUFFER_BYTES
+#define STREAM_BUFFER_BYTES (1 << 20)
+#endif
+
+/**
+ * @struct A file being read a few rows at a time
+ */
+typedef struct RowStream {
+    const char* file_name;
+    FILE* fp;
+    int binary;
+    int vector;
+    size_t cols;
+    size_t rows_read;
+
+    // CSV text between pos and len has been read but not used yet
+    char* text;
+    size_t capacity;
+    size_t len;
+    size_t pos;
+    int eof;
+    int after_comma;             // The last vector field ended at a comma
+
+    // Binary data section, staged one checksum block at a time
+    MlbHeader header;
+    double* block;
+    size_t block_len;
+    size_t block_pos;
+    uint64_t words_left;
+    uint64_t checksum;
+} RowStream;
+
+/**
+ * @brief Move the unused text to the front of the buffer and read more
+ *
+ * The buffer doubles when it is full of unused text, which only happens when
+ * a single line or field does not fit in it.
+ *
+ * @return int The resulting status code
+ */
+static int _stream_refill(RowStream* stream) {
+    if (stream->pos > 0) {
+        memmove(stream->text, stream->text + stream->pos, stream->len - stream->pos);
+        stream->len -= stream->pos;
+        stream->pos = 0;
+    }
+
+    if (stream->len == stream->capacity) {
+        char* grown = (char*)realloc(stream->text, 2 * stream->capacity);
+        if (grown == NULL) {
+            fprintf(stderr, "Stream: %s: Unable to grow the read buffer\n", stream->file_name);
+            return EXIT_FAILURE;
+        }
+        stream->text = grown;
+        stream->capacity *= 2;
+    }
+
+    size_t got = fread(stream->text + stream->len, 1, stream->capacity - stream->len, stream->fp);
+    stream->len += got;
+    if (got == 0) {
+        if (ferror(stream->fp)) {
+            perror("Unable to read file");
+            return EXIT_FAILURE;
+        }
+        stream->eof = 1;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Take the next piece of text ending in one of two separators
+ *
+ * @param stream The stream
+ * @param sep_a A separator
+ * @param sep_b Another separator, or the same one again
+ * @param begin Set to the start of the piece
+ * @param end Set to the end of the piece, excluding the separator
+ * @param found Set to 1 if there was a piece, 0 at the end of the file
+ * @return int The resulting status code
+ */
+static int _stream_take(RowStream* stream, char sep_a, char sep_b,
+                        const char** begin, const char** end, int* found) {
+    size_t scanned = stream->pos;
+    for (;;) {
+        const char* p = stream->text + scanned;
+        const char* limit = stream->text + stream->len;
+        while (p < limit && *p != sep_a && *p != sep_b) p++;
+
+        if (p < limit || (stream->eof && stream->pos < stream->len)) {
+            *begin = stream->text + stream->pos;
+            *end = p;
+            *found = 1;
+            stream->pos = (size_t)(p - stream->text) + (p < limit ? 1 : 0);
+            return EXIT_SUCCESS;
+        }
+        if (stream->eof) {
+            *found = 0;
+            return EXIT_SUCCESS;
+        }
+
+        scanned = stream->len - stream->pos;
+        if (_stream_refill(stream) != EXIT_SUCCESS) return EXIT_FAILURE;
+    }
+}
+
+/**
+ * @brief Report a problem at a 1-based row and column
+ *
+ * @return int EXIT_FAILURE
+ */
+static int _stream_error(const RowStream* stream, size_t row, size_t col, const char* problem) {
+    fprintf(stderr, "CSV: %s: row %zu, column %zu: %s\n", stream->file_name, row, col, problem);
+    return EXIT_FAILURE;
+}
+
+/**
+ * @brief Read up to max_rows lines of a CSV matrix
+ */
+static int _stream_read_csv_rows(RowStream* stream, double* out, size_t stride,
+                                 size_t max_rows, size_t* rows_read) {
+    size_t rows = 0;
+    while (rows < max_rows) {
+        const char *line, *line_end;
+        int found;
+        if (_stream_take(stream, '\n', '\n', &line, &line_end, &found) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        if (!found) break;
+        if (_csv_is_blank(line, line_end)) continue;
+
+        size_t bad_col = 0;
+        const char* error = csv_parse_line(line, line_end, stream->cols, out + rows * stride, &bad_col);
+        if (error != NULL) {
+            return _stream_error(stream, stream->rows_read + rows + 1, bad_col + 1, error);
+        }
+        rows++;
+    }
+
+    *rows_read = rows;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Read up to max_values values of a CSV vector, one per row
+ *
+ * Values may be separated by commas, line breaks or both. Blank lines are
+ * skipped. An empty field next to a comma is an error, including one left by
+ * a trailing comma, as it is for create_vector_from_file().
+ */
+static int _stream_read_csv_values(RowStream* stream, double* out, size_t stride,
+                                   size_t max_values, size_t* values_read) {
+    size_t values = 0;
+    while (values < max_values) {
+        const char *field, *field_end;
+        int found;
+        if (_stream_take(stream, ',', '\n', &field, &field_end, &found) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        size_t row = stream->rows_read + values + 1;
+        if (!found) {
+            if (stream->after_comma) return _stream_error(stream, row, 1, "empty field");
+            break;
+        }
+
+        int at_comma = field_end < stream->text + stream->len && *field_end == ',';
+        if (!at_comma && !stream->after_comma && _csv_is_blank(field, field_end)) continue;
+        stream->after_comma = at_comma;
+
+        while (field < field_end && _csv_is_space(*field)) field++;
+        const char* next = csv_parse_double(field, field_end, &out[values * stride]);
+        if (next == NULL) {
+            return _stream_error(stream, row, 1, field == field_end ? "empty field" : "not a number");
+        }
+        while (next < field_end && _csv_is_space(*next)) next++;
+        if (next != field_end) {
+            return _stream_error(stream, row, 1, "not a number");
+        }
+        values++;
+    }
+
+    *values_read = values;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Read up to max_rows rows of a binary file, checking the checksum
+ * once the last one is in
+ */
+static int _stream_read_binary_rows(RowStream* stream, double* out, size_t stride,
+                                    size_t max_rows, size_t* rows_read) {
+    size_t file_stride = (size_t)stream->header.stride;
+    size_t rows = 0;
+
+    while (rows < max_rows && stream->rows_read + rows < stream->header.rows) {
+        double* row = out + rows * stride;
+
+        // A row may straddle two blocks, so copy it a piece at a time
+        for (size_t j = 0; j < file_stride; ) {
+            if (stream->block_pos == stream->block_len) {
+                size_t want = stream->words_left < MLB_BLOCK_WORDS ? (size_t)stream->words_left : MLB_BLOCK_WORDS;
+                if (fread(stream->block, sizeof(double), want, stream->fp) != want) {
+                    fprintf(stderr, "Binary: %s: file is truncated\n", stream->file_name);
+                    return EXIT_FAILURE;
+                }
+                stream->checksum = _mlb_fold(stream->checksum,
+                                             _mlb_block_hash((const uint64_t*)stream->block, want));
+                stream->block_len = want;
+                stream->block_pos = 0;
+                stream->words_left -= want;
+            }
+
+            size_t n = file_stride - j;
+            if (n > stream->block_len - stream->block_pos) n = stream->block_len - stream->block_pos;
+            // The padding past cols is read for the checksum but not copied out
+            if (j < stream->cols) {
+                size_t used = (j + n < stream->cols) ? n : stream->cols - j;
+                memcpy(row + j, stream->block + stream->block_pos, used * sizeof(double));
+            }
+            stream->block_pos += n;
+            j += n;
+        }
+        rows++;
+    }
+
+    if (rows > 0 && stream->rows_read + rows == stream->header.rows
+        && stream->checksum != stream->header.checksum) {
+        fprintf(stderr, "Binary: %s: checksum mismatch, the data is corrupt\n", stream->file_name);
+        return EXIT_FAILURE;
+    }
+
+    *rows_read = rows;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Close a stream opened with row_stream_open()
+ *
+ * @param stream The stream
+ * @return void
+ */
+void row_stream_close(RowStream* stream) {
+    if (stream->fp != NULL) fclose(stream->fp);
+    free(stream->text);
+    free(stream->block);
+    memset(stream, 0, sizeof(RowStream));
+}
+
+/**
+ * @brief Open a CSV or binary file to be read a few rows at a time
+ *
+ * For a CSV matrix the first non-blank line is read to find the number of
+ * columns. For a binary file the header is read and checked.
+ *
+ * @param stream The stream to set up
+ * @param file_name The name of the file
+ * @param vector Nonzero to read the file as a vector, one value per row
+ * @return int The resulting status code
+ * @note Close the stream with row_stream_close(), even if this fails
+ */
+int row_stream_open(RowStream* stream, const char* file_name, int vector) {
+    memset(stream, 0, sizeof(RowStream));
+    stream->file_name = file_name;
+    stream->vector = vector;
+    stream->binary = is_binary_file(file_name);
+
+    stream->fp = fopen(file_name, "rb");
+    if (stream->fp == NULL) {
+        perror("Unable to open file");
+        return EXIT_FAILURE;
+    }
+
+    if (stream->binary) {
+        uint32_t kind = vector ? MLB_KIND_VECTOR : MLB_KIND_MATRIX;
+        struct stat st;
+        if (fread(&stream->header, sizeof(MlbHeader), 1, stream->fp) != 1
+            || fstat(fileno(stream->fp), &st) != 0) {
+            fprintf(stderr, "Binary: %s: file is truncated\n", file_name);
+            return EXIT_FAILURE;
+        }
+        if (mlb_check_header(&stream->header, (uint64_t)st.st_size, kind, file_name) != EXIT_SUCCESS
+            || fseek(stream->fp, (long)stream->header.data_offset, SEEK_SET) != 0) {
+            return EXIT_FAILURE;
+        }
+
+        stream->cols = (size_t)stream->header.cols;
+        stream->words_left = stream->header.rows * stream->header.stride;
+        stream->block = (double*)malloc(MLB_BLOCK_WORDS * sizeof(double));
+        if (stream->block == NULL) {
+            fprintf(stderr, "Binary: Unable to allocate read buffer\n");
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    stream->capacity = STREAM_BUFFER_BYTES;
+    stream->text = (char*)malloc(stream->capacity);
+    if (stream->text == NULL) {
+        fprintf(stderr, "Stream: %s: Unable to allocate the read buffer\n", file_name);
+        return EXIT_FAILURE;
+    }
+
+    if (vector) {
+        stream->cols = 1;
+        return EXIT_SUCCESS;
+    }
+
+    // Count the fields of the first non-blank line, then step back so it is read as a row
+    for (;;) {
+        const char *line, *line_end;
+        int found;
+        if (_stream_take(stream, '\n', '\n', &line, &line_end, &found) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        if (!found) {
+            fprintf(stderr, "CSV: %s: file holds no data\n", file_name);
+            return EXIT_FAILURE;
+        }
+        if (_csv_is_blank(line, line_end)) continue;
+
+        stream->cols = 1;
+        for (const char* p = line; p < line_end; p++) {
+            if (*p == ',') stream->cols++;
+        }
+        stream->pos = (size_t)(line - stream->text);
+        return EXIT_SUCCESS;
+    }
+}
+
+/**
+ * @brief Read the next rows of a stream
+ *
+ * @param stream The stream
+ * @param out Where to store the rows, row i starting at out + i * stride
+ * @param stride The distance between rows of out, at least stream->cols
+ * @param max_rows The most rows to read
+ * @param rows_read Set to the number of rows read, 0 once the file is used up
+ * @return int The resulting status code
+ */
+int row_stream_read(RowStream* stream, double* out, size_t stride, size_t max_rows, size_t* rows_read) {
+    *rows_read = 0;
+    size_t rows = 0;
+    int status;
+
+    if (stream->binary) {
+        status = _stream_read_binary_rows(stream, out, stride, max_rows, &rows);
+    } else if (stream->vector) {
+        status = _stream_read_csv_values(stream, out, stride, max_rows, &rows);
+    } else {
+        status = _stream_read_csv_rows(stream, out, stride, max_rows, &rows);
+    }
+
+    if (status != EXIT_SUCCESS) return status;
+    stream->rows_read += rows;
+    *rows_read = rows;
+    return EXIT_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,624 @@
+#ifndef SVD_H
+#define SVD_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <float.h>
+#include <math.h>
+
+#include "matrix.h"
+#include "qr.h"
+
+/**
+ * Singular value decomposition, A = U * diag(S) * Vt, and the pseudoinverse.
+ *
+ * svd() uses one-sided Jacobi. A tall A is first reduced to its n x n
+ * triangular factor R by qr_decompose(), so the Jacobi sweeps only ever work
+ * on n x n data. The columns of R are then rotated in pairs until they are
+ * all orthogonal: their norms are the singular values, and the rotations
+ * accumulate into V. U is Q times the normalised columns.
+ *
+ * The columns are stored as the rows of a transposed copy, so every rotation
+ * is a contiguous dot product. A round-robin ordering splits each sweep into
+ * rounds of disjoint pairs, and the pairs of a round are rotated in parallel.
+ *
+ * svd_randomized() finds the top k singular triplets of a large matrix from
+ * its products with a random n x (k + oversample) matrix, so almost all of its
+ * work is in gemm().
+ */
+
+// Give up on convergence after this many Jacobi sweeps
+#define SVD_MAX_SWEEPS 60
+
+// Defaults for svd_randomized()
+#define SVD_OVERSAMPLE 10
+#define SVD_POWER_ITERATIONS 2
+
+/**
+ * @struct A thin singular value decomposition of an m x n matrix
+ *
+ * With k = min(m, n), or the requested rank for svd_randomized()
+ */
+typedef struct SVD {
+    Matrix* U;      // m x k, orthonormal columns
+    Vector* S;      // k singular values, largest first
+    Matrix* V;      // n x k, orthonormal columns
+} SVD;
+
+/**
+ * @brief Free the memory an SVD is occupying
+ *
+ * @param svd A pointer to the SVD
+ * @return void
+ */
+void free_svd(SVD* svd) {
+    if (svd == NULL) return;
+    if (svd->U) free_matrix(svd->U);
+    if (svd->S) free_vector(svd->S);
+    if (svd->V) free_matrix(svd->V);
+    free(svd);
+}
+
+/**
+ * @struct Arguments shared by the threads of one Jacobi round
+ */
+typedef struct JacobiRoundTask {
+    Matrix* Y;              // Rows are the columns being orthogonalised
+    Matrix* W;              // Rows accumulate the rotations, W = Vt
+    const size_t* pairs;    // Two row indices per pair
+    double tol;
+    atomic_size_t rotations;
+} JacobiRoundTask;
+
+/**
+ * @brief Rotate rows p and q of A by [c, -s; s, c]
+ */
+static inline void _svd_rotate(Matrix* A, size_t p, size_t q, double c, double s) {
+    double* a_p = matrix_row(A, p);
+    double* a_q = matrix_row(A, q);
+    for (size_t j = 0; j < A->cols; j++) {
+        double x = a_p[j];
+        double y = a_q[j];
+        a_p[j] = c * x - s * y;
+        a_q[j] = s * x + c * y;
+    }
+}
+
+/**
+ * @brief parallel_for() body orthogonalising pairs [begin, end) of a round
+ */
+static void _svd_jacobi_task(size_t begin, size_t end, void* ctx) {
+    JacobiRoundTask* task = (JacobiRoundTask*)ctx;
+    size_t len = task->Y->cols;
+    size_t rotations = 0;
+
+    for (size_t pair = begin; pair < end; pair++) {
+        size_t p = task->pairs[2 * pair];
+        size_t q = task->pairs[2 * pair + 1];
+        const double* y_p = matrix_row(task->Y, p);
+        const double* y_q = matrix_row(task->Y, q);
+
+        double alpha = simd_dot(y_p, y_p, len);
+        double beta = simd_dot(y_q, y_q, len);
+        double gamma = simd_dot(y_p, y_q, len);
+        if (fabs(gamma) <= task->tol * sqrt(alpha * beta)) continue;
+
+        // The smaller root of t^2 + 2 * zeta * t - 1 = 0 makes the pair orthogonal
+        double zeta = (beta - alpha) / (2.0 * gamma);
+        double t = (fabs(zeta) > 1e100) ? 0.5 / zeta
+                                         : copysign(1.0, zeta) / (fabs(zeta) + sqrt(1.0 + zeta * zeta));
+        double c = 1.0 / sqrt(1.0 + t * t);
+        double s = c * t;
+
+        _svd_rotate(task->Y, p, q, c, s);
+        _svd_rotate(task->W, p, q, c, s);
+        rotations++;
+    }
+
+    if (rotations > 0) atomic_fetch_add(&task->rotations, rotations);
+}
+
+/**
+ * @brief Orthogonalise the rows of Y by one-sided Jacobi rotations
+ *
+ * @param Y The k x len matrix whose rows are rotated
+ * @param W A k x k matrix the same rotations are applied to
+ * @return int The resulting status code
+ */
+static int _svd_jacobi(Matrix* Y, Matrix* W) {
+    size_t k = Y->rows;
+    size_t players = k + (k % 2);  // An odd count gets a dummy that sits out
+    size_t* order = (size_t*)malloc(players * sizeof(size_t));
+    size_t* pairs = (size_t*)malloc(players * sizeof(size_t));
+    if (order == NULL || pairs == NULL) {
+        fprintf(stderr, "SVD: Unable to allocate workspace\n");
+        free(order);
+        free(pairs);
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < players; i++) order[i] = i;
+
+    JacobiRoundTask task = { Y, W, pairs, (double)Y->cols * DBL_EPSILON, 0 };
+    size_t grain = PARALLEL_MIN_WORK / (10 * (Y->cols + W->cols) + 1) + 1;
+    int converged = (k < 2);
+
+    for (size_t sweep = 0; sweep < SVD_MAX_SWEEPS && !converged; sweep++) {
+        atomic_store(&task.rotations, 0);
+
+        // Every pair meets once per sweep: order[0] stays put while the rest rotate
+        for (size_t round = 0; round + 1 < players; round++) {
+            size_t n_pairs = 0;
+            for (size_t i = 0; i < players / 2; i++) {
+                size_t p = order[i];
+                size_t q = order[players - 1 - i];
+                if (p >= k || q >= k) continue;
+                pairs[2 * n_pairs] = p;
+                pairs[2 * n_pairs + 1] = q;
+                n_pairs++;
+            }
+            parallel_for(0, n_pairs, grain, _svd_jacobi_task, &task);
+
+            size_t last = order[players - 1];
+            memmove(order + 2, order + 1, (players - 2) * sizeof(size_t));
+            order[1] = last;
+        }
+
+        converged = (atomic_load(&task.rotations) == 0);
+    }
+
+    free(order);
+    free(pairs);
+    if (!converged) {
+        fprintf(stderr, "SVD: Jacobi sweeps did not converge\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Compute the SVD of the leading n x n block of R, n = R->cols
+ *
+ * @param R A matrix with at least as many rows as columns
+ * @param upper Nonzero to read only the upper triangle of the block
+ * @return SVD* U and V are n x n, or NULL on failure
+ */
+static SVD* _svd_square(Matrix* R, int upper) {
+    size_t n = R->cols;
+
+    // Row i of Y is column i of R
+    Matrix* Y = create_empty_matrix(n, n);
+    Matrix* W = create_empty_matrix(n, n);
+    double* norms = (double*)malloc((n + 1) * sizeof(double));
+    size_t* order = (size_t*)malloc((n + 1) * sizeof(size_t));
+    if (Y == NULL || W == NULL || norms == NULL || order == NULL) {
+        fprintf(stderr, "SVD: Unable to allocate workspace\n");
+        if (Y) free_matrix(Y);
+        if (W) free_matrix(W);
+        free(norms);
+        free(order);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        const double* r_i = matrix_row(R, i);
+        for (size_t j = upper ? i : 0; j < n; j++) {
+            MAT_AT(Y, j, i) = r_i[j];
+        }
+        MAT_AT(W, i, i) = 1.0;
+    }
+
+    SVD* result = NULL;
+    if (_svd_jacobi(Y, W) == EXIT_SUCCESS) {
+        // The row norms are the singular values, sorted largest first
+        for (size_t i = 0; i < n; i++) {
+            norms[i] = sqrt(simd_dot(matrix_row(Y, i), matrix_row(Y, i), n));
+            order[i] = i;
+        }
+        for (size_t i = 1; i < n; i++) {
+            size_t key = order[i];
+            size_t j = i;
+            while (j > 0 && norms[order[j - 1]] < norms[key]) {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = key;
+        }
+
+        result = (SVD*)calloc(1, sizeof(SVD));
+        if (result != NULL) {
+            result->U = create_empty_matrix(n, n);
+            result->S = create_empty_vector(n);
+            result->V = create_empty_matrix(n, n);
+        }
+        if (result == NULL || result->U == NULL || result->S == NULL || result->V == NULL) {
+            fprintf(stderr, "SVD: Unable to allocate the result\n");
+            free_svd(result);
+            result = NULL;
+        }
+        for (size_t c = 0; c < n && result != NULL; c++) {
+            double sigma = norms[order[c]];
+            const double* y = matrix_row(Y, order[c]);
+            const double* w = matrix_row(W, order[c]);
+            result->S->data[c] = sigma;
+
+            for (size_t r = 0; r < n; r++) {
+                // A zero singular value has no direction to normalise; its column of U stays zero
+                MAT_AT(result->U, r, c) = sigma > 0.0 ? y[r] / sigma : 0.0;
+                MAT_AT(result->V, r, c) = w[r];
+            }
+        }
+    }
+
+    free_matrix(Y);
+    free_matrix(W);
+    free(norms);
+    free(order);
+    return result;
+}
+
+/**
+ * @brief Compute the thin singular value decomposition of a matrix
+ *
+ * @param A The m x n matrix. It is not modified
+ *
+ * @return SVD* With k = min(m, n): U is m x k, S has k entries, V is n x k.
+ * NULL on failure
+ * @note The caller is responsible for freeing this memory using free_svd()
+ */
+SVD* svd(Matrix* A) {
+    size_t m = A->rows;
+    size_t n = A->cols;
+
+    // A wide matrix is decomposed through its transpose
+    if (m < n) {
+        Matrix* At = tranpose_matrix(A);
+        if (At == NULL) return NULL;
+        SVD* result = svd(At);
+        free_matrix(At);
+        if (result != NULL) {
+            Matrix* U = result->U;
+            result->U = result->V;
+            result->V = U;
+        }
+        return result;
+    }
+
+    // A = Q * R, then R = U_R * diag(S) * Vt and U = Q * U_R
+    Matrix* F = copy_matrix(A);
+    Vector* tau = create_empty_vector(n);
+    if (F == NULL || tau == NULL || qr_decompose(F, tau) != EXIT_SUCCESS) {
+        if (F == NULL || tau == NULL) fprintf(stderr, "SVD: Unable to allocate workspace\n");
+        if (F) free_matrix(F);
+        if (tau) free_vector(tau);
+        return NULL;
+    }
+
+    SVD* result = _svd_square(F, 1);
+    Matrix* U = result ? create_empty_matrix(m, n) : NULL;
+    if (result != NULL && U == NULL) {
+        fprintf(stderr, "SVD: Unable to allocate U\n");
+        free_svd(result);
+        result = NULL;
+    }
+    if (result != NULL) {
+        for (size_t i = 0; i < n; i++) {
+            memcpy(matrix_row(U, i), matrix_row(result->U, i), n * sizeof(double));
+        }
+        free_matrix(result->U);
+        result->U = U;
+
+        if (qr_apply_q(F, tau, U) != EXIT_SUCCESS) {
+            free_svd(result);
+            result = NULL;
+        }
+    }
+
+    free_matrix(F);
+    free_vector(tau);
+    return result;
+}
+
+/**
+ * @brief Draw a standard normal value from a xorshift64* stream
+ *
+ * @param state The generator state, nonzero
+ * @return double
+ */
+static double _svd_gaussian(uint64_t* state) {
+    double u[2];
+    for (int i = 0; i < 2; i++) {
+        *state ^= *state >> 12;
+        *state ^= *state << 25;
+        *state ^= *state >> 27;
+        // 53 random bits, shifted away from 0 so the log is finite
+        u[i] = ((double)((*state * 0x2545F4914F6CDD1Dull) >> 11) + 0.5) / 9007199254740992.0;
+    }
+    return sqrt(-2.0 * log(u[0])) * cos(6.283185307179586 * u[1]);
+}
+
+/**
+ * @brief Replace the columns of Y by an orthonormal basis for their span
+ *
+ * @param Y An m x l matrix, m >= l
+ * @return Matrix* The m x l basis, or NULL on failure. Y is freed either way
+ */
+static Matrix* _svd_orthonormalize(Matrix* Y) {
+    Vector* tau = create_empty_vector(Y->cols);
+    Matrix* Q = NULL;
+    if (tau != NULL && qr_decompose(Y, tau) == EXIT_SUCCESS) {
+        Q = qr_form_q(Y, tau, Y->cols);
+    }
+    if (tau) free_vector(tau);
+    free_matrix(Y);
+    return Q;
+}
+
+/**
+ * @brief Compute Y = op(A) * B into a new matrix
+ *
+ * @return Matrix* The product, or NULL on failure
+ */
+static Matrix* _svd_product(int trans_a, Matrix* A, Matrix* B) {
+    size_t rows = trans_a ? A->cols : A->rows;
+    size_t inner = trans_a ? A->rows : A->cols;
+    Matrix* Y = create_empty_matrix(rows, B->cols);
+    if (Y == NULL) return NULL;
+
+    if (gemm(trans_a, 0, rows, B->cols, inner, 1.0, A->data, A->stride,
+             B->data, B->stride, 0.0, Y->data, Y->stride) != EXIT_SUCCESS) {
+        free_matrix(Y);
+        return NULL;
+    }
+    return Y;
+}
+
+/**
+ * @brief Keep the leading k columns of a matrix in a new m x k matrix
+ *
+ * @return Matrix*, or NULL on failure. M is freed either way
+ */
+static Matrix* _svd_leading_columns(Matrix* M, size_t k) {
+    Matrix* K = create_empty_matrix(M->rows, k);
+    if (K != NULL) {
+        for (size_t i = 0; i < M->rows; i++) memcpy(matrix_row(K, i), matrix_row(M, i), k * sizeof(double));
+    }
+    free_matrix(M);
+    return K;
+}
+
+/**
+ * @brief Compute the top k singular triplets of a matrix by randomized projection
+ *
+ * Y = A * Omega for a Gaussian n x l matrix Omega, with l = k + oversample,
+ * captures the dominant column space of A. Each power iteration replaces Y by
+ * A * At * Y, which sharpens the gap between the singular values kept and the
+ * rest. With Q an orthonormal basis for Y, the small l x n matrix Qt * A is
+ * decomposed exactly and its left vectors are mapped back through Q.
+ *
+ * @param A The m x n matrix. It is not modified
+ * @param k The number of singular triplets wanted
+ * @param oversample Extra columns to sample, SVD_OVERSAMPLE is a good default
+ * @param power_iterations Power iterations to run, SVD_POWER_ITERATIONS is a
+ * good default
+ * @param seed Seed for the random projection, runs with the same seed agree
+ *
+ * @return SVD* U is m x k, S has k entries, V is n x k. NULL on failure
+ * @note The caller is responsible for freeing this memory using free_svd()
+ */
+SVD* svd_randomized(Matrix* A, size_t k, size_t oversample, size_t power_iterations, uint64_t seed) {
+    size_t m = A->rows;
+    size_t n = A->cols;
+    size_t l = MIN(k + oversample, MIN(m, n));
+    if (k > l) k = l;
+    if (k == 0) {
+        fprintf(stderr, "SVD: The rank must be at least 1\n");
+        return NULL;
+    }
+
+    Matrix* A_ordered = A->perm ? copy_matrix(A) : A;
+    Matrix* Omega = A_ordered ? create_empty_matrix(n, l) : NULL;
+    if (Omega == NULL) {
+        fprintf(stderr, "SVD: Unable to allocate the random projection\n");
+        if (A_ordered && A_ordered != A) free_matrix(A_ordered);
+        return NULL;
+    }
+
+    uint64_t state = seed ? seed : 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < n; i++) {
+        double* row = matrix_row(Omega, i);
+        for (size_t j = 0; j < l; j++) row[j] = _svd_gaussian(&state);
+    }
+
+    Matrix* Q = _svd_product(0, A_ordered, Omega);
+    free_matrix(Omega);
+
+    for (size_t it = 0; it < power_iterations && Q != NULL; it++) {
+        // Orthonormalising between products keeps the small singular values from underflowing
+        Q = _svd_orthonormalize(Q);
+        if (Q == NULL) break;
+        Matrix* Z = _svd_product(1, A_ordered, Q);
+        free_matrix(Q);
+        Q = Z ? _svd_orthonormalize(Z) : NULL;
+        if (Q == NULL) break;
+        Z = _svd_product(0, A_ordered, Q);
+        free_matrix(Q);
+        Q = Z;
+    }
+    if (Q != NULL) Q = _svd_orthonormalize(Q);
+
+    SVD* result = NULL;
+    Matrix* B = Q ? _svd_product(1, Q, A_ordered) : NULL;
+    if (B != NULL) {
+        result = svd(B);
+        free_matrix(B);
+    }
+
+    if (result != NULL) {
+        // U = Q * U_B, keeping the leading k triplets
+        Matrix* U = _svd_product(0, Q, result->U);
+        free_matrix(result->U);
+        result->U = U ? _svd_leading_columns(U, k) : NULL;
+        result->V = _svd_leading_columns(result->V, k);
+        Vector* S = create_empty_vector(k);
+        if (S != NULL) memcpy(S->data, result->S->data, k * sizeof(double));
+        free_vector(result->S);
+        result->S = S;
+        if (result->U == NULL || result->V == NULL || result->S == NULL) {
+            free_svd(result);
+            result = NULL;
+        }
+    }
+
+    if (Q) free_matrix(Q);
+    if (A_ordered != A) free_matrix(A_ordered);
+    return result;
+}
+
+/**
+ * @brief Count the singular values above a relative cutoff
+ *
+ * @param svd The decomposition
+ * @param rcond Singular values no larger than rcond times the largest are
+ * treated as zero
+ * @return size_t The numerical rank
+ */
+size_t svd_rank(SVD* svd, double rcond) {
+    if (svd->S->rows == 0) return 0;
+    double cutoff = rcond * svd->S->data[0];
+    size_t rank = 0;
+    while (rank < svd->S->rows && svd->S->data[rank] > cutoff) rank++;
+    return rank;
+}
+
+/**
+ * @brief Get the default rank cutoff for an m x n matrix
+ *
+ * @return double max(m, n) times the machine epsilon
+ */
+static inline double svd_default_rcond(size_t m, size_t n) {
+    return (double)(m > n ? m : n) * DBL_EPSILON;
+}
+
+/**
+ * @brief Compute x = pinv(A) * b, the minimum norm least squares solution
+ *
+ * Singular values no larger than rcond times the largest are treated as zero,
+ * so the solve is well defined whatever the rank of A. For a tall A the
+ * reduction to R = Qt * A is applied to b directly, and U is never formed.
+ *
+ * @param A The m x n matrix. It is not modified
+ * @param b The m x 1 right hand side
+ * @param rcond The relative cutoff, or 0 for svd_default_rcond()
+ * @param rank If not NULL, set to the numerical rank of A
+ *
+ * @return Vector* x, an n x 1 vector, or NULL on failure
+ * @note The caller is responsible for freeing this memory using free_vector()
+ */
+Vector* pinv_solve(Matrix* A, Vector* b, double rcond, size_t* rank) {
+    size_t m = A->rows;
+    size_t n = A->cols;
+    if (b->rows != m) {
+        fprintf(stderr, "Pseudoinverse: A and b have incompatible sizes\n");
+        return NULL;
+    }
+    if (rcond <= 0.0) rcond = svd_default_rcond(m, n);
+
+    // c = Ut * b, through Qt * b for a tall A
+    SVD* decomposition = NULL;
+    Vector* c = create_empty_vector(MIN(m, n));
+    if (c == NULL) {
+        fprintf(stderr, "Pseudoinverse: Unable to allocate workspace\n");
+        return NULL;
+    }
+    int status = EXIT_SUCCESS;
+    if (m >= n) {
+        Matrix* F = copy_matrix(A);
+        Vector* tau = create_empty_vector(n);
+        Vector* qtb = create_empty_vector(m);
+        if (F == NULL || tau == NULL || qtb == NULL) {
+            fprintf(stderr, "Pseudoinverse: Unable to allocate workspace\n");
+        } else if (qr_decompose(F, tau) == EXIT_SUCCESS) {
+            memcpy(qtb->data, b->data, m * sizeof(double));
+            qr_apply_qt(F, tau, qtb);
+            decomposition = _svd_square(F, 1);
+        }
+        if (decomposition != NULL) {
+            status = gemm(1, 0, n, 1, n, 1.0, decomposition->U->data, decomposition->U->stride,
+                          qtb->data, 1, 0.0, c->data, 1);
+        }
+        if (F) free_matrix(F);
+        if (tau) free_vector(tau);
+        if (qtb) free_vector(qtb);
+    } else {
+        decomposition = svd(A);
+        if (decomposition != NULL) {
+            Matrix* U = decomposition->U;
+            status = gemm(1, 0, U->cols, 1, m, 1.0, U->data, U->stride, b->data, 1, 0.0, c->data, 1);
+        }
+    }
+
+    if (decomposition == NULL || status != EXIT_SUCCESS) {
+        free_vector(c);
+        free_svd(decomposition);
+        return NULL;
+    }
+
+    size_t r = svd_rank(decomposition, rcond);
+    for (size_t i = 0; i < c->rows; i++) {
+        c->data[i] = (i < r) ? c->data[i] / decomposition->S->data[i] : 0.0;
+    }
+
+    Vector* x = create_empty_vector(n);
+    Matrix* V = decomposition->V;
+    if (x != NULL && gemm(0, 0, n, 1, V->cols, 1.0, V->data, V->stride, c->data, 1, 0.0, x->data, 1) != EXIT_SUCCESS) {
+        free_vector(x);
+        x = NULL;
+    }
+
+    if (rank != NULL) *rank = r;
+    free_vector(c);
+    free_svd(decomposition);
+    return x;
+}
+
+/**
+ * @brief Compute the Moore-Penrose pseudoinverse of a matrix
+ *
+ * @param A The m x n matrix. It is not modified
+ * @param rcond The relative cutoff, or 0 for svd_default_rcond()
+ *
+ * @return Matrix* The n x m pseudoinverse V * pinv(diag(S)) * Ut, or NULL
+ * @note The caller is responsible for freeing this memory using free_matrix()
+ */
+Matrix* pinv(Matrix* A, double rcond) {
+    if (rcond <= 0.0) rcond = svd_default_rcond(A->rows, A->cols);
+
+    SVD* decomposition = svd(A);
+    if (decomposition == NULL) return NULL;
+
+    // Scale the columns of V, then multiply by Ut
+    Matrix* V = decomposition->V;
+    size_t r = svd_rank(decomposition, rcond);
+    for (size_t i = 0; i < V->rows; i++) {
+        double* row = matrix_row(V, i);
+        for (size_t j = 0; j < V->cols; j++) {
+            row[j] = (j < r) ? row[j] / decomposition->S->data[j] : 0.0;
+        }
+    }
+
+    Matrix* P = create_empty_matrix(A->cols, A->rows);
+    Matrix* U = decomposition->U;
+    if (P != NULL && gemm(0, 1, P->rows, P->cols, V->cols, 1.0, V->data, V->stride,
+                          U->data, U->stride, 0.0, P->data, P->stride) != EXIT_SUCCESS) {
+        free_matrix(P);
+        P = NULL;
+    }
+
+    free_svd(decomposition);
+    return P;
+}
+
+#endif
@@ -2,6 +2,11 @@
 #include <stdlib.h>
 #include <math.h> 
 #include <stdbool.h>
+#include <stdint.h>
+
+// Small CSV chunks so even the test files are split and parsed in parallel
+#define CSV_MIN_CHUNK_BYTES 16
+#define STREAM_BUFFER_BYTES 64
 
 #include "regressions.h" 
 
@@ -30,12 +35,12 @@ bool is_identity(Matrix* A) {
     for (size_t i = 0; i < n; i++) {
         for (size_t j = 0; j < n; j++) {
             // Check to see if we're on the main diagonal and value isn't one
-            if (i == j && !(is_close(A->data[i][j], 1.0))) {
+            if (i == j && !(is_close(MAT_AT(A, i, j), 1.0))) {
                 return false;
             }
 
             // Check to see if we're off the main diagonal and value isn't zero
-            if (i != j && !(is_close(A->data[i][j], 0.0))) {
+            if (i != j && !(is_close(MAT_AT(A, i, j), 0.0))) {
                 return false;
             }
         }
@@ -82,6 +87,64 @@ static char* test_dot_product_math() {
     return NULL;
 }
 
+static char* test_simd_levels() {
+    // Odd lengths leave a remainder after every unrolled loop
+    size_t n = 67;
+    Vector* a = create_empty_vector(n);
+    Vector* b = create_empty_vector(n);
+    double expected = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        a->data[i] = (double)(i % 7) - 3.0;
+        b->data[i] = 0.5 * (double)i;
+        expected += a->data[i] * b->data[i];
+    }
+
+    Matrix* A = create_empty_matrix(5, n);
+    for (size_t i = 0; i < A->rows; i++) {
+        for (size_t j = 0; j < n; j++) {
+            MAT_AT(A, i, j) = (double)((i + 1) * j % 5);
+        }
+    }
+
+    SimdLevel original = simd_active_level();
+    SimdLevel supported = simd_detect_level();
+
+    for (int l = SIMD_SCALAR; l <= (int)supported; l++) {
+        mu_assert("Could not select a supported SIMD level", simd_set_level((SimdLevel)l) == (SimdLevel)l);
+
+        for (size_t len = 0; len <= n; len += 11) {
+            double partial = 0.0;
+            for (size_t i = 0; i < len; i++) partial += a->data[i] * b->data[i];
+            mu_assert("SIMD dot product wrong for partial length", is_close(simd_dot(a->data, b->data, len), partial));
+        }
+
+        double result = 0.0;
+        dot_product(a, b, &result);
+        mu_assert("SIMD dot product wrong", is_close(result, expected));
+
+        float a_f[67], b_f[67];
+        for (size_t i = 0; i < n; i++) {
+            a_f[i] = (float)a->data[i];
+            b_f[i] = (float)b->data[i];
+        }
+        mu_assert("Float SIMD dot product wrong", fabs(simd_dot_f(a_f, b_f, n) - expected) < 1e-3);
+
+        Vector* y = matrix_vector_product(A, b);
+        for (size_t i = 0; i < A->rows; i++) {
+            double row_sum = 0.0;
+            for (size_t j = 0; j < n; j++) row_sum += MAT_AT(A, i, j) * b->data[j];
+            mu_assert("SIMD matrix-vector product wrong", is_close(y->data[i], row_sum));
+        }
+        free_vector(y);
+    }
+
+    simd_set_level(original);
+    free_vector(a);
+    free_vector(b);
+    free_matrix(A);
+    return NULL;
+}
+
 static char* test_dot_product_mismatch() {
     Vector* a = create_empty_vector(2);
     Vector* b = create_empty_vector(5); // Different size
@@ -127,10 +190,12 @@ static char* test_create_matrix() {
     mu_assert("Matrix rows wrong", m->rows == rows);
     mu_assert("Matrix cols wrong", m->cols == cols);
     mu_assert("Matrix data array NULL", m->data != NULL);
-    mu_assert("Matrix row 0 array NULL", m->data[0] != NULL);
+    mu_assert("Matrix stride smaller than cols", m->stride >= cols);
+    mu_assert("Matrix data not aligned", ((uintptr_t)m->data % MATRIX_ALIGNMENT) == 0);
+    mu_assert("Matrix row 1 not aligned", ((uintptr_t)matrix_row(m, 1) % MATRIX_ALIGNMENT) == 0);
 
     // Verify calloc zeroed the memory
-    mu_assert("Matrix data should be initialized to 0", m->data[0][0] == 0.0);
+    mu_assert("Matrix data should be initialized to 0", MAT_AT(m, 0, 0) == 0.0);
 
     free_matrix(m);
     return NULL;
@@ -142,7 +207,7 @@ static char* test_copy_matrix() {
     
     for (size_t i = 0; i < A->rows; i++) {
         for (size_t j = 0; j < A->cols; j++) {
-            mu_assert("Copy working incorrectly", A->data[i][j] == B->data[i][j]);
+            mu_assert("Copy working incorrectly", MAT_AT(A, i, j) == MAT_AT(B, i, j));
         }
     }
 
@@ -159,8 +224,8 @@ static char* test_matrix_transpose() {
     // [ 1.0, 2.0, 3.0 ]
     // [ 4.0, 5.0, 6.0 ]
     Matrix* m = create_empty_matrix(2, 3);
-    m->data[0][0] = 1.0; m->data[0][1] = 2.0; m->data[0][2] = 3.0;
-    m->data[1][0] = 4.0; m->data[1][1] = 5.0; m->data[1][2] = 6.0;
+    MAT_AT(m, 0, 0) = 1.0; MAT_AT(m, 0, 1) = 2.0; MAT_AT(m, 0, 2) = 3.0;
+    MAT_AT(m, 1, 0) = 4.0; MAT_AT(m, 1, 1) = 5.0; MAT_AT(m, 1, 2) = 6.0;
 
     // 2. Action
     Matrix* t = tranpose_matrix(m);
@@ -173,8 +238,8 @@ static char* test_matrix_transpose() {
     mu_assert("Transpose cols wrong", t->cols == 2);
     
     // Check corners
-    mu_assert("Transpose [0][1] wrong", is_close(t->data[0][1], 4.0)); 
-    mu_assert("Transpose [2][0] wrong", is_close(t->data[2][0], 3.0));
+    mu_assert("Transpose [0][1] wrong", is_close(MAT_AT(t, 0, 1), 4.0)); 
+    mu_assert("Transpose [2][0] wrong", is_close(MAT_AT(t, 2, 0), 3.0));
 
     free_matrix(m);
     free_matrix(t);
@@ -193,8 +258,8 @@ static char* test_matrix_csv_load() {
     mu_assert("Matrix failed to load from file", m != NULL);
     mu_assert("Loaded rows wrong", m->rows == 2);
     mu_assert("Loaded cols wrong", m->cols == 2);
-    mu_assert("Value at [0][0] wrong", is_close(m->data[0][0], 1.0));
-    mu_assert("Value at [1][1] wrong", is_close(m->data[1][1], 4.0));
+    mu_assert("Value at [0][0] wrong", is_close(MAT_AT(m, 0, 0), 1.0));
+    mu_assert("Value at [1][1] wrong", is_close(MAT_AT(m, 1, 1), 4.0));
 
     // 4. Cleanup
     free_matrix(m);
@@ -202,13 +267,196 @@ static char* test_matrix_csv_load() {
     return NULL;
 }
 
+static char* test_csv_parser() {
+    const char* filename = "test_parser.csv";
+
+    // CRLF endings, padding, blank lines, signs and exponents
+    create_temp_csv(filename, "1e3, -2.5 ,+0.125\r\n\n  \n4E-2,5.,-.5\r\n6,0.000001,12345678901234567890\n\n");
+    Matrix* m = create_matrix_from_file((char*)filename);
+    mu_assert("Parser matrix is NULL", m != NULL);
+    mu_assert("Parser rows wrong", m->rows == 3);
+    mu_assert("Parser cols wrong", m->cols == 3);
+    mu_assert("Exponent parsed wrong", MAT_AT(m, 0, 0) == 1000.0);
+    mu_assert("Padded value parsed wrong", MAT_AT(m, 0, 1) == -2.5);
+    mu_assert("Plus sign parsed wrong", MAT_AT(m, 0, 2) == 0.125);
+    mu_assert("Negative exponent parsed wrong", MAT_AT(m, 1, 0) == 0.04);
+    mu_assert("Trailing point parsed wrong", MAT_AT(m, 1, 1) == 5.0);
+    mu_assert("Leading point parsed wrong", MAT_AT(m, 1, 2) == -0.5);
+    mu_assert("Small value parsed wrong", MAT_AT(m, 2, 1) == 0.000001);
+    mu_assert("Long value parsed wrong", MAT_AT(m, 2, 2) == strtod("12345678901234567890", NULL));
+    free_matrix(m);
+
+    // Every double printed with %.17g reads back as the same double,
+    // including long mantissas, subnormals and the values atof() accepted
+    size_t n_values = 20000;
+    double* expected = (double*)malloc(n_values * sizeof(double));
+    FILE* fp = fopen(filename, "w");
+    srand(7);
+    for (size_t i = 0; i < n_values; i++) {
+        uint64_t bits = ((uint64_t)rand() << 62) ^ ((uint64_t)rand() << 31) ^ (uint64_t)rand();
+        double x;
+        memcpy(&x, &bits, sizeof(x));
+        if (i % 2 == 0) x = (double)rand() / RAND_MAX * pow(10.0, (double)(rand() % 40 - 20));
+        if (!isfinite(x)) x = 0.0;
+        if (i == 0) x = 77.620773969428711;
+        if (i == 1) x = 4.9e-324;
+        if (i == 2) x = -DBL_MAX;
+        expected[i] = x;
+        fprintf(fp, "%.17g\n", x);
+    }
+    fprintf(fp, "nan\ninf\n-inf\n");
+    fclose(fp);
+    Vector* v = create_vector_from_file((char*)filename);
+    mu_assert("Round trip vector is NULL", v != NULL && v->rows == n_values + 3);
+    size_t mismatches = 0;
+    for (size_t i = 0; i < n_values; i++) mismatches += memcmp(&v->data[i], &expected[i], sizeof(double)) != 0;
+    mu_assert("%.17g does not round trip", mismatches == 0);
+    mu_assert("nan and inf not read", isnan(v->data[n_values]) && isinf(v->data[n_values + 1])
+                                      && v->data[n_values + 2] < 0.0);
+    free_vector(v);
+    free(expected);
+
+    // Numbers strtod() reads keep '.' as the decimal point under a host's comma locale
+    create_temp_csv(filename, "77.620773969428711,1.5e300,nan\n");
+    const char* comma_locales[] = { "de_DE.UTF-8", "de_DE.utf8", "fr_FR.UTF-8", "fr_FR.utf8" };
+    for (size_t i = 0; i < sizeof(comma_locales) / sizeof(comma_locales[0]); i++) {
+        if (setlocale(LC_NUMERIC, comma_locales[i]) == NULL) continue;
+        m = create_matrix_from_file((char*)filename);
+        setlocale(LC_NUMERIC, "C");
+        mu_assert("Comma locale matrix is NULL", m != NULL && m->cols == 3);
+        mu_assert("Comma locale changed a value", MAT_AT(m, 0, 0) == 77.620773969428711 && MAT_AT(m, 0, 1) == 1.5e300);
+        free_matrix(m);
+        break;
+    }
+
+    // A ragged row is reported with its position
+    create_temp_csv(filename, "1,2,3\n4,5,6\n7,8\n");
+    CsvFile csv;
+    mu_assert("Could not open ragged file", csv_open(filename, &csv) == EXIT_SUCCESS);
+    double buffer[9];
+    mu_assert("Ragged file should fail", csv_read(&csv, buffer, 3) == EXIT_FAILURE);
+    mu_assert("Ragged row wrong", csv.error_row == 3);
+    mu_assert("Ragged column wrong", csv.error_col == 3);
+    csv_close(&csv);
+    mu_assert("Ragged matrix should be NULL", create_matrix_from_file((char*)filename) == NULL);
+
+    // So is a malformed value
+    create_temp_csv(filename, "1,2,3\n4,x5,6\n");
+    mu_assert("Could not open malformed file", csv_open(filename, &csv) == EXIT_SUCCESS);
+    mu_assert("Malformed file should fail", csv_read(&csv, buffer, 3) == EXIT_FAILURE);
+    mu_assert("Malformed row wrong", csv.error_row == 2);
+    mu_assert("Malformed column wrong", csv.error_col == 2);
+    csv_close(&csv);
+
+    // Rows longer than any fixed line buffer are read in full
+    size_t wide = 20000;
+    FILE* f = fopen(filename, "w");
+    for (size_t r = 0; r < 3; r++) {
+        for (size_t j = 0; j < wide; j++) {
+            fprintf(f, "%zu.5%s", j + r, j + 1 < wide ? "," : "\n");
+        }
+    }
+    fclose(f);
+    m = create_matrix_from_file((char*)filename);
+    mu_assert("Wide matrix is NULL", m != NULL);
+    mu_assert("Wide matrix cols wrong", m->cols == wide);
+    mu_assert("Wide matrix last value wrong", MAT_AT(m, 2, wide - 1) == (double)(wide + 1) + 0.5);
+    free_matrix(m);
+
+    // Vectors may also be stored as a column
+    create_temp_csv(filename, "1.5\n2.5\n3.5\n");
+    v = create_vector_from_file((char*)filename);
+    mu_assert("Column vector is NULL", v != NULL);
+    mu_assert("Column vector rows wrong", v->rows == 3);
+    mu_assert("Column vector value wrong", v->data[2] == 3.5);
+    free_vector(v);
+
+    remove(filename);
+    return NULL;
+}
+
+static char* test_binary_format() {
+    const char* matrix_file = "test_matrix.bin";
+    const char* vector_file = "test_vector.bin";
+
+    // Big enough for the checksum to span several blocks
+    Matrix* A = create_empty_matrix(300, 500);
+    for (size_t i = 0; i < A->rows; i++) {
+        for (size_t j = 0; j < A->cols; j++) {
+            MAT_AT(A, i, j) = (double)i - 0.25 * (double)j;
+        }
+    }
+    swap_rows(A, 0, 1);
+
+    mu_assert("Matrix write failed", write_matrix_to_binary(A, (char*)matrix_file) == EXIT_SUCCESS);
+    mu_assert("Binary file not recognised", is_binary_file(matrix_file));
+    mu_assert("CSV file taken for binary", !is_binary_file("my_matrix.csv"));
+
+    Matrix* B = create_matrix_from_binary((char*)matrix_file);
+    mu_assert("Binary matrix is NULL", B != NULL);
+    mu_assert("Binary matrix dimensions wrong", B->rows == A->rows && B->cols == A->cols);
+    mu_assert("Binary matrix should use the mapping directly", B->mapping != NULL && (char*)B->data == (char*)B->mapping + MLB_PAGE_SIZE);
+    mu_assert("Binary matrix data not aligned", ((uintptr_t)B->data % MATRIX_ALIGNMENT) == 0);
+    for (size_t i = 0; i < A->rows; i++) {
+        for (size_t j = 0; j < A->cols; j++) {
+            mu_assert("Binary matrix value wrong", MAT_AT(B, i, j) == MAT_AT(A, i, j));
+        }
+    }
+
+    // Mapped matrices work with every kernel, and writes stay private
+    MAT_AT(B, 0, 0) = 1234.0;
+    Matrix* Bt = tranpose_matrix(B);
+    mu_assert("Transpose of mapped matrix wrong", MAT_AT(Bt, 0, 0) == 1234.0);
+    free_matrix(Bt);
+    free_matrix(B);
+    B = create_matrix_from_binary((char*)matrix_file);
+    mu_assert("Writes to a mapped matrix reached the file", MAT_AT(B, 0, 0) == MAT_AT(A, 0, 0));
+    free_matrix(B);
+
+    // A flipped byte in the data is caught by the checksum
+    FILE* f = fopen(matrix_file, "r+b");
+    fseek(f, MLB_PAGE_SIZE + 4000, SEEK_SET);
+    fputc(0x5A, f);
+    fclose(f);
+    mu_assert("Corrupt file should not load", create_matrix_from_binary((char*)matrix_file) == NULL);
+
+    Vector* v = create_empty_vector(5);
+    for (size_t i = 0; i < v->rows; i++) v->data[i] = 1.5 * (double)i;
+    mu_assert("Vector write failed", write_vector_to_binary(v, (char*)vector_file) == EXIT_SUCCESS);
+
+    Vector* w = create_vector_from_binary((char*)vector_file);
+    mu_assert("Binary vector is NULL", w != NULL);
+    mu_assert("Binary vector rows wrong", w->rows == 5);
+    mu_assert("Binary vector value wrong", w->data[4] == 6.0);
+    mu_assert("A vector file is not a matrix", create_matrix_from_binary((char*)vector_file) == NULL);
+
+    // Row counts whose size in bytes wraps around, or that were never recorded, are rejected
+    MlbHeader h;
+    f = fopen(vector_file, "rb");
+    mu_assert("Header read failed", fread(&h, sizeof(h), 1, f) == 1);
+    fclose(f);
+    uint64_t file_size = h.data_offset + h.rows * h.stride * sizeof(double);
+    mu_assert("Valid header rejected", mlb_check_header(&h, file_size, MLB_KIND_VECTOR, vector_file) == EXIT_SUCCESS);
+    h.rows = ((uint64_t)1 << 61) + 1;
+    mu_assert("Overflowing row count accepted", mlb_check_header(&h, file_size, MLB_KIND_VECTOR, vector_file) != EXIT_SUCCESS);
+    h.rows = MLB_ROWS_UNKNOWN;
+    mu_assert("Unknown row count accepted", mlb_check_header(&h, file_size, MLB_KIND_VECTOR, vector_file) != EXIT_SUCCESS);
+
+    free_matrix(A);
+    free_vector(v);
+    free_vector(w);
+    remove(matrix_file);
+    remove(vector_file);
+    return NULL;
+}
+
 static char* test_matrix_vector_product() {
     // Setup Matrix (2x2 Identity Matrix scaled by 2)
     // [ 2, 0 ]
     // [ 0, 2 ]
     Matrix* A = create_empty_matrix(2, 2);
-    A->data[0][0] = 2.0; A->data[0][1] = 0.0;
-    A->data[1][0] = 0.0; A->data[1][1] = 2.0;
+    MAT_AT(A, 0, 0) = 2.0; MAT_AT(A, 0, 1) = 0.0;
+    MAT_AT(A, 1, 0) = 0.0; MAT_AT(A, 1, 1) = 2.0;
 
     // Setup Vector [ 3, 4 ]
     Vector* x = create_empty_vector(2);
@@ -247,24 +495,24 @@ static char* test_mv_product_mismatch() {
 
 static char* test_matrix_product() {
     Matrix* I = create_empty_matrix(2, 2);
-    I->data[0][0] = 1.0; I->data[0][1] = 0.0;
-    I->data[1][0] = 0.0; I->data[1][1] = 1.0;
+    MAT_AT(I, 0, 0) = 1.0; MAT_AT(I, 0, 1) = 0.0;
+    MAT_AT(I, 1, 0) = 0.0; MAT_AT(I, 1, 1) = 1.0;
 
     Matrix* A = create_empty_matrix(1, 4);
-    A->data[0][0] = 0.0; A->data[0][1] = 1.0; A->data[0][2] = 1.0; A->data[0][3] = 3.0;
+    MAT_AT(A, 0, 0) = 0.0; MAT_AT(A, 0, 1) = 1.0; MAT_AT(A, 0, 2) = 1.0; MAT_AT(A, 0, 3) = 3.0;
 
     Matrix* B = create_empty_matrix(4, 1);
-    B->data[0][0] = 0.0;
-    B->data[1][0] = 1.0;
-    B->data[2][0] = 2.0;
-    B->data[3][0] = 3.0;
+    MAT_AT(B, 0, 0) = 0.0;
+    MAT_AT(B, 1, 0) = 1.0;
+    MAT_AT(B, 2, 0) = 2.0;
+    MAT_AT(B, 3, 0) = 3.0;
 
     Matrix* C = matrix_product(A, B);
     Matrix* D = matrix_product(A, A);
     Matrix* E = matrix_product(I, I);
 
-    mu_assert("Result index [0][0] is wrong", is_close(E->data[0][0], 1.0));
-    mu_assert("Result index [1][0] is wrong", is_close(E->data[1][0], 0.0));
+    mu_assert("Result index [0][0] is wrong", is_close(MAT_AT(E, 0, 0), 1.0));
+    mu_assert("Result index [1][0] is wrong", is_close(MAT_AT(E, 1, 0), 0.0));
     mu_assert("Row dimension wrong", C->rows == A->rows);
     mu_assert("Column dimension wrong", C->cols == B->cols);
     mu_assert("Result dimension wrong, shouldn't work but is", D == NULL);
@@ -279,75 +527,262 @@ static char* test_matrix_product() {
     return NULL;
 }
 
+static char* test_gemm_blocked() {
+    // Sizes chosen to cross the MC and KC block edges and leave partial tiles
+    size_t m = 131, n = 37, k = 263;
+    Matrix* A = create_empty_matrix(m, k);
+    Matrix* B = create_empty_matrix(k, n);
+    for (size_t i = 0; i < m; i++) {
+        for (size_t p = 0; p < k; p++) {
+            MAT_AT(A, i, p) = (double)((i * 7 + p * 3) % 11) - 5.0;
+        }
+    }
+    for (size_t p = 0; p < k; p++) {
+        for (size_t j = 0; j < n; j++) {
+            MAT_AT(B, p, j) = (double)((p * 5 + j) % 13) / 13.0;
+        }
+    }
+
+    Matrix* C = matrix_product(A, B);
+    mu_assert("Blocked product is NULL", C != NULL);
+
+    for (size_t i = 0; i < m; i++) {
+        for (size_t j = 0; j < n; j++) {
+            double sum = 0.0;
+            for (size_t p = 0; p < k; p++) {
+                sum += MAT_AT(A, i, p) * MAT_AT(B, p, j);
+            }
+            mu_assert("Blocked product differs from the textbook product", is_close(MAT_AT(C, i, j), sum));
+        }
+    }
+
+    // C = 2 * At * A + 0.5 * C through the transposed path
+    Matrix* G = create_empty_matrix(k, k);
+    for (size_t i = 0; i < k; i++) MAT_AT(G, i, i) = 4.0;
+    gemm(1, 0, k, k, m, 2.0, A->data, A->stride, A->data, A->stride, 0.5, G->data, G->stride);
+
+    for (size_t i = 0; i < k; i += 17) {
+        for (size_t j = 0; j < k; j += 13) {
+            double sum = (i == j) ? 2.0 : 0.0;
+            for (size_t p = 0; p < m; p++) {
+                sum += 2.0 * MAT_AT(A, p, i) * MAT_AT(A, p, j);
+            }
+            mu_assert("Transposed gemm is wrong", is_close(MAT_AT(G, i, j), sum));
+        }
+    }
+
+    // Swapped rows must be honoured by the product
+    swap_rows(A, 0, 5);
+    Matrix* D = matrix_product(A, B);
+    mu_assert("Product after a row swap is wrong", is_close(MAT_AT(D, 0, 3), MAT_AT(C, 5, 3)));
+    mu_assert("Product after a row swap is wrong", is_close(MAT_AT(D, 5, 0), MAT_AT(C, 0, 0)));
+
+    free_matrix(A);
+    free_matrix(B);
+    free_matrix(C);
+    free_matrix(D);
+    free_matrix(G);
+    return NULL;
+}
+
+static char* test_gram_matrix() {
+    // Crosses the row and column blocks, and is split into slabs on 4 threads
+    size_t m = 2 * GRAM_ROW_BLOCK + 77, n = GRAM_COL_BLOCK + 9;
+    Matrix* A = create_empty_matrix(m, n);
+    Vector* b = create_empty_vector(m);
+    for (size_t i = 0; i < m; i++) {
+        for (size_t j = 0; j < n; j++) {
+            MAT_AT(A, i, j) = (double)((i * 5 + j * j) % 17) / 17.0 - 0.5;
+        }
+        b->data[i] = (double)(i % 7) - 3.0;
+    }
+    swap_rows(A, 1, 300);
+    swap_rows(A, 2, 3);
+
+    size_t original = ml_get_num_threads();
+    ml_set_num_threads(4);
+    Vector* Atb = NULL;
+    Matrix* AtA = gram_matrix(A, b, &Atb);
+    ml_set_num_threads(original);
+    mu_assert("Gram matrix is NULL", AtA != NULL && Atb != NULL);
+
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < n; j++) {
+            double sum = 0.0;
+            for (size_t p = 0; p < m; p++) sum += MAT_AT(A, p, i) * MAT_AT(A, p, j);
+            mu_assert("Gram matrix is wrong", is_close(MAT_AT(AtA, i, j), sum));
+        }
+        double sum = 0.0;
+        for (size_t p = 0; p < m; p++) sum += MAT_AT(A, p, i) * b->data[p];
+        mu_assert("Gram vector is wrong", is_close(Atb->data[i], sum));
+    }
+
+    free_matrix(A);
+    free_matrix(AtA);
+    free_vector(b);
+    free_vector(Atb);
+    return NULL;
+}
+
+static void count_visits(size_t begin, size_t end, void* ctx) {
+    int* visits = (int*)ctx;
+    for (size_t i = begin; i < end; i++) {
+        visits[i]++;
+    }
+}
+
+static char* test_thread_pool() {
+    size_t original = ml_get_num_threads();
+    ml_set_num_threads(4);
+    mu_assert("Thread count not applied", ml_get_num_threads() == 4);
+
+    int visits[1000] = {0};
+    parallel_for(0, 1000, 1, count_visits, visits);
+    for (size_t i = 0; i < 1000; i++) {
+        mu_assert("parallel_for must visit every index exactly once", visits[i] == 1);
+    }
+
+    // Matrices big enough that every kernel really splits its work
+    size_t n = 300;
+    Matrix* A = create_empty_matrix(n, n);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < n; j++) {
+            MAT_AT(A, i, j) = (i == j) ? (double)n : (double)((i * 31 + j * 17) % 10) / 10.0;
+        }
+    }
+
+    Matrix* A_inv = invert(A);
+    Matrix* P = matrix_product(A, A_inv);
+    Matrix* R = gauss_jordan_elimination(A);
+    mu_assert("Threaded inverse is wrong", is_identity(P));
+    mu_assert("Threaded elimination is wrong", is_identity(R));
+
+    Matrix* W = create_empty_matrix(n, 2000);
+    for (size_t i = 0; i < W->rows; i++) {
+        for (size_t j = 0; j < W->cols; j++) {
+            MAT_AT(W, i, j) = (double)(i * W->cols + j);
+        }
+    }
+    Matrix* Wt = tranpose_matrix(W);
+    for (size_t i = 0; i < W->rows; i += 7) {
+        for (size_t j = 0; j < W->cols; j += 13) {
+            mu_assert("Threaded transpose is wrong", MAT_AT(Wt, j, i) == MAT_AT(W, i, j));
+        }
+    }
+
+    // The same product on one thread must agree
+    ml_set_num_threads(1);
+    Matrix* Q = matrix_product(A, A_inv);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < n; j++) {
+            mu_assert("Threaded product differs from serial", is_close(MAT_AT(P, i, j), MAT_AT(Q, i, j)));
+        }
+    }
+
+    ml_set_num_threads(original);
+    free_matrix(A);
+    free_matrix(A_inv);
+    free_matrix(P);
+    free_matrix(Q);
+    free_matrix(R);
+    free_matrix(W);
+    free_matrix(Wt);
+    return NULL;
+}
+
 static char* test_swap_rows() {
     Matrix* A = create_empty_matrix(2, 2);
-    A->data[0][0] = 1.0; A->data[0][1] = 0.0;
-    A->data[1][0] = 0.0; A->data[1][0] = 1.0;
+    MAT_AT(A, 0, 0) = 1.0; MAT_AT(A, 0, 1) = 0.0;
+    MAT_AT(A, 1, 0) = 0.0; MAT_AT(A, 1, 0) = 1.0;
 
     swap_rows(A, 0, 1);
 
-    mu_assert("Swap did not happen", A->data[0][0] == 1.0 && A->data[0][1] == 0.0);
+    mu_assert("Swap did not happen", MAT_AT(A, 0, 0) == 1.0 && MAT_AT(A, 0, 1) == 0.0);
 
     return NULL;
 }
+static char* test_swap_rows_permutation() {
+    Matrix* A = create_empty_matrix(3, 2);
+    MAT_AT(A, 0, 0) = 1.0; MAT_AT(A, 0, 1) = 2.0;
+    MAT_AT(A, 1, 0) = 3.0; MAT_AT(A, 1, 1) = 4.0;
+    MAT_AT(A, 2, 0) = 5.0; MAT_AT(A, 2, 1) = 6.0;
+    double* row_0 = matrix_row(A, 0);
+
+    swap_rows(A, 0, 2);
+
+    mu_assert("Swapped row 0 wrong", MAT_AT(A, 0, 0) == 5.0 && MAT_AT(A, 0, 1) == 6.0);
+    mu_assert("Swapped row 2 wrong", MAT_AT(A, 2, 0) == 1.0 && MAT_AT(A, 2, 1) == 2.0);
+    mu_assert("Row data should not move", matrix_row(A, 2) == row_0);
+
+    // A copy stores the rows in their logical order
+    Matrix* B = copy_matrix(A);
+    mu_assert("Copy should not carry a permutation", B->perm == NULL);
+    mu_assert("Copy row 0 wrong", MAT_AT(B, 0, 0) == 5.0);
+    mu_assert("Copy row 2 wrong", MAT_AT(B, 2, 1) == 2.0);
+
+    free_matrix(A);
+    free_matrix(B);
+    return NULL;
+}
+
 static char* test_gj_elimination() {
     // Upper Triangular Matrix
     Matrix* U = create_empty_matrix(3, 3);
-    U->data[0][0] = 1.0; U->data[0][1] = 1.0; U->data[0][2] = 1.0;
-    U->data[1][0] = 0.0; U->data[1][1] = 1.0; U->data[1][2] = 1.0;
-    U->data[2][0] = 0.0; U->data[2][1] = 0.0; U->data[2][2] = 1.0;
+    MAT_AT(U, 0, 0) = 1.0; MAT_AT(U, 0, 1) = 1.0; MAT_AT(U, 0, 2) = 1.0;
+    MAT_AT(U, 1, 0) = 0.0; MAT_AT(U, 1, 1) = 1.0; MAT_AT(U, 1, 2) = 1.0;
+    MAT_AT(U, 2, 0) = 0.0; MAT_AT(U, 2, 1) = 0.0; MAT_AT(U, 2, 2) = 1.0;
     Matrix* A = gauss_jordan_elimination(U);
 
-    mu_assert("T1: Results index[0][1] is wrong", is_close(A->data[0][1], 0.0));
-    mu_assert("T1: Results index[0][2] is wrong", is_close(A->data[0][2], 0.0));
-    mu_assert("T1: Results index[1][2] is wrong", is_close(A->data[1][2], 0.0));
-    mu_assert("T1: Results index[1][1] is wrong", is_close(A->data[0][0], 1.0));
-    mu_assert("T1: Results index[2][2] is wrong", is_close(A->data[1][1], 1.0));
-    mu_assert("T1: Results index[3][3] is wrong", is_close(A->data[2][2], 1.0));
+    mu_assert("T1: Results index[0][1] is wrong", is_close(MAT_AT(A, 0, 1), 0.0));
+    mu_assert("T1: Results index[0][2] is wrong", is_close(MAT_AT(A, 0, 2), 0.0));
+    mu_assert("T1: Results index[1][2] is wrong", is_close(MAT_AT(A, 1, 2), 0.0));
+    mu_assert("T1: Results index[1][1] is wrong", is_close(MAT_AT(A, 0, 0), 1.0));
+    mu_assert("T1: Results index[2][2] is wrong", is_close(MAT_AT(A, 1, 1), 1.0));
+    mu_assert("T1: Results index[3][3] is wrong", is_close(MAT_AT(A, 2, 2), 1.0));
 
     if (A) free_matrix(A);
 
-    U->data[0][0] = 2.0; U->data[0][1] = 3.0; U->data[0][2] = 4.0;
-    U->data[1][0] = 0.0; U->data[1][1] = 4.0; U->data[1][2] = 5.0;
-    U->data[2][0] = 0.0; U->data[2][1] = 0.0; U->data[2][2] = 6.0;
+    MAT_AT(U, 0, 0) = 2.0; MAT_AT(U, 0, 1) = 3.0; MAT_AT(U, 0, 2) = 4.0;
+    MAT_AT(U, 1, 0) = 0.0; MAT_AT(U, 1, 1) = 4.0; MAT_AT(U, 1, 2) = 5.0;
+    MAT_AT(U, 2, 0) = 0.0; MAT_AT(U, 2, 1) = 0.0; MAT_AT(U, 2, 2) = 6.0;
     A = gauss_jordan_elimination(U);
 
-    mu_assert("T2: Results index[0][1] is wrong", is_close(A->data[0][1], 0.0));
-    mu_assert("T2: Results index[0][2] is wrong", is_close(A->data[0][2], 0.0));
-    mu_assert("T2: Results index[1][2] is wrong", is_close(A->data[1][2], 0.0));
-    mu_assert("T2: Results index[0][0] is wrong", is_close(A->data[0][0], 1.0));
-    mu_assert("T2: Results index[1][1] is wrong", is_close(A->data[1][1], 1.0));
-    mu_assert("T2: Results index[2][2] is wrong", is_close(A->data[2][2], 1.0));
+    mu_assert("T2: Results index[0][1] is wrong", is_close(MAT_AT(A, 0, 1), 0.0));
+    mu_assert("T2: Results index[0][2] is wrong", is_close(MAT_AT(A, 0, 2), 0.0));
+    mu_assert("T2: Results index[1][2] is wrong", is_close(MAT_AT(A, 1, 2), 0.0));
+    mu_assert("T2: Results index[0][0] is wrong", is_close(MAT_AT(A, 0, 0), 1.0));
+    mu_assert("T2: Results index[1][1] is wrong", is_close(MAT_AT(A, 1, 1), 1.0));
+    mu_assert("T2: Results index[2][2] is wrong", is_close(MAT_AT(A, 2, 2), 1.0));
 
     if (A) free_matrix(A);
 
-    U->data[0][0] = 2.0; U->data[0][1] = 3.0; U->data[0][2] = 4.0;
-    U->data[1][0] = 5.0; U->data[1][1] = 6.0; U->data[1][2] = 7.0;
-    U->data[2][0] = 8.0; U->data[2][1] = 9.0; U->data[2][2] = 10.0;
+    MAT_AT(U, 0, 0) = 2.0; MAT_AT(U, 0, 1) = 3.0; MAT_AT(U, 0, 2) = 4.0;
+    MAT_AT(U, 1, 0) = 5.0; MAT_AT(U, 1, 1) = 6.0; MAT_AT(U, 1, 2) = 7.0;
+    MAT_AT(U, 2, 0) = 8.0; MAT_AT(U, 2, 1) = 9.0; MAT_AT(U, 2, 2) = 10.0;
     A = gauss_jordan_elimination(U);
 
-    mu_assert("T3: Results index[0][1] is wrong", is_close(A->data[0][1], 0.0));
-    mu_assert("T3: Results index[0][2] is wrong", is_close(A->data[0][2], -1.0));
-    mu_assert("T3: Results index[1][2] is wrong", is_close(A->data[1][2], 2.0));
-    mu_assert("T3: Results index[0][0] is wrong", is_close(A->data[0][0], 1.0));
-    mu_assert("T3: Results index[1][1] is wrong", is_close(A->data[1][1], 1.0));
-    mu_assert("T3: Results index[2][2] is wrong", is_close(A->data[2][2], 0.0));
+    mu_assert("T3: Results index[0][1] is wrong", is_close(MAT_AT(A, 0, 1), 0.0));
+    mu_assert("T3: Results index[0][2] is wrong", is_close(MAT_AT(A, 0, 2), -1.0));
+    mu_assert("T3: Results index[1][2] is wrong", is_close(MAT_AT(A, 1, 2), 2.0));
+    mu_assert("T3: Results index[0][0] is wrong", is_close(MAT_AT(A, 0, 0), 1.0));
+    mu_assert("T3: Results index[1][1] is wrong", is_close(MAT_AT(A, 1, 1), 1.0));
+    mu_assert("T3: Results index[2][2] is wrong", is_close(MAT_AT(A, 2, 2), 0.0));
     if (A) free_matrix(A);
 
     Matrix* V = create_empty_matrix(4, 3);
-    V->data[0][0] = 2.0; V->data[0][1] = 3.0; V->data[0][2] = 4.0;
-    V->data[1][0] = 5.0; V->data[1][1] = 6.0; V->data[1][2] = 7.0;
-    V->data[2][0] = 8.0; V->data[2][1] = 9.0; V->data[2][2] = 10.0;
-    V->data[3][0] = 8.0; V->data[3][1] = 9.0; V->data[3][2] = 10.0;
+    MAT_AT(V, 0, 0) = 2.0; MAT_AT(V, 0, 1) = 3.0; MAT_AT(V, 0, 2) = 4.0;
+    MAT_AT(V, 1, 0) = 5.0; MAT_AT(V, 1, 1) = 6.0; MAT_AT(V, 1, 2) = 7.0;
+    MAT_AT(V, 2, 0) = 8.0; MAT_AT(V, 2, 1) = 9.0; MAT_AT(V, 2, 2) = 10.0;
+    MAT_AT(V, 3, 0) = 8.0; MAT_AT(V, 3, 1) = 9.0; MAT_AT(V, 3, 2) = 10.0;
     Matrix* B = gauss_jordan_elimination(V);
 
-    mu_assert("T4: Results index[0][1] is wrong", is_close(B->data[0][1], 0.0));
-    mu_assert("T4: Results index[0][2] is wrong", is_close(B->data[0][2], -1.0));
-    mu_assert("T4: Results index[1][2] is wrong", is_close(B->data[1][2], 2.0));
-    mu_assert("T4: Results index[0][0] is wrong", is_close(B->data[0][0], 1.0));
-    mu_assert("T4: Results index[1][1] is wrong", is_close(B->data[1][1], 1.0));
-    mu_assert("T4: Results index[2][2] is wrong", is_close(B->data[2][2], 0.0));
-    mu_assert("T4: Results index[3][2] is wrong", is_close(B->data[3][2], 0.0));
+    mu_assert("T4: Results index[0][1] is wrong", is_close(MAT_AT(B, 0, 1), 0.0));
+    mu_assert("T4: Results index[0][2] is wrong", is_close(MAT_AT(B, 0, 2), -1.0));
+    mu_assert("T4: Results index[1][2] is wrong", is_close(MAT_AT(B, 1, 2), 2.0));
+    mu_assert("T4: Results index[0][0] is wrong", is_close(MAT_AT(B, 0, 0), 1.0));
+    mu_assert("T4: Results index[1][1] is wrong", is_close(MAT_AT(B, 1, 1), 1.0));
+    mu_assert("T4: Results index[2][2] is wrong", is_close(MAT_AT(B, 2, 2), 0.0));
+    mu_assert("T4: Results index[3][2] is wrong", is_close(MAT_AT(B, 3, 2), 0.0));
  
     free_matrix(V);
     if (B) free_matrix(B);
@@ -357,8 +792,8 @@ static char* test_gj_elimination() {
 
 static char* test_inverse() {
     Matrix* A = create_empty_matrix(2,2);
-    A->data[0][0] = 1.0; A->data[0][1] = 2.0;
-    A->data[1][0] = 3.0; A->data[1][1] = 4.0;
+    MAT_AT(A, 0, 0) = 1.0; MAT_AT(A, 0, 1) = 2.0;
+    MAT_AT(A, 1, 0) = 3.0; MAT_AT(A, 1, 1) = 4.0;
 
     Matrix* A_inv = invert(A);
 
@@ -367,8 +802,8 @@ static char* test_inverse() {
     mu_assert("Matrix times inverse is not identity matrix", is_identity(P));
 
     Matrix* I = create_empty_matrix(2,2);
-    I->data[0][0] = 1.0; I->data[0][1] = 0.0;
-    I->data[1][0] = 0.0; I->data[1][1] = 1.0;
+    MAT_AT(I, 0, 0) = 1.0; MAT_AT(I, 0, 1) = 0.0;
+    MAT_AT(I, 1, 0) = 0.0; MAT_AT(I, 1, 1) = 1.0;
 
     Matrix* I_inv = invert(I);
 
@@ -381,23 +816,1242 @@ static char* test_inverse() {
     free_matrix(P);
     return 0;
 }
+static char* test_ols_streaming() {
+    // More rows than one chunk, and a y file that is one long line
+    size_t rows = OLS_STREAM_CHUNK_ROWS + 904;
+    Matrix* A = create_empty_matrix(rows, 3);
+    Vector* b = create_empty_vector(rows);
+    FILE* fa = fopen("test_stream_A.csv", "w");
+    FILE* fb = fopen("test_stream_b.csv", "w");
+    for (size_t i = 0; i < rows; i++) {
+        MAT_AT(A, i, 0) = 1.0;
+        MAT_AT(A, i, 1) = (double)(i % 17) * 0.5;
+        MAT_AT(A, i, 2) = (double)((i * 7) % 23) - 11.0;
+        b->data[i] = 2.0 - MAT_AT(A, i, 1) + 0.25 * MAT_AT(A, i, 2) + (double)(i % 3) * 0.125;
+        fprintf(fa, "%g, %g,%g\n", MAT_AT(A, i, 0), MAT_AT(A, i, 1), MAT_AT(A, i, 2));
+        if (i % 1000 == 0) fprintf(fa, "\n");
+        fprintf(fb, i + 1 < rows ? "%g," : "%g\n", b->data[i]);
+    }
+    fclose(fa);
+    fclose(fb);
+
+    Vector* expected = ols(A, b);
+    Vector* x_hat = ols_streaming("test_stream_A.csv", "test_stream_b.csv");
+    mu_assert("Streaming OLS from CSV failed", x_hat != NULL && x_hat->rows == 3);
+    for (size_t j = 0; j < 3; j++) {
+        mu_assert("Streaming OLS from CSV disagrees with ols()", fabs(x_hat->data[j] - expected->data[j]) < 1e-9);
+    }
+    free_vector(x_hat);
+
+    mu_assert("Matrix write failed", write_matrix_to_binary(A, "test_stream_A.bin") == EXIT_SUCCESS);
+    mu_assert("Vector write failed", write_vector_to_binary(b, "test_stream_b.bin") == EXIT_SUCCESS);
+    x_hat = ols_streaming("test_stream_A.bin", "test_stream_b.bin");
+    mu_assert("Streaming OLS from binary failed", x_hat != NULL);
+    for (size_t j = 0; j < 3; j++) {
+        mu_assert("Streaming OLS from binary disagrees with ols()", fabs(x_hat->data[j] - expected->data[j]) < 1e-9);
+    }
+    free_vector(x_hat);
+
+    // Mixed formats, and a y that is one row short
+    fb = fopen("test_stream_b.csv", "w");
+    for (size_t i = 0; i + 1 < rows; i++) fprintf(fb, "%g\n", b->data[i]);
+    fclose(fb);
+    mu_assert("Row count mismatch should fail", ols_streaming("test_stream_A.bin", "test_stream_b.csv") == NULL);
+
+    // Both loaders reject a trailing comma, with or without a final line break
+    for (int newline = 0; newline < 2; newline++) {
+        fb = fopen("test_stream_b.csv", "w");
+        for (size_t i = 0; i < rows; i++) fprintf(fb, "%g,", b->data[i]);
+        if (newline) fprintf(fb, "\n");
+        fclose(fb);
+        mu_assert("Trailing comma accepted by the loader", create_vector_from_file("test_stream_b.csv") == NULL);
+        mu_assert("Trailing comma accepted by the stream", ols_streaming("test_stream_A.csv", "test_stream_b.csv") == NULL);
+    }
+
+    free_matrix(A);
+    free_vector(b);
+    free_vector(expected);
+    remove("test_stream_A.csv");
+    remove("test_stream_b.csv");
+    remove("test_stream_A.bin");
+    remove("test_stream_b.bin");
+    return NULL;
+}
+static char* test_arena() {
+    Arena arena;
+    mu_assert("Arena init failed", arena_init(&arena, 4096) == EXIT_SUCCESS);
+
+    // Blocks are aligned, zeroed when they are matrices, and run out cleanly
+    Matrix* M = arena_matrix(&arena, 3, 5);
+    Vector* v = arena_vector(&arena, 7);
+    mu_assert("Arena allocation failed", M != NULL && v != NULL);
+    mu_assert("Arena matrix not aligned", ((uintptr_t)M->data % MATRIX_ALIGNMENT) == 0);
+    mu_assert("Arena matrix not zeroed", MAT_AT(M, 2, 4) == 0.0 && v->data[6] == 0.0);
+    size_t used = arena.used;
+    mu_assert("Oversized allocation should fail", arena_matrix(&arena, 100, 100) == NULL);
+    mu_assert("Failed allocation should not use space", arena.used == used);
+    free_matrix(M);
+    free_vector(v);
+    arena_reset(&arena);
+    mu_assert("Reset should reuse the same memory", arena_matrix(&arena, 3, 5) == M);
+    arena_reset(&arena);
+
+    // The _into variants write into caller storage
+    Matrix* A = arena_matrix(&arena, 2, 3);
+    Matrix* At = arena_matrix(&arena, 3, 2);
+    Matrix* AAt = arena_matrix(&arena, 2, 2);
+    Vector* x = arena_vector(&arena, 3);
+    Vector* Ax = arena_vector(&arena, 2);
+    for (size_t i = 0; i < 2; i++) {
+        for (size_t j = 0; j < 3; j++) MAT_AT(A, i, j) = (double)(i * 3 + j + 1);
+    }
+    for (size_t j = 0; j < 3; j++) x->data[j] = 1.0;
+    mu_assert("Transpose into failed", tranpose_matrix_into(A, At) == EXIT_SUCCESS && MAT_AT(At, 2, 1) == 6.0);
+    mu_assert("Product into failed", matrix_product_into(A, At, AAt) == EXIT_SUCCESS);
+    mu_assert("Product into wrong", is_close(MAT_AT(AAt, 0, 1), 32.0) && is_close(MAT_AT(AAt, 1, 1), 77.0));
+    mu_assert("Matrix vector product into failed", matrix_vector_product_into(A, x, Ax) == EXIT_SUCCESS);
+    mu_assert("Matrix vector product into wrong", is_close(Ax->data[0], 6.0) && is_close(Ax->data[1], 15.0));
+    mu_assert("Size mismatch should fail", matrix_product_into(A, A, AAt) == EXIT_FAILURE);
+    arena_free(&arena);
+
+    // ols_into() agrees with ols() and gives its scratch space back every time
+    size_t m = 300, n = 12;
+    Matrix* X = create_empty_matrix(m, n);
+    Vector* y = create_empty_vector(m);
+    for (size_t i = 0; i < m; i++) {
+        for (size_t j = 0; j < n; j++) MAT_AT(X, i, j) = cos((double)(i * i % 97 + 11 * j * j + i * j));
+        y->data[i] = (double)(i % 10);
+    }
+    Vector* expected = ols(X, y);
+    Vector* x_hat = create_empty_vector(n);
+    mu_assert("Arena init failed", arena_init(&arena, ols_workspace_bytes(n)) == EXIT_SUCCESS);
+    for (int fit = 0; fit < 3; fit++) {
+        mu_assert("ols_into failed", ols_into(X, y, x_hat, &arena) == EXIT_SUCCESS);
+        mu_assert("ols_into kept arena space", arena.used == 0);
+    }
+    for (size_t j = 0; j < n; j++) {
+        mu_assert("ols_into disagrees with ols()", fabs(x_hat->data[j] - expected->data[j]) < 1e-9);
+    }
+    arena_free(&arena);
+    free_matrix(X);
+    free_vector(y);
+    free_vector(expected);
+
+    // Enough rows for the threads' private copies of AtA, which come from the arena too
+    size_t threads = ml_get_num_threads();
+    ml_set_num_threads(4);
+    m = 5000;
+    X = create_empty_matrix(m, n);
+    y = create_empty_vector(m);
+    for (size_t i = 0; i < m; i++) {
+        for (size_t j = 0; j < n; j++) MAT_AT(X, i, j) = cos((double)(i * i % 97 + 11 * j * j + i * j));
+        y->data[i] = (double)(i % 10);
+    }
+    expected = ols(X, y);
+    mu_assert("Threaded workspace missing", gram_workspace_bytes(n, 16) > 0);
+    mu_assert("Arena init failed", arena_init(&arena, ols_workspace_bytes(n)) == EXIT_SUCCESS);
+    mu_assert("Threaded ols_into failed", ols_into(X, y, x_hat, &arena) == EXIT_SUCCESS && arena.used == 0);
+    for (size_t j = 0; j < n; j++) {
+        mu_assert("Threaded ols_into disagrees with ols()", fabs(x_hat->data[j] - expected->data[j]) < 1e-9);
+    }
+    arena_free(&arena);
+    ml_set_num_threads(threads);
+
+    free_matrix(X);
+    free_vector(y);
+    free_vector(expected);
+    free_vector(x_hat);
+    return NULL;
+}
+
+static char* test_sparse() {
+    // Unsorted COO triplets with a repeated entry and an empty row
+    size_t r[] = { 2, 0, 3, 0, 2, 3, 0 };
+    size_t c[] = { 1, 2, 0, 0, 1, 2, 2 };
+    double v[] = { 4.0, 1.0, -2.0, 3.0, 0.5, 6.0, 2.0 };
+    SparseMatrix* S = sparse_from_coo(4, 3, 7, r, c, v);
+    mu_assert("COO build failed", S != NULL && S->nnz == 5);
+    mu_assert("Row pointers wrong", S->row_ptr[1] == 2 && S->row_ptr[2] == 2 && S->row_ptr[4] == 5);
+    mu_assert("Columns not sorted", S->col_idx[0] == 0 && S->col_idx[1] == 2);
+    mu_assert("Repeated entries not summed", is_close(S->values[1], 3.0) && is_close(S->values[2], 4.5));
+    mu_assert("Out of range entry should fail", sparse_from_coo(2, 3, 7, r, c, v) == NULL);
+
+    SparseMatrix* T = sparse_transpose(S);
+    mu_assert("Transpose failed", T != NULL && T->rows == 3 && T->nnz == 5);
+    mu_assert("Transpose wrong", T->col_idx[T->row_ptr[2]] == 0 && is_close(T->values[T->row_ptr[2] + 1], 6.0));
+    free_sparse_matrix(T);
+    free_sparse_matrix(S);
+
+    // A mostly zero matrix, through both loaders, against the dense kernels
+    size_t m = 2 * SPARSE_STREAM_CHUNK_ROWS + 17, n = 9;
+    Matrix* A = create_empty_matrix(m, n);
+    Vector* b = create_empty_vector(m);
+    FILE* fa = fopen("test_sparse_A.csv", "w");
+    FILE* fc = fopen("test_sparse_coo.csv", "w");
+    for (size_t i = 0; i < m; i++) {
+        MAT_AT(A, i, 0) = 1.0;
+        MAT_AT(A, i, 1 + i % (n - 1)) = cos((double)(i * i % 97 + i));
+        if (i % 5 == 0) MAT_AT(A, i, 1 + (i / 5) % (n - 1)) += 2.0;
+        b->data[i] = sin((double)i);
+        for (size_t j = 0; j < n; j++) {
+            fprintf(fa, j + 1 < n ? "%.17g," : "%.17g\n", MAT_AT(A, i, j));
+            if (MAT_AT(A, i, j) != 0.0) fprintf(fc, "%zu,%zu,%.17g\n", m - 1 - i, j, MAT_AT(A, i, j));
+        }
+    }
+    fclose(fa);
+    fclose(fc);
+
+    SparseMatrix* from_dense = sparse_from_dense(A);
+    SparseMatrix* from_file = create_sparse_matrix_from_file("test_sparse_A.csv");
+    SparseMatrix* from_coo = create_sparse_matrix_from_coo("test_sparse_coo.csv", 0, 0);
+    mu_assert("Sparse loading failed", from_dense && from_file && from_coo);
+    mu_assert("Sparse file size wrong", from_file->rows == m && from_file->cols == n && from_file->nnz == from_dense->nnz);
+    mu_assert("Sparse COO size wrong", from_coo->rows == m && from_coo->nnz == from_dense->nnz);
+    for (size_t k = 0; k < from_dense->nnz; k++) {
+        mu_assert("Sparse file values wrong", from_file->col_idx[k] == from_dense->col_idx[k]
+                  && is_close(from_file->values[k], from_dense->values[k]));
+    }
+    mu_assert("Sparse COO rows reversed wrong", from_coo->col_idx[from_coo->row_ptr[m - 1]] == 0);
+
+    Vector* x = create_empty_vector(n);
+    for (size_t j = 0; j < n; j++) x->data[j] = (double)j - 3.5;
+    Vector* dense_Ax = matrix_vector_product(A, x);
+    Vector* sparse_Ax = sparse_matrix_vector_product(from_file, x);
+    mu_assert("SpMV failed", sparse_Ax != NULL);
+    for (size_t i = 0; i < m; i++) {
+        mu_assert("SpMV disagrees with the dense product", fabs(sparse_Ax->data[i] - dense_Ax->data[i]) < 1e-12);
+    }
+    mu_assert("SpMV size mismatch should fail", sparse_matrix_vector_product(from_file, b) == NULL);
+
+    Vector *dense_Atb = NULL, *sparse_Atb = NULL;
+    Matrix* dense_AtA = gram_matrix(A, b, &dense_Atb);
+    Matrix* sparse_AtA = sparse_gram_matrix(from_file, b, &sparse_Atb);
+    mu_assert("Sparse Gram matrix failed", sparse_AtA != NULL && sparse_Atb != NULL);
+    for (size_t i = 0; i < n; i++) {
+        mu_assert("Sparse Atb wrong", fabs(sparse_Atb->data[i] - dense_Atb->data[i]) < 1e-9);
+        for (size_t j = 0; j < n; j++) {
+            mu_assert("Sparse AtA wrong", fabs(MAT_AT(sparse_AtA, i, j) - MAT_AT(dense_AtA, i, j)) < 1e-9);
+        }
+    }
+
+    Vector* expected = ols(A, b);
+    Vector* x_hat = ols_sparse(from_file, b);
+    mu_assert("Sparse OLS failed", x_hat != NULL);
+    for (size_t j = 0; j < n; j++) {
+        mu_assert("Sparse OLS disagrees with ols()", fabs(x_hat->data[j] - expected->data[j]) < 1e-9);
+    }
+
+    free_matrix(A);
+    free_vector(b);
+    free_vector(x);
+    free_vector(dense_Ax);
+    free_vector(sparse_Ax);
+    free_matrix(dense_AtA);
+    free_matrix(sparse_AtA);
+    free_vector(dense_Atb);
+    free_vector(sparse_Atb);
+    free_vector(expected);
+    free_vector(x_hat);
+    free_sparse_matrix(from_dense);
+    free_sparse_matrix(from_file);
+    free_sparse_matrix(from_coo);
+    remove("test_sparse_A.csv");
+    remove("test_sparse_coo.csv");
+    return NULL;
+}
+
+static char* test_lsq() {
+    size_t m = 400, n = 24;
+    Matrix* A = create_empty_matrix(m, n);
+    Vector* b = create_empty_vector(m);
+    for (size_t i = 0; i < m; i++) {
+        // Columns of very different scales for the preconditioner to fix
+        for (size_t j = 0; j < n; j++) {
+            MAT_AT(A, i, j) = cos((double)(i * i % 97 + 11 * j * j + i * j)) * pow(10.0, (double)(j % 4));
+        }
+        b->data[i] = sin((double)i) + (double)(i % 7);
+    }
+
+    // At * y without forming At
+    Vector* y = create_empty_vector(m);
+    Vector* Aty = create_empty_vector(n);
+    for (size_t i = 0; i < m; i++) y->data[i] = (double)(i % 5) - 2.0;
+    Matrix* At = tranpose_matrix(A);
+    Vector* expected_Aty = matrix_vector_product(At, y);
+    mu_assert("Transposed product failed", matrix_transpose_vector_product_into(A, y, Aty) == EXIT_SUCCESS);
+    for (size_t j = 0; j < n; j++) {
+        mu_assert("Transposed product wrong", fabs(Aty->data[j] - expected_Aty->data[j]) < 1e-9 * fabs(expected_Aty->data[j]) + 1e-9);
+    }
+
+    Vector* expected = ols(A, b);
+    LsqOptions options = lsq_default_options();
+    Vector* x_lsqr = lsqr(A, b, &options);
+    mu_assert("LSQR failed", x_lsqr != NULL && options.converged);
+    size_t preconditioned_iterations = options.iterations;
+    Vector* x_cgls = cgls(A, b, NULL);
+    mu_assert("CGLS failed", x_cgls != NULL);
+    for (size_t j = 0; j < n; j++) {
+        double tol = 1e-7 * (fabs(expected->data[j]) + 1e-3);
+        mu_assert("LSQR disagrees with ols()", fabs(x_lsqr->data[j] - expected->data[j]) < tol);
+        mu_assert("CGLS disagrees with ols()", fabs(x_cgls->data[j] - expected->data[j]) < tol);
+    }
+
+    // Column scaling takes fewer iterations
+    options.precondition = 0;
+    Vector* x_plain = lsqr(A, b, &options);
+    mu_assert("Unpreconditioned LSQR failed", x_plain != NULL);
+    mu_assert("Preconditioning should save iterations", preconditioned_iterations < options.iterations);
+
+    // Warm starting from the answer has nothing left to do, a cap stops early
+    options = lsq_default_options();
+    options.x0 = expected;
+    Vector* x_warm = cgls(A, b, &options);
+    mu_assert("Warm start failed", x_warm != NULL && options.converged && options.iterations <= 1);
+    options = lsq_default_options();
+    options.max_iterations = 2;
+    Vector* x_capped = lsqr(A, b, &options);
+    mu_assert("Iteration cap ignored", x_capped != NULL && !options.converged && options.iterations == 2);
+
+    // The sparse operator gives the same answer
+    SparseMatrix* S = sparse_from_dense(A);
+    Vector* x_sparse = lsqr_sparse(S, b, NULL);
+    Vector* x_sparse_cgls = cgls_sparse(S, b, NULL);
+    mu_assert("Sparse LSQR and CGLS failed", x_sparse != NULL && x_sparse_cgls != NULL);
+    for (size_t j = 0; j < n; j++) {
+        double tol = 1e-7 * (fabs(expected->data[j]) + 1e-3);
+        mu_assert("Sparse LSQR disagrees with ols()", fabs(x_sparse->data[j] - expected->data[j]) < tol);
+        mu_assert("Sparse CGLS disagrees with ols()", fabs(x_sparse_cgls->data[j] - expected->data[j]) < tol);
+    }
+    mu_assert("Size mismatch should fail", lsqr(At, b, NULL) == NULL);
+
+    free_matrix(A);
+    free_matrix(At);
+    free_vector(b);
+    free_vector(y);
+    free_vector(Aty);
+    free_vector(expected_Aty);
+    free_vector(expected);
+    free_vector(x_lsqr);
+    free_vector(x_cgls);
+    free_vector(x_plain);
+    free_vector(x_warm);
+    free_vector(x_capped);
+    free_vector(x_sparse);
+    free_vector(x_sparse_cgls);
+    free_sparse_matrix(S);
+    return NULL;
+}
+
+static char* test_rls() {
+    size_t m = 600, n = 10, first = 300, batch = 100;
+    Matrix* A = create_empty_matrix(m, n);
+    Vector* b = create_empty_vector(m);
+    for (size_t i = 0; i < m; i++) {
+        for (size_t j = 0; j < n; j++) MAT_AT(A, i, j) = cos((double)(i * i % 97 + 11 * j * j + i * j));
+        b->data[i] = sin((double)i) + (double)(i % 7);
+    }
+
+    // A first fit, then batches of new rows, agree with a refit on everything
+    Matrix* head = create_empty_matrix(first, n);
+    Vector* head_b = create_empty_vector(first);
+    for (size_t i = 0; i < first; i++) {
+        memcpy(matrix_row(head, i), matrix_row(A, i), n * sizeof(double));
+        head_b->data[i] = b->data[i];
+    }
+    RLS* rls = rls_fit(head, head_b, 1.0);
+    mu_assert("RLS fit failed", rls != NULL && rls->observations == first);
+
+    Matrix* X = create_empty_matrix(batch, n);
+    Vector* y = create_empty_vector(batch);
+    for (size_t start = first; start < m; start += batch) {
+        for (size_t i = 0; i < batch; i++) {
+            memcpy(matrix_row(X, i), matrix_row(A, start + i), n * sizeof(double));
+            y->data[i] = b->data[start + i];
+        }
+        mu_assert("RLS update failed", rls_update(rls, X, y) == EXIT_SUCCESS);
+    }
+    Vector* expected = ols(A, b);
+    for (size_t j = 0; j < n; j++) {
+        mu_assert("RLS disagrees with a full refit", fabs(rls->coefficients->data[j] - expected->data[j]) < 1e-9);
+    }
+    mu_assert("RLS size mismatch should fail", rls_update(rls, head, y) == EXIT_FAILURE);
+    free_rls(rls);
+
+    // With forgetting, a batch weighs its rows as if they came one at a time,
+    // which is ols() on rows scaled by the square roots of their weights.
+    double f = 0.99;
+    RLS* batched = rls_fit(head, head_b, f);
+    RLS* single = rls_create(n, f, 1e-300);
+    mu_assert("RLS create failed", batched != NULL && single != NULL && rls_create(n, 1.5, 1.0) == NULL);
+    for (size_t i = 0; i < first; i++) {
+        Matrix* row = create_empty_matrix(1, n);
+        Vector* target = create_empty_vector(1);
+        memcpy(matrix_row(row, 0), matrix_row(A, i), n * sizeof(double));
+        target->data[0] = b->data[i];
+        rls_update(single, row, target);
+        free_matrix(row);
+        free_vector(target);
+    }
+    for (size_t i = 0; i < batch; i++) {
+        memcpy(matrix_row(X, i), matrix_row(A, first + i), n * sizeof(double));
+        y->data[i] = b->data[first + i];
+    }
+    rls_update(batched, X, y);
+    rls_update(single, X, y);
+
+    // The first fit weighs its rows equally, rows added one at a time each get their own weight
+    Matrix* W = create_empty_matrix(first + batch, n);
+    Vector* Wb = create_empty_vector(first + batch);
+    Vector* weighted[2];
+    for (int per_row = 0; per_row < 2; per_row++) {
+        for (size_t i = 0; i < first + batch; i++) {
+            size_t age = (per_row || i >= first) ? first + batch - 1 - i : batch;
+            double w = sqrt(pow(f, (double)age));
+            for (size_t j = 0; j < n; j++) MAT_AT(W, i, j) = w * MAT_AT(A, i, j);
+            Wb->data[i] = w * b->data[i];
+        }
+        weighted[per_row] = ols(W, Wb);
+    }
+    for (size_t j = 0; j < n; j++) {
+        mu_assert("Forgetting RLS disagrees with weighted ols()", fabs(batched->coefficients->data[j] - weighted[0]->data[j]) < 1e-9);
+        mu_assert("Row by row RLS disagrees with weighted ols()", fabs(single->coefficients->data[j] - weighted[1]->data[j]) < 1e-9);
+    }
+
+    free_rls(batched);
+    free_rls(single);
+    free_matrix(A);
+    free_matrix(head);
+    free_matrix(X);
+    free_matrix(W);
+    free_vector(b);
+    free_vector(head_b);
+    free_vector(y);
+    free_vector(Wb);
+    free_vector(expected);
+    free_vector(weighted[0]);
+    free_vector(weighted[1]);
+    return NULL;
+}
+
+static char* test_ridge() {
+    size_t m = 200, n = 12;
+    Matrix* A = create_empty_matrix(m, n);
+    Vector* b = create_empty_vector(m);
+    for (size_t i = 0; i < m; i++) {
+        for (size_t j = 0; j < n; j++) MAT_AT(A, i, j) = cos((double)(i * i % 97 + 11 * j * j + i * j));
+        b->data[i] = sin((double)i) + (double)(i % 7);
+    }
+
+    double lambdas[] = { 0.0, 0.1, 1.0, 10.0, 1000.0 };
+    size_t n_lambdas = sizeof(lambdas) / sizeof(lambdas[0]);
+    Matrix* path = ridge_path(A, b, lambdas, n_lambdas);
+    mu_assert("Ridge path failed", path != NULL && path->rows == n_lambdas && path->cols == n);
+
+    // Each row of the path matches a direct solve, and lambda = 0 is ols()
+    Vector* expected = ols(A, b);
+    double previous_norm = INFINITY;
+    for (size_t l = 0; l < n_lambdas; l++) {
+        Vector* x = ridge(A, b, lambdas[l]);
+        mu_assert("Ridge failed", x != NULL);
+        double norm = 0.0;
+        for (size_t j = 0; j < n; j++) {
+            mu_assert("Ridge path disagrees with ridge()", fabs(MAT_AT(path, l, j) - x->data[j]) < 1e-9);
+            if (l == 0) mu_assert("Ridge without a penalty disagrees with ols()", fabs(x->data[j] - expected->data[j]) < 1e-9);
+            norm += x->data[j] * x->data[j];
+        }
+        mu_assert("A larger penalty should shrink the coefficients", norm < previous_norm);
+        previous_norm = norm;
+        free_vector(x);
+    }
+    mu_assert("A negative penalty should fail", ridge(A, b, -1.0) == NULL);
+
+    // A repeated column: lambda = 0 gives the minimum norm solution, which splits it evenly
+    for (size_t i = 0; i < m; i++) MAT_AT(A, i, 1) = MAT_AT(A, i, 0);
+    Matrix* deficient = ridge_path(A, b, lambdas, 2);
+    mu_assert("Rank deficient ridge path failed", deficient != NULL);
+    mu_assert("Rank deficient path not minimum norm", fabs(MAT_AT(deficient, 0, 0) - MAT_AT(deficient, 0, 1)) < 1e-8);
+    mu_assert("Penalized path should split the repeated column", fabs(MAT_AT(deficient, 1, 0) - MAT_AT(deficient, 1, 1)) < 1e-8);
+
+    free_matrix(A);
+    free_matrix(path);
+    free_matrix(deficient);
+    free_vector(b);
+    free_vector(expected);
+    return NULL;
+}
+
+static char* test_cross_validation() {
+    size_t m = 203, n = 8, k = 5;
+    Matrix* A = create_empty_matrix(m, n);
+    Vector* b = create_empty_vector(m);
+    for (size_t i = 0; i < m; i++) {
+        for (size_t j = 0; j < n; j++) MAT_AT(A, i, j) = cos((double)(i * i % 97 + 11 * j * j + i * j));
+        b->data[i] = sin((double)i) + (double)(i % 7);
+    }
+
+    // Against refitting every fold from its training rows
+    double lambdas[] = { 0.0, 2.5 };
+    for (size_t p = 0; p < 2; p++) {
+        CrossValidation* cv = cross_validate(A, b, k, lambdas[p]);
+        mu_assert("Cross-validation failed", cv != NULL && cv->folds == k);
+
+        double total_sse = 0.0;
+        for (size_t f = 0; f < k; f++) {
+            size_t lo = f * m / k, hi = (f + 1) * m / k;
+            Matrix* train = create_empty_matrix(m - (hi - lo), n);
+            Vector* train_b = create_empty_vector(m - (hi - lo));
+            Matrix* test = create_empty_matrix(hi - lo, n);
+            Vector* test_b = create_empty_vector(hi - lo);
+            for (size_t i = 0, r = 0; i < m; i++) {
+                int held_out = i >= lo && i < hi;
+                Matrix* dst = held_out ? test : train;
+                size_t row = held_out ? i - lo : r++;
+                memcpy(matrix_row(dst, row), matrix_row(A, i), n * sizeof(double));
+                (held_out ? test_b : train_b)->data[row] = b->data[i];
+            }
+
+            Vector* x = ridge(train, train_b, lambdas[p]);
+            Vector* predicted = matrix_vector_product(test, x);
+            double fold_mse = 0.0, fold_mae = 0.0;
+            mse(test_b, predicted, &fold_mse);
+            mae(test_b, predicted, &fold_mae);
+            mu_assert("Fold MSE wrong", fabs(cv->fold_mse->data[f] - fold_mse) < 1e-9 * fold_mse);
+            mu_assert("Fold MAE wrong", fabs(cv->fold_mae->data[f] - fold_mae) < 1e-9 * fold_mae);
+            total_sse += fold_mse * (double)(hi - lo);
+
+            free_matrix(train);
+            free_matrix(test);
+            free_vector(train_b);
+            free_vector(test_b);
+            free_vector(x);
+            free_vector(predicted);
+        }
+        mu_assert("Overall MSE wrong", fabs(cv->mse - total_sse / (double)m) < 1e-9 * cv->mse);
+        free_cross_validation(cv);
+    }
+    mu_assert("Too many folds should fail", cross_validate(A, b, m + 1, 0.0) == NULL);
+    mu_assert("One fold should fail", cross_validate(A, b, 1, 0.0) == NULL);
+
+    free_matrix(A);
+    free_vector(b);
+    return NULL;
+}
+
+static char* test_predict() {
+    size_t m = PREDICT_CHUNK_ROWS + 321, n = 5;
+    Matrix* X = create_empty_matrix(m, n);
+    Vector* beta = create_empty_vector(n);
+    for (size_t j = 0; j < n; j++) beta->data[j] = (double)j - 1.5;
+    FILE* fx = fopen("test_predict_X.csv", "w");
+    for (size_t i = 0; i < m; i++) {
+        for (size_t j = 0; j < n; j++) {
+            MAT_AT(X, i, j) = cos((double)(i * 7 + j * j));
+            fprintf(fx, j + 1 < n ? "%.17g," : "%.17g\n", MAT_AT(X, i, j));
+        }
+    }
+    fclose(fx);
+    mu_assert("Matrix write failed", write_matrix_to_binary(X, "test_predict_X.bin") == EXIT_SUCCESS);
+
+    Vector* expected = predict(X, beta);
+    mu_assert("Predict failed", expected != NULL && expected->rows == m);
+    mu_assert("Predict wrong", is_close(expected->data[3], simd_dot(matrix_row(X, 3), beta->data, n)));
+
+    // Streamed from CSV to CSV, and from binary to a binary file of unknown length up front
+    size_t rows = 0;
+    mu_assert("CSV prediction failed", predict_streaming("test_predict_X.csv", beta, "test_predict_y.csv", 0, &rows) == EXIT_SUCCESS);
+    mu_assert("CSV prediction row count wrong", rows == m);
+    Vector* from_csv = create_vector_from_file("test_predict_y.csv");
+    mu_assert("Binary prediction failed", predict_streaming("test_predict_X.bin", beta, "test_predict_y.bin", 1, &rows) == EXIT_SUCCESS);
+    Vector* from_binary = create_vector_from_binary("test_predict_y.bin");
+    mu_assert("Predictions unreadable", from_csv != NULL && from_binary != NULL);
+    mu_assert("Prediction sizes wrong", from_csv->rows == m && from_binary->rows == m);
+    for (size_t i = 0; i < m; i++) {
+        mu_assert("CSV predictions wrong", from_csv->data[i] == expected->data[i]);
+        mu_assert("Binary predictions wrong", from_binary->data[i] == expected->data[i]);
+    }
+
+    // Saved coefficients, as ml_app --save writes them, reload bit for bit
+    Vector* saved = create_empty_vector(n);
+    for (size_t j = 0; j < n; j++) saved->data[j] = 1.0 / 3.0 + (double)j * 77.620773969428711;
+    mu_assert("Save failed", write_vector_to_csv(saved, "test_predict_beta.csv") == EXIT_SUCCESS);
+    Vector* reloaded = create_vector_from_file("test_predict_beta.csv");
+    mu_assert("Reload failed", reloaded != NULL && reloaded->rows == n);
+    mu_assert("Reloaded coefficients differ", memcmp(saved->data, reloaded->data, n * sizeof(double)) == 0);
+    free_vector(saved);
+    free_vector(reloaded);
+    remove("test_predict_beta.csv");
+
+    Vector* short_beta = create_empty_vector(n - 1);
+    mu_assert("Coefficient count mismatch should fail",
+              predict_streaming("test_predict_X.csv", short_beta, "test_predict_y.csv", 0, NULL) == EXIT_FAILURE
+              && predict(X, short_beta) == NULL);
+
+    free_matrix(X);
+    free_vector(beta);
+    free_vector(short_beta);
+    free_vector(expected);
+    free_vector(from_csv);
+    free_vector(from_binary);
+    remove("test_predict_X.csv");
+    remove("test_predict_X.bin");
+    remove("test_predict_y.csv");
+    remove("test_predict_y.bin");
+    return NULL;
+}
+
+static char* test_metrics() {
+    // Small enough to check by hand: r = (0.5, -1, 0, 2.5)
+    Vector* y = create_empty_vector(4);
+    Vector* y_hat = create_empty_vector(4);
+    double y_values[] = { 1.0, 2.0, 3.0, 6.0 };
+    double r_values[] = { 0.5, -1.0, 0.0, 2.5 };
+    for (size_t i = 0; i < 4; i++) {
+        y->data[i] = y_values[i];
+        y_hat->data[i] = y_values[i] - r_values[i];
+    }
+    Metrics metrics;
+    mu_assert("Metrics failed", compute_metrics(y, y_hat, &metrics) == EXIT_SUCCESS && metrics.n == 4);
+    mu_assert("SSE wrong", is_close(metrics.sse, 7.5) && is_close(metrics.mse, 1.875));
+    mu_assert("RMSE wrong", is_close(metrics.rmse, sqrt(1.875)));
+    mu_assert("MAE wrong", is_close(metrics.mae, 1.0));
+    mu_assert("R^2 wrong", is_close(metrics.r2, 1.0 - 7.5 / 14.0));
+    mu_assert("Max error wrong", is_close(metrics.max_error, 2.5));
+    mu_assert("Residual mean wrong", is_close(metrics.residual_mean, 0.5));
+
+    double result = 0.0;
+    mu_assert("MSE wrapper wrong", mse(y, y_hat, &result) == EXIT_SUCCESS && is_close(result, 1.875));
+    mu_assert("MAE wrapper wrong", mae(y, y_hat, &result) == EXIT_SUCCESS && is_close(result, 1.0));
+    Vector* short_y = create_empty_vector(3);
+    mu_assert("Size mismatch should fail", compute_metrics(short_y, y_hat, &metrics) == EXIT_FAILURE);
+    free_vector(y);
+    free_vector(y_hat);
+    free_vector(short_y);
+
+    // Many blocks: a constant residual comes out exact, and the model
+    // version agrees without storing the predictions
+    size_t m = 1000003, n = 3;
+    Matrix* X = create_empty_matrix(m, n);
+    Vector* beta = create_empty_vector(n);
+    y = create_empty_vector(m);
+    for (size_t j = 0; j < n; j++) beta->data[j] = 0.5 * (double)j;
+    for (size_t i = 0; i < m; i++) {
+        for (size_t j = 0; j < n; j++) MAT_AT(X, i, j) = (double)((i + j) % 11);
+        y->data[i] = simd_dot(matrix_row(X, i), beta->data, n) + 0.1;
+    }
+    Metrics model;
+    y_hat = predict(X, beta);
+    mu_assert("Model metrics failed", compute_model_metrics(X, beta, y, &model) == EXIT_SUCCESS);
+    mu_assert("Metrics failed", compute_metrics(y, y_hat, &metrics) == EXIT_SUCCESS);
+    mu_assert("Model and vector metrics disagree", model.sse == metrics.sse && model.r2 == metrics.r2);
+    mu_assert("Compensated residual mean inexact", fabs(model.residual_mean - 0.1) < 1e-14);
+    mu_assert("Compensated MSE inexact", fabs(model.mse - 0.01) < 1e-14);
+    mu_assert("Large R^2 wrong", model.r2 > 0.99 && model.r2 < 1.0);
+
+    free_matrix(X);
+    free_vector(beta);
+    free_vector(y);
+    free_vector(y_hat);
+    return NULL;
+}
+
+static char* test_trace() {
+#if ML_TRACE_ENABLED
+    Matrix* A = create_empty_matrix(3, 4);
+    Matrix* B = create_empty_matrix(4, 5);
+
+    // Spans count only while tracing is on
+    TraceMode mode = ml_trace_mode();
+    ml_trace_enable(TRACE_TABLE, NULL);
+    ml_trace_reset();
+    free_matrix(matrix_product(A, B));
+    free_matrix(matrix_product(A, B));
+    const TraceStat* stat = ml_trace_stat("matrix_product");
+    mu_assert("matrix_product span missing", stat != NULL && stat->calls == 2);
+    mu_assert("Flop count wrong", stat->flops == 2 * 2.0 * 3 * 4 * 5);
+    mu_assert("Byte count wrong", stat->bytes == 2 * 8.0 * (12 + 20 + 15));
+    mu_assert("Negative time", stat->seconds >= 0.0);
+
+    ml_trace_enable(TRACE_OFF, NULL);
+    free_matrix(matrix_product(A, B));
+    mu_assert("Span counted while off", ml_trace_stat("matrix_product")->calls == 2);
+
+    // A Chrome trace keeps every call
+    const char* file = "test_trace.json";
+    ml_trace_enable(TRACE_CHROME, file);
+    ml_trace_reset();
+    free_matrix(matrix_product(A, B));
+    mu_assert("Chrome trace not written", ml_trace_write_chrome(file) == EXIT_SUCCESS);
+    FILE* fp = fopen(file, "r");
+    char text[512] = {0};
+    mu_assert("Chrome trace missing", fp != NULL && fread(text, 1, sizeof(text) - 1, fp) > 0);
+    fclose(fp);
+    remove(file);
+    mu_assert("Chrome event wrong", strstr(text, "\"name\": \"matrix_product\", \"ph\": \"X\"") != NULL);
+
+    // Calls that fail or fall back are counted too
+    ml_trace_enable(TRACE_TABLE, NULL);
+    ml_trace_reset();
+    Matrix* D = create_empty_matrix(10, 3);
+    Vector* y = create_empty_vector(10);
+    for (size_t i = 0; i < 10; i++) {
+        MAT_AT(D, i, 0) = MAT_AT(D, i, 1) = (double)i;
+        MAT_AT(D, i, 2) = 1.0;
+        y->data[i] = (double)(i % 3);
+    }
+    Vector* x = ols(D, y);
+    mu_assert("Rank deficient ols() failed", x != NULL);
+    mu_assert("ols() fallback not counted", ml_trace_stat("ols")->calls == 1 && ml_trace_stat("ols_pinv")->calls == 1);
+    Matrix* Z = create_empty_matrix(3, 3);
+    mu_assert("Singular matrix inverted", invert(Z) == NULL);
+    mu_assert("Failed invert() not counted", ml_trace_stat("invert")->calls == 1);
+    free_vector(x);
+    free_vector(y);
+    free_matrix(D);
+    free_matrix(Z);
+
+    ml_trace_reset();
+    ml_trace_enable(mode, NULL);
+    free_matrix(A);
+    free_matrix(B);
+#endif
+    return NULL;
+}
+
+static char* test_cholesky() {
+    // Several blocks, so the panel solve and trailing update both run
+    size_t n = 2 * CHOLESKY_BLOCK + 22;
+    Matrix* M = create_empty_matrix(n, n);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < n; j++) {
+            MAT_AT(M, i, j) = (double)((i * 31 + j * 17) % 13) - 6.0;
+        }
+    }
+    Matrix* Mt = tranpose_matrix(M);
+    Matrix* A = matrix_product(M, Mt);
+    for (size_t i = 0; i < n; i++) MAT_AT(A, i, i) += (double)n;
+
+    Matrix* L = cholesky(A);
+    mu_assert("Cholesky of SPD matrix failed", L != NULL);
+    mu_assert("Cholesky factor not lower triangular", MAT_AT(L, 0, n - 1) == 0.0);
+
+    Matrix* Lt = tranpose_matrix(L);
+    Matrix* LLt = matrix_product(L, Lt);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < n; j++) {
+            mu_assert("L * Lt does not reproduce A", fabs(MAT_AT(LLt, i, j) - MAT_AT(A, i, j)) < 1e-8);
+        }
+    }
+
+    Vector* x = create_empty_vector(n);
+    for (size_t i = 0; i < n; i++) x->data[i] = (double)i * 0.1 - 3.0;
+    Vector* b = matrix_vector_product(A, x);
+    Vector* x_hat = cholesky_solve(L, b);
+    for (size_t i = 0; i < n; i++) {
+        mu_assert("Cholesky solve wrong", fabs(x_hat->data[i] - x->data[i]) < 1e-9);
+    }
+
+    // Indefinite and singular matrices are refused
+    Matrix* S = create_empty_matrix(2, 2);
+    MAT_AT(S, 0, 0) = 1.0; MAT_AT(S, 0, 1) = 2.0;
+    MAT_AT(S, 1, 0) = 2.0; MAT_AT(S, 1, 1) = 1.0;
+    mu_assert("Indefinite matrix should not factor", cholesky(S) == NULL);
+    MAT_AT(S, 1, 1) = 4.0;
+    mu_assert("Singular matrix should not factor", cholesky(S) == NULL);
+
+    free_matrix(M);
+    free_matrix(Mt);
+    free_matrix(A);
+    free_matrix(L);
+    free_matrix(Lt);
+    free_matrix(LLt);
+    free_matrix(S);
+    free_vector(x);
+    free_vector(b);
+    free_vector(x_hat);
+    return NULL;
+}
+
+static char* test_mixed_precision() {
+    // The float engine crosses the same block edges as the double one
+    size_t m = 131, n = 37, k = 263;
+    float* A_f = (float*)malloc(m * k * sizeof(float));
+    float* B_f = (float*)malloc(k * n * sizeof(float));
+    float* C_f = (float*)malloc(m * n * sizeof(float));
+    for (size_t i = 0; i < m * k; i++) A_f[i] = (float)((i * 7) % 11) - 5.0f;
+    for (size_t i = 0; i < k * n; i++) B_f[i] = (float)((i * 5) % 13) / 13.0f;
+    mu_assert("Float gemm failed", gemm_f(0, 0, m, n, k, 1.0f, A_f, k, B_f, n, 0.0f, C_f, n) == EXIT_SUCCESS);
+    for (size_t i = 0; i < m; i += 13) {
+        for (size_t j = 0; j < n; j += 5) {
+            double sum = 0.0;
+            for (size_t p = 0; p < k; p++) sum += (double)A_f[i * k + p] * (double)B_f[p * n + j];
+            mu_assert("Float gemm wrong", fabs(C_f[i * n + j] - sum) < 1e-3 * (1.0 + fabs(sum)));
+        }
+    }
+    free(A_f);
+    free(B_f);
+    free(C_f);
+
+    // Refinement recovers the double solution, across several Cholesky blocks
+    size_t rows = 600, cols = CHOLESKY_BLOCK + 40;
+    Matrix* X = create_empty_matrix(rows, cols);
+    Vector* y = create_empty_vector(rows);
+    for (size_t i = 0; i < rows; i++) {
+        for (size_t j = 0; j < cols; j++) MAT_AT(X, i, j) = cos((double)(i * i % 97 + 11 * j * j + i * j));
+        y->data[i] = sin((double)i);
+    }
+    Vector* expected = ols(X, y);
+    Vector* x_hat = ols_mixed(X, y);
+    mu_assert("Mixed precision OLS failed", x_hat != NULL);
+    for (size_t j = 0; j < cols; j++) {
+        mu_assert("Mixed precision OLS not refined to double accuracy", fabs(x_hat->data[j] - expected->data[j]) < 1e-10);
+    }
+    free_vector(expected);
+    free_vector(x_hat);
+
+    // Too ill conditioned for a float factor, so the double path takes over
+    for (size_t i = 0; i < rows; i++) MAT_AT(X, i, 1) = MAT_AT(X, i, 0) + 1e-5 * MAT_AT(X, i, 1);
+    expected = ols(X, y);
+    x_hat = ols_mixed(X, y);
+    mu_assert("Mixed precision fallback failed", x_hat != NULL);
+    for (size_t j = 0; j < cols; j++) {
+        mu_assert("Mixed precision fallback wrong", fabs(x_hat->data[j] - expected->data[j]) < 1e-6);
+    }
+
+    free_matrix(X);
+    free_vector(y);
+    free_vector(expected);
+    free_vector(x_hat);
+    return NULL;
+}
+
+static char* test_cholesky_pivoted() {
+    // A = M * Mt with M n x r is semidefinite of rank r, across several blocks
+    size_t n = 2 * CHOLESKY_BLOCK + 30, r = CHOLESKY_BLOCK + 11;
+    Matrix* M = create_empty_matrix(n, r);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < r; j++) {
+            MAT_AT(M, i, j) = cos((double)(i * i % 97 + 11 * j * j + i * j));
+        }
+    }
+    Matrix* Mt = tranpose_matrix(M);
+    Matrix* A = matrix_product(M, Mt);
+
+    PivotedCholesky* chol = cholesky_pivoted(A);
+    mu_assert("Pivoted Cholesky failed", chol != NULL);
+    mu_assert("Pivoted Cholesky found the wrong rank", chol->rank == r);
+    mu_assert("Rank deficient matrix has a condition estimate", chol->rcond == 0.0);
+
+    // P * A * Pt = L * Lt
+    Matrix* Lt = tranpose_matrix(chol->L);
+    Matrix* LLt = matrix_product(chol->L, Lt);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < n; j++) {
+            double a = MAT_AT(A, chol->pivots[i], chol->pivots[j]);
+            mu_assert("L * Lt does not reproduce the pivoted A", fabs(MAT_AT(LLt, i, j) - a) < 1e-8);
+        }
+    }
+
+    // Full rank once the diagonal is shifted, and the solve undoes the pivots
+    for (size_t i = 0; i < n; i++) MAT_AT(A, i, i) += 1.0;
+    PivotedCholesky* full = cholesky_pivoted(A);
+    mu_assert("Pivoted Cholesky of SPD matrix lost rank", full != NULL && full->rank == n);
+    mu_assert("Condition estimate out of range", full->rcond > 0.0 && full->rcond < 1.0);
+
+    Vector* x = create_empty_vector(n);
+    for (size_t i = 0; i < n; i++) x->data[i] = (double)(i % 9) - 4.0;
+    Vector* b = matrix_vector_product(A, x);
+    Vector* x_hat = cholesky_pivoted_solve(full, b);
+    for (size_t i = 0; i < n; i++) {
+        mu_assert("Pivoted Cholesky solve wrong", fabs(x_hat->data[i] - x->data[i]) < 1e-8);
+    }
+
+    free_pivoted_cholesky(chol);
+    free_pivoted_cholesky(full);
+    free_matrix(M);
+    free_matrix(Mt);
+    free_matrix(A);
+    free_matrix(Lt);
+    free_matrix(LLt);
+    free_vector(x);
+    free_vector(b);
+    free_vector(x_hat);
+    return NULL;
+}
+
+static char* test_solve_linear_system() {
+    // Needs a row exchange: the first pivot is zero
+    Matrix* A = create_empty_matrix(3, 3);
+    MAT_AT(A, 0, 0) = 0.0; MAT_AT(A, 0, 1) = 2.0; MAT_AT(A, 0, 2) = 1.0;
+    MAT_AT(A, 1, 0) = 1.0; MAT_AT(A, 1, 1) = 1.0; MAT_AT(A, 1, 2) = 0.0;
+    MAT_AT(A, 2, 0) = 3.0; MAT_AT(A, 2, 1) = 0.0; MAT_AT(A, 2, 2) = 1.0;
+    Vector* b = create_empty_vector(3);
+    b->data[0] = 7.0; b->data[1] = 3.0; b->data[2] = 6.0;
+
+    Vector* x = solve_linear_system(A, b);
+    mu_assert("Solve returned NULL", x != NULL);
+    mu_assert("Solve x[0] wrong", is_close(x->data[0], 1.0));
+    mu_assert("Solve x[1] wrong", is_close(x->data[1], 2.0));
+    mu_assert("Solve x[2] wrong", is_close(x->data[2], 3.0));
+    mu_assert("Solve should not modify A", MAT_AT(A, 0, 0) == 0.0 && A->perm == NULL);
+
+    // Third row is the sum of the first two
+    MAT_AT(A, 2, 0) = 1.0; MAT_AT(A, 2, 1) = 3.0; MAT_AT(A, 2, 2) = 1.0;
+    mu_assert("Singular system should fail", solve_linear_system(A, b) == NULL);
+
+    free_matrix(A);
+    free_vector(b);
+    free_vector(x);
+    return NULL;
+}
+
+static char* test_qr() {
+    // Several panels and a trailing update
+    size_t m = 300, n = 2 * QR_BLOCK + 6;
+    Matrix* A = create_empty_matrix(m, n);
+    Vector* b = create_empty_vector(m);
+    for (size_t i = 0; i < m; i++) {
+        for (size_t j = 0; j < n; j++) {
+            MAT_AT(A, i, j) = (double)((i * 37 + j * 11 + i * j) % 29) - 14.0 + (i == j ? 20.0 : 0.0);
+        }
+        b->data[i] = (double)(i % 7) - 3.0;
+    }
+
+    Matrix* At = tranpose_matrix(A);
+    Matrix* AtA = matrix_product(At, A);
+    Vector* expected = ols(A, b);
+
+    Matrix* F = copy_matrix(A);
+    Vector* x_hat = ols_qr(F, b);
+    mu_assert("QR OLS failed", x_hat != NULL && x_hat->rows == n);
+    for (size_t j = 0; j < n; j++) {
+        mu_assert("QR OLS disagrees with ols()", fabs(x_hat->data[j] - expected->data[j]) < 1e-9);
+    }
+
+    // Q is orthogonal, so Rt * R must equal AtA
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < n; j++) {
+            double sum = 0.0;
+            for (size_t k = 0; k <= MIN(i, j); k++) sum += MAT_AT(F, k, i) * MAT_AT(F, k, j);
+            mu_assert("Rt * R does not reproduce AtA", fabs(sum - MAT_AT(AtA, i, j)) < 1e-6 * fabs(MAT_AT(AtA, i, i)));
+        }
+    }
+    free_matrix(F);
+    free_vector(x_hat);
+
+    // Swapped rows of an arena matrix are put in order inside the arena's buffer
+    Arena arena;
+    mu_assert("Arena init failed", arena_init(&arena, 2 * m * n * sizeof(double)) == EXIT_SUCCESS);
+    Matrix* E = arena_matrix(&arena, m, n);
+    Vector* c = create_empty_vector(m);
+    for (size_t i = 0; i < m; i++) {
+        memcpy(matrix_row(E, i), matrix_row(A, i), n * sizeof(double));
+        c->data[i] = b->data[i];
+    }
+    size_t swaps[][2] = { { 0, 7 }, { 7, 200 }, { 3, 4 }, { 299, 0 } };
+    for (size_t s = 0; s < 4; s++) {
+        swap_rows(E, swaps[s][0], swaps[s][1]);
+        double temp = c->data[swaps[s][0]];
+        c->data[swaps[s][0]] = c->data[swaps[s][1]];
+        c->data[swaps[s][1]] = temp;
+    }
+    double* arena_data = E->data;
+    x_hat = ols_qr(E, c);
+    mu_assert("QR OLS on a permuted arena matrix failed", x_hat != NULL);
+    mu_assert("QR moved an arena matrix out of its arena", E->data == arena_data && E->arena == &arena && E->perm == NULL);
+    for (size_t j = 0; j < n; j++) {
+        mu_assert("QR OLS on a permuted matrix disagrees with ols()", fabs(x_hat->data[j] - expected->data[j]) < 1e-9);
+    }
+    free_matrix(E);
+    free_vector(c);
+    free_vector(x_hat);
+    arena_free(&arena);
+
+    // Polynomial features are badly conditioned: QR keeps the digits the normal equations lose
+    size_t degree = 9;
+    Matrix* P = create_empty_matrix(200, degree);
+    Vector* y = create_empty_vector(200);
+    for (size_t i = 0; i < 200; i++) {
+        double t = (double)i / 199.0, power = 1.0;
+        for (size_t j = 0; j < degree; j++) {
+            MAT_AT(P, i, j) = power;
+            y->data[i] += power;
+            power *= t;
+        }
+    }
+    x_hat = ols_qr(P, y);
+    mu_assert("QR OLS on polynomial features failed", x_hat != NULL);
+    for (size_t j = 0; j < degree; j++) {
+        mu_assert("QR OLS lost accuracy on polynomial features", fabs(x_hat->data[j] - 1.0) < 1e-6);
+    }
+
+    // A repeated column is caught
+    F = copy_matrix(A);
+    for (size_t i = 0; i < m; i++) MAT_AT(F, i, 1) = MAT_AT(F, i, 0);
+    mu_assert("Rank deficient A should fail", ols_qr(F, b) == NULL);
+
+    free_matrix(A);
+    free_matrix(At);
+    free_matrix(AtA);
+    free_matrix(F);
+    free_matrix(P);
+    free_vector(b);
+    free_vector(y);
+    free_vector(expected);
+    free_vector(x_hat);
+    return NULL;
+}
+
+static char* test_svd() {
+    // Tall, across several QR panels, and wide through the transpose
+    size_t shapes[2][2] = { {120, 40}, {30, 50} };
+    for (size_t s = 0; s < 2; s++) {
+        size_t m = shapes[s][0], n = shapes[s][1], k = MIN(m, n);
+        Matrix* A = create_empty_matrix(m, n);
+        for (size_t i = 0; i < m; i++) {
+            for (size_t j = 0; j < n; j++) {
+                MAT_AT(A, i, j) = sin((double)(i * n + j)) + (i == j ? 2.0 : 0.0);
+            }
+        }
+
+        SVD* d = svd(A);
+        mu_assert("SVD failed", d != NULL && d->U->cols == k && d->V->rows == n && d->S->rows == k);
+        for (size_t i = 1; i < k; i++) {
+            mu_assert("Singular values not sorted", d->S->data[i - 1] >= d->S->data[i]);
+        }
+
+        for (size_t i = 0; i < m; i++) {
+            for (size_t j = 0; j < n; j++) {
+                double sum = 0.0;
+                for (size_t c = 0; c < k; c++) sum += MAT_AT(d->U, i, c) * d->S->data[c] * MAT_AT(d->V, j, c);
+                mu_assert("U * S * Vt does not reproduce A", fabs(sum - MAT_AT(A, i, j)) < 1e-10);
+            }
+        }
+        for (size_t a = 0; a < k; a++) {
+            for (size_t b = 0; b < k; b++) {
+                double uu = 0.0, vv = 0.0;
+                for (size_t i = 0; i < m; i++) uu += MAT_AT(d->U, i, a) * MAT_AT(d->U, i, b);
+                for (size_t j = 0; j < n; j++) vv += MAT_AT(d->V, j, a) * MAT_AT(d->V, j, b);
+                mu_assert("U columns not orthonormal", fabs(uu - (a == b)) < 1e-10);
+                mu_assert("V columns not orthonormal", fabs(vv - (a == b)) < 1e-10);
+            }
+        }
+
+        free_svd(d);
+        free_matrix(A);
+    }
+
+    // A rank 5 matrix: the randomized SVD finds its singular values
+    Matrix* L = create_empty_matrix(200, 5);
+    Matrix* R = create_empty_matrix(5, 80);
+    for (size_t i = 0; i < 200; i++) for (size_t j = 0; j < 5; j++) MAT_AT(L, i, j) = cos((double)(i * i % 97 + 11 * j * j + i * j));
+    for (size_t i = 0; i < 5; i++) for (size_t j = 0; j < 80; j++) MAT_AT(R, i, j) = sin((double)((i + 1) * j * j % 31 + 3 * i)) * (double)(5 - i);
+    Matrix* A = matrix_product(L, R);
+
+    SVD* exact = svd(A);
+    SVD* fast = svd_randomized(A, 5, SVD_OVERSAMPLE, SVD_POWER_ITERATIONS, 42);
+    mu_assert("Randomized SVD failed", fast != NULL && fast->S->rows == 5 && fast->U->cols == 5);
+    mu_assert("Rank of a rank 5 matrix wrong", svd_rank(exact, svd_default_rcond(200, 80)) == 5);
+    for (size_t i = 0; i < 5; i++) {
+        mu_assert("Randomized singular value wrong", fabs(fast->S->data[i] - exact->S->data[i]) < 1e-9 * exact->S->data[0]);
+    }
+
+    // The triplets are stored as true m x k and n x k matrices, and rebuild A
+    Matrix* U5 = create_empty_matrix(200, 5);
+    mu_assert("Randomized U not sized to k", fast->U->stride == U5->stride && fast->V->cols == 5 && fast->V->stride == U5->stride);
+    for (size_t i = 0; i < 200; i++) {
+        for (size_t j = 0; j < 5; j++) MAT_AT(U5, i, j) = MAT_AT(fast->U, i, j) * fast->S->data[j];
+    }
+    Matrix* Vt = tranpose_matrix(fast->V);
+    Matrix* rebuilt = matrix_product(U5, Vt);
+    for (size_t i = 0; i < 200; i += 7) {
+        for (size_t j = 0; j < 80; j += 3) {
+            mu_assert("Randomized SVD does not rebuild A", fabs(MAT_AT(rebuilt, i, j) - MAT_AT(A, i, j)) < 1e-8 * exact->S->data[0]);
+        }
+    }
+    free_matrix(U5);
+    free_matrix(Vt);
+    free_matrix(rebuilt);
+    free_svd(exact);
+    free_svd(fast);
+
+    free_matrix(L);
+    free_matrix(R);
+    free_matrix(A);
+    return NULL;
+}
+
+static char* test_pinv() {
+    // Column 2 repeats column 1, so ols() falls back to the pseudoinverse
+    size_t m = 50;
+    Matrix* A = create_empty_matrix(m, 3);
+    Vector* b = create_empty_vector(m);
+    for (size_t i = 0; i < m; i++) {
+        MAT_AT(A, i, 0) = 1.0;
+        MAT_AT(A, i, 1) = (double)i;
+        MAT_AT(A, i, 2) = (double)i;
+        b->data[i] = 3.0 + 2.0 * (double)i;
+    }
+
+    Vector* x = ols(A, b);
+    mu_assert("Rank deficient OLS should still fit", x != NULL);
+    mu_assert("Intercept wrong", fabs(x->data[0] - 3.0) < 1e-9);
+    mu_assert("Minimum norm solution splits the weight", fabs(x->data[1] - 1.0) < 1e-9 && fabs(x->data[2] - 1.0) < 1e-9);
+
+    // The explicit pseudoinverse gives the same answer, and A * pinv(A) * A = A
+    Matrix* P = pinv(A, 0.0);
+    mu_assert("Pseudoinverse failed", P != NULL && P->rows == 3 && P->cols == m);
+    Vector* y = matrix_vector_product(P, b);
+    for (size_t j = 0; j < 3; j++) {
+        mu_assert("pinv(A) * b disagrees with pinv_solve()", fabs(y->data[j] - x->data[j]) < 1e-9);
+    }
+    Matrix* AP = matrix_product(A, P);
+    Matrix* APA = matrix_product(AP, A);
+    for (size_t i = 0; i < m; i++) {
+        for (size_t j = 0; j < 3; j++) {
+            mu_assert("A * pinv(A) * A is not A", fabs(MAT_AT(APA, i, j) - MAT_AT(A, i, j)) < 1e-9 * m);
+        }
+    }
+
+    free_matrix(A);
+    free_matrix(P);
+    free_matrix(AP);
+    free_matrix(APA);
+    free_vector(b);
+    free_vector(x);
+    free_vector(y);
+    return NULL;
+}
+
+static char* test_lu() {
+    // Several panels, not symmetric, and needing row exchanges
+    size_t n = 2 * LU_BLOCK + 19;
+    Matrix* A = create_empty_matrix(n, n);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < n; j++) {
+            MAT_AT(A, i, j) = sin((double)(i * 7 + j * j)) + (i == (j + 3) % n ? 4.0 : 0.0);
+        }
+    }
+
+    LU* lu = lu_decompose(A);
+    mu_assert("LU of nonsingular matrix failed", lu != NULL);
+    mu_assert("Condition estimate out of range", lu->rcond > 0.0 && lu->rcond <= 1.0);
+
+    // Three right hand sides at once, and one on its own
+    Matrix* X = create_empty_matrix(n, 3);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t c = 0; c < 3; c++) MAT_AT(X, i, c) = (double)(i % 5) - (double)c;
+    }
+    Matrix* B = matrix_product(A, X);
+    Matrix* X_hat = lu_solve_matrix(lu, B);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t c = 0; c < 3; c++) {
+            mu_assert("LU multi right hand side solve wrong", fabs(MAT_AT(X_hat, i, c) - MAT_AT(X, i, c)) < 1e-9);
+        }
+    }
+
+    Vector* b = create_empty_vector(n);
+    for (size_t i = 0; i < n; i++) b->data[i] = MAT_AT(B, i, 1);
+    Vector* x = lu_solve(lu, b);
+    for (size_t i = 0; i < n; i++) {
+        mu_assert("LU solve wrong", fabs(x->data[i] - MAT_AT(X, i, 1)) < 1e-9);
+    }
+
+    // A zero on the diagonal only appears after elimination
+    Matrix* C = create_empty_matrix(2, 2);
+    MAT_AT(C, 0, 0) = 1.0; MAT_AT(C, 0, 1) = 1.0;
+    MAT_AT(C, 1, 0) = 1.0; MAT_AT(C, 1, 1) = 0.0;
+    Matrix* C_inv = invert(C);
+    mu_assert("Inverse wrong", is_close(MAT_AT(C_inv, 0, 0), 0.0) && is_close(MAT_AT(C_inv, 0, 1), 1.0)
+                               && is_close(MAT_AT(C_inv, 1, 0), 1.0) && is_close(MAT_AT(C_inv, 1, 1), -1.0));
+
+    // Singular up to rounding is refused rather than inverted into garbage
+    MAT_AT(C, 0, 0) = 1.0; MAT_AT(C, 0, 1) = 2.0;
+    MAT_AT(C, 1, 0) = 2.0; MAT_AT(C, 1, 1) = 4.0 + 1e-17;
+    mu_assert("Singular matrix should not invert", invert(C) == NULL);
+
+    // The Hilbert matrix is famously ill conditioned
+    Matrix* H = create_empty_matrix(8, 8);
+    for (size_t i = 0; i < 8; i++) {
+        for (size_t j = 0; j < 8; j++) MAT_AT(H, i, j) = 1.0 / (double)(i + j + 1);
+    }
+    LU* lu_h = lu_decompose(H);
+    mu_assert("Hilbert condition estimate too optimistic", lu_h != NULL && lu_h->rcond < 1e-8);
+
+    // Against the exact 1 / (||H||_1 ||H^-1||_1): never above it, as
+    // ||H^-1||_1 is estimated from below, and within a small factor of it
+    Matrix* H_inv = invert(H);
+    mu_assert("Hilbert inverse failed", H_inv != NULL);
+    double norm_h = 0.0, norm_h_inv = 0.0;
+    for (size_t j = 0; j < 8; j++) {
+        double col = 0.0, col_inv = 0.0;
+        for (size_t i = 0; i < 8; i++) {
+            col += fabs(MAT_AT(H, i, j));
+            col_inv += fabs(MAT_AT(H_inv, i, j));
+        }
+        norm_h = fmax(norm_h, col);
+        norm_h_inv = fmax(norm_h_inv, col_inv);
+    }
+    double exact_rcond = 1.0 / (norm_h * norm_h_inv);
+    mu_assert("Hilbert condition estimate above exact", lu_h->rcond >= exact_rcond * (1.0 - 1e-4));
+    mu_assert("Hilbert condition estimate far from exact", lu_h->rcond <= 10.0 * exact_rcond);
+    free_matrix(H_inv);
+
+    free_lu(lu);
+    free_lu(lu_h);
+    free_matrix(A);
+    free_matrix(X);
+    free_matrix(B);
+    free_matrix(X_hat);
+    free_matrix(C);
+    free_matrix(C_inv);
+    free_matrix(H);
+    free_vector(b);
+    free_vector(x);
+    return NULL;
+}
+
 // --- 4. Test Runner ---
 static char* all_tests() {
     mu_run_test(test_create_vector);
     mu_run_test(test_dot_product_math);
     mu_run_test(test_dot_product_mismatch);
+    mu_run_test(test_simd_levels);
     mu_run_test(test_csv_loading);
 
     mu_run_test(test_create_matrix);
     mu_run_test(test_copy_matrix);
     mu_run_test(test_matrix_transpose);
     mu_run_test(test_matrix_csv_load);
+    mu_run_test(test_csv_parser);
+    mu_run_test(test_binary_format);
     mu_run_test(test_matrix_vector_product);
     mu_run_test(test_mv_product_mismatch);
     mu_run_test(test_matrix_product);
+    mu_run_test(test_gemm_blocked);
+    mu_run_test(test_gram_matrix);
     mu_run_test(test_swap_rows);
+    mu_run_test(test_swap_rows_permutation);
     mu_run_test(test_gj_elimination);
     mu_run_test(test_inverse);
+    mu_run_test(test_cholesky);
+    mu_run_test(test_cholesky_pivoted);
+    mu_run_test(test_mixed_precision);
+    mu_run_test(test_solve_linear_system);
+    mu_run_test(test_lu);
+    mu_run_test(test_qr);
+    mu_run_test(test_svd);
+    mu_run_test(test_pinv);
+    mu_run_test(test_ols_streaming);
+    mu_run_test(test_arena);
+    mu_run_test(test_sparse);
+    mu_run_test(test_lsq);
+    mu_run_test(test_rls);
+    mu_run_test(test_ridge);
+    mu_run_test(test_cross_validation);
+    mu_run_test(test_predict);
+    mu_run_test(test_metrics);
+    mu_run_test(test_trace);
+    mu_run_test(test_thread_pool);
     return NULL;
 }
 
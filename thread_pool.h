@@ -0,0 +1,253 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/**
+ * A library-wide pool of worker threads behind a single parallel_for().
+ *
+ * The workers are started on the first parallel call and sleep on a condition
+ * variable between calls. The calling thread always takes part in the work,
+ * so a pool of n threads starts n - 1 workers.
+ *
+ * The thread count defaults to the number of online CPUs. It can be set with
+ * the environment variable ML_NUM_THREADS, or at any time between parallel
+ * calls with ml_set_num_threads().
+ *
+ * A parallel_for() issued from inside a worker, or while another thread is
+ * already using the pool, runs serially on the calling thread.
+ */
+
+// Rough flop count below which a chunk of work is not worth handing to a thread
+#define PARALLEL_MIN_WORK 131072
+
+typedef void (*parallel_fn)(size_t begin, size_t end, void* ctx);
+
+typedef struct ThreadPool {
+    pthread_t* workers;
+    size_t n_workers;
+    atomic_size_t n_threads;    // Requested size including the caller, 0 until resolved
+    int started;
+    int shutting_down;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    pthread_mutex_t submit;     // Held by the thread currently running a job
+
+    // The job being run, published under lock with a new generation number
+    unsigned long generation;
+    parallel_fn fn;
+    void* ctx;
+    size_t end;
+    size_t chunk;
+    atomic_size_t next;
+    size_t pending;             // Workers that have not finished the current job
+} ThreadPool;
+
+static ThreadPool _pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work_ready = PTHREAD_COND_INITIALIZER,
+    .work_done = PTHREAD_COND_INITIALIZER,
+    .submit = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread int _pool_in_worker = 0;
+
+/**
+ * @brief Get the number of CPUs currently online
+ *
+ * @return size_t At least 1
+ */
+static size_t _pool_online_cpus() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (size_t)cpus : 1;
+}
+
+/**
+ * @brief Get the number of threads parallel kernels will use
+ *
+ * @return size_t
+ */
+size_t ml_get_num_threads() {
+    size_t n_threads = atomic_load(&_pool.n_threads);
+    if (n_threads == 0) {
+        const char* env = getenv("ML_NUM_THREADS");
+        long requested = env ? atol(env) : 0;
+        n_threads = requested > 0 ? (size_t)requested : _pool_online_cpus();
+
+        // Threads resolving it at the same time all keep the first value stored
+        size_t unset = 0;
+        if (!atomic_compare_exchange_strong(&_pool.n_threads, &unset, n_threads)) n_threads = unset;
+    }
+    return n_threads;
+}
+
+/**
+ * @brief Take chunks of the current job until none are left
+ *
+ * @return void
+ */
+static void _pool_run_chunks() {
+    for (;;) {
+        size_t lo = atomic_fetch_add(&_pool.next, _pool.chunk);
+        if (lo >= _pool.end) break;
+        size_t hi = (lo + _pool.chunk < _pool.end) ? lo + _pool.chunk : _pool.end;
+        _pool.fn(lo, hi, _pool.ctx);
+    }
+}
+
+static void* _pool_worker(void* arg) {
+    (void)arg;
+    _pool_in_worker = 1;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&_pool.lock);
+    for (;;) {
+        while (_pool.generation == seen && !_pool.shutting_down) {
+            pthread_cond_wait(&_pool.work_ready, &_pool.lock);
+        }
+        if (_pool.shutting_down) break;
+        seen = _pool.generation;
+        pthread_mutex_unlock(&_pool.lock);
+
+        _pool_run_chunks();
+
+        pthread_mutex_lock(&_pool.lock);
+        if (--_pool.pending == 0) {
+            pthread_cond_signal(&_pool.work_done);
+        }
+    }
+    pthread_mutex_unlock(&_pool.lock);
+    return NULL;
+}
+
+/**
+ * @brief Stop and join all workers. They are started again on the next
+ * parallel call
+ *
+ * @return void
+ */
+static void _pool_stop() {
+    if (!_pool.started) return;
+
+    pthread_mutex_lock(&_pool.lock);
+    _pool.shutting_down = 1;
+    pthread_cond_broadcast(&_pool.work_ready);
+    pthread_mutex_unlock(&_pool.lock);
+
+    for (size_t i = 0; i < _pool.n_workers; i++) {
+        pthread_join(_pool.workers[i], NULL);
+    }
+
+    free(_pool.workers);
+    _pool.workers = NULL;
+    _pool.n_workers = 0;
+    _pool.shutting_down = 0;
+    _pool.started = 0;
+}
+
+/**
+ * @brief Start ml_get_num_threads() - 1 workers
+ *
+ * @return void
+ */
+static void _pool_start() {
+    static int registered = 0;
+    if (!registered) {
+        atexit(_pool_stop);
+        registered = 1;
+    }
+
+    size_t wanted = ml_get_num_threads() - 1;
+    _pool.workers = (pthread_t*)malloc(wanted * sizeof(pthread_t));
+    _pool.n_workers = 0;
+    _pool.generation = 0;
+
+    for (size_t i = 0; _pool.workers != NULL && i < wanted; i++) {
+        if (pthread_create(&_pool.workers[i], NULL, _pool_worker, NULL) != 0) {
+            fprintf(stderr, "Thread Pool: Started only %zu of %zu workers\n", i, wanted);
+            break;
+        }
+        _pool.n_workers++;
+    }
+
+    _pool.started = 1;
+}
+
+/**
+ * @brief Set the number of threads parallel kernels will use
+ *
+ * @param n_threads The thread count including the caller. 0 restores the
+ * default of one thread per online CPU
+ * @return void
+ */
+void ml_set_num_threads(size_t n_threads) {
+    pthread_mutex_lock(&_pool.submit);
+    _pool_stop();
+    atomic_store(&_pool.n_threads, n_threads > 0 ? n_threads : _pool_online_cpus());
+    pthread_mutex_unlock(&_pool.submit);
+}
+
+/**
+ * @brief Run fn over [begin, end) split into chunks shared by the pool
+ *
+ * fn is called with disjoint sub-ranges that together cover [begin, end)
+ * exactly once, from any pool thread, and must not depend on the order.
+ *
+ * @param begin The first index
+ * @param end One past the last index
+ * @param grain The smallest chunk worth handing to a thread. Ranges no longer
+ * than this run serially on the caller
+ * @param fn The function to run on each chunk
+ * @param ctx Passed through to fn
+ * @return void
+ */
+void parallel_for(size_t begin, size_t end, size_t grain, parallel_fn fn, void* ctx) {
+    if (end <= begin) return;
+
+    size_t n = end - begin;
+    if (grain == 0) grain = 1;
+
+    size_t n_threads = ml_get_num_threads();
+    if (n_threads <= 1 || n <= grain || _pool_in_worker
+        || pthread_mutex_trylock(&_pool.submit) != 0) {
+        fn(begin, end, ctx);
+        return;
+    }
+
+    if (!_pool.started) _pool_start();
+
+    // A few chunks per thread evens out uneven chunk costs
+    size_t chunk = (n + 4 * n_threads - 1) / (4 * n_threads);
+    if (chunk < grain) chunk = grain;
+
+    pthread_mutex_lock(&_pool.lock);
+    _pool.fn = fn;
+    _pool.ctx = ctx;
+    _pool.end = end;
+    _pool.chunk = chunk;
+    atomic_store(&_pool.next, begin);
+    _pool.pending = _pool.n_workers;
+    _pool.generation++;
+    pthread_cond_broadcast(&_pool.work_ready);
+    pthread_mutex_unlock(&_pool.lock);
+
+    _pool_in_worker = 1;
+    _pool_run_chunks();
+    _pool_in_worker = 0;
+
+    pthread_mutex_lock(&_pool.lock);
+    while (_pool.pending > 0) {
+        pthread_cond_wait(&_pool.work_done, &_pool.lock);
+    }
+    pthread_mutex_unlock(&_pool.lock);
+
+    pthread_mutex_unlock(&_pool.submit);
+}
+
+#endif
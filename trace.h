@@ -0,0 +1,347 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/**
+ * Kernel instrumentation.
+ *
+ * A kernel marks its work as a named span:
+ *
+ *     ML_TRACE_BEGIN(span, "matrix_product");
+ *     ...
+ *     ML_TRACE_END(span, flops, bytes);
+ *
+ * Each span name keeps a call count, the total time on a monotonic clock and
+ * the flops and bytes the calls reported. With a Chrome trace every call is
+ * also kept as an event. The results are written when the program exits, or
+ * at any time with ml_trace_dump().
+ *
+ * Tracing is off until it is turned on at runtime, either with the
+ * environment variable ML_TRACE set to "table" or "chrome", or with
+ * ml_trace_enable(). A table is written to stderr, and a Chrome trace to
+ * ML_TRACE_FILE (default TRACE_DEFAULT_FILE) for chrome://tracing or Perfetto.
+ * While it is off a span costs one untaken branch.
+ *
+ * Compiling with -DML_TRACE_ENABLED=0 removes every span, and the flop and
+ * byte expressions are never evaluated.
+ */
+
+#ifndef ML_TRACE_ENABLED
+#define ML_TRACE_ENABLED 1
+#endif
+
+// Most distinct span names, and most events kept for a Chrome trace
+#define TRACE_MAX_SPANS 64
+#define TRACE_MAX_EVENTS (1 << 20)
+#define TRACE_DEFAULT_FILE "trace.json"
+
+typedef enum TraceMode {
+    TRACE_OFF = 0,
+    TRACE_TABLE,
+    TRACE_CHROME,
+} TraceMode;
+
+/**
+ * @struct The totals for one span name
+ */
+typedef struct TraceStat {
+    const char* name;
+    size_t calls;
+    double seconds;
+    double flops;
+    double bytes;
+} TraceStat;
+
+/**
+ * @struct One call, kept for a Chrome trace
+ */
+typedef struct TraceEvent {
+    int id;
+    int thread;
+    double start;
+    double duration;
+} TraceEvent;
+
+/**
+ * @struct A span in progress. id is -1 when tracing was off at its start
+ */
+typedef struct TraceSpan {
+    int id;
+    double start;
+} TraceSpan;
+
+typedef struct Tracer {
+    atomic_int resolved;         // The environment has been read
+    atomic_int mode;             // A TraceMode, read without the lock on every span
+    char file[256];
+    int registered;              // The exit handler is installed
+    double epoch;
+
+    pthread_mutex_t lock;
+    TraceStat stats[TRACE_MAX_SPANS];
+    int n_stats;
+    TraceEvent* events;
+    size_t n_events;
+    size_t events_capacity;
+    size_t dropped;
+    atomic_int next_thread;
+} Tracer;
+
+static Tracer _tracer = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * @brief Read a monotonic clock in seconds
+ *
+ * @return double
+ */
+static double _trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+void ml_trace_dump();
+
+static void _trace_at_exit() {
+    ml_trace_dump();
+}
+
+/**
+ * @brief Turn tracing on or off
+ *
+ * Counts gathered so far are kept. The results are dumped at exit once
+ * tracing has been turned on.
+ *
+ * @param mode TRACE_OFF, TRACE_TABLE or TRACE_CHROME
+ * @param file Where a Chrome trace goes, or NULL for ML_TRACE_FILE or TRACE_DEFAULT_FILE
+ * @return void
+ */
+void ml_trace_enable(TraceMode mode, const char* file) {
+    pthread_mutex_lock(&_tracer.lock);
+    if (file == NULL) file = getenv("ML_TRACE_FILE");
+    snprintf(_tracer.file, sizeof(_tracer.file), "%s", file ? file : TRACE_DEFAULT_FILE);
+    if (_tracer.epoch == 0.0) _tracer.epoch = _trace_now();
+    if (mode != TRACE_OFF && !_tracer.registered) {
+        _tracer.registered = 1;
+        atexit(_trace_at_exit);
+    }
+    atomic_store_explicit(&_tracer.mode, mode, memory_order_release);
+    atomic_store_explicit(&_tracer.resolved, 1, memory_order_release);
+    pthread_mutex_unlock(&_tracer.lock);
+}
+
+/**
+ * @brief Get the current mode, reading ML_TRACE on the first call
+ *
+ * @return TraceMode
+ */
+TraceMode ml_trace_mode() {
+    if (!atomic_load_explicit(&_tracer.resolved, memory_order_acquire)) {
+        const char* env = getenv("ML_TRACE");
+        TraceMode mode = TRACE_OFF;
+        if (env != NULL && strcmp(env, "table") == 0) {
+            mode = TRACE_TABLE;
+        } else if (env != NULL && strcmp(env, "chrome") == 0) {
+            mode = TRACE_CHROME;
+        } else if (env != NULL && env[0] != '\0' && strcmp(env, "off") != 0) {
+            fprintf(stderr, "Trace: Unknown ML_TRACE \"%s\", expected table, chrome or off\n", env);
+        }
+        ml_trace_enable(mode, NULL);
+    }
+    return (TraceMode)atomic_load_explicit(&_tracer.mode, memory_order_acquire);
+}
+
+/**
+ * @brief Clear every count and event
+ *
+ * @return void
+ */
+void ml_trace_reset() {
+    pthread_mutex_lock(&_tracer.lock);
+    for (int i = 0; i < _tracer.n_stats; i++) {
+        _tracer.stats[i].calls = 0;
+        _tracer.stats[i].seconds = 0.0;
+        _tracer.stats[i].flops = 0.0;
+        _tracer.stats[i].bytes = 0.0;
+    }
+    _tracer.n_events = 0;
+    _tracer.dropped = 0;
+    _tracer.epoch = _trace_now();
+    pthread_mutex_unlock(&_tracer.lock);
+}
+
+/**
+ * @brief Get the totals for a span name
+ *
+ * The totals keep changing while spans of that name run on other threads.
+ *
+ * @param name The span name
+ * @return const TraceStat*, or NULL if no span of that name has run while tracing
+ */
+const TraceStat* ml_trace_stat(const char* name) {
+    const TraceStat* found = NULL;
+    pthread_mutex_lock(&_tracer.lock);
+    for (int i = 0; i < _tracer.n_stats && found == NULL; i++) {
+        if (strcmp(_tracer.stats[i].name, name) == 0) found = &_tracer.stats[i];
+    }
+    pthread_mutex_unlock(&_tracer.lock);
+    return found;
+}
+
+#if ML_TRACE_ENABLED
+// A small id per thread for the Chrome trace
+static __thread int _trace_thread = -1;
+
+/**
+ * @brief Start a span. Use ML_TRACE_BEGIN() rather than calling this directly
+ *
+ * @param id The span's slot, cached by the call site and shared by every thread. -1 until first resolved
+ * @param name The span name, a string literal
+ * @return TraceSpan
+ */
+static TraceSpan _trace_begin(atomic_int* id, const char* name) {
+    TraceSpan span = { -1, 0.0 };
+    if (ml_trace_mode() == TRACE_OFF) return span;
+
+    int slot = atomic_load_explicit(id, memory_order_acquire);
+    if (slot < 0) {
+        pthread_mutex_lock(&_tracer.lock);
+        int found = -1;
+        for (int i = 0; i < _tracer.n_stats && found < 0; i++) {
+            if (strcmp(_tracer.stats[i].name, name) == 0) found = i;
+        }
+        if (found < 0 && _tracer.n_stats < TRACE_MAX_SPANS) {
+            found = _tracer.n_stats++;
+            _tracer.stats[found].name = name;
+        }
+        atomic_store_explicit(id, found, memory_order_release);
+        pthread_mutex_unlock(&_tracer.lock);
+        if (found < 0) return span;
+        slot = found;
+    }
+
+    span.id = slot;
+    span.start = _trace_now();
+    return span;
+}
+
+/**
+ * @brief Finish a span. Use ML_TRACE_END() rather than calling this directly
+ *
+ * @param span The span from _trace_begin()
+ * @param flops The floating point operations the call did
+ * @param bytes The bytes the call read and wrote
+ * @return void
+ */
+static void _trace_end(TraceSpan* span, double flops, double bytes) {
+    if (span->id < 0) return;
+    double end = _trace_now();
+    if (_trace_thread < 0) _trace_thread = atomic_fetch_add(&_tracer.next_thread, 1);
+
+    pthread_mutex_lock(&_tracer.lock);
+    TraceStat* stat = &_tracer.stats[span->id];
+    stat->calls++;
+    stat->seconds += end - span->start;
+    stat->flops += flops;
+    stat->bytes += bytes;
+
+    if (atomic_load_explicit(&_tracer.mode, memory_order_relaxed) == TRACE_CHROME) {
+        if (_tracer.n_events == _tracer.events_capacity && _tracer.events_capacity < TRACE_MAX_EVENTS) {
+            size_t capacity = _tracer.events_capacity ? 2 * _tracer.events_capacity : 1024;
+            TraceEvent* events = realloc(_tracer.events, capacity * sizeof(TraceEvent));
+            if (events != NULL) {
+                _tracer.events = events;
+                _tracer.events_capacity = capacity;
+            }
+        }
+        if (_tracer.n_events < _tracer.events_capacity) {
+            _tracer.events[_tracer.n_events++] = (TraceEvent){ span->id, _trace_thread,
+                                                               span->start - _tracer.epoch, end - span->start };
+        } else {
+            _tracer.dropped++;
+        }
+    }
+    pthread_mutex_unlock(&_tracer.lock);
+}
+#endif
+
+/**
+ * @brief Write the totals of every span as a table
+ *
+ * @param fp Where to write
+ * @return void
+ */
+void ml_trace_print_table(FILE* fp) {
+    fprintf(fp, "%-28s %10s %12s %12s %10s %10s\n", "span", "calls", "total (s)", "mean (ms)", "GFLOP/s", "GB/s");
+    for (int i = 0; i < _tracer.n_stats; i++) {
+        TraceStat* s = &_tracer.stats[i];
+        if (s->calls == 0) continue;
+        double seconds = s->seconds > 0.0 ? s->seconds : 1e-12;
+        fprintf(fp, "%-28s %10zu %12.6f %12.4f %10.2f %10.2f\n", s->name, s->calls, s->seconds,
+                1e3 * s->seconds / s->calls, s->flops / seconds * 1e-9, s->bytes / seconds * 1e-9);
+    }
+}
+
+/**
+ * @brief Write every recorded call as a Chrome trace
+ *
+ * @param file_name The file to write
+ * @return int The resulting status code
+ */
+int ml_trace_write_chrome(const char* file_name) {
+    FILE* fp = fopen(file_name, "w");
+    if (fp == NULL) {
+        perror("Unable to write trace");
+        return EXIT_FAILURE;
+    }
+
+    fprintf(fp, "{\"traceEvents\": [\n");
+    for (size_t i = 0; i < _tracer.n_events; i++) {
+        TraceEvent* e = &_tracer.events[i];
+        fprintf(fp, "  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}%s\n",
+                _tracer.stats[e->id].name, e->thread, e->start * 1e6, e->duration * 1e6,
+                i + 1 < _tracer.n_events ? "," : "");
+    }
+    fprintf(fp, "], \"displayTimeUnit\": \"ms\"}\n");
+    if (_tracer.dropped > 0) {
+        fprintf(stderr, "Trace: %zu events past the first %d were not kept\n", _tracer.dropped, TRACE_MAX_EVENTS);
+    }
+
+    return fclose(fp) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * @brief Write the results in the current mode: a table to stderr, or a Chrome trace
+ *
+ * @return void
+ */
+void ml_trace_dump() {
+    pthread_mutex_lock(&_tracer.lock);
+    TraceMode mode = (TraceMode)atomic_load_explicit(&_tracer.mode, memory_order_relaxed);
+    if (mode == TRACE_TABLE) {
+        ml_trace_print_table(stderr);
+    } else if (mode == TRACE_CHROME) {
+        ml_trace_write_chrome(_tracer.file);
+    }
+    pthread_mutex_unlock(&_tracer.lock);
+}
+
+#if ML_TRACE_ENABLED
+#define ML_TRACE_BEGIN(span, name) \
+    static atomic_int span##_id = -1; \
+    TraceSpan span = _trace_begin(&span##_id, name)
+#define ML_TRACE_END(span, flops, bytes) _trace_end(&(span), (double)(flops), (double)(bytes))
+#else
+#define ML_TRACE_BEGIN(span, name) do {} while (0)
+#define ML_TRACE_END(span, flops, bytes) do {} while (0)
+#endif
+
+#endif
@@ -1,14 +1,116 @@
+#ifndef VECTOR_H
+#define VECTOR_H
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define MAX_LINE_LENGTH 32768
+#include "simd.h"
+#include "csv.h"
+#include "binary_format.h"
+
+// Alignment of every block handed out by an Arena (one cache line)
+#define ARENA_ALIGNMENT 64
+
+/**
+ * @struct A preallocated region that temporaries are carved out of
+ *
+ * Allocating is a pointer bump and nothing is freed on its own. The whole
+ * region is released at once by arena_reset(), or back to an earlier point
+ * with arena_release(), so a fit that is repeated many times costs no calls
+ * to malloc or free once the arena exists.
+ */
+typedef struct Arena {
+    unsigned char* base;
+    size_t size;
+    size_t used;
+    size_t peak;        // Highest value of used so far, for sizing the arena
+} Arena;
+
+/**
+ * @brief Reserve the memory for an arena
+ *
+ * @param arena The arena to set up
+ * @param bytes The size of the region
+ * @return int The resulting status code
+ */
+int arena_init(Arena* arena, size_t bytes) {
+    bytes = (bytes + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+    arena->base = (unsigned char*)aligned_alloc(ARENA_ALIGNMENT, bytes ? bytes : ARENA_ALIGNMENT);
+    arena->size = arena->base ? bytes : 0;
+    arena->used = 0;
+    arena->peak = 0;
+    if (arena->base == NULL) {
+        fprintf(stderr, "Arena: Unable to reserve %zu bytes\n", bytes);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Take an uninitialised, ARENA_ALIGNMENT aligned block from an arena
+ *
+ * @param arena The arena
+ * @param bytes The size of the block
+ * @return void* The block, or NULL if the arena is full
+ */
+void* arena_alloc(Arena* arena, size_t bytes) {
+    size_t start = (arena->used + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+    if (start > arena->size || bytes > arena->size - start) {
+        return NULL;
+    }
+    arena->used = start + bytes;
+    if (arena->used > arena->peak) arena->peak = arena->used;
+    return arena->base + start;
+}
+
+/**
+ * @brief Give back everything allocated since arena->used was mark
+ *
+ * @param arena The arena
+ * @param mark A value of arena->used saved earlier
+ * @return void
+ */
+void arena_release(Arena* arena, size_t mark) {
+    if (mark < arena->used) arena->used = mark;
+}
+
+/**
+ * @brief Give back everything allocated from an arena, keeping its memory
+ *
+ * @param arena The arena
+ * @return void
+ */
+void arena_reset(Arena* arena) {
+    arena->used = 0;
+}
+
+/**
+ * @brief Release the memory of an arena
+ *
+ * @param arena The arena
+ * @return void
+ */
+void arena_free(Arena* arena) {
+    free(arena->base);
+    arena->base = NULL;
+    arena->size = 0;
+    arena->used = 0;
+}
+
 /**
  * @struct A structure to encapsulate a basic mathematical vector
  */
 typedef struct Vector {
     size_t rows;
     double *data;
+
+    // Set when data points into a mapped binary file instead of the heap
+    void* mapping;
+    size_t mapping_size;
+
+    // Set when the vector lives in an Arena, which owns its memory
+    Arena* arena;
 } Vector;
 
 /**
@@ -20,6 +122,9 @@ typedef struct Vector {
 Vector* create_empty_vector(size_t rows) {
     Vector* vec = (Vector*)malloc(sizeof(Vector));
     vec->rows = rows;
+    vec->mapping = NULL;
+    vec->mapping_size = 0;
+    vec->arena = NULL;
     vec->data = (double*)calloc(rows, sizeof(double));
 
     if (vec->data == NULL) {
@@ -30,6 +135,35 @@ Vector* create_empty_vector(size_t rows) {
     return vec;
 }
 
+/**
+ * @brief Constructor for a vector inside an arena
+ *
+ * The vector is zeroed like one from create_empty_vector(). It is released
+ * with the arena, and free_vector() leaves it alone.
+ *
+ * @param arena The arena to allocate from
+ * @param rows The number of rows in the vector
+ *
+ * @return Vector*, or NULL if the arena is full
+ */
+Vector* arena_vector(Arena* arena, size_t rows) {
+    size_t mark = arena->used;
+    Vector* vec = (Vector*)arena_alloc(arena, sizeof(Vector));
+    double* data = (double*)arena_alloc(arena, rows * sizeof(double));
+    if (vec == NULL || data == NULL) {
+        arena_release(arena, mark);
+        return NULL;
+    }
+
+    memset(data, 0, rows * sizeof(double));
+    vec->rows = rows;
+    vec->data = data;
+    vec->mapping = NULL;
+    vec->mapping_size = 0;
+    vec->arena = arena;
+    return vec;
+}
+
 /**
  * @brief Destructor for a vector
  * @param vec A pointer to the vector to free in memory
@@ -37,7 +171,14 @@ Vector* create_empty_vector(size_t rows) {
  * @return void
  */
 void free_vector(Vector* vec) {
-    free(vec->data);
+    if (vec->arena != NULL) {
+        return;
+    }
+    if (vec->mapping != NULL) {
+        munmap(vec->mapping, vec->mapping_size);
+    } else {
+        free(vec->data);
+    }
     free(vec);
 }
 
@@ -56,90 +197,122 @@ void print_vector(Vector* vec) {
 }
 
 /**
- * @brief Populate a vector from a CSV file
+ * @brief Create a vector from a file
  * 
- * @param vec A pointer to the vector
- * @param file_name The name of the CSV file to populate from
+ * The values may be laid out as a single row or as a single column. The file
+ * is read through the memory-mapped parser in csv.h, so there is no limit on
+ * the length of the row.
  * 
- * @return integer representing success status.
- */
-static int _populate_vector(Vector* vec, char* file_name) {
-    FILE* file_pointer;
-    char buffer[MAX_LINE_LENGTH];
-    
-    *buffer = '\0';
-    size_t i = 0; // current row
-
-    file_pointer = fopen(file_name, "r");
-    if (file_pointer == NULL) {
-        perror("Unable to open file\n");
-        return EXIT_FAILURE;
+ * @param file_name The name of the CSV file to create the vector from
+ * 
+ * @return Vector*, or NULL if the file cannot be read or is not one row or column
+ * @note The caller is reponsible for freeing this memory using free_vector()
+ */
+Vector* create_vector_from_file(char* file_name) {
+    CsvFile csv;
+    if (csv_open(file_name, &csv) != EXIT_SUCCESS) {
+        return NULL;
     }
 
-    fgets(buffer, MAX_LINE_LENGTH, file_pointer);
-    char* token = strtok(buffer, ",");
-    while (token != NULL) {
-        vec->data[i] = atof(token);
+    if (csv.rows > 1 && csv.cols > 1) {
+        fprintf(stderr, "CSV: %s: a vector must be one row or one column, found %zu x %zu\n",
+                file_name, csv.rows, csv.cols);
+        csv_close(&csv);
+        return NULL;
+    }
 
-        i++;
-        token = strtok(NULL, ",");
+    // A single row is one row of cols values, a single column is rows rows of one
+    Vector* vec = create_empty_vector(csv.rows * csv.cols);
+    if (vec == NULL || csv_read(&csv, vec->data, csv.cols) != EXIT_SUCCESS) {
+        if (vec) free_vector(vec);
+        csv_close(&csv);
+        return NULL;
     }
 
-    fclose(file_pointer);
-    return EXIT_SUCCESS;
+    csv_close(&csv);
+    return vec;
 }
 
 /**
- * @brief Get number of rows of vector (the dimension)
+ * @brief Create a vector from a binary file
  * 
- * @param file_name The name of the CSV file to get the dimension from
- * @param n_rows An integer to put the number of rows in
+ * The file is memory mapped and the vector uses the mapped pages as its data,
+ * so nothing is copied. See binary_format.h for the layout.
  * 
- * @return void
+ * @param file_name The name of the binary file to create the vector from
+ * 
+ * @return Vector*, or NULL if the file is not a valid binary vector
+ * @note The caller is reponsible for freeing this memory using free_vector()
  */
-static void _put_vector_dimension(char* file_name, int* n_rows) {
-    FILE* file_pointer;
-    char buffer[MAX_LINE_LENGTH];
-
-    *buffer = '\0';
-    // set n_rows to 0 for safety
-    *n_rows = 0;
-
-    file_pointer = fopen(file_name, "r");
-    if (file_pointer == NULL) {
-        perror("Unable to open file\n");
-        return;
+Vector* create_vector_from_binary(char* file_name) {
+    MlbMapping mapping;
+    if (mlb_map(file_name, MLB_KIND_VECTOR, &mapping) != EXIT_SUCCESS) {
+        return NULL;
     }
 
-    fgets(buffer, MAX_LINE_LENGTH, file_pointer);
-    char* token = strtok(buffer, ",");
-
-    while (token != NULL) {
-        (*n_rows)++;
-        token = strtok(NULL, ",");
+    Vector* vec = (Vector*)malloc(sizeof(Vector));
+    if (vec == NULL) {
+        munmap(mapping.base, mapping.size);
+        return NULL;
     }
 
-    fclose(file_pointer);
+    vec->rows = (size_t)mapping.header.rows;
+    vec->data = mapping.data;
+    vec->mapping = mapping.base;
+    vec->mapping_size = mapping.size;
+    vec->arena = NULL;
+    return vec;
 }
 
 /**
- * @brief Create a vector from a file
+ * @brief Write a vector to a binary file
  * 
- * Create a vector from a file using a combination of methods
- * 
- * @param file_name The name of the CSV file to create the vector from
+ * @param vec The vector to write
+ * @param file_name The name of the file to create
  * 
- * @return Vector*
- * @note The caller is reponsible for freeing this memory using free_vector()
+ * @return int The resulting status code
  */
-Vector* create_vector_from_file(char* file_name) {
-    int rows = 0;
-    _put_vector_dimension(file_name, &rows);
+int write_vector_to_binary(Vector* vec, char* file_name) {
+    MlbWriter writer;
+    if (mlb_writer_open(&writer, file_name, MLB_KIND_VECTOR, vec->rows, 1) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
 
-    Vector* vec = create_empty_vector(rows);
-    _populate_vector(vec, file_name);
+    int status = EXIT_SUCCESS;
+    for (size_t i = 0; i < vec->rows && status == EXIT_SUCCESS; i++) {
+        status = mlb_writer_write_row(&writer, &vec->data[i]);
+    }
 
-    return vec;
+    if (mlb_writer_close(&writer) != EXIT_SUCCESS) status = EXIT_FAILURE;
+    return status;
+}
+
+/**
+ * @brief Write a vector to a CSV file, one value per line
+ *
+ * Values are written with 17 significant digits, which identify a double
+ * uniquely, and the CSV parser is correctly rounded, so reading the file
+ * back with create_vector_from_file() gives exactly the same doubles.
+ *
+ * @param vec The vector to write
+ * @param file_name The name of the CSV file to create
+ * @return int The resulting status code
+ */
+int write_vector_to_csv(Vector* vec, char* file_name) {
+    FILE* fp = fopen(file_name, "w");
+    if (fp == NULL) {
+        perror("Unable to create CSV file");
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_SUCCESS;
+    for (size_t i = 0; i < vec->rows && status == EXIT_SUCCESS; i++) {
+        if (fprintf(fp, "%.17g\n", vec->data[i]) < 0) status = EXIT_FAILURE;
+    }
+
+    if (fclose(fp) != 0) status = EXIT_FAILURE;
+    if (status != EXIT_SUCCESS) perror("Unable to write CSV file");
+    return status;
 }
 
 /**
@@ -157,11 +330,10 @@ int dot_product(Vector* a, Vector* b, double* c) {
         return EXIT_FAILURE;
     }
 
-    *c = 0.0;
-
-    for (size_t i=0; i < a->rows; i++) {
-        *c += (a->data[i] * b->data[i]);
-    }
+    // Vectorised for the best instruction set available, see simd.h
+    *c = simd_dot(a->data, b->data, a->rows);
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+
+#endif